@@ -0,0 +1,460 @@
+#pragma once
+
+#include "vertices.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace analysis
+{
+
+
+struct VertexCacheStatistics
+{
+    std::size_t cache_size;
+    std::size_t vertices_transformed;
+    // Average cache miss ratio, transformed vertices per triangle (0.5 - 3.0)
+    float acmr;
+    // Average transform to vertex ratio, transformed vertices per referenced
+    // vertex (1.0 is optimal)
+    float atvr;
+};
+
+
+struct VertexFetchStatistics
+{
+    std::size_t bytes_fetched;
+    // Fetched bytes relative to the size of the referenced vertex data (1.0
+    // is optimal, every cache line is fetched exactly once)
+    float overfetch;
+};
+
+
+struct OverdrawStatistics
+{
+    std::size_t pixels_covered;
+    std::size_t pixels_shaded;
+    // Shaded pixels per covered pixel (1.0 is optimal)
+    float overdraw;
+};
+
+
+struct MeshStatistics
+{
+    std::size_t vertex_count;
+    std::size_t index_count;
+    std::size_t triangle_count;
+    std::size_t unreferenced_vertices;
+    std::size_t duplicate_vertices;
+    std::size_t degenerate_triangles;
+    std::size_t vertex_size;
+    std::size_t vertex_padding;
+    std::size_t wasted_bytes;
+    std::vector<VertexCacheStatistics> vertex_cache;
+    VertexFetchStatistics vertex_fetch;
+    OverdrawStatistics overdraw;
+};
+
+
+template <class TVertex, std::size_t... layout_position>
+constexpr std::size_t attribute_bytes(std::index_sequence<layout_position...>)
+{
+    const std::size_t sizes[] = {0, (TVertex::template attribute<layout_position>::size *
+                                     models::gl_type_size(TVertex::template attribute<layout_position>::type))...};
+    std::size_t total = 0;
+    for (auto size : sizes)
+    {
+        total += size;
+    }
+    return total;
+}
+
+
+/**
+* Return the number of bytes the vertex attributes of `TVertex` actually use,
+* excluding any padding the compiler inserted into the vertex structure
+*/
+template <class TVertex>
+constexpr std::size_t attribute_bytes()
+{
+    return attribute_bytes<TVertex>(std::make_index_sequence<TVertex::attribute_count>{});
+}
+
+
+/**
+* Simulate a FIFO post-transform vertex cache over the index stream
+*
+* @param indices is the triangle list index buffer
+* @param vertex_count is the number of vertices in the vertex buffer
+* @param cache_size is the number of entries in the simulated cache
+*/
+inline VertexCacheStatistics analyze_vertex_cache(const std::vector<GLuint>& indices,
+                                                  std::size_t vertex_count,
+                                                  std::size_t cache_size)
+{
+    VertexCacheStatistics result{cache_size, 0, 0.0f, 0.0f};
+    // Timestamp at which each vertex entered the cache, a vertex is a hit
+    // while fewer than `cache_size` misses happened since it was inserted
+    std::vector<std::size_t> inserted_at(vertex_count, 0);
+    std::vector<bool> referenced(vertex_count, false);
+    std::size_t referenced_count = 0;
+    for (auto index : indices)
+    {
+        if (index >= vertex_count)
+        {
+            continue;
+        }
+        if (!referenced[index])
+        {
+            referenced[index] = true;
+            ++referenced_count;
+        }
+        if (inserted_at[index] == 0 ||
+            result.vertices_transformed - inserted_at[index] + 1 > cache_size)
+        {
+            ++result.vertices_transformed;
+            inserted_at[index] = result.vertices_transformed;
+        }
+    }
+    const std::size_t triangle_count = indices.size() / 3;
+    if (triangle_count > 0)
+    {
+        result.acmr = static_cast<float>(result.vertices_transformed) / triangle_count;
+    }
+    if (referenced_count > 0)
+    {
+        result.atvr = static_cast<float>(result.vertices_transformed) / referenced_count;
+    }
+    return result;
+}
+
+
+/**
+* Simulate the pre-transform vertex fetch cache with 64 byte lines
+*
+* @param indices is the triangle list index buffer
+* @param vertex_count is the number of vertices in the vertex buffer
+* @param vertex_size is the stride of a single vertex in bytes
+* @param line_count is the number of lines held by the simulated cache
+*/
+inline VertexFetchStatistics analyze_vertex_fetch(const std::vector<GLuint>& indices,
+                                                  std::size_t vertex_count,
+                                                  std::size_t vertex_size,
+                                                  std::size_t line_count = 64)
+{
+    const std::size_t line_size = 64;
+    VertexFetchStatistics result{0, 0.0f};
+    std::deque<std::size_t> lines;
+    std::vector<bool> referenced(vertex_count, false);
+    std::size_t referenced_count = 0;
+    for (auto index : indices)
+    {
+        if (index >= vertex_count)
+        {
+            continue;
+        }
+        if (!referenced[index])
+        {
+            referenced[index] = true;
+            ++referenced_count;
+        }
+        const std::size_t begin = index * vertex_size / line_size;
+        const std::size_t end = ((index + 1) * vertex_size - 1) / line_size;
+        for (std::size_t line = begin; line <= end; ++line)
+        {
+            if (std::find(lines.begin(), lines.end(), line) == lines.end())
+            {
+                result.bytes_fetched += line_size;
+                lines.push_back(line);
+                if (lines.size() > line_count)
+                {
+                    lines.pop_front();
+                }
+            }
+        }
+    }
+    if (referenced_count > 0)
+    {
+        result.overfetch = static_cast<float>(result.bytes_fetched) / (referenced_count * vertex_size);
+    }
+    return result;
+}
+
+
+/**
+* Estimate overdraw by rasterizing the triangles in submission order from six
+* axis aligned directions into a small depth buffer, counting the fragments
+* that pass the depth test against the number of covered pixels
+*
+* @param positions is the list of vertex positions
+* @param indices is the triangle list index buffer
+* @param resolution is the width and height of the simulated render target
+*/
+inline OverdrawStatistics analyze_overdraw(const std::vector<glm::vec3>& positions,
+                                           const std::vector<GLuint>& indices,
+                                           int resolution = 256)
+{
+    OverdrawStatistics result{0, 0, 0.0f};
+    if (positions.empty() || indices.size() < 3)
+    {
+        return result;
+    }
+    glm::vec3 minimum = positions.front();
+    glm::vec3 maximum = positions.front();
+    for (const auto& position : positions)
+    {
+        minimum = glm::min(minimum, position);
+        maximum = glm::max(maximum, position);
+    }
+    const glm::vec3 extent = maximum - minimum;
+    const float scale = std::max(extent.x, std::max(extent.y, extent.z));
+    if (scale <= 0.0f)
+    {
+        return result;
+    }
+
+    const float cleared = std::numeric_limits<float>::max();
+    std::vector<float> depth(resolution * resolution);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        for (int direction = 0; direction < 2; ++direction)
+        {
+            std::fill(depth.begin(), depth.end(), cleared);
+            // Project onto the plane orthogonal to `axis`, viewing from the
+            // negative or positive side depending on `direction`
+            auto project = [&](const glm::vec3& position)
+            {
+                const glm::vec3 p = (position - minimum) / scale;
+                const float u = p[(axis + 1) % 3] * (resolution - 1);
+                const float v = p[(axis + 2) % 3] * (resolution - 1);
+                const float z = direction == 0 ? p[axis] : 1.0f - p[axis];
+                return glm::vec3(u, v, z);
+            };
+            for (std::size_t i = 0; i + 2 < indices.size(); i += 3)
+            {
+                if (indices[i] >= positions.size() ||
+                    indices[i + 1] >= positions.size() ||
+                    indices[i + 2] >= positions.size())
+                {
+                    continue;
+                }
+                const glm::vec3 a = project(positions[indices[i]]);
+                const glm::vec3 b = project(positions[indices[i + 1]]);
+                const glm::vec3 c = project(positions[indices[i + 2]]);
+                const float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+                if (area == 0.0f)
+                {
+                    continue;
+                }
+                const int min_x = std::max(0, static_cast<int>(std::floor(std::min(a.x, std::min(b.x, c.x)))));
+                const int min_y = std::max(0, static_cast<int>(std::floor(std::min(a.y, std::min(b.y, c.y)))));
+                const int max_x = std::min(resolution - 1, static_cast<int>(std::ceil(std::max(a.x, std::max(b.x, c.x)))));
+                const int max_y = std::min(resolution - 1, static_cast<int>(std::ceil(std::max(a.y, std::max(b.y, c.y)))));
+                for (int y = min_y; y <= max_y; ++y)
+                {
+                    for (int x = min_x; x <= max_x; ++x)
+                    {
+                        // Sample at pixel centers using edge functions,
+                        // accepting both windings as culling is disabled
+                        const float px = x + 0.5f;
+                        const float py = y + 0.5f;
+                        const float w0 = ((c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x)) / area;
+                        const float w1 = ((a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x)) / area;
+                        const float w2 = 1.0f - w0 - w1;
+                        if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                        {
+                            continue;
+                        }
+                        const float z = w0 * a.z + w1 * b.z + w2 * c.z;
+                        float& stored = depth[y * resolution + x];
+                        if (stored == cleared)
+                        {
+                            ++result.pixels_covered;
+                        }
+                        if (z < stored)
+                        {
+                            stored = z;
+                            ++result.pixels_shaded;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (result.pixels_covered > 0)
+    {
+        result.overdraw = static_cast<float>(result.pixels_shaded) / result.pixels_covered;
+    }
+    return result;
+}
+
+
+/**
+* Extract the positions of a vertex list whose vertex type carries a
+* `attributes::Position` attribute
+*/
+template <class TVertex>
+std::vector<glm::vec3> collect_positions(const std::vector<TVertex>& vertices)
+{
+    static_assert(std::is_base_of<models::attributes::Position, TVertex>::value,
+                  "Mesh analysis requires a vertex type with a Position attribute");
+    std::vector<glm::vec3> positions;
+    positions.reserve(vertices.size());
+    for (const auto& vertex : vertices)
+    {
+        positions.push_back(static_cast<const models::attributes::Position&>(vertex).position);
+    }
+    return positions;
+}
+
+
+/**
+* Count vertices that are bitwise identical to an earlier vertex in the list
+*/
+template <class TVertex>
+std::size_t count_duplicate_vertices(const std::vector<TVertex>& vertices)
+{
+    static_assert(std::is_trivially_copyable<TVertex>::value,
+                  "Duplicate detection compares the raw vertex bytes");
+    struct Key
+    {
+        const TVertex* vertex;
+        bool operator==(const Key& rhs) const
+        {
+            return std::memcmp(vertex, rhs.vertex, sizeof(TVertex)) == 0;
+        }
+    };
+    struct Hash
+    {
+        std::size_t operator()(const Key& key) const
+        {
+            const auto* bytes = reinterpret_cast<const unsigned char*>(key.vertex);
+            return std::hash<std::string>()(std::string(bytes, bytes + sizeof(TVertex)));
+        }
+    };
+    std::unordered_map<Key, std::size_t, Hash> seen;
+    seen.reserve(vertices.size());
+    std::size_t duplicates = 0;
+    for (const auto& vertex : vertices)
+    {
+        if (++seen[Key{&vertex}] > 1)
+        {
+            ++duplicates;
+        }
+    }
+    return duplicates;
+}
+
+
+/**
+* Count triangles that reference the same vertex twice or have zero area
+*/
+inline std::size_t count_degenerate_triangles(const std::vector<glm::vec3>& positions,
+                                              const std::vector<GLuint>& indices)
+{
+    std::size_t degenerate = 0;
+    for (std::size_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+        const GLuint a = indices[i];
+        const GLuint b = indices[i + 1];
+        const GLuint c = indices[i + 2];
+        if (a == b || b == c || a == c)
+        {
+            ++degenerate;
+            continue;
+        }
+        if (a < positions.size() && b < positions.size() && c < positions.size())
+        {
+            const glm::vec3 normal = glm::cross(positions[b] - positions[a], positions[c] - positions[a]);
+            if (glm::dot(normal, normal) == 0.0f)
+            {
+                ++degenerate;
+            }
+        }
+    }
+    return degenerate;
+}
+
+
+/**
+* Compute all the statistics of a single mesh
+*
+* Non-indexed meshes are analyzed as if they were indexed sequentially, which
+* is how they are drawn with `glDrawArrays`.
+*
+* @param vertices is a list of vertices
+* @param indices is a list of indices used for indexed draw
+* @param cache_sizes is the list of post-transform cache sizes to simulate
+*/
+template <class TVertex>
+MeshStatistics analyze_mesh(const std::vector<TVertex>& vertices,
+                            const std::vector<GLuint>& indices,
+                            const std::vector<std::size_t>& cache_sizes = {16, 32, 64})
+{
+    std::vector<GLuint> sequential;
+    if (indices.empty())
+    {
+        sequential.resize(vertices.size());
+        for (std::size_t i = 0; i < sequential.size(); ++i)
+        {
+            sequential[i] = static_cast<GLuint>(i);
+        }
+    }
+    const auto& draw_indices = indices.empty() ? sequential : indices;
+    const auto positions = collect_positions(vertices);
+
+    MeshStatistics result{};
+    result.vertex_count = vertices.size();
+    result.index_count = indices.size();
+    result.triangle_count = draw_indices.size() / 3;
+    result.vertex_size = sizeof(TVertex);
+    result.vertex_padding = sizeof(TVertex) - attribute_bytes<TVertex>();
+
+    std::vector<bool> referenced(vertices.size(), false);
+    for (auto index : draw_indices)
+    {
+        if (index < referenced.size())
+        {
+            referenced[index] = true;
+        }
+    }
+    result.unreferenced_vertices = std::count(referenced.begin(), referenced.end(), false);
+    result.duplicate_vertices = count_duplicate_vertices(vertices);
+    result.degenerate_triangles = count_degenerate_triangles(positions, draw_indices);
+
+    for (auto cache_size : cache_sizes)
+    {
+        result.vertex_cache.push_back(analyze_vertex_cache(draw_indices, vertices.size(), cache_size));
+    }
+    result.vertex_fetch = analyze_vertex_fetch(draw_indices, vertices.size(), sizeof(TVertex));
+    result.overdraw = analyze_overdraw(positions, draw_indices);
+
+    // Bytes that could be dropped without changing the rendered result
+    result.wasted_bytes = (result.unreferenced_vertices + result.duplicate_vertices) * sizeof(TVertex) +
+                          result.vertex_padding * vertices.size() +
+                          (indices.empty() ? 0 : result.degenerate_triangles * 3 * sizeof(GLuint));
+    return result;
+}
+
+
+}  // namespace analysis
+
+
+}  // namespace crudegl
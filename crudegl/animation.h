@@ -0,0 +1,950 @@
+#pragma once
+
+#include "jobs.h"
+#include "simd.h"
+#include "skeleton.h"
+
+#include <assimp/anim.h>
+#include <assimp/scene.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace animation
+{
+
+
+namespace simd
+{
+
+
+using crudegl::simd::Lanes;
+
+
+// Interpolation factors loaded per lane
+struct StreamFactor
+{
+    const float* factors;
+
+    Lanes::type load(std::size_t index) const
+    {
+        return Lanes::load(factors + index);
+    }
+};
+
+
+// The same interpolation factor for every lane
+struct UniformFactor
+{
+    Lanes::type factor;
+
+    Lanes::type load(std::size_t) const
+    {
+        return factor;
+    }
+};
+
+
+/**
+* Linearly interpolate between `from` and `to`
+*
+* @param count is the number of values, which must be a multiple of the
+*        lane width
+*/
+template <class TFactor>
+void lerp(const float* from, const float* to, const TFactor& factor, float* result, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; i += Lanes::width)
+    {
+        const Lanes::type a = Lanes::load(from + i);
+        const Lanes::type b = Lanes::load(to + i);
+        Lanes::store(result + i, Lanes::add(a, Lanes::mul(Lanes::sub(b, a), factor.load(i))));
+    }
+}
+
+
+/**
+* Normalized linear interpolation between quaternions stored as x, y, z and w
+* streams, along the shortest path
+*
+* @param count is the number of quaternions, which must be a multiple of the
+*        lane width
+*/
+template <class TFactor>
+void nlerp(const float* const from[4],
+           const float* const to[4],
+           const TFactor& factor,
+           float* const result[4],
+           std::size_t count)
+{
+    for (std::size_t i = 0; i < count; i += Lanes::width)
+    {
+        Lanes::type a[4];
+        Lanes::type b[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            a[c] = Lanes::load(from[c] + i);
+            b[c] = Lanes::load(to[c] + i);
+        }
+        const Lanes::type dot = Lanes::add(Lanes::add(Lanes::mul(a[0], b[0]), Lanes::mul(a[1], b[1])),
+                                           Lanes::add(Lanes::mul(a[2], b[2]), Lanes::mul(a[3], b[3])));
+        const Lanes::type t = factor.load(i);
+        Lanes::type r[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            // q and -q are the same rotation, pick the one in a's hemisphere
+            r[c] = Lanes::add(a[c], Lanes::mul(Lanes::sub(Lanes::copy_sign(b[c], dot), a[c]), t));
+        }
+        const Lanes::type length = Lanes::sqrt(Lanes::add(Lanes::add(Lanes::mul(r[0], r[0]), Lanes::mul(r[1], r[1])),
+                                                          Lanes::add(Lanes::mul(r[2], r[2]), Lanes::mul(r[3], r[3]))));
+        const Lanes::type inverse_length = Lanes::div(Lanes::set(1.0f), length);
+        for (int c = 0; c < 4; ++c)
+        {
+            Lanes::store(result[c] + i, Lanes::mul(r[c], inverse_length));
+        }
+    }
+}
+
+
+/**
+* Spherical linear interpolation between quaternions stored as x, y, z and w
+* streams, along the shortest path
+*
+* Exact but considerably slower than `nlerp`, since the weights need
+* trigonometry per quaternion.
+*/
+inline void slerp(const float* const from[4],
+                  const float* const to[4],
+                  const float* factors,
+                  float* const result[4],
+                  std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        float dot = 0.0f;
+        for (int c = 0; c < 4; ++c)
+        {
+            dot += from[c][i] * to[c][i];
+        }
+        const float sign = dot < 0.0f ? -1.0f : 1.0f;
+        dot = std::abs(dot);
+        float from_weight = 1.0f - factors[i];
+        float to_weight = factors[i];
+        // Nearly parallel quaternions fall back to nlerp to avoid dividing
+        // by sin(angle) close to 0
+        if (dot < 0.9995f)
+        {
+            const float angle = std::acos(dot);
+            const float inverse_sin = 1.0f / std::sin(angle);
+            from_weight = std::sin(from_weight * angle) * inverse_sin;
+            to_weight = std::sin(to_weight * angle) * inverse_sin;
+        }
+        float length = 0.0f;
+        float r[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            r[c] = from[c][i] * from_weight + to[c][i] * to_weight * sign;
+            length += r[c] * r[c];
+        }
+        length = std::sqrt(length);
+        for (int c = 0; c < 4; ++c)
+        {
+            result[c][i] = r[c] / length;
+        }
+    }
+}
+
+
+}  // namespace simd
+
+
+/**
+* Local transforms of all joints of a skeleton, stored as one stream per
+* component so they can be interpolated several joints at a time. Streams are
+* padded to a multiple of 8 joints and the padding holds identity transforms,
+* so the SIMD kernels never need a scalar tail.
+*/
+class Pose
+{
+public:
+    enum Stream
+    {
+        translation_x,
+        translation_y,
+        translation_z,
+        rotation_x,
+        rotation_y,
+        rotation_z,
+        rotation_w,
+        scale_x,
+        scale_y,
+        scale_z,
+        stream_count
+    };
+    enum
+    {
+        padding = 8
+    };
+
+    Pose() : m_joint_count{0},
+             m_stride{0}
+    {
+    }
+    explicit Pose(std::size_t joint_count)
+    {
+        resize(joint_count);
+    }
+    /**
+    * Resize the pose and reset all joints to identity transforms
+    */
+    void resize(std::size_t joint_count)
+    {
+        m_joint_count = joint_count;
+        m_stride = (joint_count + padding - 1) / padding * padding;
+        m_data.assign(m_stride * stream_count, 0.0f);
+        std::fill_n(stream(rotation_w), m_stride, 1.0f);
+        std::fill_n(stream(scale_x), m_stride * 3, 1.0f);
+    }
+    std::size_t size() const noexcept
+    {
+        return m_joint_count;
+    }
+    /**
+    * Return the padded number of joints of each stream
+    */
+    std::size_t stride() const noexcept
+    {
+        return m_stride;
+    }
+    float* stream(Stream component) noexcept
+    {
+        return m_data.data() + component * m_stride;
+    }
+    const float* stream(Stream component) const noexcept
+    {
+        return m_data.data() + component * m_stride;
+    }
+    void set(std::size_t joint, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale)
+    {
+        const float values[stream_count] = {translation.x, translation.y, translation.z,
+                                            rotation.x, rotation.y, rotation.z, rotation.w,
+                                            scale.x, scale.y, scale.z};
+        for (int component = 0; component < stream_count; ++component)
+        {
+            m_data[component * m_stride + joint] = values[component];
+        }
+    }
+    /**
+    * Return the local transform of the joint as a matrix
+    */
+    glm::mat4 local_matrix(std::size_t joint) const
+    {
+        const float* data = m_data.data() + joint;
+        const float x = data[rotation_x * m_stride];
+        const float y = data[rotation_y * m_stride];
+        const float z = data[rotation_z * m_stride];
+        const float w = data[rotation_w * m_stride];
+        const float sx = data[scale_x * m_stride];
+        const float sy = data[scale_y * m_stride];
+        const float sz = data[scale_z * m_stride];
+        glm::mat4 result;
+        result[0] = glm::vec4((1.0f - 2.0f * (y * y + z * z)) * sx,
+                              2.0f * (x * y + w * z) * sx,
+                              2.0f * (x * z - w * y) * sx,
+                              0.0f);
+        result[1] = glm::vec4(2.0f * (x * y - w * z) * sy,
+                              (1.0f - 2.0f * (x * x + z * z)) * sy,
+                              2.0f * (y * z + w * x) * sy,
+                              0.0f);
+        result[2] = glm::vec4(2.0f * (x * z + w * y) * sz,
+                              2.0f * (y * z - w * x) * sz,
+                              (1.0f - 2.0f * (x * x + y * y)) * sz,
+                              0.0f);
+        result[3] = glm::vec4(data[translation_x * m_stride],
+                              data[translation_y * m_stride],
+                              data[translation_z * m_stride],
+                              1.0f);
+        return result;
+    }
+private:
+    std::size_t m_joint_count;
+    std::size_t m_stride;
+    std::vector<float> m_data;
+};
+
+
+/**
+* Blend `to` into `from` by `weight`, storing the result in `result`, which
+* may alias either pose
+*/
+inline void blend_poses(const Pose& from, const Pose& to, float weight, Pose& result)
+{
+    const std::size_t count = from.stride();
+    const simd::UniformFactor factor{simd::Lanes::set(weight)};
+    for (int component : {Pose::translation_x, Pose::translation_y, Pose::translation_z,
+                          Pose::scale_x, Pose::scale_y, Pose::scale_z})
+    {
+        const auto stream = static_cast<Pose::Stream>(component);
+        simd::lerp(from.stream(stream), to.stream(stream), factor, result.stream(stream), count);
+    }
+    const float* const from_rotation[4] = {from.stream(Pose::rotation_x), from.stream(Pose::rotation_y),
+                                           from.stream(Pose::rotation_z), from.stream(Pose::rotation_w)};
+    const float* const to_rotation[4] = {to.stream(Pose::rotation_x), to.stream(Pose::rotation_y),
+                                         to.stream(Pose::rotation_z), to.stream(Pose::rotation_w)};
+    float* const result_rotation[4] = {result.stream(Pose::rotation_x), result.stream(Pose::rotation_y),
+                                       result.stream(Pose::rotation_z), result.stream(Pose::rotation_w)};
+    simd::nlerp(from_rotation, to_rotation, factor, result_rotation, count);
+}
+
+
+/**
+* Split an affine assimp matrix into translation, rotation and scale
+*/
+inline void decompose(const aiMatrix4x4& m, glm::vec3& translation, glm::quat& rotation, glm::vec3& scale)
+{
+    translation = glm::vec3(m.a4, m.b4, m.c4);
+    scale = glm::vec3(std::sqrt(m.a1 * m.a1 + m.b1 * m.b1 + m.c1 * m.c1),
+                      std::sqrt(m.a2 * m.a2 + m.b2 * m.b2 + m.c2 * m.c2),
+                      std::sqrt(m.a3 * m.a3 + m.b3 * m.b3 + m.c3 * m.c3));
+    const float determinant = m.a1 * (m.b2 * m.c3 - m.b3 * m.c2) -
+                              m.a2 * (m.b1 * m.c3 - m.b3 * m.c1) +
+                              m.a3 * (m.b1 * m.c2 - m.b2 * m.c1);
+    if (determinant < 0.0f)
+    {
+        scale.x = -scale.x;
+    }
+    // Rotation matrix in row-major order, with the scale divided out
+    const float r[3][3] = {{m.a1 / scale.x, m.a2 / scale.y, m.a3 / scale.z},
+                           {m.b1 / scale.x, m.b2 / scale.y, m.b3 / scale.z},
+                           {m.c1 / scale.x, m.c2 / scale.y, m.c3 / scale.z}};
+    const float trace = r[0][0] + r[1][1] + r[2][2];
+    if (trace > 0.0f)
+    {
+        const float s = std::sqrt(trace + 1.0f) * 2.0f;
+        rotation = glm::quat(0.25f * s, (r[2][1] - r[1][2]) / s, (r[0][2] - r[2][0]) / s, (r[1][0] - r[0][1]) / s);
+    }
+    else if (r[0][0] > r[1][1] && r[0][0] > r[2][2])
+    {
+        const float s = std::sqrt(1.0f + r[0][0] - r[1][1] - r[2][2]) * 2.0f;
+        rotation = glm::quat((r[2][1] - r[1][2]) / s, 0.25f * s, (r[0][1] + r[1][0]) / s, (r[0][2] + r[2][0]) / s);
+    }
+    else if (r[1][1] > r[2][2])
+    {
+        const float s = std::sqrt(1.0f + r[1][1] - r[0][0] - r[2][2]) * 2.0f;
+        rotation = glm::quat((r[0][2] - r[2][0]) / s, (r[0][1] + r[1][0]) / s, 0.25f * s, (r[1][2] + r[2][1]) / s);
+    }
+    else
+    {
+        const float s = std::sqrt(1.0f + r[2][2] - r[0][0] - r[1][1]) * 2.0f;
+        rotation = glm::quat((r[1][0] - r[0][1]) / s, (r[0][2] + r[2][0]) / s, (r[1][2] + r[2][1]) / s, 0.25f * s);
+    }
+}
+
+
+/**
+* Joint hierarchy of a model, flattened from the assimp node tree so that
+* every parent comes before it's children
+*/
+class Skeleton
+{
+public:
+    Skeleton()
+    {
+    }
+    explicit Skeleton(const aiNode* root)
+    {
+        std::vector<const aiNode*> nodes;
+        add_node(root, -1, nodes);
+        m_rest_pose.resize(nodes.size());
+        for (std::size_t joint = 0; joint < nodes.size(); ++joint)
+        {
+            glm::vec3 translation;
+            glm::quat rotation;
+            glm::vec3 scale;
+            decompose(nodes[joint]->mTransformation, translation, rotation, scale);
+            m_rest_pose.set(joint, translation, rotation, scale);
+        }
+        m_global_inverse = glm::inverse(to_mat4(root->mTransformation));
+    }
+    std::size_t size() const noexcept
+    {
+        return m_parents.size();
+    }
+    /**
+    * Return the index of the joint with the given name or -1 if there's none
+    */
+    int find(const std::string& name) const
+    {
+        const auto found = m_indices.find(name);
+        return found == m_indices.end() ? -1 : found->second;
+    }
+    const std::string& get_name(std::size_t joint) const
+    {
+        return m_names[joint];
+    }
+    int get_parent(std::size_t joint) const
+    {
+        return m_parents[joint];
+    }
+    /**
+    * Return the local joint transforms of the node tree, used for joints
+    * without animation
+    */
+    const Pose& get_rest_pose() const noexcept
+    {
+        return m_rest_pose;
+    }
+    const glm::mat4& get_global_inverse() const noexcept
+    {
+        return m_global_inverse;
+    }
+private:
+    void add_node(const aiNode* node, int parent, std::vector<const aiNode*>& nodes)
+    {
+        const int index = static_cast<int>(nodes.size());
+        nodes.push_back(node);
+        m_names.push_back(node->mName.C_Str());
+        m_parents.push_back(parent);
+        m_indices.emplace(m_names.back(), index);
+        for (unsigned int i = 0; i < node->mNumChildren; ++i)
+        {
+            add_node(node->mChildren[i], index, nodes);
+        }
+    }
+private:
+    std::vector<std::string> m_names;
+    std::vector<int> m_parents;
+    std::unordered_map<std::string, int> m_indices;
+    Pose m_rest_pose;
+    glm::mat4 m_global_inverse;
+};
+
+
+/**
+* Maps the bone palette of a mesh to the joints of a skeleton
+*/
+struct SkinBinding
+{
+    // Skeleton joint of every bone, -1 for bones missing from the skeleton
+    std::vector<int> joints;
+    std::vector<glm::mat4> offsets;
+};
+
+
+inline SkinBinding bind_skin(const Skeleton& skeleton, const BonePalette& palette)
+{
+    SkinBinding binding;
+    binding.joints.reserve(palette.size());
+    binding.offsets.reserve(palette.size());
+    for (const auto& bone : palette)
+    {
+        binding.joints.push_back(skeleton.find(bone.name));
+        binding.offsets.push_back(bone.offset);
+    }
+    return binding;
+}
+
+
+enum class Interpolation
+{
+    // Normalized lerp of rotations, evaluated several joints at a time
+    nlerp,
+    // Exact spherical interpolation of rotations, one joint at a time
+    slerp
+};
+
+
+/**
+* Per-sampler state reused between frames: the last key of every track, so
+* playback advancing forward finds it's keys without searching, and scratch
+* poses holding the keys to interpolate between.
+*/
+struct SamplingCache
+{
+    std::vector<std::uint32_t> cursors;
+    Pose from;
+    Pose to;
+    std::vector<float> factors;
+};
+
+
+/**
+* Size the pose and the sampling cache for a clip, unless they already are
+* @param tracks is the number of key tracks per joint
+*/
+inline void prepare_sampling(std::size_t joint_count, std::size_t tracks, Pose& pose, SamplingCache& cache)
+{
+    if (pose.size() != joint_count || cache.from.size() != joint_count || cache.cursors.size() != joint_count * tracks)
+    {
+        pose.resize(joint_count);
+        cache.from.resize(joint_count);
+        cache.to.resize(joint_count);
+        cache.factors.assign(pose.stride() * tracks, 0.0f);
+        cache.cursors.assign(joint_count * tracks, 0);
+    }
+}
+
+
+/**
+* Return the index of the last key at or before `time` and the interpolation
+* factor towards the next one
+*
+* Playback usually moves forward by less than a key per frame, so the search
+* starts by advancing the key found last time and only falls back to binary
+* search when that fails.
+*
+* @param cursor is the key found by the previous search of the track
+*/
+template <class TTime>
+std::uint32_t find_key(const TTime* times, std::uint32_t count, float time, std::uint32_t& cursor, float& factor)
+{
+    factor = 0.0f;
+    if (count == 1 || time <= times[0])
+    {
+        return 0;
+    }
+    if (time >= times[count - 1])
+    {
+        return count - 1;
+    }
+    std::uint32_t key = cursor;
+    if (key < count - 1 && times[key] <= time)
+    {
+        for (int step = 0; step < 4 && times[key + 1] <= time; ++step)
+        {
+            ++key;
+        }
+    }
+    if (key >= count - 1 || times[key] > time || times[key + 1] <= time)
+    {
+        key = static_cast<std::uint32_t>(std::upper_bound(times, times + count, time) - times) - 1;
+    }
+    cursor = key;
+    factor = (time - times[key]) / static_cast<float>(times[key + 1] - times[key]);
+    return key;
+}
+
+
+/**
+* Interface of animation clips that can be sampled into poses
+*/
+class Clip
+{
+public:
+    virtual ~Clip() = default;
+    virtual const std::string& get_name() const = 0;
+    /**
+    * Return the length of the clip in seconds
+    */
+    virtual float get_duration() const = 0;
+    /**
+    * Sample the clip at `time` seconds into `pose`
+    * @param rest_pose provides the transforms of joints without animation
+    * @param cache holds the cursors and scratch memory, one per playback
+    */
+    virtual void sample(float time,
+                        const Pose& rest_pose,
+                        Pose& pose,
+                        SamplingCache& cache,
+                        Interpolation interpolation) const = 0;
+};
+
+
+/**
+* Keyframes of an assimp animation, converted to one track per joint and
+* channel with the key times and each value component in separate arrays
+*/
+class AnimationClip : public Clip
+{
+public:
+    enum Channel
+    {
+        translation,
+        rotation,
+        scale,
+        channel_count
+    };
+
+    /**
+    * Constructor
+    * Convert the channels of `animation` animating joints of `skeleton`,
+    * channels of other nodes are ignored.
+    */
+    AnimationClip(const aiAnimation* animation, const Skeleton& skeleton) : m_name{animation->mName.C_Str()},
+                                                                           m_joint_count{skeleton.size()}
+    {
+        const double ticks_per_second = animation->mTicksPerSecond > 0.0 ? animation->mTicksPerSecond : 25.0;
+        m_duration = static_cast<float>(animation->mDuration / ticks_per_second);
+
+        std::vector<const aiNodeAnim*> channels(m_joint_count, nullptr);
+        for (unsigned int i = 0; i < animation->mNumChannels; ++i)
+        {
+            const int joint = skeleton.find(animation->mChannels[i]->mNodeName.C_Str());
+            if (joint >= 0)
+            {
+                channels[joint] = animation->mChannels[i];
+            }
+        }
+        for (auto& track : m_tracks)
+        {
+            track.ranges.assign(m_joint_count, KeyRange{0, 0});
+        }
+        // Tracks are laid out in joint order, so sampling walks memory
+        // linearly
+        for (std::size_t joint = 0; joint < m_joint_count; ++joint)
+        {
+            const aiNodeAnim* channel = channels[joint];
+            if (!channel)
+            {
+                continue;
+            }
+            add_keys(m_tracks[translation], joint, channel->mPositionKeys, channel->mNumPositionKeys, ticks_per_second);
+            add_keys(m_tracks[scale], joint, channel->mScalingKeys, channel->mNumScalingKeys, ticks_per_second);
+            add_keys(m_tracks[rotation], joint, channel->mRotationKeys, channel->mNumRotationKeys, ticks_per_second);
+        }
+    }
+    const std::string& get_name() const override
+    {
+        return m_name;
+    }
+    float get_duration() const override
+    {
+        return m_duration;
+    }
+    /**
+    * Sample the clip at `time` seconds into `pose`
+    *
+    * Keys of all tracks are located first, then interpolated for all joints
+    * at once.
+    */
+    void sample(float time,
+                const Pose& rest_pose,
+                Pose& pose,
+                SamplingCache& cache,
+                Interpolation interpolation) const override
+    {
+        const std::size_t stride = rest_pose.stride();
+        prepare_sampling(m_joint_count, channel_count, pose, cache);
+        for (int channel = 0; channel < channel_count; ++channel)
+        {
+            gather_keys(static_cast<Channel>(channel), time, rest_pose, cache);
+        }
+
+        const simd::StreamFactor translation_factor{cache.factors.data() + translation * stride};
+        const simd::StreamFactor scale_factor{cache.factors.data() + scale * stride};
+        for (int component = 0; component < 3; ++component)
+        {
+            const auto translation_stream = static_cast<Pose::Stream>(Pose::translation_x + component);
+            const auto scale_stream = static_cast<Pose::Stream>(Pose::scale_x + component);
+            simd::lerp(cache.from.stream(translation_stream), cache.to.stream(translation_stream),
+                       translation_factor, pose.stream(translation_stream), stride);
+            simd::lerp(cache.from.stream(scale_stream), cache.to.stream(scale_stream),
+                       scale_factor, pose.stream(scale_stream), stride);
+        }
+        const float* const from_rotation[4] = {cache.from.stream(Pose::rotation_x), cache.from.stream(Pose::rotation_y),
+                                               cache.from.stream(Pose::rotation_z), cache.from.stream(Pose::rotation_w)};
+        const float* const to_rotation[4] = {cache.to.stream(Pose::rotation_x), cache.to.stream(Pose::rotation_y),
+                                             cache.to.stream(Pose::rotation_z), cache.to.stream(Pose::rotation_w)};
+        float* const rotation_result[4] = {pose.stream(Pose::rotation_x), pose.stream(Pose::rotation_y),
+                                           pose.stream(Pose::rotation_z), pose.stream(Pose::rotation_w)};
+        const float* rotation_factors = cache.factors.data() + rotation * stride;
+        if (interpolation == Interpolation::slerp)
+        {
+            simd::slerp(from_rotation, to_rotation, rotation_factors, rotation_result, stride);
+        }
+        else
+        {
+            simd::nlerp(from_rotation, to_rotation, simd::StreamFactor{rotation_factors}, rotation_result, stride);
+        }
+    }
+private:
+    struct KeyRange
+    {
+        std::uint32_t first;
+        std::uint32_t count;
+    };
+
+    struct Track
+    {
+        std::vector<KeyRange> ranges;
+        std::vector<float> times;
+        // One array per value component, rotations use all four
+        std::vector<float> values[4];
+    };
+
+    static void append_value(Track& track, const aiVectorKey& key, bool)
+    {
+        track.values[0].push_back(key.mValue.x);
+        track.values[1].push_back(key.mValue.y);
+        track.values[2].push_back(key.mValue.z);
+    }
+    static void append_value(Track& track, const aiQuatKey& key, bool first_key)
+    {
+        float sign = 1.0f;
+        if (!first_key)
+        {
+            // Keep consecutive keys in the same hemisphere, so interpolating
+            // between them takes the shortest path
+            const std::size_t last = track.values[3].size() - 1;
+            const float dot = track.values[0][last] * key.mValue.x + track.values[1][last] * key.mValue.y +
+                              track.values[2][last] * key.mValue.z + track.values[3][last] * key.mValue.w;
+            sign = dot < 0.0f ? -1.0f : 1.0f;
+        }
+        track.values[0].push_back(key.mValue.x * sign);
+        track.values[1].push_back(key.mValue.y * sign);
+        track.values[2].push_back(key.mValue.z * sign);
+        track.values[3].push_back(key.mValue.w * sign);
+    }
+    template <class TKey>
+    static void add_keys(Track& track, std::size_t joint, const TKey* keys, unsigned int count, double ticks_per_second)
+    {
+        const auto first = static_cast<std::uint32_t>(track.times.size());
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            track.times.push_back(static_cast<float>(keys[i].mTime / ticks_per_second));
+            append_value(track, keys[i], i == 0);
+        }
+        track.ranges[joint] = KeyRange{first, count};
+    }
+    void gather_keys(Channel channel, float time, const Pose& rest_pose, SamplingCache& cache) const
+    {
+        const Track& track = m_tracks[channel];
+        const int components = channel == rotation ? 4 : 3;
+        const int base = channel == translation ? Pose::translation_x :
+                         channel == rotation ? Pose::rotation_x : Pose::scale_x;
+        float* factors = cache.factors.data() + channel * rest_pose.stride();
+        std::uint32_t* cursors = cache.cursors.data() + channel * m_joint_count;
+        for (std::size_t joint = 0; joint < m_joint_count; ++joint)
+        {
+            const KeyRange range = track.ranges[joint];
+            if (range.count == 0)
+            {
+                for (int c = 0; c < components; ++c)
+                {
+                    const auto stream = static_cast<Pose::Stream>(base + c);
+                    cache.from.stream(stream)[joint] = rest_pose.stream(stream)[joint];
+                    cache.to.stream(stream)[joint] = rest_pose.stream(stream)[joint];
+                }
+                factors[joint] = 0.0f;
+                continue;
+            }
+            const std::uint32_t key = find_key(track.times.data() + range.first, range.count, time, cursors[joint], factors[joint]);
+            const std::uint32_t from = range.first + key;
+            const std::uint32_t to = range.first + std::min(key + 1, range.count - 1);
+            for (int c = 0; c < components; ++c)
+            {
+                const auto stream = static_cast<Pose::Stream>(base + c);
+                cache.from.stream(stream)[joint] = track.values[c][from];
+                cache.to.stream(stream)[joint] = track.values[c][to];
+            }
+        }
+    }
+private:
+    std::string m_name;
+    std::size_t m_joint_count;
+    float m_duration;
+    Track m_tracks[channel_count];
+};
+
+
+/**
+* Return the clips of all animations of the scene
+*/
+inline std::vector<AnimationClip> collect_clips(const aiScene* scene, const Skeleton& skeleton)
+{
+    std::vector<AnimationClip> clips;
+    clips.reserve(scene->mNumAnimations);
+    for (unsigned int i = 0; i < scene->mNumAnimations; ++i)
+    {
+        clips.emplace_back(scene->mAnimations[i], skeleton);
+    }
+    return clips;
+}
+
+
+/**
+* Plays and blends animation clips on one instance of a skeleton and
+* computes it's skinning matrix palette
+*/
+class Animator
+{
+public:
+    /**
+    * Constructor
+    * @param skeleton is the animated skeleton, which must outlive the animator
+    * @param skin optionally maps a mesh's bones to the skeleton, a skinning
+    *        palette is only computed with one
+    */
+    explicit Animator(const Skeleton& skeleton,
+                      const SkinBinding* skin = nullptr) : m_skeleton{&skeleton},
+                                                           m_skin{skin},
+                                                           m_interpolation{Interpolation::nlerp},
+                                                           m_pose{skeleton.size()},
+                                                           m_sample{skeleton.size()}
+    {
+    }
+    /**
+    * Add a clip to be played and blended with the other layers by `weight`
+    * @return the index of the new layer
+    */
+    std::size_t add_layer(const Clip& clip, float weight = 1.0f, bool loop = true)
+    {
+        m_layers.push_back(Layer{&clip, 0.0f, weight, loop, SamplingCache{}});
+        return m_layers.size() - 1;
+    }
+    void clear_layers()
+    {
+        m_layers.clear();
+    }
+    void set_weight(std::size_t layer, float weight)
+    {
+        m_layers[layer].weight = weight;
+    }
+    void set_time(std::size_t layer, float time)
+    {
+        m_layers[layer].time = time;
+    }
+    /**
+    * Advance the playback time of all layers by `seconds`
+    */
+    void advance(float seconds)
+    {
+        for (auto& layer : m_layers)
+        {
+            layer.time += seconds;
+            const float duration = layer.clip->get_duration();
+            if (layer.loop && duration > 0.0f)
+            {
+                layer.time = std::fmod(layer.time, duration);
+                layer.time = layer.time < 0.0f ? layer.time + duration : layer.time;
+            }
+        }
+    }
+    void set_interpolation(Interpolation interpolation)
+    {
+        m_interpolation = interpolation;
+    }
+    /**
+    * Sample and blend all layers, then compute the global joint transforms
+    * and the skinning palette
+    */
+    void evaluate()
+    {
+        float total_weight = 0.0f;
+        for (auto& layer : m_layers)
+        {
+            if (layer.weight <= 0.0f)
+            {
+                continue;
+            }
+            Pose& target = total_weight > 0.0f ? m_sample : m_pose;
+            layer.clip->sample(layer.time, m_skeleton->get_rest_pose(), target, layer.cache, m_interpolation);
+            total_weight += layer.weight;
+            if (&target == &m_sample)
+            {
+                // Running weighted average of all layers so far
+                blend_poses(m_pose, m_sample, layer.weight / total_weight, m_pose);
+            }
+        }
+        if (total_weight <= 0.0f)
+        {
+            m_pose = m_skeleton->get_rest_pose();
+        }
+        compute_global_transforms();
+        if (m_skin)
+        {
+            compute_palette();
+        }
+    }
+    const Pose& get_pose() const noexcept
+    {
+        return m_pose;
+    }
+    /**
+    * Return the model space transform of every joint
+    */
+    const std::vector<glm::mat4>& get_global_transforms() const noexcept
+    {
+        return m_globals;
+    }
+    /**
+    * Return the skinning matrix of every bone of the bound mesh
+    */
+    const std::vector<glm::mat4>& get_palette() const noexcept
+    {
+        return m_palette;
+    }
+private:
+    struct Layer
+    {
+        const Clip* clip;
+        float time;
+        float weight;
+        bool loop;
+        SamplingCache cache;
+    };
+
+    void compute_global_transforms()
+    {
+        const std::size_t joint_count = m_skeleton->size();
+        m_globals.resize(joint_count);
+        for (std::size_t joint = 0; joint < joint_count; ++joint)
+        {
+            const int parent = m_skeleton->get_parent(joint);
+            m_globals[joint] = parent < 0 ? m_pose.local_matrix(joint) : m_globals[parent] * m_pose.local_matrix(joint);
+        }
+    }
+    void compute_palette()
+    {
+        m_palette.resize(m_skin->joints.size());
+        for (std::size_t bone = 0; bone < m_palette.size(); ++bone)
+        {
+            const int joint = m_skin->joints[bone];
+            m_palette[bone] = joint < 0 ? glm::mat4(1.0f) :
+                              m_skeleton->get_global_inverse() * m_globals[joint] * m_skin->offsets[bone];
+        }
+    }
+private:
+    const Skeleton* m_skeleton;
+    const SkinBinding* m_skin;
+    Interpolation m_interpolation;
+    std::vector<Layer> m_layers;
+    Pose m_pose;
+    Pose m_sample;
+    std::vector<glm::mat4> m_globals;
+    std::vector<glm::mat4> m_palette;
+};
+
+
+/**
+* Evaluate many animators, spread across the workers of the job system
+* @param jobs is an optional job system, animators are evaluated serially
+*        without one
+*/
+inline void evaluate_animators(jobs::JobSystem* jobs, std::vector<Animator>& animators)
+{
+    jobs::parallel_for(jobs, 0, animators.size(), [&](std::size_t i)
+                       {
+                           animators[i].evaluate();
+                       },
+                       4);
+}
+
+
+}  // namespace animation
+
+
+}  // namespace crudegl
@@ -0,0 +1,391 @@
+#pragma once
+
+#include "bounds.h"
+#include "jobs.h"
+#include "materials.h"
+#include "meshes.h"
+#include "simd.h"
+#include "vertices.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+/**
+* Indices of one source mesh within a static batch
+*/
+struct BatchRange
+{
+    std::size_t first_index;
+    std::size_t index_count;
+    // Bounds of the pre-transformed vertices, in world space
+    geometry::BoundingBox bounds;
+};
+
+
+/**
+* Where a source mesh ended up, see `StaticBatcher::add`
+*/
+struct BatchLocation
+{
+    std::size_t batch;
+    std::size_t range;
+};
+
+
+/**
+* Merged mesh of many static meshes sharing their material, keeping the range
+* of each source mesh so culled ones can be skipped
+*/
+template <class TMesh = Mesh<>>
+class StaticBatch
+{
+public:
+    using mesh_type = TMesh;
+    using program_type = typename mesh_type::program_type;
+
+    StaticBatch(mesh_type mesh, std::vector<BatchRange> ranges) : m_mesh(std::move(mesh)),
+                                                                 m_ranges(std::move(ranges))
+    {
+    }
+    /**
+    * Render every source mesh with a single draw
+    */
+    void render(program_type& program) const
+    {
+        m_mesh.render(program);
+    }
+    /**
+    * Render the source meshes flagged visible with a single multi-draw,
+    * merging neighbouring visible ranges
+    * @param visible holds one flag per range
+    */
+    void render(program_type& program, const std::vector<std::uint8_t>& visible) const
+    {
+        m_counts.clear();
+        m_offsets.clear();
+        std::size_t end = 0;
+        for (std::size_t i = 0; i < m_ranges.size() && i < visible.size(); ++i)
+        {
+            if (!visible[i])
+            {
+                continue;
+            }
+            const BatchRange& range = m_ranges[i];
+            if (!m_counts.empty() && range.first_index == end)
+            {
+                m_counts.back() += static_cast<GLsizei>(range.index_count);
+            }
+            else
+            {
+                m_counts.push_back(static_cast<GLsizei>(range.index_count));
+                m_offsets.push_back(reinterpret_cast<const void*>(range.first_index * sizeof(GLuint)));
+            }
+            end = range.first_index + range.index_count;
+        }
+        if (!m_counts.empty())
+        {
+            m_mesh.render_ranges(program, m_counts, m_offsets);
+        }
+    }
+    const std::vector<BatchRange>& get_ranges() const noexcept
+    {
+        return m_ranges;
+    }
+    const mesh_type& get_mesh() const noexcept
+    {
+        return m_mesh;
+    }
+private:
+    mesh_type m_mesh;
+    std::vector<BatchRange> m_ranges;
+    // Multi-draw arguments, kept to reuse their storage
+    mutable std::vector<GLsizei> m_counts;
+    mutable std::vector<const void*> m_offsets;
+};
+
+
+/**
+* Merges small static meshes into few large ones, at load time or offline
+*
+* Meshes are grouped by their material and textures, the vertex format being
+* fixed by the mesh type, and their vertices pre-transformed into world
+* space, so that a group renders with one draw instead of one per mesh.
+* Groups are split once they reach `max_vertices`, keeping batches small
+* enough to cull by range.
+*
+* Like `AssetModel`, `process` only does CPU work and may run on any thread,
+* while `upload` must run on the thread owning the OpenGL context.
+*/
+template <class TMesh = Mesh<>>
+class StaticBatcher
+{
+public:
+    using mesh_type = TMesh;
+    using vertex_data_type = typename mesh_type::vertex_data_type;
+    using texture_type = typename mesh_type::texture_type;
+    using texture_vec = typename mesh_type::texture_vec;
+    using batch_type = StaticBatch<mesh_type>;
+
+    static_assert(std::is_base_of<attributes::Position, vertex_data_type>::value,
+                  "Static batching requires vertex positions");
+    static_assert(!is_skinned_vertex<vertex_data_type>::value, "Skinned vertices cannot be batched statically");
+
+    /**
+    * Constructor
+    * @param max_vertices is the vertex count at which a batch is split
+    * @param jobs pre-transforms the vertices of the source meshes in parallel
+    */
+    explicit StaticBatcher(std::size_t max_vertices = 1 << 20,
+                           jobs::JobSystem* jobs = nullptr) : m_max_vertices(max_vertices),
+                                                              m_jobs(jobs)
+    {
+    }
+    /**
+    * Add a static mesh
+    * @param transform places the mesh in world space
+    * @param material is the material of the mesh within a `MaterialLibrary`,
+    *        set on the batch mesh if its type supports materials
+    * @return the batch and the range the mesh will be rendered from
+    */
+    template <class TVertexAllocator, class TIndexAllocator>
+    BatchLocation add(const std::vector<vertex_data_type, TVertexAllocator>& vertices,
+                      const std::vector<GLuint, TIndexAllocator>& indices,
+                      const texture_vec& textures,
+                      const glm::mat4& transform,
+                      MaterialHandle material = no_material)
+    {
+        GroupKey key;
+        key.first = material;
+        for (const auto& texture : textures)
+        {
+            key.second.push_back(texture.get());
+        }
+        std::size_t batch = 0;
+        const auto found = m_open.find(key);
+        if (found != m_open.end() && m_groups[found->second].vertices.size() + vertices.size() <= m_max_vertices)
+        {
+            batch = found->second;
+        }
+        else
+        {
+            m_groups.emplace_back();
+            m_groups.back().textures = textures;
+            m_groups.back().material = material;
+            batch = m_groups.size() - 1;
+            m_open[std::move(key)] = batch;
+        }
+        Group& group = m_groups[batch];
+        const auto base = static_cast<GLuint>(group.vertices.size());
+        Source source;
+        source.first_vertex = group.vertices.size();
+        source.vertex_count = vertices.size();
+        source.transform = transform;
+        group.vertices.insert(group.vertices.end(), vertices.begin(), vertices.end());
+        group.sources.push_back(source);
+
+        BatchRange range;
+        range.first_index = group.indices.size();
+        // Only whole triangles are copied
+        range.index_count = indices.size() / 3 * 3;
+        // A mirroring transform turns the triangles inside out, which the
+        // winding has to undo to keep them front facing
+        const bool mirrored = glm::determinant(glm::mat3(transform)) < 0.0f;
+        for (std::size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+            group.indices.push_back(base + indices[i]);
+            group.indices.push_back(base + indices[mirrored ? i + 2 : i + 1]);
+            group.indices.push_back(base + indices[mirrored ? i + 1 : i + 2]);
+        }
+        group.ranges.push_back(range);
+        return BatchLocation{batch, group.ranges.size() - 1};
+    }
+    /**
+    * Pre-transform the vertices of every added mesh into world space
+    */
+    void process()
+    {
+        std::vector<std::pair<std::size_t, std::size_t>> sources;
+        for (std::size_t g = 0; g < m_groups.size(); ++g)
+        {
+            for (std::size_t s = 0; s < m_groups[g].sources.size(); ++s)
+            {
+                sources.emplace_back(g, s);
+            }
+        }
+        jobs::parallel_for(m_jobs, 0, sources.size(), [&](std::size_t i)
+                           {
+                               Group& group = m_groups[sources[i].first];
+                               transform(group.sources[sources[i].second], group.vertices.data(),
+                                         group.ranges[sources[i].second].bounds);
+                           });
+    }
+    /**
+    * Create one mesh per batch and reset the batcher
+    */
+    std::vector<batch_type> upload()
+    {
+        std::vector<batch_type> batches;
+        batches.reserve(m_groups.size());
+        for (Group& group : m_groups)
+        {
+            mesh_type mesh(group.vertices, group.indices, std::move(group.textures));
+            set_material(mesh, group.material, has_material<mesh_type>());
+            batches.emplace_back(std::move(mesh), std::move(group.ranges));
+        }
+        m_groups.clear();
+        m_open.clear();
+        return batches;
+    }
+    std::size_t get_batch_count() const noexcept
+    {
+        return m_groups.size();
+    }
+private:
+    struct Source
+    {
+        std::size_t first_vertex;
+        std::size_t vertex_count;
+        glm::mat4 transform;
+    };
+
+    // Material and textures shared by the meshes of a group
+    using GroupKey = std::pair<MaterialHandle, std::vector<const texture_type*>>;
+
+    struct Group
+    {
+        texture_vec textures;
+        MaterialHandle material;
+        std::vector<vertex_data_type> vertices;
+        std::vector<GLuint> indices;
+        std::vector<Source> sources;
+        std::vector<BatchRange> ranges;
+    };
+
+    static void set_material(mesh_type&, MaterialHandle, std::false_type)
+    {
+    }
+    static void set_material(mesh_type& mesh, MaterialHandle material, std::true_type)
+    {
+        mesh.set_material(material);
+    }
+    /**
+    * Transform the positions and normals of one source mesh in place, a
+    * lane per vertex, and collect their bounds
+    */
+    static void transform(const Source& source, vertex_data_type* vertices, geometry::BoundingBox& bounds)
+    {
+        using simd::Lanes;
+        vertex_data_type* first = vertices + source.first_vertex;
+        const std::size_t count = source.vertex_count;
+        const std::size_t padded = (count + Lanes::width - 1) / Lanes::width * Lanes::width;
+        std::vector<float> components(padded * 3, 0.0f);
+        float* x = components.data();
+        float* y = x + padded;
+        float* z = y + padded;
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            const glm::vec3& position = first[i].position;
+            x[i] = position.x;
+            y[i] = position.y;
+            z[i] = position.z;
+        }
+        transform_lanes(glm::mat3(source.transform), glm::vec3(source.transform[3]), x, y, z, padded, false);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            first[i].position = glm::vec3(x[i], y[i], z[i]);
+            bounds.expand(first[i].position);
+        }
+        transform_normals(source, first, x, y, z, padded, std::is_base_of<attributes::Normal, vertex_data_type>());
+    }
+    static void transform_normals(const Source&, vertex_data_type*, float*, float*, float*, std::size_t, std::false_type)
+    {
+    }
+    static void transform_normals(const Source& source, vertex_data_type* first,
+                                  float* x, float* y, float* z, std::size_t padded, std::true_type)
+    {
+        for (std::size_t i = 0; i < source.vertex_count; ++i)
+        {
+            const glm::vec3& normal = first[i].normal;
+            x[i] = normal.x;
+            y[i] = normal.y;
+            z[i] = normal.z;
+        }
+        // Padding lanes still hold positions, which is harmless
+        const glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(source.transform)));
+        transform_lanes(normal_matrix, glm::vec3(0.0f), x, y, z, padded, true);
+        for (std::size_t i = 0; i < source.vertex_count; ++i)
+        {
+            first[i].normal = glm::vec3(x[i], y[i], z[i]);
+        }
+    }
+    static void transform_lanes(const glm::mat3& matrix, const glm::vec3& translation,
+                                float* x, float* y, float* z, std::size_t padded, bool normalize)
+    {
+        using simd::Lanes;
+        Lanes::type columns[3][3];
+        for (int column = 0; column < 3; ++column)
+        {
+            for (int row = 0; row < 3; ++row)
+            {
+                columns[column][row] = Lanes::set(matrix[column][row]);
+            }
+        }
+        const Lanes::type offset[3] = {Lanes::set(translation.x), Lanes::set(translation.y), Lanes::set(translation.z)};
+        for (std::size_t i = 0; i < padded; i += Lanes::width)
+        {
+            const Lanes::type in[3] = {Lanes::load(x + i), Lanes::load(y + i), Lanes::load(z + i)};
+            Lanes::type out[3];
+            for (int row = 0; row < 3; ++row)
+            {
+                out[row] = Lanes::add(Lanes::add(Lanes::mul(columns[0][row], in[0]), Lanes::mul(columns[1][row], in[1])),
+                                      Lanes::add(Lanes::mul(columns[2][row], in[2]), offset[row]));
+            }
+            if (normalize)
+            {
+                const Lanes::type length = Lanes::sqrt(Lanes::add(Lanes::add(Lanes::mul(out[0], out[0]), Lanes::mul(out[1], out[1])),
+                                                                  Lanes::mul(out[2], out[2])));
+                // Zero normals stay zero instead of turning into NaN
+                const Lanes::type scale = Lanes::select(Lanes::equal(length, Lanes::set(0.0f)),
+                                                        Lanes::set(0.0f),
+                                                        Lanes::div(Lanes::set(1.0f), length));
+                for (int row = 0; row < 3; ++row)
+                {
+                    out[row] = Lanes::mul(out[row], scale);
+                }
+            }
+            Lanes::store(x + i, out[0]);
+            Lanes::store(y + i, out[1]);
+            Lanes::store(z + i, out[2]);
+        }
+    }
+private:
+    std::size_t m_max_vertices;
+    jobs::JobSystem* m_jobs;
+    std::vector<Group> m_groups;
+    // Group still open for more meshes, per material and set of textures
+    std::map<GroupKey, std::size_t> m_open;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <limits>
+
+
+namespace crudegl
+{
+
+
+namespace geometry
+{
+
+
+struct BoundingBox
+{
+    glm::vec3 minimum;
+    glm::vec3 maximum;
+
+    /**
+    * Constructor
+    * Create an empty box, which grows to fit the first point or box added
+    */
+    BoundingBox() : minimum(std::numeric_limits<float>::max()),
+                    maximum(-std::numeric_limits<float>::max())
+    {
+    }
+
+    BoundingBox(const glm::vec3& min_corner, const glm::vec3& max_corner) : minimum(min_corner),
+                                                                            maximum(max_corner)
+    {
+    }
+
+    bool empty() const noexcept
+    {
+        return minimum.x > maximum.x || minimum.y > maximum.y || minimum.z > maximum.z;
+    }
+    void expand(const glm::vec3& point)
+    {
+        minimum = glm::min(minimum, point);
+        maximum = glm::max(maximum, point);
+    }
+    void expand(const BoundingBox& box)
+    {
+        minimum = glm::min(minimum, box.minimum);
+        maximum = glm::max(maximum, box.maximum);
+    }
+    glm::vec3 center() const
+    {
+        return (minimum + maximum) * 0.5f;
+    }
+    glm::vec3 extent() const
+    {
+        return maximum - minimum;
+    }
+    /**
+    * Return the radius of the sphere enclosing the box, centered on it
+    */
+    float radius() const
+    {
+        return glm::length(extent()) * 0.5f;
+    }
+    float surface_area() const
+    {
+        if (empty())
+        {
+            return 0.0f;
+        }
+        const glm::vec3 size = extent();
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+    /**
+    * Return the box enclosing this box after transformation by `matrix`
+    */
+    BoundingBox transformed(const glm::mat4& matrix) const
+    {
+        if (empty())
+        {
+            return *this;
+        }
+        // Arvo's method, project the extents onto the rotated axes
+        const glm::vec3 translation(matrix[3]);
+        BoundingBox result(translation, translation);
+        for (int column = 0; column < 3; ++column)
+        {
+            for (int row = 0; row < 3; ++row)
+            {
+                const float a = matrix[column][row] * minimum[column];
+                const float b = matrix[column][row] * maximum[column];
+                result.minimum[row] += std::min(a, b);
+                result.maximum[row] += std::max(a, b);
+            }
+        }
+        return result;
+    }
+};
+
+
+struct Sphere
+{
+    glm::vec3 center;
+    float radius;
+
+    Sphere(const glm::vec3& sphere_center, float sphere_radius) : center(sphere_center),
+                                                                  radius(sphere_radius)
+    {
+    }
+
+    bool intersects(const BoundingBox& box) const
+    {
+        const glm::vec3 closest = glm::min(glm::max(center, box.minimum), box.maximum);
+        const glm::vec3 offset = closest - center;
+        return !box.empty() && glm::dot(offset, offset) <= radius * radius;
+    }
+};
+
+
+struct Ray
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+    // Component-wise reciprocal of the direction, for slab tests
+    glm::vec3 inverse_direction;
+
+    /**
+    * Constructor
+    * @param ray_direction is the direction, distances along the ray are
+    *        measured in multiples of its length
+    */
+    Ray(const glm::vec3& ray_origin, const glm::vec3& ray_direction) : origin(ray_origin),
+                                                                       direction(ray_direction),
+                                                                       inverse_direction(1.0f / ray_direction.x,
+                                                                                         1.0f / ray_direction.y,
+                                                                                         1.0f / ray_direction.z)
+    {
+    }
+
+    glm::vec3 at(float distance) const
+    {
+        return origin + direction * distance;
+    }
+    /**
+    * Return the distance at which the ray enters the box, or infinity when
+    * it misses the box within `max_distance`
+    */
+    float intersect(const BoundingBox& box, float max_distance = std::numeric_limits<float>::infinity()) const
+    {
+        const glm::vec3 t1 = (box.minimum - origin) * inverse_direction;
+        const glm::vec3 t2 = (box.maximum - origin) * inverse_direction;
+        const glm::vec3 entries = glm::min(t1, t2);
+        const glm::vec3 exits = glm::max(t1, t2);
+        const float entry = std::max(std::max(entries.x, entries.y), std::max(entries.z, 0.0f));
+        const float exit = std::min(std::min(exits.x, exits.y), std::min(exits.z, max_distance));
+        return entry <= exit ? entry : std::numeric_limits<float>::infinity();
+    }
+};
+
+
+/**
+* View frustum as six planes facing inwards, extracted from a view projection
+* matrix with OpenGL clip space conventions
+*/
+struct Frustum
+{
+    enum Plane
+    {
+        left_plane,
+        right_plane,
+        bottom_plane,
+        top_plane,
+        near_plane,
+        far_plane,
+        plane_count
+    };
+
+    // Normal in xyz and distance from the origin in w
+    glm::vec4 planes[plane_count];
+
+    explicit Frustum(const glm::mat4& view_projection)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            for (int column = 0; column < 4; ++column)
+            {
+                planes[2 * i][column] = view_projection[column][3] + view_projection[column][i];
+                planes[2 * i + 1][column] = view_projection[column][3] - view_projection[column][i];
+            }
+        }
+        for (glm::vec4& plane : planes)
+        {
+            plane = plane / glm::length(glm::vec3(plane));
+        }
+    }
+
+    bool intersects(const BoundingBox& box) const
+    {
+        if (box.empty())
+        {
+            return false;
+        }
+        for (const glm::vec4& plane : planes)
+        {
+            // Test the corner furthest along the plane normal
+            const glm::vec3 corner(plane.x > 0.0f ? box.maximum.x : box.minimum.x,
+                                   plane.y > 0.0f ? box.maximum.y : box.minimum.y,
+                                   plane.z > 0.0f ? box.maximum.z : box.minimum.z);
+            if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool intersects(const Sphere& sphere) const
+    {
+        for (const glm::vec4& plane : planes)
+        {
+            if (glm::dot(glm::vec3(plane), sphere.center) + plane.w < -sphere.radius)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+}  // namespace geometry
+
+
+}  // namespace crudegl
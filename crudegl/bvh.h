@@ -0,0 +1,1048 @@
+#pragma once
+
+#include "bounds.h"
+#include "jobs.h"
+#include "simd.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace geometry
+{
+
+
+using MeshHandle = std::uint32_t;
+
+
+// Handle of no mesh, e.g. in the result of a missed pick
+constexpr MeshHandle invalid_mesh_handle = std::numeric_limits<MeshHandle>::max();
+
+
+// Parent of the root node of a BVH
+constexpr std::uint32_t invalid_bvh_node = std::numeric_limits<std::uint32_t>::max();
+
+
+enum
+{
+    // Children per BVH node, one or two SIMD registers of child bounds
+    bvh_width = simd::Lanes::width < 4 ? 4 : simd::Lanes::width
+};
+
+
+/**
+* Wide BVH node storing the bounds of its children as structure of arrays,
+* so that all children are tested against a query at once
+*
+* Loads are unaligned, `std::vector` doesn't honor over-aligned types before
+* C++17.
+*/
+struct BVHNode
+{
+    float minimum[3][bvh_width];
+    float maximum[3][bvh_width];
+    // Node index of internal children, first reference of leaf children
+    std::uint32_t child[bvh_width];
+    // Number of references of leaf children, zero for internal children
+    std::uint32_t count[bvh_width];
+    std::uint32_t child_count;
+    std::uint32_t parent;
+};
+
+
+inline BoundingBox get_child_bounds(const BVHNode& node, std::size_t slot)
+{
+    return BoundingBox(glm::vec3(node.minimum[0][slot], node.minimum[1][slot], node.minimum[2][slot]),
+                       glm::vec3(node.maximum[0][slot], node.maximum[1][slot], node.maximum[2][slot]));
+}
+
+
+inline void set_child_bounds(BVHNode& node, std::size_t slot, const BoundingBox& bounds)
+{
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        node.minimum[axis][slot] = bounds.minimum[axis];
+        node.maximum[axis][slot] = bounds.maximum[axis];
+    }
+}
+
+
+inline int lowest_bit(int bits)
+{
+    int index = 0;
+    while (!(bits & (1 << index)))
+    {
+        ++index;
+    }
+    return index;
+}
+
+
+// Accepts the children of a node intersecting a frustum
+struct FrustumTest
+{
+    const Frustum* frustum;
+
+    bool operator()(const BoundingBox& bounds) const
+    {
+        return frustum->intersects(bounds);
+    }
+    simd::Lanes::mask operator()(const BVHNode& node, int first) const
+    {
+        using simd::Lanes;
+        Lanes::mask inside{};
+        for (int p = 0; p < Frustum::plane_count; ++p)
+        {
+            const glm::vec4& plane = frustum->planes[p];
+            // Distance of the corner furthest along the plane normal
+            Lanes::type distance = Lanes::set(plane.w);
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const float* corner = plane[axis] > 0.0f ? node.maximum[axis] : node.minimum[axis];
+                distance = Lanes::add(distance, Lanes::mul(Lanes::set(plane[axis]), Lanes::load(corner + first)));
+            }
+            const Lanes::mask plane_inside = Lanes::less_equal(Lanes::set(0.0f), distance);
+            inside = p == 0 ? plane_inside : Lanes::both(inside, plane_inside);
+        }
+        return inside;
+    }
+};
+
+
+// Accepts the children of a node intersecting a sphere
+struct SphereTest
+{
+    const Sphere* sphere;
+
+    bool operator()(const BoundingBox& bounds) const
+    {
+        return sphere->intersects(bounds);
+    }
+    simd::Lanes::mask operator()(const BVHNode& node, int first) const
+    {
+        using simd::Lanes;
+        const Lanes::type zero = Lanes::set(0.0f);
+        Lanes::type distance = zero;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const Lanes::type center = Lanes::set(sphere->center[axis]);
+            const Lanes::type below = Lanes::sub(Lanes::load(node.minimum[axis] + first), center);
+            const Lanes::type above = Lanes::sub(center, Lanes::load(node.maximum[axis] + first));
+            const Lanes::type offset = Lanes::max(Lanes::max(below, above), zero);
+            distance = Lanes::add(distance, Lanes::mul(offset, offset));
+        }
+        return Lanes::less_equal(distance, Lanes::set(sphere->radius * sphere->radius));
+    }
+};
+
+
+// Accepts the children of a node hit by a ray within a maximum distance
+struct RayTest
+{
+    const Ray* ray;
+    float max_distance;
+    // Receives the entry distance of every child
+    float* distances;
+
+    simd::Lanes::mask operator()(const BVHNode& node, int first) const
+    {
+        using simd::Lanes;
+        Lanes::type entry = Lanes::set(0.0f);
+        Lanes::type exit = Lanes::set(max_distance);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const Lanes::type origin = Lanes::set(ray->origin[axis]);
+            const Lanes::type inverse = Lanes::set(ray->inverse_direction[axis]);
+            const Lanes::type t1 = Lanes::mul(Lanes::sub(Lanes::load(node.minimum[axis] + first), origin), inverse);
+            const Lanes::type t2 = Lanes::mul(Lanes::sub(Lanes::load(node.maximum[axis] + first), origin), inverse);
+            entry = Lanes::max(entry, Lanes::min(t1, t2));
+            exit = Lanes::min(exit, Lanes::max(t1, t2));
+        }
+        Lanes::store(distances + first, entry);
+        return Lanes::less_equal(entry, exit);
+    }
+};
+
+
+/**
+* Return one bit per child of `node` accepted by `test`
+*/
+template <class TTest>
+int test_children(const BVHNode& node, const TTest& test)
+{
+    int result = 0;
+    for (int first = 0; first < bvh_width; first += simd::Lanes::width)
+    {
+        result |= simd::Lanes::bits(test(node, first)) << first;
+    }
+    return result & ((1 << node.child_count) - 1);
+}
+
+
+/**
+* Visit the leaves of `nodes` accepted by `test`
+*
+* @param visitor is called with the first reference and the reference count
+*        of every accepted leaf
+*/
+template <class TTest, class TVisitor>
+void traverse_bvh(const std::vector<BVHNode>& nodes, const TTest& test, TVisitor&& visitor)
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+    std::vector<std::uint32_t> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        const BVHNode& node = nodes[stack.back()];
+        stack.pop_back();
+        for (int hits = test_children(node, test); hits; hits &= hits - 1)
+        {
+            const int slot = lowest_bit(hits);
+            if (node.count[slot] == 0)
+            {
+                stack.push_back(node.child[slot]);
+            }
+            else
+            {
+                visitor(node.child[slot], node.count[slot]);
+            }
+        }
+    }
+}
+
+
+/**
+* Visit the leaves of `nodes` hit by the ray, roughly nearest first
+*
+* @param visitor is called with the first reference and the reference count
+*        of every leaf hit within the current maximum distance, and the
+*        distance itself, and returns the new maximum distance
+*/
+template <class TVisitor>
+void traverse_bvh(const std::vector<BVHNode>& nodes, const Ray& ray, float max_distance, TVisitor&& visitor)
+{
+    if (nodes.empty())
+    {
+        return;
+    }
+    struct Entry
+    {
+        std::uint32_t child;
+        std::uint32_t count;
+        float distance;
+    };
+    std::vector<Entry> stack;
+    stack.reserve(64);
+    stack.push_back(Entry{0, 0, 0.0f});
+    while (!stack.empty())
+    {
+        const Entry entry = stack.back();
+        stack.pop_back();
+        if (entry.distance > max_distance)
+        {
+            continue;
+        }
+        if (entry.count > 0)
+        {
+            max_distance = visitor(entry.child, entry.count, max_distance);
+            continue;
+        }
+        const BVHNode& node = nodes[entry.child];
+        float distances[bvh_width];
+        int hits = test_children(node, RayTest{&ray, max_distance, distances});
+        // Push the farthest child first, so the nearest is visited next
+        Entry children[bvh_width];
+        int hit_count = 0;
+        for (; hits; hits &= hits - 1)
+        {
+            const int slot = lowest_bit(hits);
+            const Entry child{node.child[slot], node.count[slot], distances[slot]};
+            int position = hit_count++;
+            for (; position > 0 && children[position - 1].distance < child.distance; --position)
+            {
+                children[position] = children[position - 1];
+            }
+            children[position] = child;
+        }
+        stack.insert(stack.end(), children, children + hit_count);
+    }
+}
+
+
+struct BVHPrimitive
+{
+    BoundingBox bounds;
+    glm::vec3 centroid;
+    std::uint32_t index;
+};
+
+
+/**
+* Builds wide BVH nodes with the binned surface area heuristic
+*
+* Every node is filled by repeatedly splitting its child with the largest
+* surface area, until it has `bvh_width` children or all children are small
+* enough to become leaves. Given a job system, large subtrees are built in
+* parallel and concatenated, keeping the depth-first node order.
+*/
+class BVHBuilder
+{
+public:
+    enum
+    {
+        max_bins = 32
+    };
+
+    /**
+    * Constructor
+    * @param leaf_size is the largest number of primitives referenced by a leaf
+    * @param bin_count is the number of buckets the centroids are sorted into
+    *        per axis when searching for the best split, up to 32
+    */
+    BVHBuilder(std::size_t leaf_size, std::size_t bin_count, jobs::JobSystem* jobs = nullptr)
+        : m_leaf_size(std::max<std::size_t>(leaf_size, 1)),
+          m_bin_count(std::min<std::size_t>(std::max<std::size_t>(bin_count, 2), max_bins)),
+          m_jobs(jobs)
+    {
+    }
+    /**
+    * Build the nodes over `primitives`, which are reordered so that every
+    * leaf references a consecutive range of them
+    */
+    std::vector<BVHNode> build(std::vector<BVHPrimitive>& primitives) const
+    {
+        std::vector<BVHNode> nodes;
+        if (!primitives.empty())
+        {
+            build_node(primitives, 0, primitives.size(), invalid_bvh_node, nodes);
+        }
+        return nodes;
+    }
+private:
+    struct BuildRange
+    {
+        std::size_t first;
+        std::size_t last;
+        BoundingBox bounds;
+    };
+
+    enum
+    {
+        // Smallest subtree worth building as a separate job
+        parallel_threshold = 4096
+    };
+
+    static BVHNode make_node(std::uint32_t parent)
+    {
+        BVHNode node;
+        for (std::size_t slot = 0; slot < bvh_width; ++slot)
+        {
+            set_child_bounds(node, slot, BoundingBox());
+            node.child[slot] = invalid_bvh_node;
+            node.count[slot] = 0;
+        }
+        node.child_count = 0;
+        node.parent = parent;
+        return node;
+    }
+    static BoundingBox get_range_bounds(const std::vector<BVHPrimitive>& primitives, std::size_t first, std::size_t last)
+    {
+        BoundingBox bounds;
+        for (std::size_t i = first; i < last; ++i)
+        {
+            bounds.expand(primitives[i].bounds);
+        }
+        return bounds;
+    }
+    /**
+    * Reorder the primitives in [first, last) into two halves with the
+    * binned surface area heuristic
+    *
+    * @param bounds receives the bounds of both halves
+    * @return the first primitive of the second half
+    */
+    std::size_t split(std::vector<BVHPrimitive>& primitives,
+                      std::size_t first,
+                      std::size_t last,
+                      BoundingBox bounds[2]) const
+    {
+        struct Bin
+        {
+            BoundingBox bounds;
+            std::size_t count;
+        };
+
+        BoundingBox centroids;
+        for (std::size_t i = first; i < last; ++i)
+        {
+            centroids.expand(primitives[i].centroid);
+        }
+        const std::size_t bin_count = m_bin_count;
+        const glm::vec3 extent = centroids.extent();
+        glm::vec3 scale;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            scale[axis] = extent[axis] > 0.0f ? bin_count / extent[axis] : 0.0f;
+        }
+        const auto bin_of = [&](const glm::vec3& centroid, int axis)
+                            {
+                                const auto b = static_cast<std::size_t>((centroid[axis] - centroids.minimum[axis]) * scale[axis]);
+                                return std::min(b, bin_count - 1);
+                            };
+
+        // Bin along all axes in one pass over the primitives
+        Bin bins[3][max_bins];
+        for (auto& axis_bins : bins)
+        {
+            for (std::size_t b = 0; b < bin_count; ++b)
+            {
+                axis_bins[b] = Bin{BoundingBox(), 0};
+            }
+        }
+        for (std::size_t i = first; i < last; ++i)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                Bin& bin = bins[axis][bin_of(primitives[i].centroid, axis)];
+                bin.bounds.expand(primitives[i].bounds);
+                ++bin.count;
+            }
+        }
+
+        float best_cost = std::numeric_limits<float>::max();
+        int best_axis = -1;
+        std::size_t best_bin = 0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extent[axis] <= 0.0f)
+            {
+                continue;
+            }
+            // Cost and bounds of everything right of each bin boundary
+            float right_costs[max_bins];
+            BoundingBox right_bounds[max_bins];
+            BoundingBox right;
+            std::size_t right_count = 0;
+            for (std::size_t b = bin_count - 1; b > 0; --b)
+            {
+                right.expand(bins[axis][b].bounds);
+                right_count += bins[axis][b].count;
+                right_costs[b] = right.surface_area() * right_count;
+                right_bounds[b] = right;
+            }
+            BoundingBox left;
+            std::size_t left_count = 0;
+            for (std::size_t b = 0; b + 1 < bin_count; ++b)
+            {
+                left.expand(bins[axis][b].bounds);
+                left_count += bins[axis][b].count;
+                const float cost = left.surface_area() * left_count + right_costs[b + 1];
+                if (left_count > 0 && left_count < last - first && cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                    bounds[0] = left;
+                    bounds[1] = right_bounds[b + 1];
+                }
+            }
+        }
+        // All centroids coincide, any split is as good as another
+        if (best_axis < 0)
+        {
+            const std::size_t middle = first + (last - first) / 2;
+            bounds[0] = get_range_bounds(primitives, first, middle);
+            bounds[1] = get_range_bounds(primitives, middle, last);
+            return middle;
+        }
+        const auto middle = std::partition(primitives.begin() + first,
+                                           primitives.begin() + last,
+                                           [&](const BVHPrimitive& primitive)
+                                           {
+                                               return bin_of(primitive.centroid, best_axis) <= best_bin;
+                                           });
+        return static_cast<std::size_t>(middle - primitives.begin());
+    }
+    /**
+    * Append the node over the primitives in [first, last) and its subtree
+    * to `nodes`
+    */
+    void build_node(std::vector<BVHPrimitive>& primitives,
+                    std::size_t first,
+                    std::size_t last,
+                    std::uint32_t parent,
+                    std::vector<BVHNode>& nodes) const
+    {
+        const auto index = static_cast<std::uint32_t>(nodes.size());
+        nodes.push_back(make_node(parent));
+
+        // Split the child with the largest surface area until the node is full
+        BuildRange children[bvh_width];
+        std::size_t child_count = 1;
+        children[0] = BuildRange{first, last, get_range_bounds(primitives, first, last)};
+        while (child_count < bvh_width)
+        {
+            std::size_t largest = child_count;
+            float largest_area = -1.0f;
+            for (std::size_t i = 0; i < child_count; ++i)
+            {
+                const float area = children[i].bounds.surface_area();
+                if (children[i].last - children[i].first > m_leaf_size && area > largest_area)
+                {
+                    largest = i;
+                    largest_area = area;
+                }
+            }
+            if (largest == child_count)
+            {
+                break;
+            }
+            const BuildRange range = children[largest];
+            BoundingBox bounds[2];
+            const std::size_t middle = split(primitives, range.first, range.last, bounds);
+            children[largest] = BuildRange{range.first, middle, bounds[0]};
+            children[child_count++] = BuildRange{middle, range.last, bounds[1]};
+        }
+
+        BVHNode& node = nodes[index];
+        node.child_count = static_cast<std::uint32_t>(child_count);
+        for (std::size_t i = 0; i < child_count; ++i)
+        {
+            set_child_bounds(node, i, children[i].bounds);
+            node.child[i] = static_cast<std::uint32_t>(children[i].first);
+            node.count[i] = static_cast<std::uint32_t>(children[i].last - children[i].first);
+        }
+
+        // Subtrees of the children which don't fit a leaf, large ones are
+        // built by separate jobs into their own arrays first
+        std::vector<BVHNode> subtrees[bvh_width];
+        jobs::parallel_for(m_jobs, 0, child_count, [&](std::size_t i)
+                           {
+                               const std::size_t count = children[i].last - children[i].first;
+                               if (m_jobs && count > m_leaf_size && count >= parallel_threshold)
+                               {
+                                   build_node(primitives, children[i].first, children[i].last, 0, subtrees[i]);
+                               }
+                           });
+        for (std::size_t i = 0; i < child_count; ++i)
+        {
+            const std::size_t count = children[i].last - children[i].first;
+            if (count <= m_leaf_size)
+            {
+                continue;
+            }
+            const auto offset = static_cast<std::uint32_t>(nodes.size());
+            nodes[index].child[i] = offset;
+            nodes[index].count[i] = 0;
+            if (subtrees[i].empty())
+            {
+                build_node(primitives, children[i].first, children[i].last, index, nodes);
+                continue;
+            }
+            for (BVHNode& subtree_node : subtrees[i])
+            {
+                subtree_node.parent = nodes.size() == offset ? index : subtree_node.parent + offset;
+                for (std::size_t slot = 0; slot < subtree_node.child_count; ++slot)
+                {
+                    if (subtree_node.count[slot] == 0)
+                    {
+                        subtree_node.child[slot] += offset;
+                    }
+                }
+                nodes.push_back(subtree_node);
+            }
+        }
+    }
+private:
+    std::size_t m_leaf_size;
+    std::size_t m_bin_count;
+    jobs::JobSystem* m_jobs;
+};
+
+
+struct BVHSettings
+{
+    // Largest number of meshes referenced by a leaf
+    std::size_t leaf_size = 4;
+    // Number of buckets the centroids are sorted into per axis when searching
+    // for the split with the lowest surface area heuristic cost, up to 32
+    std::size_t bin_count = 16;
+    // Rebuild once refitting increased the cost of the tree by this factor
+    float rebuild_threshold = 1.5f;
+    // Rebuild once more meshes than this were inserted or removed since the
+    // last build, inserted meshes are tested one by one until then
+    std::size_t max_pending = 64;
+};
+
+
+/**
+* Bounding volume hierarchy over the world bounds of the meshes in a scene
+*
+* The tree is built with the surface area heuristic into a flat array of
+* `bvh_width` wide nodes in depth-first order. Moving meshes only refits the
+* bounds on their path to the root, and once refitting degraded the tree or
+* many meshes were inserted, it's rebuilt on the job system while queries
+* keep using the old tree. Frustum, sphere and ray queries return the handles
+* given out by `insert`.
+*
+* Not thread safe, modifications and `maintain` must not overlap queries.
+*/
+class SceneBVH
+{
+public:
+    /**
+    * Constructor
+    * @param jobs runs background rebuilds, rebuilds happen within `maintain`
+    *        when null
+    */
+    explicit SceneBVH(jobs::JobSystem* jobs = nullptr, BVHSettings settings = BVHSettings()) : m_jobs(jobs),
+                                                                                                m_settings(settings),
+                                                                                                m_cost(0.0f),
+                                                                                                m_built_cost(0.0f)
+    {
+    }
+    ~SceneBVH()
+    {
+        if (m_build)
+        {
+            m_jobs->wait(m_build->counter);
+        }
+    }
+
+    // Move-only semantics
+    SceneBVH(const SceneBVH&) = delete;
+    SceneBVH& operator=(const SceneBVH&) = delete;
+
+    SceneBVH(SceneBVH&&) = default;
+    SceneBVH& operator=(SceneBVH&&) = default;
+
+    /**
+    * Add a mesh with the given world bounds
+    * @return handle identifying the mesh in queries
+    */
+    MeshHandle insert(const BoundingBox& bounds)
+    {
+        MeshHandle handle;
+        if (m_free.empty())
+        {
+            handle = static_cast<MeshHandle>(m_bounds.size());
+            m_bounds.push_back(bounds);
+            m_state.push_back(pending_mesh);
+            m_leaf.push_back(invalid_bvh_node);
+        }
+        else
+        {
+            handle = m_free.back();
+            m_free.pop_back();
+            m_bounds[handle] = bounds;
+            m_state[handle] = pending_mesh;
+        }
+        m_pending.push_back(handle);
+        return handle;
+    }
+    /**
+    * Set the world bounds of a mesh after its transform changed, the tree is
+    * refitted by the next `refit` or `maintain`
+    */
+    void update(MeshHandle handle, const BoundingBox& bounds)
+    {
+        m_bounds[handle] = bounds;
+        if (m_state[handle] == tree_mesh)
+        {
+            mark_dirty(m_leaf[handle]);
+        }
+    }
+    /**
+    * Remove a mesh, its handle is reused after the next rebuild
+    */
+    void remove(MeshHandle handle)
+    {
+        if (m_state[handle] == tree_mesh)
+        {
+            mark_dirty(m_leaf[handle]);
+        }
+        m_state[handle] = removed_mesh;
+        m_bounds[handle] = BoundingBox();
+        m_removed.push_back(handle);
+    }
+    const BoundingBox& get_bounds(MeshHandle handle) const
+    {
+        return m_bounds[handle];
+    }
+    /**
+    * Return one past the largest handle given out so far
+    */
+    std::size_t get_handle_count() const noexcept
+    {
+        return m_bounds.size();
+    }
+    /**
+    * Refit, and swap in or start rebuilds as needed, typically called once
+    * per frame after updating the bounds of moving meshes
+    */
+    void maintain()
+    {
+        if (m_build && m_build->counter.done())
+        {
+            finish_rebuild(*m_build);
+            m_build.reset();
+        }
+        refit();
+        if (!m_build && needs_rebuild())
+        {
+            start_rebuild(m_jobs);
+        }
+    }
+    /**
+    * Rebuild the tree from all meshes right away, e.g. after loading a scene
+    */
+    void rebuild()
+    {
+        if (m_build)
+        {
+            m_jobs->wait(m_build->counter);
+            finish_rebuild(*m_build);
+            m_build.reset();
+        }
+        start_rebuild(nullptr);
+    }
+    /**
+    * Recompute the bounds of the nodes above meshes that were updated
+    * @return whether any node changed
+    */
+    bool refit()
+    {
+        if (m_dirty.empty())
+        {
+            return false;
+        }
+        // Children are stored after their parents
+        std::sort(m_dirty.begin(), m_dirty.end(), std::greater<std::uint32_t>());
+        for (std::uint32_t node : m_dirty)
+        {
+            refit_node(node);
+            m_dirty_flags[node] = 0;
+        }
+        m_dirty.clear();
+        m_cost = compute_cost();
+        return true;
+    }
+    /**
+    * Return the surface area heuristic cost of the tree relative to the cost
+    * right after it was built
+    */
+    float get_cost_ratio() const noexcept
+    {
+        return m_built_cost > 0.0f ? m_cost / m_built_cost : 1.0f;
+    }
+    bool is_rebuilding() const noexcept
+    {
+        return static_cast<bool>(m_build);
+    }
+    const std::vector<BVHNode>& get_nodes() const noexcept
+    {
+        return m_nodes;
+    }
+    /**
+    * Append the handles of all meshes intersecting the frustum to `result`
+    */
+    void query(const Frustum& frustum, std::vector<MeshHandle>& result) const
+    {
+        collect(FrustumTest{&frustum}, result);
+    }
+    /**
+    * Append the handles of all meshes intersecting the sphere to `result`
+    */
+    void query(const Sphere& sphere, std::vector<MeshHandle>& result) const
+    {
+        collect(SphereTest{&sphere}, result);
+    }
+    /**
+    * Append the handles of all meshes whose bounds the ray hits within
+    * `max_distance` to `result`, roughly nearest first
+    */
+    void query(const Ray& ray,
+               std::vector<MeshHandle>& result,
+               float max_distance = std::numeric_limits<float>::infinity()) const
+    {
+        traverse(ray, max_distance, [&result](MeshHandle handle, float distance)
+                                    {
+                                        result.push_back(handle);
+                                        return distance;
+                                    });
+    }
+    /**
+    * Visit the meshes whose bounds the ray hits, roughly nearest first
+    *
+    * @param visitor is called with the handle and the current maximum
+    *        distance, and returns the new maximum distance, which allows
+    *        closest hit searches to skip everything behind a hit
+    */
+    template <class TVisitor>
+    void traverse(const Ray& ray, float max_distance, TVisitor&& visitor) const
+    {
+        for (MeshHandle handle : m_pending)
+        {
+            if (m_state[handle] == pending_mesh && ray.intersect(m_bounds[handle], max_distance) <= max_distance)
+            {
+                max_distance = visitor(handle, max_distance);
+            }
+        }
+        traverse_bvh(m_nodes, ray, max_distance, [&](std::uint32_t first, std::uint32_t count, float distance)
+                     {
+                         for (std::uint32_t i = first; i < first + count; ++i)
+                         {
+                             const MeshHandle handle = m_references[i];
+                             if (m_state[handle] != removed_mesh &&
+                                 ray.intersect(m_bounds[handle], distance) <= distance)
+                             {
+                                 distance = visitor(handle, distance);
+                             }
+                         }
+                         return distance;
+                     });
+    }
+private:
+    enum MeshState : std::uint8_t
+    {
+        free_mesh,
+        // Inserted after the last rebuild started, not in the tree
+        pending_mesh,
+        tree_mesh,
+        // Removed, but possibly still referenced by the tree
+        removed_mesh
+    };
+
+    struct BuildJob
+    {
+        // Meshes in the tree, reordered by the build so leaves reference
+        // consecutive ranges
+        std::vector<MeshHandle> references;
+        std::vector<BoundingBox> bounds;
+        std::vector<BVHNode> nodes;
+        // Meshes removed before the build started, free once it finished
+        std::vector<MeshHandle> retiring;
+        jobs::Counter counter;
+    };
+
+    template <class TTest>
+    void collect(const TTest& test, std::vector<MeshHandle>& result) const
+    {
+        for (MeshHandle handle : m_pending)
+        {
+            if (m_state[handle] == pending_mesh && test(m_bounds[handle]))
+            {
+                result.push_back(handle);
+            }
+        }
+        traverse_bvh(m_nodes, test, [&](std::uint32_t first, std::uint32_t count)
+                     {
+                         for (std::uint32_t i = first; i < first + count; ++i)
+                         {
+                             const MeshHandle handle = m_references[i];
+                             if (m_state[handle] != removed_mesh && test(m_bounds[handle]))
+                             {
+                                 result.push_back(handle);
+                             }
+                         }
+                     });
+    }
+    static void build(BuildJob& job, const BVHSettings& settings)
+    {
+        std::vector<BVHPrimitive> primitives(job.references.size());
+        for (std::size_t i = 0; i < primitives.size(); ++i)
+        {
+            primitives[i] = BVHPrimitive{job.bounds[i], job.bounds[i].center(), job.references[i]};
+        }
+        job.nodes = BVHBuilder(settings.leaf_size, settings.bin_count).build(primitives);
+        for (std::size_t i = 0; i < primitives.size(); ++i)
+        {
+            job.references[i] = primitives[i].index;
+        }
+    }
+    bool needs_rebuild() const
+    {
+        return m_pending.size() > m_settings.max_pending ||
+               m_removed.size() > m_settings.max_pending ||
+               get_cost_ratio() > m_settings.rebuild_threshold;
+    }
+    void start_rebuild(jobs::JobSystem* jobs)
+    {
+        std::unique_ptr<BuildJob> job(new BuildJob());
+        for (MeshHandle handle = 0; handle < m_state.size(); ++handle)
+        {
+            if (m_state[handle] == pending_mesh || m_state[handle] == tree_mesh)
+            {
+                job->references.push_back(handle);
+                job->bounds.push_back(m_bounds[handle]);
+            }
+        }
+        job->retiring.swap(m_removed);
+        if (!jobs)
+        {
+            build(*job, m_settings);
+            finish_rebuild(*job);
+            return;
+        }
+        BuildJob* raw = job.get();
+        const BVHSettings settings = m_settings;
+        m_build = std::move(job);
+        jobs->run([raw, settings]()
+                  {
+                      build(*raw, settings);
+                  },
+                  &raw->counter);
+    }
+    void finish_rebuild(BuildJob& job)
+    {
+        m_nodes.swap(job.nodes);
+        m_references.swap(job.references);
+        for (MeshHandle handle : job.retiring)
+        {
+            m_state[handle] = free_mesh;
+            m_free.push_back(handle);
+        }
+        for (std::uint32_t index = 0; index < m_nodes.size(); ++index)
+        {
+            const BVHNode& node = m_nodes[index];
+            for (std::size_t slot = 0; slot < node.child_count; ++slot)
+            {
+                if (node.count[slot] == 0)
+                {
+                    continue;
+                }
+                for (std::uint32_t i = node.child[slot]; i < node.child[slot] + node.count[slot]; ++i)
+                {
+                    const MeshHandle handle = m_references[i];
+                    if (m_state[handle] != removed_mesh)
+                    {
+                        m_state[handle] = tree_mesh;
+                        m_leaf[handle] = index;
+                    }
+                }
+            }
+        }
+        // Meshes inserted while building stay pending
+        m_pending.erase(std::remove_if(m_pending.begin(),
+                                       m_pending.end(),
+                                       [this](MeshHandle handle)
+                                       {
+                                           return m_state[handle] != pending_mesh;
+                                       }),
+                        m_pending.end());
+
+        // Catch up with updates made while building
+        m_dirty.clear();
+        m_dirty_flags.assign(m_nodes.size(), 0);
+        for (std::size_t index = m_nodes.size(); index-- > 0;)
+        {
+            refit_node(static_cast<std::uint32_t>(index));
+        }
+        m_cost = compute_cost();
+        m_built_cost = m_cost;
+    }
+    void mark_dirty(std::uint32_t node)
+    {
+        for (; node != invalid_bvh_node && !m_dirty_flags[node]; node = m_nodes[node].parent)
+        {
+            m_dirty_flags[node] = 1;
+            m_dirty.push_back(node);
+        }
+    }
+    void refit_node(std::uint32_t index)
+    {
+        BVHNode& node = m_nodes[index];
+        for (std::size_t slot = 0; slot < node.child_count; ++slot)
+        {
+            BoundingBox bounds;
+            if (node.count[slot] > 0)
+            {
+                for (std::uint32_t i = node.child[slot]; i < node.child[slot] + node.count[slot]; ++i)
+                {
+                    bounds.expand(m_bounds[m_references[i]]);
+                }
+            }
+            else
+            {
+                const BVHNode& child = m_nodes[node.child[slot]];
+                for (std::size_t child_slot = 0; child_slot < child.child_count; ++child_slot)
+                {
+                    bounds.expand(get_child_bounds(child, child_slot));
+                }
+            }
+            set_child_bounds(node, slot, bounds);
+        }
+    }
+    /**
+    * Return the expected cost of a query with the surface area heuristic,
+    * relative to the area of the root
+    */
+    float compute_cost() const
+    {
+        if (m_nodes.empty())
+        {
+            return 0.0f;
+        }
+        BoundingBox root;
+        float cost = 0.0f;
+        for (std::size_t index = 0; index < m_nodes.size(); ++index)
+        {
+            const BVHNode& node = m_nodes[index];
+            for (std::size_t slot = 0; slot < node.child_count; ++slot)
+            {
+                const BoundingBox bounds = get_child_bounds(node, slot);
+                cost += bounds.surface_area() * std::max<std::uint32_t>(node.count[slot], 1);
+                if (index == 0)
+                {
+                    root.expand(bounds);
+                }
+            }
+        }
+        const float area = root.surface_area();
+        return area > 0.0f ? cost / area : 0.0f;
+    }
+private:
+    jobs::JobSystem* m_jobs;
+    BVHSettings m_settings;
+
+    std::vector<BVHNode> m_nodes;
+    std::vector<MeshHandle> m_references;
+
+    // Per mesh handle
+    std::vector<BoundingBox> m_bounds;
+    std::vector<MeshState> m_state;
+    std::vector<std::uint32_t> m_leaf;
+
+    std::vector<MeshHandle> m_pending;
+    std::vector<MeshHandle> m_removed;
+    std::vector<MeshHandle> m_free;
+
+    std::vector<std::uint32_t> m_dirty;
+    std::vector<std::uint8_t> m_dirty_flags;
+
+    float m_cost;
+    float m_built_cost;
+    std::unique_ptr<BuildJob> m_build;
+};
+
+
+}  // namespace geometry
+
+
+}  // namespace crudegl
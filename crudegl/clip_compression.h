@@ -0,0 +1,665 @@
+#pragma once
+
+#include "animation.h"
+
+#include <assimp/anim.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace animation
+{
+
+
+/**
+* Error tolerances of clip compression, in model units for translations and
+* scales and in radians for rotations
+*/
+struct CompressionSettings
+{
+    float translation_tolerance = 0.001f;
+    float rotation_tolerance = 0.001f;
+    float scale_tolerance = 0.001f;
+};
+
+
+struct CompressionReport
+{
+    // Size of the source `aiAnimation` keys
+    std::size_t source_bytes;
+    std::size_t compressed_bytes;
+    std::size_t source_keys;
+    std::size_t compressed_keys;
+    // Largest errors measured at the source key times
+    float max_translation_error;
+    float max_rotation_error;
+    float max_scale_error;
+
+    double ratio() const
+    {
+        return compressed_bytes > 0 ? static_cast<double>(source_bytes) / compressed_bytes : 0.0;
+    }
+};
+
+
+namespace simd
+{
+
+
+/**
+* Reconstruct quaternions encoded with the smallest three method in place
+*
+* On input the x, y and z streams hold the three smallest components as 15
+* bit integers and the w stream holds the index of the dropped largest
+* component, on output the streams hold the decoded quaternion.
+*/
+inline void decode_smallest_three(float* const streams[4], std::size_t count)
+{
+    const Lanes::type range = Lanes::set(0.70710678f);
+    const Lanes::type step = Lanes::set(2.0f * 0.70710678f / 32767.0f);
+    const Lanes::type one = Lanes::set(1.0f);
+    const Lanes::type zero = Lanes::set(0.0f);
+    for (std::size_t i = 0; i < count; i += Lanes::width)
+    {
+        const Lanes::type a = Lanes::sub(Lanes::mul(Lanes::load(streams[0] + i), step), range);
+        const Lanes::type b = Lanes::sub(Lanes::mul(Lanes::load(streams[1] + i), step), range);
+        const Lanes::type c = Lanes::sub(Lanes::mul(Lanes::load(streams[2] + i), step), range);
+        const Lanes::type largest = Lanes::load(streams[3] + i);
+        const Lanes::type squares = Lanes::add(Lanes::add(Lanes::mul(a, a), Lanes::mul(b, b)), Lanes::mul(c, c));
+        const Lanes::type d = Lanes::sqrt(Lanes::max(Lanes::sub(one, squares), zero));
+        const Lanes::mask is_x = Lanes::equal(largest, zero);
+        const Lanes::mask is_y = Lanes::equal(largest, one);
+        const Lanes::mask is_z = Lanes::equal(largest, Lanes::set(2.0f));
+        const Lanes::mask is_w = Lanes::equal(largest, Lanes::set(3.0f));
+        // The remaining components keep their order, shifted past the
+        // dropped one
+        Lanes::store(streams[0] + i, Lanes::select(is_x, d, a));
+        Lanes::store(streams[1] + i, Lanes::select(is_x, a, Lanes::select(is_y, d, b)));
+        Lanes::store(streams[2] + i, Lanes::select(is_z, d, Lanes::select(is_w, c, b)));
+        Lanes::store(streams[3] + i, Lanes::select(is_w, d, c));
+    }
+}
+
+
+/**
+* Map quantized values in place to `offset + value * scale`, with offset and
+* scale given per lane
+*/
+inline void dequantize(float* values, const float* offsets, const float* scales, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; i += Lanes::width)
+    {
+        const Lanes::type value = Lanes::mul(Lanes::load(values + i), Lanes::load(scales + i));
+        Lanes::store(values + i, Lanes::add(Lanes::load(offsets + i), value));
+    }
+}
+
+
+}  // namespace simd
+
+
+/**
+* Animation clip compressed at import
+*
+* Keys that linear interpolation between their neighbours reproduces within
+* the tolerances are removed and tracks that don't change are collapsed.
+* Quantization adds a small error on top, the errors of the final data are
+* measured at the source key times and reported. The remaining key times are
+* stored as 16 bit fractions of the clip duration, rotations with the
+* smallest three method in 48 bits and translations and scales as 16 bit
+* fractions of each track's range. The keys of a track are contiguous, so
+* the two keys interpolated during sampling usually share a cache line, and
+* dequantization runs on all joints at once.
+*/
+class CompressedClip : public Clip
+{
+public:
+    using Channel = AnimationClip::Channel;
+
+    /**
+    * Constructor
+    * Compress the channels of `animation` animating joints of `skeleton`,
+    * channels of other nodes are ignored.
+    */
+    CompressedClip(const aiAnimation* animation,
+                   const Skeleton& skeleton,
+                   const CompressionSettings& settings = CompressionSettings()) : m_name{animation->mName.C_Str()},
+                                                                                  m_joint_count{skeleton.size()},
+                                                                                  m_report{}
+    {
+        const double ticks_per_second = animation->mTicksPerSecond > 0.0 ? animation->mTicksPerSecond : 25.0;
+        m_duration = static_cast<float>(animation->mDuration / ticks_per_second);
+
+        std::vector<const aiNodeAnim*> channels(m_joint_count, nullptr);
+        for (unsigned int i = 0; i < animation->mNumChannels; ++i)
+        {
+            const int joint = skeleton.find(animation->mChannels[i]->mNodeName.C_Str());
+            if (joint >= 0)
+            {
+                channels[joint] = animation->mChannels[i];
+                m_report.source_keys += animation->mChannels[i]->mNumPositionKeys +
+                                        animation->mChannels[i]->mNumRotationKeys +
+                                        animation->mChannels[i]->mNumScalingKeys;
+                m_report.source_bytes += animation->mChannels[i]->mNumPositionKeys * sizeof(aiVectorKey) +
+                                         animation->mChannels[i]->mNumRotationKeys * sizeof(aiQuatKey) +
+                                         animation->mChannels[i]->mNumScalingKeys * sizeof(aiVectorKey);
+            }
+        }
+
+        const Pose& rest_pose = skeleton.get_rest_pose();
+        const std::size_t stride = rest_pose.stride();
+        for (auto& track : m_tracks)
+        {
+            track.ranges.assign(m_joint_count, KeyRange{0, 0});
+        }
+        for (auto& ranges : m_ranges)
+        {
+            // Offsets and scales of the three components, zero for joints
+            // without keys until their track is compressed
+            ranges.assign(stride * 6, 0.0f);
+        }
+        for (std::size_t joint = 0; joint < m_joint_count; ++joint)
+        {
+            const aiNodeAnim* channel = channels[joint];
+            // Channels without keys fall back to the rest pose
+            SourceTrack translations = channel && channel->mNumPositionKeys > 0 ?
+                                       to_source(channel->mPositionKeys, channel->mNumPositionKeys, ticks_per_second) :
+                                       rest_track(rest_pose, Pose::translation_x, 3, joint);
+            SourceTrack rotations = channel && channel->mNumRotationKeys > 0 ?
+                                    to_source(channel->mRotationKeys, channel->mNumRotationKeys, ticks_per_second) :
+                                    rest_track(rest_pose, Pose::rotation_x, 4, joint);
+            SourceTrack scales = channel && channel->mNumScalingKeys > 0 ?
+                                 to_source(channel->mScalingKeys, channel->mNumScalingKeys, ticks_per_second) :
+                                 rest_track(rest_pose, Pose::scale_x, 3, joint);
+            compress_vector_track(AnimationClip::translation, joint, translations, settings.translation_tolerance);
+            compress_rotation_track(joint, rotations, settings.rotation_tolerance);
+            compress_vector_track(AnimationClip::scale, joint, scales, settings.scale_tolerance);
+            if (channel)
+            {
+                measure_error(AnimationClip::translation, joint, translations, m_report.max_translation_error);
+                measure_error(AnimationClip::rotation, joint, rotations, m_report.max_rotation_error);
+                measure_error(AnimationClip::scale, joint, scales, m_report.max_scale_error);
+            }
+        }
+        for (int channel = AnimationClip::translation; channel < AnimationClip::channel_count; ++channel)
+        {
+            m_report.compressed_keys += m_tracks[channel].times.size();
+        }
+        m_report.compressed_bytes = memory_size();
+    }
+    const std::string& get_name() const override
+    {
+        return m_name;
+    }
+    float get_duration() const override
+    {
+        return m_duration;
+    }
+    /**
+    * Sample the clip at `time` seconds into `pose`
+    *
+    * Quantized keys of all tracks are gathered first, then dequantized,
+    * decoded and interpolated for all joints at once. Joints without
+    * animation were compressed from the rest pose of the skeleton, so
+    * `rest_pose` is unused.
+    */
+    void sample(float time,
+                const Pose&,
+                Pose& pose,
+                SamplingCache& cache,
+                Interpolation interpolation) const override
+    {
+        prepare_sampling(m_joint_count, AnimationClip::channel_count, pose, cache);
+        const std::size_t stride = pose.stride();
+        const float key_time = m_duration > 0.0f ? std::min(std::max(time / m_duration, 0.0f), 1.0f) * 65535.0f : 0.0f;
+        for (int channel = AnimationClip::translation; channel < AnimationClip::channel_count; ++channel)
+        {
+            gather_keys(static_cast<Channel>(channel), key_time, stride, cache);
+        }
+
+        for (Pose* keys : {&cache.from, &cache.to})
+        {
+            for (int component = 0; component < 3; ++component)
+            {
+                const float* translation_range = m_ranges[0].data() + component * stride;
+                const float* scale_range = m_ranges[1].data() + component * stride;
+                simd::dequantize(keys->stream(static_cast<Pose::Stream>(Pose::translation_x + component)),
+                                 translation_range, translation_range + 3 * stride, stride);
+                simd::dequantize(keys->stream(static_cast<Pose::Stream>(Pose::scale_x + component)),
+                                 scale_range, scale_range + 3 * stride, stride);
+            }
+            float* const rotation[4] = {keys->stream(Pose::rotation_x), keys->stream(Pose::rotation_y),
+                                        keys->stream(Pose::rotation_z), keys->stream(Pose::rotation_w)};
+            simd::decode_smallest_three(rotation, stride);
+        }
+
+        const simd::StreamFactor translation_factor{cache.factors.data() + AnimationClip::translation * stride};
+        const simd::StreamFactor scale_factor{cache.factors.data() + AnimationClip::scale * stride};
+        for (int component = 0; component < 3; ++component)
+        {
+            const auto translation_stream = static_cast<Pose::Stream>(Pose::translation_x + component);
+            const auto scale_stream = static_cast<Pose::Stream>(Pose::scale_x + component);
+            simd::lerp(cache.from.stream(translation_stream), cache.to.stream(translation_stream),
+                       translation_factor, pose.stream(translation_stream), stride);
+            simd::lerp(cache.from.stream(scale_stream), cache.to.stream(scale_stream),
+                       scale_factor, pose.stream(scale_stream), stride);
+        }
+        const float* const from_rotation[4] = {cache.from.stream(Pose::rotation_x), cache.from.stream(Pose::rotation_y),
+                                               cache.from.stream(Pose::rotation_z), cache.from.stream(Pose::rotation_w)};
+        const float* const to_rotation[4] = {cache.to.stream(Pose::rotation_x), cache.to.stream(Pose::rotation_y),
+                                             cache.to.stream(Pose::rotation_z), cache.to.stream(Pose::rotation_w)};
+        float* const rotation_result[4] = {pose.stream(Pose::rotation_x), pose.stream(Pose::rotation_y),
+                                           pose.stream(Pose::rotation_z), pose.stream(Pose::rotation_w)};
+        const float* rotation_factors = cache.factors.data() + AnimationClip::rotation * stride;
+        if (interpolation == Interpolation::slerp)
+        {
+            simd::slerp(from_rotation, to_rotation, rotation_factors, rotation_result, stride);
+        }
+        else
+        {
+            simd::nlerp(from_rotation, to_rotation, simd::StreamFactor{rotation_factors}, rotation_result, stride);
+        }
+    }
+    /**
+    * Return the number of bytes used by the compressed tracks
+    */
+    std::size_t memory_size() const
+    {
+        std::size_t size = 0;
+        for (const auto& track : m_tracks)
+        {
+            size += track.ranges.size() * sizeof(KeyRange) +
+                    track.times.size() * sizeof(std::uint16_t) +
+                    track.values.size() * sizeof(std::uint16_t);
+        }
+        for (const auto& ranges : m_ranges)
+        {
+            size += ranges.size() * sizeof(float);
+        }
+        return size;
+    }
+    const CompressionReport& get_report() const noexcept
+    {
+        return m_report;
+    }
+private:
+    struct KeyRange
+    {
+        std::uint32_t first;
+        std::uint32_t count;
+    };
+
+    struct Track
+    {
+        // Tracks without keys are constant, their value is the offset of
+        // their range
+        std::vector<KeyRange> ranges;
+        std::vector<std::uint16_t> times;
+        // Three quantized values per key
+        std::vector<std::uint16_t> values;
+    };
+
+    struct SourceTrack
+    {
+        std::vector<float> times;
+        std::vector<glm::vec4> values;
+    };
+
+    template <class TKey>
+    static SourceTrack to_source(const TKey* keys, unsigned int count, double ticks_per_second)
+    {
+        SourceTrack source;
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            source.times.push_back(static_cast<float>(keys[i].mTime / ticks_per_second));
+            source.values.push_back(to_vec4(keys[i]));
+        }
+        return source;
+    }
+    static glm::vec4 to_vec4(const aiVectorKey& key)
+    {
+        return glm::vec4(key.mValue.x, key.mValue.y, key.mValue.z, 0.0f);
+    }
+    static glm::vec4 to_vec4(const aiQuatKey& key)
+    {
+        return glm::vec4(key.mValue.x, key.mValue.y, key.mValue.z, key.mValue.w);
+    }
+    static SourceTrack rest_track(const Pose& rest_pose, Pose::Stream first, int components, std::size_t joint)
+    {
+        glm::vec4 value(0.0f);
+        for (int c = 0; c < components; ++c)
+        {
+            value[c] = rest_pose.stream(static_cast<Pose::Stream>(first + c))[joint];
+        }
+        SourceTrack source;
+        source.times.push_back(0.0f);
+        source.values.push_back(value);
+        return source;
+    }
+    static float rotation_error(const glm::vec4& lhs, const glm::vec4& rhs)
+    {
+        const float dot = std::min(std::abs(glm::dot(lhs, rhs)), 1.0f);
+        return 2.0f * std::acos(dot);
+    }
+    static glm::vec4 interpolate(const glm::vec4& from, const glm::vec4& to, float factor, bool rotation)
+    {
+        if (!rotation)
+        {
+            return from + (to - from) * factor;
+        }
+        const glm::vec4 target = glm::dot(from, to) < 0.0f ? -to : to;
+        return glm::normalize(from + (target - from) * factor);
+    }
+    /**
+    * Greedily drop keys that interpolating between the last kept key and the
+    * following keys reproduces within `tolerance`
+    * @return the indices of the kept keys
+    */
+    static std::vector<std::size_t> reduce_keys(const SourceTrack& source, float tolerance, bool rotation)
+    {
+        std::vector<std::size_t> kept{0};
+        const std::size_t count = source.times.size();
+        std::size_t anchor = 0;
+        for (std::size_t end = 2; end < count; ++end)
+        {
+            const float span = source.times[end] - source.times[anchor];
+            for (std::size_t i = anchor + 1; i < end; ++i)
+            {
+                const float factor = span > 0.0f ? (source.times[i] - source.times[anchor]) / span : 0.0f;
+                const glm::vec4 value = interpolate(source.values[anchor], source.values[end], factor, rotation);
+                const float error = rotation ? rotation_error(value, source.values[i]) :
+                                               glm::length(value - source.values[i]);
+                if (error > tolerance)
+                {
+                    anchor = end - 1;
+                    kept.push_back(anchor);
+                    break;
+                }
+            }
+        }
+        if (count > 1)
+        {
+            kept.push_back(count - 1);
+        }
+        return kept;
+    }
+    std::uint16_t quantize_time(float time) const
+    {
+        const float fraction = m_duration > 0.0f ? std::min(std::max(time / m_duration, 0.0f), 1.0f) : 0.0f;
+        return static_cast<std::uint16_t>(std::lround(fraction * 65535.0f));
+    }
+    void compress_vector_track(Channel channel, std::size_t joint, const SourceTrack& source, float tolerance)
+    {
+        const std::vector<std::size_t> kept = reduce_keys(source, tolerance, false);
+        glm::vec3 minimum(source.values[kept[0]]);
+        glm::vec3 maximum(minimum);
+        for (std::size_t key : kept)
+        {
+            minimum = glm::min(minimum, glm::vec3(source.values[key]));
+            maximum = glm::max(maximum, glm::vec3(source.values[key]));
+        }
+        const glm::vec3 extent = maximum - minimum;
+        std::vector<float>& ranges = m_ranges[channel == AnimationClip::translation ? 0 : 1];
+        const std::size_t stride = ranges.size() / 6;
+        if (std::max(extent.x, std::max(extent.y, extent.z)) <= tolerance)
+        {
+            // Constant track, stored as the center of it's range
+            const glm::vec3 center = (minimum + maximum) * 0.5f;
+            for (int c = 0; c < 3; ++c)
+            {
+                ranges[c * stride + joint] = center[c];
+            }
+            return;
+        }
+        Track& track = m_tracks[channel];
+        track.ranges[joint] = KeyRange{static_cast<std::uint32_t>(track.times.size()),
+                                       static_cast<std::uint32_t>(kept.size())};
+        for (int c = 0; c < 3; ++c)
+        {
+            ranges[c * stride + joint] = minimum[c];
+            ranges[(c + 3) * stride + joint] = extent[c] / 65535.0f;
+        }
+        for (std::size_t key : kept)
+        {
+            track.times.push_back(quantize_time(source.times[key]));
+            for (int c = 0; c < 3; ++c)
+            {
+                const float fraction = extent[c] > 0.0f ? (source.values[key][c] - minimum[c]) / extent[c] : 0.0f;
+                track.values.push_back(static_cast<std::uint16_t>(std::lround(fraction * 65535.0f)));
+            }
+        }
+    }
+    void compress_rotation_track(std::size_t joint, const SourceTrack& source, float tolerance)
+    {
+        std::vector<std::size_t> kept = reduce_keys(source, tolerance, true);
+        bool constant = true;
+        for (std::size_t key : kept)
+        {
+            constant = constant && rotation_error(source.values[kept[0]], source.values[key]) <= tolerance;
+        }
+        if (constant)
+        {
+            kept.resize(1);
+        }
+        Track& track = m_tracks[AnimationClip::rotation];
+        track.ranges[joint] = KeyRange{static_cast<std::uint32_t>(track.times.size()),
+                                       static_cast<std::uint32_t>(kept.size())};
+        for (std::size_t key : kept)
+        {
+            track.times.push_back(quantize_time(source.times[key]));
+            encode_smallest_three(glm::normalize(source.values[key]), track.values);
+        }
+    }
+    /**
+    * Append the quaternion as the 2 bit index of it's largest component
+    * followed by the three others quantized to 15 bits each
+    */
+    static void encode_smallest_three(glm::vec4 rotation, std::vector<std::uint16_t>& values)
+    {
+        int largest = 0;
+        for (int c = 1; c < 4; ++c)
+        {
+            largest = std::abs(rotation[c]) > std::abs(rotation[largest]) ? c : largest;
+        }
+        // q and -q are the same rotation, make the dropped component positive
+        // so it can be reconstructed
+        rotation = rotation[largest] < 0.0f ? -rotation : rotation;
+        std::uint64_t bits = static_cast<std::uint64_t>(largest);
+        for (int c = 0; c < 4; ++c)
+        {
+            if (c == largest)
+            {
+                continue;
+            }
+            const float fraction = (std::min(std::max(rotation[c], -0.70710678f), 0.70710678f) + 0.70710678f) / (2.0f * 0.70710678f);
+            bits = (bits << 15) | static_cast<std::uint64_t>(std::lround(fraction * 32767.0f));
+        }
+        values.push_back(static_cast<std::uint16_t>(bits >> 32));
+        values.push_back(static_cast<std::uint16_t>(bits >> 16));
+        values.push_back(static_cast<std::uint16_t>(bits));
+    }
+    /**
+    * Write the packed rotation of `key` as quantized smallest three components
+    * and largest component index, as expected by `decode_smallest_three`
+    */
+    static void unpack_smallest_three(const std::uint16_t* packed, float unpacked[4])
+    {
+        const std::uint64_t bits = (static_cast<std::uint64_t>(packed[0]) << 32) |
+                                   (static_cast<std::uint64_t>(packed[1]) << 16) |
+                                   static_cast<std::uint64_t>(packed[2]);
+        unpacked[0] = static_cast<float>((bits >> 30) & 0x7fff);
+        unpacked[1] = static_cast<float>((bits >> 15) & 0x7fff);
+        unpacked[2] = static_cast<float>(bits & 0x7fff);
+        unpacked[3] = static_cast<float>((bits >> 45) & 0x3);
+    }
+    void gather_keys(Channel channel, float key_time, std::size_t stride, SamplingCache& cache) const
+    {
+        const Track& track = m_tracks[channel];
+        const bool rotation = channel == AnimationClip::rotation;
+        const int base = channel == AnimationClip::translation ? Pose::translation_x :
+                         rotation ? Pose::rotation_x : Pose::scale_x;
+        float* from_streams[4];
+        float* to_streams[4];
+        for (int c = 0; c < 4; ++c)
+        {
+            // Translations and scales only use the first three
+            from_streams[c] = cache.from.stream(static_cast<Pose::Stream>(std::min(base + c, Pose::stream_count - 1)));
+            to_streams[c] = cache.to.stream(static_cast<Pose::Stream>(std::min(base + c, Pose::stream_count - 1)));
+        }
+        const int components = rotation ? 4 : 3;
+        float* factors = cache.factors.data() + channel * stride;
+        std::uint32_t* cursors = cache.cursors.data() + channel * m_joint_count;
+        for (std::size_t joint = 0; joint < m_joint_count; ++joint)
+        {
+            const KeyRange range = track.ranges[joint];
+            factors[joint] = 0.0f;
+            if (range.count == 0)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    from_streams[c][joint] = 0.0f;
+                    to_streams[c][joint] = 0.0f;
+                }
+                continue;
+            }
+            const std::uint32_t key = find_key(track.times.data() + range.first, range.count, key_time, cursors[joint], factors[joint]);
+            const std::uint16_t* from = track.values.data() + (range.first + key) * 3;
+            const std::uint16_t* to = track.values.data() + (range.first + std::min(key + 1, range.count - 1)) * 3;
+            if (rotation)
+            {
+                float unpacked[4];
+                unpack_smallest_three(from, unpacked);
+                for (int c = 0; c < components; ++c)
+                {
+                    from_streams[c][joint] = unpacked[c];
+                }
+                unpack_smallest_three(to, unpacked);
+                for (int c = 0; c < components; ++c)
+                {
+                    to_streams[c][joint] = unpacked[c];
+                }
+                continue;
+            }
+            for (int c = 0; c < components; ++c)
+            {
+                from_streams[c][joint] = from[c];
+                to_streams[c][joint] = to[c];
+            }
+        }
+        // Padding joints decode to identity rotations
+        if (rotation)
+        {
+            for (std::size_t joint = m_joint_count; joint < stride; ++joint)
+            {
+                for (float** streams : {from_streams, to_streams})
+                {
+                    streams[0][joint] = 16383.5f;
+                    streams[1][joint] = 16383.5f;
+                    streams[2][joint] = 16383.5f;
+                    streams[3][joint] = 3.0f;
+                }
+            }
+        }
+    }
+    /**
+    * Return the value of a compressed track at `time` seconds, decoded one
+    * key at a time
+    */
+    glm::vec4 evaluate(Channel channel, std::size_t joint, float time) const
+    {
+        const Track& track = m_tracks[channel];
+        const KeyRange range = track.ranges[joint];
+        const bool rotation = channel == AnimationClip::rotation;
+        if (range.count == 0)
+        {
+            const std::vector<float>& ranges = m_ranges[channel == AnimationClip::translation ? 0 : 1];
+            const std::size_t stride = ranges.size() / 6;
+            return glm::vec4(ranges[joint], ranges[stride + joint], ranges[2 * stride + joint], 0.0f);
+        }
+        std::uint32_t cursor = 0;
+        float factor = 0.0f;
+        const float key_time = m_duration > 0.0f ? std::min(std::max(time / m_duration, 0.0f), 1.0f) * 65535.0f : 0.0f;
+        const std::uint32_t key = find_key(track.times.data() + range.first, range.count, key_time, cursor, factor);
+        const glm::vec4 from = decode(channel, joint, range.first + key);
+        const glm::vec4 to = decode(channel, joint, range.first + std::min(key + 1, range.count - 1));
+        return interpolate(from, to, factor, rotation);
+    }
+    glm::vec4 decode(Channel channel, std::size_t joint, std::uint32_t key) const
+    {
+        const std::uint16_t* packed = m_tracks[channel].values.data() + key * 3;
+        if (channel == AnimationClip::rotation)
+        {
+            float unpacked[4];
+            unpack_smallest_three(packed, unpacked);
+            float streams[4][simd::Lanes::width];
+            float* const pointers[4] = {streams[0], streams[1], streams[2], streams[3]};
+            for (int c = 0; c < 4; ++c)
+            {
+                std::fill_n(streams[c], static_cast<int>(simd::Lanes::width), unpacked[c]);
+            }
+            simd::decode_smallest_three(pointers, simd::Lanes::width);
+            return glm::vec4(streams[0][0], streams[1][0], streams[2][0], streams[3][0]);
+        }
+        const std::vector<float>& ranges = m_ranges[channel == AnimationClip::translation ? 0 : 1];
+        const std::size_t stride = ranges.size() / 6;
+        glm::vec4 value(0.0f);
+        for (int c = 0; c < 3; ++c)
+        {
+            value[c] = ranges[c * stride + joint] + packed[c] * ranges[(c + 3) * stride + joint];
+        }
+        return value;
+    }
+    void measure_error(Channel channel, std::size_t joint, const SourceTrack& source, float& max_error) const
+    {
+        const bool rotation = channel == AnimationClip::rotation;
+        for (std::size_t i = 0; i < source.times.size(); ++i)
+        {
+            const glm::vec4 value = evaluate(channel, joint, source.times[i]);
+            const float error = rotation ? rotation_error(value, source.values[i]) :
+                                           glm::length(value - source.values[i]);
+            max_error = std::max(max_error, error);
+        }
+    }
+private:
+    std::string m_name;
+    std::size_t m_joint_count;
+    float m_duration;
+    Track m_tracks[AnimationClip::channel_count];
+    // Dequantization offsets and scales of translations and scales, as three
+    // offset streams followed by three scale streams
+    std::vector<float> m_ranges[2];
+    CompressionReport m_report;
+};
+
+
+/**
+* Compress the clips of all animations of the scene
+*/
+inline std::vector<CompressedClip> compress_clips(const aiScene* scene,
+                                                  const Skeleton& skeleton,
+                                                  const CompressionSettings& settings = CompressionSettings())
+{
+    std::vector<CompressedClip> clips;
+    clips.reserve(scene->mNumAnimations);
+    for (unsigned int i = 0; i < scene->mNumAnimations; ++i)
+    {
+        clips.emplace_back(scene->mAnimations[i], skeleton, settings);
+    }
+    return clips;
+}
+
+
+}  // namespace animation
+
+
+}  // namespace crudegl
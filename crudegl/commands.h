@@ -0,0 +1,476 @@
+#pragma once
+
+#include "draws.h"
+#include "materials.h"
+#include "memory.h"
+#include "programs.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+enum class CommandType : std::uint32_t
+{
+    bind_program,
+    bind_vertex_array,
+    bind_material,
+    draw_indexed,
+    multi_draw,
+    update_uniforms
+};
+
+
+/**
+* A packet of a `CommandList`, holding the arguments of it's type only
+*/
+struct Command
+{
+    struct DrawIndexed
+    {
+        GLuint first_index;
+        GLuint index_count;
+        GLint base_vertex;
+        GLuint base_instance;
+    };
+
+    // Range of the indirect draws of the command list
+    struct MultiDraw
+    {
+        GLuint first_draw;
+        GLuint draw_count;
+    };
+
+    // Range of the uniform data of the command list, bound to a uniform
+    // block binding point
+    struct UpdateUniforms
+    {
+        GLuint binding;
+        GLuint offset;
+        GLuint size;
+    };
+
+    CommandType type;
+    union
+    {
+        GLuint program;
+        GLuint vao;
+        MaterialHandle material;
+        DrawIndexed draw_indexed;
+        MultiDraw multi_draw;
+        UpdateUniforms update_uniforms;
+    };
+};
+
+
+static_assert(std::is_trivially_copyable<Command>::value, "Commands must be plain data");
+
+
+/**
+* Alignment of uniform blocks within the uniform data of command lists, the
+* largest uniform buffer offset alignment OpenGL allows
+*/
+constexpr std::size_t uniform_data_alignment = 256;
+
+
+/**
+* Draw commands recorded on any thread, to be executed later on the thread
+* owning the OpenGL context by a `CommandExecutor`
+*
+* Recording touches no OpenGL state, so different parts of a scene can be
+* recorded into different lists in parallel, such as one list per model or
+* per job. Commands only hold OpenGL names and handles, which the objects they
+* come from must keep valid until the list is executed.
+*
+* Lists recorded every frame can store their commands in a frame arena of the
+* recording thread, see `reset`, instead of the heap.
+*/
+class CommandList
+{
+public:
+    /**
+    * Constructor
+    * @param arena stores the commands, null for the heap
+    */
+    explicit CommandList(memory::LinearArena* arena = nullptr) : m_commands(arena),
+                                                                 m_draws(arena),
+                                                                 m_uniform_data(arena)
+    {
+    }
+    void bind_program(const shaders::GLSLProgram& program)
+    {
+        Command command;
+        command.type = CommandType::bind_program;
+        command.program = program.get_handle();
+        m_commands.push_back(command);
+    }
+    void bind_vertex_array(GLuint vao)
+    {
+        Command command;
+        command.type = CommandType::bind_vertex_array;
+        command.vao = vao;
+        m_commands.push_back(command);
+    }
+    /**
+    * Bind the textures of a material of the executor's material library and
+    * set the `material_index` uniform of the bound program, if it has one
+    *
+    * `no_material` unbinds the textures of the previous material instead.
+    */
+    void bind_material(MaterialHandle material)
+    {
+        Command command;
+        command.type = CommandType::bind_material;
+        command.material = material;
+        m_commands.push_back(command);
+    }
+    /**
+    * Draw a range of the indices of the bound vertex array
+    */
+    void draw_indexed(std::size_t first_index, std::size_t index_count, GLint base_vertex = 0, GLuint base_instance = 0)
+    {
+        Command command;
+        command.type = CommandType::draw_indexed;
+        command.draw_indexed = Command::DrawIndexed{static_cast<GLuint>(first_index), static_cast<GLuint>(index_count),
+                                                    base_vertex, base_instance};
+        m_commands.push_back(command);
+    }
+    /**
+    * Draw a level of detail of an indexed mesh with it's vertex array and
+    * material, the full detail one if the mesh has no levels
+    *
+    * Meshes without a material are drawn with no material textures bound.
+    */
+    template <class TMesh>
+    void draw(const TMesh& mesh, std::size_t level = 0)
+    {
+        bind_vertex_array(mesh.get_vertex_array());
+        bind_material(mesh.get_material());
+        const auto& lods = mesh.get_lods();
+        if (lods.empty())
+        {
+            draw_indexed(0, mesh.get_index_count());
+            return;
+        }
+        const LODLevel& lod = lods[std::min(level, lods.size() - 1)];
+        draw_indexed(lod.first_index, lod.index_count);
+    }
+    /**
+    * Draw ranges of the indices of the bound vertex array with one indirect
+    * multi-draw
+    */
+    void multi_draw(const DrawElementsCommand* draws, std::size_t count)
+    {
+        Command command;
+        command.type = CommandType::multi_draw;
+        command.multi_draw = Command::MultiDraw{static_cast<GLuint>(m_draws.size()), static_cast<GLuint>(count)};
+        m_draws.insert(m_draws.end(), draws, draws + count);
+        m_commands.push_back(command);
+    }
+    /**
+    * Copy a uniform block into the list and bind it to `binding` when
+    * executed, the layout of `TBlock` matching the std140 layout of the block
+    */
+    template <class TBlock>
+    void update_uniforms(GLuint binding, const TBlock& block)
+    {
+        static_assert(std::is_trivially_copyable<TBlock>::value, "Uniform blocks must be plain data");
+        const std::size_t offset = (m_uniform_data.size() + uniform_data_alignment - 1) / uniform_data_alignment *
+                                   uniform_data_alignment;
+        m_uniform_data.resize(offset + sizeof(TBlock));
+        const auto bytes = reinterpret_cast<const unsigned char*>(&block);
+        std::copy(bytes, bytes + sizeof(TBlock), m_uniform_data.begin() + offset);
+
+        Command command;
+        command.type = CommandType::update_uniforms;
+        command.update_uniforms = Command::UpdateUniforms{binding, static_cast<GLuint>(offset), static_cast<GLuint>(sizeof(TBlock))};
+        m_commands.push_back(command);
+    }
+    /**
+    * Drop every command, keeping the storage for the next frame
+    */
+    void clear()
+    {
+        m_commands.clear();
+        m_draws.clear();
+        m_uniform_data.clear();
+    }
+    /**
+    * Drop every command and store the next ones in another arena, such as
+    * the arena of the recording thread for a new frame
+    * @param arena stores the commands, null for the heap
+    */
+    void reset(memory::LinearArena* arena)
+    {
+        m_commands = memory::ArenaVector<Command>(arena);
+        m_draws = memory::ArenaVector<DrawElementsCommand>(arena);
+        m_uniform_data = memory::ArenaVector<unsigned char>(arena);
+    }
+    std::size_t size() const noexcept
+    {
+        return m_commands.size();
+    }
+    const memory::ArenaVector<Command>& get_commands() const noexcept
+    {
+        return m_commands;
+    }
+    const memory::ArenaVector<DrawElementsCommand>& get_draws() const noexcept
+    {
+        return m_draws;
+    }
+    const memory::ArenaVector<unsigned char>& get_uniform_data() const noexcept
+    {
+        return m_uniform_data;
+    }
+private:
+    memory::ArenaVector<Command> m_commands;
+    memory::ArenaVector<DrawElementsCommand> m_draws;
+    memory::ArenaVector<unsigned char> m_uniform_data;
+};
+
+
+/**
+* Executes command lists on the thread owning the OpenGL context, skipping
+* state changes that would not change anything
+*
+* The indirect draws and uniform data of all lists executed together are
+* uploaded in one go, into buffers orphaned from one execution to the next.
+* Bindings are cached from the start of an execution to it's end, so state
+* changed by other code in between is never missed. Uniform locations are
+* cached per program across executions, see `forget_program`.
+*/
+template <class TMaterialLibrary = MaterialLibrary<>>
+class CommandExecutor
+{
+public:
+    using material_library_type = TMaterialLibrary;
+
+    /**
+    * Constructor
+    * @param materials binds the materials of `bind_material` commands
+    */
+    explicit CommandExecutor(const material_library_type* materials = nullptr) : m_materials(materials),
+                                                                                  m_draw_buffer(0),
+                                                                                  m_uniform_buffer(0),
+                                                                                  m_program(0),
+                                                                                  m_vao(0),
+                                                                                  m_material(no_material),
+                                                                                  m_material_location(-1),
+                                                                                  m_skipped_count(0)
+    {
+        glGenBuffers(1, &m_draw_buffer);
+        glGenBuffers(1, &m_uniform_buffer);
+    }
+    ~CommandExecutor()
+    {
+        glDeleteBuffers(1, &m_draw_buffer);
+        glDeleteBuffers(1, &m_uniform_buffer);
+    }
+
+    // Owns OpenGL objects
+    CommandExecutor(const CommandExecutor&) = delete;
+    CommandExecutor& operator=(const CommandExecutor&) = delete;
+
+    /**
+    * Execute command lists in order
+    */
+    void execute(const std::vector<CommandList>& lists)
+    {
+        execute(lists.data(), lists.size());
+    }
+    void execute(const CommandList* lists, std::size_t count)
+    {
+        upload(lists, count);
+        m_program = 0;
+        m_vao = 0;
+        m_material = no_material;
+        m_material_location = -1;
+        m_skipped_count = 0;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            execute(lists[i], m_draw_offsets[i], m_uniform_offsets[i]);
+        }
+        if (m_materials && m_material != no_material)
+        {
+            m_materials->unbind_textures(m_material);
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+    /**
+    * Drop the cached uniform locations of a program, which must be done
+    * before executing commands with it once it's relinked or deleted
+    */
+    void forget_program(GLuint program)
+    {
+        m_material_locations.erase(program);
+    }
+    /**
+    * Return the number of bind commands skipped by the last execution, as
+    * binding what was bound already
+    */
+    std::size_t get_skipped_count() const noexcept
+    {
+        return m_skipped_count;
+    }
+private:
+    /**
+    * Upload the indirect draws and uniform data of all lists, recording
+    * where those of each list start
+    */
+    void upload(const CommandList* lists, std::size_t count)
+    {
+        m_draws.clear();
+        m_uniform_data.clear();
+        m_draw_offsets.clear();
+        m_uniform_offsets.clear();
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            m_draw_offsets.push_back(m_draws.size());
+            m_draws.insert(m_draws.end(), lists[i].get_draws().begin(), lists[i].get_draws().end());
+            const std::size_t offset = (m_uniform_data.size() + uniform_data_alignment - 1) / uniform_data_alignment *
+                                       uniform_data_alignment;
+            m_uniform_offsets.push_back(offset);
+            m_uniform_data.resize(offset);
+            m_uniform_data.insert(m_uniform_data.end(), lists[i].get_uniform_data().begin(), lists[i].get_uniform_data().end());
+        }
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_draw_buffer);
+        if (!m_draws.empty())
+        {
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, m_draws.size() * sizeof(DrawElementsCommand), m_draws.data(), GL_STREAM_DRAW);
+        }
+        if (!m_uniform_data.empty())
+        {
+            glBindBuffer(GL_UNIFORM_BUFFER, m_uniform_buffer);
+            glBufferData(GL_UNIFORM_BUFFER, m_uniform_data.size(), m_uniform_data.data(), GL_STREAM_DRAW);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+    }
+    void execute(const CommandList& list, std::size_t draw_offset, std::size_t uniform_offset)
+    {
+        for (const Command& command : list.get_commands())
+        {
+            switch (command.type)
+            {
+            case CommandType::bind_program:
+                if (command.program == m_program)
+                {
+                    ++m_skipped_count;
+                    break;
+                }
+                glUseProgram(command.program);
+                m_program = command.program;
+                m_material_location = get_material_location(m_program);
+                if (m_material_location >= 0 && m_material != no_material)
+                {
+                    glUniform1ui(m_material_location, m_material);
+                }
+                break;
+            case CommandType::bind_vertex_array:
+                if (command.vao == m_vao)
+                {
+                    ++m_skipped_count;
+                    break;
+                }
+                glBindVertexArray(command.vao);
+                m_vao = command.vao;
+                break;
+            case CommandType::bind_material:
+                if (command.material == m_material)
+                {
+                    ++m_skipped_count;
+                    break;
+                }
+                if (command.material == no_material)
+                {
+                    if (m_materials)
+                    {
+                        m_materials->unbind_textures(m_material);
+                    }
+                    m_material = no_material;
+                    break;
+                }
+                if (m_materials)
+                {
+                    m_materials->bind_textures(command.material);
+                }
+                if (m_material_location >= 0)
+                {
+                    glUniform1ui(m_material_location, command.material);
+                }
+                m_material = command.material;
+                break;
+            case CommandType::draw_indexed:
+            {
+                const Command::DrawIndexed& draw = command.draw_indexed;
+                glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, static_cast<GLsizei>(draw.index_count), GL_UNSIGNED_INT,
+                                                              reinterpret_cast<const void*>(draw.first_index * sizeof(GLuint)),
+                                                              1, draw.base_vertex, draw.base_instance);
+                break;
+            }
+            case CommandType::multi_draw:
+            {
+                const std::size_t first = draw_offset + command.multi_draw.first_draw;
+                glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                            reinterpret_cast<const void*>(first * sizeof(DrawElementsCommand)),
+                                            static_cast<GLsizei>(command.multi_draw.draw_count), 0);
+                break;
+            }
+            case CommandType::update_uniforms:
+            {
+                const Command::UpdateUniforms& update = command.update_uniforms;
+                glBindBufferRange(GL_UNIFORM_BUFFER, update.binding, m_uniform_buffer,
+                                  static_cast<GLintptr>(uniform_offset + update.offset), update.size);
+                break;
+            }
+            }
+        }
+    }
+    GLint get_material_location(GLuint program)
+    {
+        const auto found = m_material_locations.find(program);
+        if (found != m_material_locations.end())
+        {
+            return found->second;
+        }
+        const GLint location = glGetUniformLocation(program, "material_index");
+        m_material_locations.emplace(program, location);
+        return location;
+    }
+private:
+    const material_library_type* m_materials;
+    GLuint m_draw_buffer;
+    GLuint m_uniform_buffer;
+    // State cache, valid during an execution
+    GLuint m_program;
+    GLuint m_vao;
+    MaterialHandle m_material;
+    GLint m_material_location;
+    std::size_t m_skipped_count;
+    // Location of the `material_index` uniform per program, -1 if unused
+    std::unordered_map<GLuint, GLint> m_material_locations;
+    // Data of the lists executed, kept to reuse their storage
+    std::vector<DrawElementsCommand> m_draws;
+    std::vector<unsigned char> m_uniform_data;
+    std::vector<std::size_t> m_draw_offsets;
+    std::vector<std::size_t> m_uniform_offsets;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
@@ -0,0 +1,325 @@
+#pragma once
+
+#include "lod.h"
+#include "memory.h"
+#include "programs.h"
+#include "pulling.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+// Shader storage buffer binding point of the per-draw data, clear of the
+// ones used for skinning and vertex pulling
+enum DrawDataBinding
+{
+    draw_data_binding = 6
+};
+
+
+/**
+* Data of one draw, laid out as `DrawData` of `draw_data_glsl` under std430
+*/
+struct DrawData
+{
+    glm::mat4 model;
+    // Index of the material of the draw, defined by the application
+    GLuint material;
+    // Index of the object drawn, for picking or per-object effects
+    GLuint object;
+    GLuint padding[2];
+};
+
+
+static_assert(sizeof(DrawData) == 80, "DrawData must match the std430 layout of draw_data_glsl");
+
+
+/**
+* Layout of the commands read by glMultiDrawElementsIndirect
+*/
+struct DrawElementsCommand
+{
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
+};
+
+
+/**
+* GLSL declarations reading the `DrawData` of the current draw of a
+* `RenderQueue`. Paste them after the version directive of a `#version 460`
+* shader, or of a `#version 430` one enabling GL_ARB_shader_draw_parameters.
+*
+* The draw is found through `gl_BaseInstance`, which the queue sets to the
+* index of its data. Shaders drawing instances of their own can define
+* `DRAW_INDEX_FROM_DRAW_ID` before these declarations to find it through
+* `gl_DrawID` instead, offset by the `draw_index_base` uniform the queue sets
+* once per multi-draw.
+*/
+const char* const draw_data_glsl = R"glsl(
+struct DrawData
+{
+    mat4 model;
+    uint material;
+    uint object;
+};
+
+layout (std430, binding = 6) readonly buffer DrawDataBuffer
+{
+    DrawData draws[];
+};
+
+#ifdef DRAW_INDEX_FROM_DRAW_ID
+uniform uint draw_index_base;
+#endif
+
+uint draw_index()
+{
+#if __VERSION__ >= 460
+#ifdef DRAW_INDEX_FROM_DRAW_ID
+    return draw_index_base + uint(gl_DrawID);
+#else
+    return uint(gl_BaseInstance);
+#endif
+#else
+#ifdef DRAW_INDEX_FROM_DRAW_ID
+    return draw_index_base + uint(gl_DrawIDARB);
+#else
+    return uint(gl_BaseInstanceARB);
+#endif
+#endif
+}
+
+DrawData draw_data()
+{
+    return draws[draw_index()];
+}
+)glsl";
+
+
+/**
+* Collects the draws of a frame with their per-draw data, and submits them
+* with one multi-draw per run of draws sharing a program and vertex array
+*
+* The per-draw data of every draw is uploaded to a single storage buffer per
+* flush, replacing the uniform updates between draws that keep them from
+* being merged. Draws are indexed, of triangles, from 32 bit index buffers
+* bound to their vertex array object, which is what `Mesh` and `VertexPool`
+* use. Textures are not bound by the queue, shaders are expected to find them
+* through the material index.
+*
+* Queues filled every frame can store their draws in a frame arena, see
+* `reset`, instead of the heap.
+*
+* Requires OpenGL 4.3 for indirect multi-draws.
+*/
+class RenderQueue
+{
+public:
+    /**
+    * Constructor
+    * @param arena stores the queued draws, null for the heap
+    */
+    explicit RenderQueue(memory::LinearArena* arena = nullptr) : m_data_buffer(0),
+                                                                 m_command_buffer(0),
+                                                                 m_batch_count(0),
+                                                                 m_draws(arena),
+                                                                 m_data(arena),
+                                                                 m_sorted_data(arena),
+                                                                 m_commands(arena)
+    {
+        glGenBuffers(1, &m_data_buffer);
+        glGenBuffers(1, &m_command_buffer);
+    }
+    ~RenderQueue()
+    {
+        glDeleteBuffers(1, &m_data_buffer);
+        glDeleteBuffers(1, &m_command_buffer);
+    }
+
+    // Owns OpenGL objects
+    RenderQueue(const RenderQueue&) = delete;
+    RenderQueue& operator=(const RenderQueue&) = delete;
+
+    /**
+    * Queue a range of the index buffer of a vertex array object
+    * @param program must outlive the next `flush`
+    * @param first_index is the index of the first index of the range
+    * @param base_vertex is added to every index of the range
+    */
+    void submit(shaders::GLSLProgram& program,
+                GLuint vao,
+                std::size_t first_index,
+                std::size_t index_count,
+                GLint base_vertex,
+                const DrawData& data)
+    {
+        Draw draw;
+        draw.program = &program;
+        draw.vao = vao;
+        draw.command = DrawElementsCommand{static_cast<GLuint>(index_count), 1, static_cast<GLuint>(first_index),
+                                           base_vertex, 0};
+        draw.data = m_data.size();
+        m_draws.push_back(draw);
+        m_data.push_back(data);
+    }
+    /**
+    * Queue a mesh of a vertex pool, which has to be bound with
+    * `VertexPool::bind` when flushing
+    */
+    void submit(shaders::GLSLProgram& program, const VertexPool& pool, const PulledMesh& mesh, const DrawData& data)
+    {
+        submit(program, pool.get_vertex_array(), mesh.first_index, mesh.index_count, mesh.base_vertex, data);
+    }
+    /**
+    * Queue a level of detail of an indexed mesh, the full detail one if the
+    * mesh has no levels
+    */
+    template <class TMesh>
+    void submit(shaders::GLSLProgram& program, const TMesh& mesh, std::size_t level, const DrawData& data)
+    {
+        const auto& lods = mesh.get_lods();
+        if (lods.empty())
+        {
+            submit(program, mesh.get_vertex_array(), 0, mesh.get_index_count(), 0, data);
+            return;
+        }
+        const LODLevel& lod = lods[std::min(level, lods.size() - 1)];
+        submit(program, mesh.get_vertex_array(), lod.first_index, lod.index_count, 0, data);
+    }
+    /**
+    * Upload the per-draw data and submit every queued draw, then clear the
+    * queue for the next frame
+    * @param sort groups the draws by program and vertex array first, which
+    *        merges more of them but changes the order they are drawn in
+    */
+    void flush(bool sort = true)
+    {
+        if (m_draws.empty())
+        {
+            return;
+        }
+        if (sort)
+        {
+            std::stable_sort(m_draws.begin(), m_draws.end(), [](const Draw& lhs, const Draw& rhs)
+                             {
+                                 return lhs.program != rhs.program ? std::less<shaders::GLSLProgram*>()(lhs.program, rhs.program) :
+                                                                  lhs.vao < rhs.vao;
+                             });
+        }
+        // Store the data in the order of the draws, so that both the base
+        // instance and the draw index within a multi-draw lead to it
+        m_commands.clear();
+        m_sorted_data.clear();
+        for (const Draw& draw : m_draws)
+        {
+            m_commands.push_back(draw.command);
+            m_commands.back().base_instance = static_cast<GLuint>(m_sorted_data.size());
+            m_sorted_data.push_back(m_data[draw.data]);
+        }
+
+        // Orphan the buffers of the previous frame rather than wait for the
+        // draws still reading them
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_data_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, m_sorted_data.size() * sizeof(DrawData), m_sorted_data.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, draw_data_binding, m_data_buffer);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_command_buffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, m_commands.size() * sizeof(DrawElementsCommand), m_commands.data(), GL_STREAM_DRAW);
+
+        m_batch_count = 0;
+        std::size_t first = 0;
+        while (first < m_draws.size())
+        {
+            std::size_t end = first + 1;
+            while (end < m_draws.size() && m_draws[end].program == m_draws[first].program &&
+                   m_draws[end].vao == m_draws[first].vao)
+            {
+                ++end;
+            }
+            shaders::GLSLProgram& program = *m_draws[first].program;
+            program.use();
+            program.set_uniform("draw_index_base", static_cast<GLuint>(first));
+            glBindVertexArray(m_draws[first].vao);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                        reinterpret_cast<const void*>(first * sizeof(DrawElementsCommand)),
+                                        static_cast<GLsizei>(end - first), 0);
+            ++m_batch_count;
+            first = end;
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        clear();
+    }
+    /**
+    * Drop the queued draws without submitting them
+    */
+    void clear()
+    {
+        m_draws.clear();
+        m_data.clear();
+    }
+    /**
+    * Drop the queued draws and store the next ones in another arena, such as
+    * the arena of the submitting thread for a new frame
+    * @param arena stores the queued draws, null for the heap
+    */
+    void reset(memory::LinearArena* arena)
+    {
+        m_draws = memory::ArenaVector<Draw>(arena);
+        m_data = memory::ArenaVector<DrawData>(arena);
+        m_sorted_data = memory::ArenaVector<DrawData>(arena);
+        m_commands = memory::ArenaVector<DrawElementsCommand>(arena);
+    }
+    std::size_t size() const noexcept
+    {
+        return m_draws.size();
+    }
+    /**
+    * Return the number of multi-draws the last `flush` was submitted with
+    */
+    std::size_t get_batch_count() const noexcept
+    {
+        return m_batch_count;
+    }
+private:
+    struct Draw
+    {
+        shaders::GLSLProgram* program;
+        GLuint vao;
+        DrawElementsCommand command;
+        // Index of the data of the draw in `m_data`
+        std::size_t data;
+    };
+private:
+    GLuint m_data_buffer;
+    GLuint m_command_buffer;
+    std::size_t m_batch_count;
+    memory::ArenaVector<Draw> m_draws;
+    memory::ArenaVector<DrawData> m_data;
+    // Draw data and commands in the order of the draws, kept to reuse their
+    // storage
+    memory::ArenaVector<DrawData> m_sorted_data;
+    memory::ArenaVector<DrawElementsCommand> m_commands;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
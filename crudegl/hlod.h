@@ -0,0 +1,647 @@
+#pragma once
+
+#include "bounds.h"
+#include "bvh.h"
+#include "jobs.h"
+#include "lod.h"
+#include "meshes.h"
+#include "textures.h"
+#include "vertices.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+struct HLODSettings
+{
+    // Number of meshes, or clusters of the level below, merged per cluster
+    std::size_t cluster_size;
+    // Simplification grid cells along the longest side of a cluster
+    std::size_t grid_resolution;
+    // Texels along the side of the atlas tile of every source texture
+    std::size_t tile_size;
+    // Name under which the atlas of a proxy is referenced in shaders
+    std::string atlas_name;
+};
+
+
+constexpr std::size_t no_hlod_image = static_cast<std::size_t>(-1);
+
+
+/**
+* Cluster hierarchy built by `HLODBuilder`, rendering a merged and simplified
+* proxy per cluster in place of everything below it when it's far enough for
+* the difference to stay under a pixel threshold
+*
+* Clusters of the first level stand in for source meshes, identified by the
+* item ids handed out by the builder, clusters of the following levels for
+* the clusters below them.
+*/
+class HLOD
+{
+public:
+    using proxy_mesh_type = Mesh<GLfloat, DefaultVertex>;
+    using program_type = proxy_mesh_type::program_type;
+
+    struct Image
+    {
+        std::size_t width;
+        std::size_t height;
+        // Three bytes per texel, row by row
+        std::vector<unsigned char> pixels;
+    };
+
+    struct Cluster
+    {
+        geometry::BoundingBox bounds;
+        // Largest distance between the proxy and the source surface, which
+        // grows from each level to the next
+        float error;
+        // Clusters of the level below, empty for the first level
+        std::vector<std::size_t> children;
+        // Source meshes, only for the first level
+        std::vector<std::size_t> items;
+        // Proxy geometry laid out as `DefaultVertex`, released by `upload`
+        std::vector<GLfloat> vertices;
+        std::vector<GLuint> indices;
+        Image atlas;
+        std::shared_ptr<proxy_mesh_type> proxy;
+    };
+
+    HLOD() = default;
+    HLOD(std::vector<Cluster> clusters, std::vector<std::size_t> roots, std::size_t item_count, std::string atlas_name)
+        : m_clusters(std::move(clusters)),
+          m_roots(std::move(roots)),
+          m_item_selected(item_count, 1),
+          m_atlas_name(std::move(atlas_name))
+    {
+    }
+    /**
+    * Create the proxy meshes and their atlases
+    *
+    * Must run on the thread owning the OpenGL context.
+    */
+    void upload()
+    {
+        for (Cluster& cluster : m_clusters)
+        {
+            if (cluster.proxy || cluster.indices.empty())
+            {
+                continue;
+            }
+            proxy_mesh_type::texture_vec textures;
+            if (!cluster.atlas.pixels.empty())
+            {
+                auto atlas = std::make_shared<textures::Texture2D>(m_atlas_name,
+                                                                   static_cast<GLsizei>(cluster.atlas.width),
+                                                                   static_cast<GLsizei>(cluster.atlas.height),
+                                                                   cluster.atlas.pixels);
+                atlas->upload();
+                textures.push_back(std::move(atlas));
+            }
+            cluster.proxy = std::make_shared<proxy_mesh_type>(cluster.vertices, cluster.indices, std::move(textures));
+            std::vector<GLfloat>().swap(cluster.vertices);
+            std::vector<GLuint>().swap(cluster.indices);
+            std::vector<unsigned char>().swap(cluster.atlas.pixels);
+        }
+    }
+    /**
+    * Choose the coarsest clusters whose error projects to at most
+    * `pixel_threshold`, and the source meshes not covered by any of them
+    * @param eye is the camera position in world space
+    * @param error_scale converts a world space error at unit distance into
+    *        pixels, the viewport height over twice the tangent of half the
+    *        vertical field of view for a perspective projection
+    */
+    void select(const glm::vec3& eye, float error_scale, float pixel_threshold)
+    {
+        m_selected.clear();
+        std::fill(m_item_selected.begin(), m_item_selected.end(), 0);
+        m_stack.assign(m_roots.rbegin(), m_roots.rend());
+        while (!m_stack.empty())
+        {
+            const Cluster& cluster = m_clusters[m_stack.back()];
+            const std::size_t index = m_stack.back();
+            m_stack.pop_back();
+            const float distance = glm::length(glm::max(glm::max(cluster.bounds.minimum - eye, eye - cluster.bounds.maximum),
+                                                        glm::vec3(0.0f)));
+            if (distance > 0.0f && cluster.error * error_scale <= pixel_threshold * distance)
+            {
+                m_selected.push_back(index);
+                continue;
+            }
+            m_stack.insert(m_stack.end(), cluster.children.rbegin(), cluster.children.rend());
+            for (std::size_t item : cluster.items)
+            {
+                m_item_selected[item] = 1;
+            }
+        }
+    }
+    /**
+    * Render the proxies of the selected clusters
+    */
+    void render(program_type& program) const
+    {
+        for (std::size_t index : m_selected)
+        {
+            if (m_clusters[index].proxy)
+            {
+                m_clusters[index].proxy->render(program);
+            }
+        }
+    }
+    /**
+    * Return whether the source mesh has to be rendered itself, not being
+    * replaced by a selected proxy
+    */
+    bool is_item_selected(std::size_t item) const
+    {
+        return m_item_selected[item] != 0;
+    }
+    const std::vector<std::size_t>& get_selected() const noexcept
+    {
+        return m_selected;
+    }
+    const std::vector<Cluster>& get_clusters() const noexcept
+    {
+        return m_clusters;
+    }
+    const std::vector<std::size_t>& get_roots() const noexcept
+    {
+        return m_roots;
+    }
+private:
+    std::vector<Cluster> m_clusters;
+    std::vector<std::size_t> m_roots;
+    std::vector<std::size_t> m_selected;
+    std::vector<std::uint8_t> m_item_selected;
+    // Clusters left to visit by `select`, kept to reuse it's storage
+    std::vector<std::size_t> m_stack;
+    std::string m_atlas_name;
+};
+
+
+/**
+* Builds an `HLOD` over static meshes of any number of models
+*
+* Meshes are clustered spatially with the leaves of a BVH over their bounds,
+* then the clusters themselves, level by level until a single one is left.
+* The proxy of a cluster merges the geometry of its members in world space,
+* simplifies it by clustering vertices on a grid sized to the cluster, and
+* bakes the textures of the members into one atlas of equally sized tiles.
+* Texture coordinates are wrapped into their tile, so repeating textures
+* lose their tiling on proxies.
+*/
+class HLODBuilder
+{
+public:
+    explicit HLODBuilder(const HLODSettings& settings = HLODSettings{16, 32, 64, "atlas"},
+                         jobs::JobSystem* jobs = nullptr) : m_settings(settings),
+                                                            m_jobs(jobs)
+    {
+        m_settings.cluster_size = std::max<std::size_t>(m_settings.cluster_size, 2);
+        m_settings.grid_resolution = std::max<std::size_t>(m_settings.grid_resolution, 1);
+        m_settings.tile_size = std::max<std::size_t>(m_settings.tile_size, 4);
+    }
+    /**
+    * Add a static mesh, the first texture being baked into the atlas
+    *
+    * Textures have to be processed but not uploaded yet, as their pixels
+    * are released by `upload`.
+    *
+    * @param transform places the mesh in world space
+    * @return the item id of the mesh, see `HLOD::is_item_selected`
+    */
+    template <class TVertexData, class TVertexAllocator, class TIndexAllocator, class TTexture>
+    std::size_t add(const std::vector<TVertexData, TVertexAllocator>& vertices,
+                    const std::vector<GLuint, TIndexAllocator>& indices,
+                    const std::vector<std::shared_ptr<TTexture>>& textures,
+                    const glm::mat4& transform)
+    {
+        static_assert(std::is_base_of<attributes::Position, TVertexData>::value, "HLOD requires vertex positions");
+        Piece piece;
+        const glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+        for (const TVertexData& vertex : vertices)
+        {
+            const glm::vec3 position(transform * glm::vec4(vertex.position, 1.0f));
+            piece.positions.push_back(position);
+            piece.normals.push_back(get_normal(vertex, normal_matrix, std::is_base_of<attributes::Normal, TVertexData>()));
+            piece.uvs.push_back(get_uv(vertex, std::is_base_of<attributes::TextureCoordinate, TVertexData>()));
+            piece.bounds.expand(position);
+        }
+        piece.indices.assign(indices.begin(), indices.end());
+        // Keep the triangles front facing under a mirroring transform
+        if (glm::determinant(glm::mat3(transform)) < 0.0f)
+        {
+            for (std::size_t i = 0; i + 2 < piece.indices.size(); i += 3)
+            {
+                std::swap(piece.indices[i + 1], piece.indices[i + 2]);
+            }
+        }
+        piece.image = textures.empty() ? no_hlod_image : add_image(*textures.front());
+        piece.wrap = true;
+        m_pieces.push_back(std::move(piece));
+        return m_pieces.size() - 1;
+    }
+    /**
+    * Cluster the added meshes and build the proxies, in parallel per
+    * cluster if a job system was given, and reset the builder
+    */
+    HLOD build()
+    {
+        std::vector<HLOD::Cluster> clusters;
+        std::vector<geometry::BoundingBox> bounds;
+        for (const Piece& piece : m_pieces)
+        {
+            bounds.push_back(piece.bounds);
+        }
+        // Members of the current level, source meshes first, then clusters
+        std::vector<std::size_t> level(m_pieces.size());
+        for (std::size_t i = 0; i < level.size(); ++i)
+        {
+            level[i] = i;
+        }
+        bool first_level = true;
+        while (level.size() > 1 || first_level)
+        {
+            const std::vector<std::vector<std::size_t>> groups = group(level, bounds);
+            if (!first_level && groups.size() == level.size())
+            {
+                break;
+            }
+            const std::size_t first_cluster = clusters.size();
+            clusters.resize(first_cluster + groups.size());
+            jobs::parallel_for(m_jobs, 0, groups.size(), [&](std::size_t i)
+                               {
+                                   HLOD::Cluster& cluster = clusters[first_cluster + i];
+                                   if (first_level)
+                                   {
+                                       cluster.items = groups[i];
+                                   }
+                                   else
+                                   {
+                                       cluster.children = groups[i];
+                                   }
+                                   build_proxy(cluster, clusters);
+                               });
+            level.clear();
+            bounds.clear();
+            for (std::size_t i = first_cluster; i < clusters.size(); ++i)
+            {
+                level.push_back(i);
+                bounds.push_back(clusters[i].bounds);
+            }
+            first_level = false;
+        }
+        HLOD hlod(std::move(clusters), std::move(level), m_pieces.size(), m_settings.atlas_name);
+        m_pieces.clear();
+        m_images.clear();
+        m_image_indices.clear();
+        return hlod;
+    }
+    std::size_t get_item_count() const noexcept
+    {
+        return m_pieces.size();
+    }
+private:
+    // Geometry of a source mesh in world space
+    struct Piece
+    {
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> normals;
+        std::vector<glm::vec2> uvs;
+        std::vector<GLuint> indices;
+        geometry::BoundingBox bounds;
+        std::size_t image;
+        bool wrap;
+    };
+
+    // Simplified vertex, accumulated from all vertices falling into a cell
+    struct Cell
+    {
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec2 uv;
+        float count;
+    };
+
+    template <class TVertexData>
+    static glm::vec3 get_normal(const TVertexData& vertex, const glm::mat3& normal_matrix, std::true_type)
+    {
+        const glm::vec3 normal = normal_matrix * vertex.normal;
+        const float length = glm::length(normal);
+        return length > 0.0f ? normal / length : normal;
+    }
+    template <class TVertexData>
+    static glm::vec3 get_normal(const TVertexData&, const glm::mat3&, std::false_type)
+    {
+        return glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+    template <class TVertexData>
+    static glm::vec2 get_uv(const TVertexData& vertex, std::true_type)
+    {
+        return vertex.texture_coordinate;
+    }
+    template <class TVertexData>
+    static glm::vec2 get_uv(const TVertexData&, std::false_type)
+    {
+        return glm::vec2(0.0f);
+    }
+    /**
+    * Return the index of the tile sized copy of the texture, shared by all
+    * meshes using it
+    */
+    template <class TTexture>
+    std::size_t add_image(const TTexture& texture)
+    {
+        const auto found = m_image_indices.find(&texture);
+        if (found != m_image_indices.end())
+        {
+            return found->second;
+        }
+        if (!texture.get_pixels())
+        {
+            return no_hlod_image;
+        }
+        HLOD::Image source{static_cast<std::size_t>(texture.get_width()), static_cast<std::size_t>(texture.get_height()),
+                           std::vector<unsigned char>(texture.get_pixels(),
+                                                      texture.get_pixels() + texture.get_width() * texture.get_height() * 3)};
+        m_images.push_back(resample(source, m_settings.tile_size));
+        m_image_indices.emplace(&texture, m_images.size() - 1);
+        return m_images.size() - 1;
+    }
+    /**
+    * Scale an image down, or up, to a square tile, averaging the texels
+    * covered by each tile texel
+    */
+    static HLOD::Image resample(const HLOD::Image& source, std::size_t size)
+    {
+        HLOD::Image tile{size, size, std::vector<unsigned char>(size * size * 3, 255)};
+        if (source.width == 0 || source.height == 0)
+        {
+            return tile;
+        }
+        for (std::size_t y = 0; y < size; ++y)
+        {
+            const std::size_t y0 = y * source.height / size;
+            const std::size_t y1 = std::max(y0 + 1, (y + 1) * source.height / size);
+            for (std::size_t x = 0; x < size; ++x)
+            {
+                const std::size_t x0 = x * source.width / size;
+                const std::size_t x1 = std::max(x0 + 1, (x + 1) * source.width / size);
+                std::size_t sums[3] = {0, 0, 0};
+                for (std::size_t sy = y0; sy < y1; ++sy)
+                {
+                    const unsigned char* texel = source.pixels.data() + (sy * source.width + x0) * 3;
+                    for (std::size_t sx = x0; sx < x1; ++sx, texel += 3)
+                    {
+                        sums[0] += texel[0];
+                        sums[1] += texel[1];
+                        sums[2] += texel[2];
+                    }
+                }
+                const std::size_t count = (y1 - y0) * (x1 - x0);
+                for (int channel = 0; channel < 3; ++channel)
+                {
+                    tile.pixels[(y * size + x) * 3 + channel] = static_cast<unsigned char>(sums[channel] / count);
+                }
+            }
+        }
+        return tile;
+    }
+    /**
+    * Split the members of a level into spatially close groups, the leaves
+    * of a BVH over their bounds
+    */
+    std::vector<std::vector<std::size_t>> group(const std::vector<std::size_t>& members,
+                                                const std::vector<geometry::BoundingBox>& bounds) const
+    {
+        std::vector<geometry::BVHPrimitive> primitives(members.size());
+        for (std::size_t i = 0; i < members.size(); ++i)
+        {
+            primitives[i].bounds = bounds[i];
+            primitives[i].centroid = bounds[i].empty() ? glm::vec3(0.0f) : bounds[i].center();
+            primitives[i].index = static_cast<std::uint32_t>(i);
+        }
+        const std::vector<geometry::BVHNode> nodes = geometry::BVHBuilder(m_settings.cluster_size, 8, m_jobs).build(primitives);
+        std::vector<std::vector<std::size_t>> groups;
+        for (const geometry::BVHNode& node : nodes)
+        {
+            for (std::uint32_t slot = 0; slot < node.child_count; ++slot)
+            {
+                if (node.count[slot] == 0)
+                {
+                    continue;
+                }
+                groups.emplace_back();
+                for (std::uint32_t i = node.child[slot]; i < node.child[slot] + node.count[slot]; ++i)
+                {
+                    groups.back().push_back(members[primitives[i].index]);
+                }
+            }
+        }
+        return groups;
+    }
+    /**
+    * Merge and simplify the geometry of the members of a cluster and bake
+    * their textures, or the atlases of child clusters, into one atlas
+    */
+    void build_proxy(HLOD::Cluster& cluster, const std::vector<HLOD::Cluster>& clusters) const
+    {
+        // Gather the members as pieces, child proxies included
+        std::vector<Piece> children;
+        std::vector<const Piece*> pieces;
+        std::vector<const HLOD::Image*> images;
+        std::map<std::size_t, std::size_t> tiles;
+        for (std::size_t item : cluster.items)
+        {
+            const Piece& piece = m_pieces[item];
+            pieces.push_back(&piece);
+            if (piece.image != no_hlod_image && tiles.emplace(piece.image, images.size()).second)
+            {
+                images.push_back(&m_images[piece.image]);
+            }
+        }
+        children.reserve(cluster.children.size());
+        for (std::size_t index : cluster.children)
+        {
+            const HLOD::Cluster& child = clusters[index];
+            children.push_back(to_piece(child));
+            pieces.push_back(&children.back());
+            if (!child.atlas.pixels.empty())
+            {
+                children.back().image = images.size();
+                images.push_back(&child.atlas);
+            }
+        }
+        float error = 0.0f;
+        for (std::size_t index : cluster.children)
+        {
+            error = std::max(error, clusters[index].error);
+        }
+        for (const Piece* piece : pieces)
+        {
+            cluster.bounds.expand(piece->bounds);
+        }
+        if (cluster.bounds.empty())
+        {
+            cluster.error = error;
+            return;
+        }
+
+        // Atlas of equally sized tiles, one per image, plus a white one for
+        // the untextured members as any other tile could lie under them
+        const std::size_t white_tile = images.size();
+        std::size_t tile_count = images.size();
+        if (!images.empty() && std::any_of(pieces.begin(), pieces.end(), [](const Piece* piece)
+                                           {
+                                               return piece->image == no_hlod_image;
+                                           }))
+        {
+            ++tile_count;
+        }
+        const std::size_t tile = m_settings.tile_size;
+        const auto columns = static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(tile_count))));
+        const std::size_t rows = columns > 0 ? (tile_count + columns - 1) / columns : 0;
+        if (!images.empty())
+        {
+            // Starts out white, which leaves the white tile as is
+            cluster.atlas = HLOD::Image{columns * tile, rows * tile, std::vector<unsigned char>(columns * tile * rows * tile * 3, 255)};
+            for (std::size_t i = 0; i < images.size(); ++i)
+            {
+                const HLOD::Image scaled = images[i]->width == tile && images[i]->height == tile ? *images[i] : resample(*images[i], tile);
+                const std::size_t x0 = (i % columns) * tile;
+                const std::size_t y0 = (i / columns) * tile;
+                for (std::size_t y = 0; y < tile; ++y)
+                {
+                    std::copy_n(scaled.pixels.begin() + y * tile * 3, tile * 3,
+                                cluster.atlas.pixels.begin() + ((y0 + y) * cluster.atlas.width + x0) * 3);
+                }
+            }
+        }
+
+        // Cluster vertices on a grid, keeping the tiles apart
+        const glm::vec3 extent = cluster.bounds.maximum - cluster.bounds.minimum;
+        const float cell_size = std::max(std::max(std::max(extent.x, extent.y), extent.z) / m_settings.grid_resolution, 1e-6f);
+        std::unordered_map<std::uint64_t, GLuint> cell_indices;
+        std::vector<Cell> cells;
+        std::vector<GLuint> remap;
+        std::vector<std::tuple<GLuint, GLuint, GLuint>> triangles;
+        for (const Piece* piece : pieces)
+        {
+            // Tile of the piece in the atlas, children store their tile
+            // directly as they have no entry in `m_images`
+            std::size_t tile_index = no_hlod_image;
+            if (piece->image != no_hlod_image)
+            {
+                tile_index = piece->wrap ? tiles.at(piece->image) : piece->image;
+            }
+            else if (!images.empty())
+            {
+                tile_index = white_tile;
+            }
+            const float inset = 0.5f / tile;
+            remap.resize(piece->positions.size());
+            for (std::size_t v = 0; v < piece->positions.size(); ++v)
+            {
+                const std::uint64_t key = cluster_key(piece->positions[v], cluster.bounds.minimum, cell_size, 16) |
+                                          static_cast<std::uint64_t>(tile_index & 0xffff) << 48;
+                const auto inserted = cell_indices.emplace(key, static_cast<GLuint>(cells.size()));
+                if (inserted.second)
+                {
+                    cells.push_back(Cell{glm::vec3(0.0f), glm::vec3(0.0f), glm::vec2(0.0f), 0.0f});
+                }
+                remap[v] = inserted.first->second;
+                glm::vec2 uv(0.5f);
+                if (tile_index != no_hlod_image)
+                {
+                    glm::vec2 local(0.5f);
+                    if (tile_index != white_tile)
+                    {
+                        local = piece->uvs[v];
+                        local = piece->wrap ? local - glm::floor(local) : glm::clamp(local, glm::vec2(0.0f), glm::vec2(1.0f));
+                        local = glm::vec2(inset) + local * (1.0f - 2.0f * inset);
+                    }
+                    uv = glm::vec2((tile_index % columns + local.x) / columns, (tile_index / columns + local.y) / rows);
+                }
+                Cell& cell = cells[remap[v]];
+                cell.position += piece->positions[v];
+                cell.normal += piece->normals[v];
+                cell.uv += uv;
+                cell.count += 1.0f;
+            }
+            for (std::size_t i = 0; i + 2 < piece->indices.size(); i += 3)
+            {
+                triangles.emplace_back(remap[piece->indices[i]],
+                                       remap[piece->indices[i + 1]],
+                                       remap[piece->indices[i + 2]]);
+            }
+        }
+        // Drop triangles collapsed onto the same cells, whatever their order
+        append_unique_triangles(triangles, cluster.indices);
+        for (const Cell& cell : cells)
+        {
+            const glm::vec3 position = cell.position / cell.count;
+            const float length = glm::length(cell.normal);
+            const glm::vec3 normal = length > 0.0f ? cell.normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+            const glm::vec2 uv = cell.uv / cell.count;
+            cluster.vertices.insert(cluster.vertices.end(), {position.x, position.y, position.z,
+                                                             normal.x, normal.y, normal.z,
+                                                             uv.x, uv.y});
+        }
+        cluster.error = std::max(error, cell_size * std::sqrt(3.0f));
+    }
+    /**
+    * Return the proxy geometry of a child cluster as a piece
+    */
+    static Piece to_piece(const HLOD::Cluster& cluster)
+    {
+        Piece piece;
+        for (std::size_t i = 0; i + 7 < cluster.vertices.size(); i += 8)
+        {
+            const GLfloat* vertex = cluster.vertices.data() + i;
+            piece.positions.emplace_back(vertex[0], vertex[1], vertex[2]);
+            piece.normals.emplace_back(vertex[3], vertex[4], vertex[5]);
+            piece.uvs.emplace_back(vertex[6], vertex[7]);
+        }
+        piece.indices = cluster.indices;
+        piece.bounds = cluster.bounds;
+        piece.image = no_hlod_image;
+        piece.wrap = false;
+        return piece;
+    }
+private:
+    HLODSettings m_settings;
+    jobs::JobSystem* m_jobs;
+    std::vector<Piece> m_pieces;
+    // Tile sized copies of the source textures
+    std::vector<HLOD::Image> m_images;
+    std::unordered_map<const void*, std::size_t> m_image_indices;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
@@ -0,0 +1,779 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace jobs
+{
+
+
+class JobSystem;
+
+
+/**
+* Lock-free single owner, multiple thief work-stealing deque
+*
+* Implements the Chase-Lev deque as formalized for weak memory models by Lê et
+* al. The owner thread pushes and pops at the bottom, while any other thread
+* may steal from the top. All synchronization is expressed through atomic
+* operations rather than standalone fences, so that ThreadSanitizer can
+* reason about it.
+*/
+template <class T>
+class WorkStealingDeque
+{
+public:
+    // `capacity` must be a power of two
+    explicit WorkStealingDeque(std::size_t capacity = 256) : m_top(0),
+                                                             m_bottom(0),
+                                                             m_array(nullptr)
+    {
+        m_arrays.emplace_back(new Array(capacity));
+        m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    // Non-copyable, non-movable, thieves hold references to it
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    /**
+    * Push an item to the bottom of the deque, owner thread only
+    */
+    void push(T item)
+    {
+        const std::int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        const std::int64_t top = m_top.load(std::memory_order_acquire);
+        Array* array = m_array.load(std::memory_order_relaxed);
+        if (bottom - top > static_cast<std::int64_t>(array->capacity) - 1)
+        {
+            array = grow(array, top, bottom);
+        }
+        array->put(bottom, item);
+        m_bottom.store(bottom + 1, std::memory_order_release);
+    }
+    /**
+    * Pop an item from the bottom of the deque, owner thread only
+    *
+    * @return whether an item was retrieved
+    */
+    bool pop(T& item)
+    {
+        const std::int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* array = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(bottom, std::memory_order_seq_cst);
+        std::int64_t top = m_top.load(std::memory_order_seq_cst);
+        if (top > bottom)
+        {
+            // Deque was empty
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return false;
+        }
+        item = array->get(bottom);
+        if (top == bottom)
+        {
+            // Last item, race against thieves for it
+            const bool won = m_top.compare_exchange_strong(top,
+                                                           top + 1,
+                                                           std::memory_order_seq_cst,
+                                                           std::memory_order_relaxed);
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+    /**
+    * Steal an item from the top of the deque, any thread
+    *
+    * @return whether an item was retrieved, fails spuriously under contention
+    */
+    bool steal(T& item)
+    {
+        std::int64_t top = m_top.load(std::memory_order_seq_cst);
+        const std::int64_t bottom = m_bottom.load(std::memory_order_seq_cst);
+        if (top >= bottom)
+        {
+            return false;
+        }
+        Array* array = m_array.load(std::memory_order_acquire);
+        T stolen = array->get(top);
+        if (!m_top.compare_exchange_strong(top,
+                                           top + 1,
+                                           std::memory_order_seq_cst,
+                                           std::memory_order_relaxed))
+        {
+            return false;
+        }
+        item = stolen;
+        return true;
+    }
+    /**
+    * Return an estimate of the number of items in the deque
+    */
+    std::size_t size() const noexcept
+    {
+        const std::int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        const std::int64_t top = m_top.load(std::memory_order_relaxed);
+        return bottom > top ? static_cast<std::size_t>(bottom - top) : 0;
+    }
+private:
+    struct Array
+    {
+        explicit Array(std::size_t size) : capacity(size),
+                                           items(new std::atomic<T>[size])
+        {
+        }
+        T get(std::int64_t index) const noexcept
+        {
+            return items[index & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void put(std::int64_t index, T item) noexcept
+        {
+            items[index & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+
+        const std::size_t capacity;
+        std::unique_ptr<std::atomic<T>[]> items;
+    };
+
+    Array* grow(Array* array, std::int64_t top, std::int64_t bottom)
+    {
+        // Retired arrays are kept alive until destruction, as a thief might
+        // still be reading from them
+        m_arrays.emplace_back(new Array(array->capacity * 2));
+        Array* grown = m_arrays.back().get();
+        for (std::int64_t i = top; i < bottom; ++i)
+        {
+            grown->put(i, array->get(i));
+        }
+        m_array.store(grown, std::memory_order_release);
+        return grown;
+    }
+private:
+    std::atomic<std::int64_t> m_top;
+    std::atomic<std::int64_t> m_bottom;
+    std::atomic<Array*> m_array;
+    std::vector<std::unique_ptr<Array>> m_arrays;
+};
+
+
+struct Job;
+
+
+/**
+* Tracks the completion of a group of jobs
+*
+* Every job scheduled with a counter increments it, and decrements it when
+* finished. Jobs scheduled with `JobSystem::run_after` on a counter are held
+* back until it reaches zero. The first exception thrown by one of its jobs is
+* kept and rethrown by `JobSystem::wait`, the remaining jobs still run.
+*/
+class Counter
+{
+public:
+    Counter() : m_pending(0)
+    {
+    }
+
+    // Non-copyable, non-movable, jobs hold pointers to it
+    Counter(const Counter&) = delete;
+    Counter& operator=(const Counter&) = delete;
+
+    /**
+    * Return whether all jobs tracked by this counter are finished
+    */
+    bool done() const
+    {
+        if (m_pending.load(std::memory_order_acquire) != 0)
+        {
+            return false;
+        }
+        // The last job decrements while holding the lock, so acquiring it
+        // ensures that job stopped touching the counter and it's safe to
+        // destroy it
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pending.load(std::memory_order_relaxed) == 0;
+    }
+private:
+    friend class JobSystem;
+
+    std::atomic<int> m_pending;
+    mutable std::mutex m_mutex;
+    std::vector<Job*> m_dependents;
+    std::exception_ptr m_exception;
+};
+
+
+struct Job
+{
+    std::function<void()> function;
+    Counter* counter;
+    bool pinned;
+};
+
+
+struct WorkerStats
+{
+    std::size_t jobs_executed;
+    std::size_t jobs_stolen;
+    std::size_t failed_steals;
+    std::chrono::nanoseconds busy_time;
+    // Fraction of the time since the job system started spent running jobs
+    float utilization;
+};
+
+
+struct Stats
+{
+    std::chrono::nanoseconds elapsed;
+    // Index 0 is the thread that created the job system, usually the thread
+    // owning the OpenGL context
+    std::vector<WorkerStats> workers;
+};
+
+
+/**
+* Work-stealing job system
+*
+* Each worker thread owns a `WorkStealingDeque` it pushes newly spawned jobs
+* to and pops from, idle workers steal from the others. The thread creating
+* the job system takes part as worker 0 whenever it waits on a counter, and is
+* the only one executing pinned jobs, so it should be the thread owning the
+* OpenGL context.
+*/
+class JobSystem
+{
+public:
+    /**
+    * Constructor
+    * Start the worker threads
+    *
+    * @param worker_count is the number of background threads to spawn, in
+    *        addition to the calling thread
+    */
+    explicit JobSystem(std::size_t worker_count = default_worker_count()) : m_stopping(false),
+                                                                            m_queued(0),
+                                                                            m_sleeping(0),
+                                                                            m_start(std::chrono::steady_clock::now())
+    {
+        for (std::size_t i = 0; i < worker_count + 1; ++i)
+        {
+            m_workers.emplace_back(new Worker());
+        }
+        bind_current_thread(0);
+        for (std::size_t i = 1; i < m_workers.size(); ++i)
+        {
+            m_workers[i]->thread = std::thread(&JobSystem::worker_loop, this, i);
+        }
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_stopping.store(true);
+        }
+        m_sleep_condition.notify_all();
+        for (std::size_t i = 1; i < m_workers.size(); ++i)
+        {
+            m_workers[i]->thread.join();
+        }
+        // Release jobs nobody got to run
+        Job* job = nullptr;
+        for (auto& worker : m_workers)
+        {
+            while (worker->deque.steal(job))
+            {
+                delete job;
+            }
+        }
+        for (Job* pending : m_injected)
+        {
+            delete pending;
+        }
+        for (Job* pending : m_pinned)
+        {
+            delete pending;
+        }
+        if (current().system == this)
+        {
+            current() = ThreadBinding{nullptr, 0};
+        }
+    }
+
+    // Non-copyable, non-movable, worker threads hold a pointer to it
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    static std::size_t default_worker_count()
+    {
+        const std::size_t hardware = std::thread::hardware_concurrency();
+        return hardware > 1 ? hardware - 1 : 1;
+    }
+    /**
+    * Schedule a job on any worker
+    *
+    * @param function is the work to perform
+    * @param counter is incremented now and decremented once the job finished
+    */
+    void run(std::function<void()> function, Counter* counter = nullptr)
+    {
+        schedule(make_job(std::move(function), counter, false));
+    }
+    /**
+    * Schedule a job on the thread that created the job system, it's executed
+    * from `run_pinned_jobs` or while that thread waits on a counter
+    */
+    void run_pinned(std::function<void()> function, Counter* counter = nullptr)
+    {
+        schedule(make_job(std::move(function), counter, true));
+    }
+    /**
+    * Schedule a job to run once all jobs tracked by `dependency` finished
+    *
+    * @param dependency is the counter that has to reach zero first
+    * @param function is the work to perform
+    * @param counter is incremented now and decremented once the job finished
+    * @param pinned indicates whether the job must run on the main thread
+    */
+    void run_after(Counter& dependency,
+                   std::function<void()> function,
+                   Counter* counter = nullptr,
+                   bool pinned = false)
+    {
+        Job* job = make_job(std::move(function), counter, pinned);
+        {
+            std::lock_guard<std::mutex> lock(dependency.m_mutex);
+            if (dependency.m_pending.load(std::memory_order_acquire) > 0)
+            {
+                dependency.m_dependents.push_back(job);
+                return;
+            }
+        }
+        schedule(job);
+    }
+    /**
+    * Execute all pinned jobs queued so far, must be called on the thread that
+    * created the job system, typically once per frame
+    *
+    * @return number of jobs executed
+    */
+    std::size_t run_pinned_jobs()
+    {
+        std::vector<Job*> jobs;
+        {
+            std::lock_guard<std::mutex> lock(m_pinned_mutex);
+            jobs.swap(m_pinned);
+        }
+        for (Job* job : jobs)
+        {
+            execute(job, 0);
+        }
+        return jobs.size();
+    }
+    /**
+    * Block until all jobs tracked by the counter finished, executing other
+    * jobs in the meantime instead of idling
+    *
+    * Rethrows the first exception thrown by one of those jobs, which clears
+    * it from the counter
+    */
+    void wait(Counter& counter)
+    {
+        wait_until([&counter]()
+                   {
+                       return counter.done();
+                   });
+        std::exception_ptr exception;
+        {
+            std::lock_guard<std::mutex> lock(counter.m_mutex);
+            exception.swap(counter.m_exception);
+        }
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+    }
+    /**
+    * Block until the predicate returns true, executing other jobs in the
+    * meantime instead of idling
+    */
+    template <class TPredicate>
+    void wait_until(TPredicate&& predicate)
+    {
+        const std::size_t index = current_index();
+        while (!predicate())
+        {
+            if (index == 0)
+            {
+                run_pinned_jobs();
+            }
+            Job* job = find_job(index);
+            if (job)
+            {
+                execute(job, index);
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+    /**
+    * Invoke `function(i)` for every `i` in `[begin, end)` in parallel and
+    * return once all invocations finished
+    *
+    * The range is split lazily: a job only splits off the upper half of its
+    * remaining range while its worker's deque is empty, which means the
+    * previously split work got stolen and other workers are hungry. Balanced
+    * loops end up with few large jobs, unbalanced ones keep splitting.
+    *
+    * @param min_grain is the smallest number of iterations run as one unit
+    */
+    template <class TFunction>
+    void parallel_for(std::size_t begin, std::size_t end, TFunction&& function, std::size_t min_grain = 1)
+    {
+        if (begin >= end)
+        {
+            return;
+        }
+        const std::size_t count = end - begin;
+        const std::size_t grain = std::max<std::size_t>(std::max<std::size_t>(min_grain, 1),
+                                                        count / (m_workers.size() * 8));
+        if (count <= grain || m_workers.size() == 1)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                function(i);
+            }
+            return;
+        }
+        Counter counter;
+        run_range(begin, end, grain, function, counter);
+        wait(counter);
+    }
+    /**
+    * Return the number of threads executing jobs, including the main thread
+    */
+    std::size_t get_thread_count() const noexcept
+    {
+        return m_workers.size();
+    }
+    /**
+    * Return the index of the calling thread among the threads executing
+    * jobs, the one that created the job system being 0, or the number of
+    * threads for threads outside of the job system
+    */
+    std::size_t get_thread_index() const
+    {
+        return current_index();
+    }
+    /**
+    * Return a snapshot of per-thread utilization statistics
+    */
+    Stats get_stats() const
+    {
+        Stats stats;
+        stats.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+        for (const auto& worker : m_workers)
+        {
+            WorkerStats worker_stats;
+            worker_stats.jobs_executed = worker->jobs_executed.load(std::memory_order_relaxed);
+            worker_stats.jobs_stolen = worker->jobs_stolen.load(std::memory_order_relaxed);
+            worker_stats.failed_steals = worker->failed_steals.load(std::memory_order_relaxed);
+            worker_stats.busy_time = std::chrono::nanoseconds(worker->busy_time.load(std::memory_order_relaxed));
+            worker_stats.utilization = stats.elapsed.count() > 0 ?
+                                       static_cast<float>(worker_stats.busy_time.count()) / stats.elapsed.count() :
+                                       0.0f;
+            stats.workers.push_back(worker_stats);
+        }
+        return stats;
+    }
+private:
+    struct Worker
+    {
+        Worker() : jobs_executed(0),
+                   jobs_stolen(0),
+                   failed_steals(0),
+                   busy_time(0)
+        {
+        }
+
+        WorkStealingDeque<Job*> deque;
+        std::thread thread;
+        std::atomic<std::size_t> jobs_executed;
+        std::atomic<std::size_t> jobs_stolen;
+        std::atomic<std::size_t> failed_steals;
+        std::atomic<std::int64_t> busy_time;
+    };
+
+    struct ThreadBinding
+    {
+        JobSystem* system;
+        std::size_t index;
+    };
+
+    static ThreadBinding& current()
+    {
+        static thread_local ThreadBinding binding{nullptr, 0};
+        return binding;
+    }
+
+    void bind_current_thread(std::size_t index)
+    {
+        current() = ThreadBinding{this, index};
+    }
+    /**
+    * Return the worker index of the calling thread, or the number of workers
+    * for threads that are not part of this job system
+    */
+    std::size_t current_index() const
+    {
+        const ThreadBinding& binding = current();
+        return binding.system == this ? binding.index : m_workers.size();
+    }
+
+    Job* make_job(std::function<void()> function, Counter* counter, bool pinned)
+    {
+        if (counter)
+        {
+            counter->m_pending.fetch_add(1, std::memory_order_relaxed);
+        }
+        return new Job{std::move(function), counter, pinned};
+    }
+
+    void schedule(Job* job)
+    {
+        if (job->pinned)
+        {
+            std::lock_guard<std::mutex> lock(m_pinned_mutex);
+            m_pinned.push_back(job);
+            return;
+        }
+        const std::size_t index = current_index();
+        if (index < m_workers.size())
+        {
+            m_workers[index]->deque.push(job);
+        }
+        else
+        {
+            // Foreign threads cannot push to a deque they don't own
+            std::lock_guard<std::mutex> lock(m_injected_mutex);
+            m_injected.push_back(job);
+        }
+        m_queued.fetch_add(1, std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_seq_cst) > 0)
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_sleep_condition.notify_one();
+        }
+    }
+
+    Job* find_job(std::size_t index)
+    {
+        Job* job = nullptr;
+        if (index < m_workers.size() && m_workers[index]->deque.pop(job))
+        {
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            return job;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_injected_mutex);
+            if (!m_injected.empty())
+            {
+                job = m_injected.front();
+                m_injected.pop_front();
+                m_queued.fetch_sub(1, std::memory_order_relaxed);
+                return job;
+            }
+        }
+        // Start stealing at a different victim on every thread to spread
+        // contention
+        const std::size_t count = m_workers.size();
+        for (std::size_t i = 1; i < count; ++i)
+        {
+            const std::size_t victim = (index + i) % count;
+            if (m_workers[victim]->deque.steal(job))
+            {
+                m_queued.fetch_sub(1, std::memory_order_relaxed);
+                if (index < count)
+                {
+                    m_workers[index]->jobs_stolen.fetch_add(1, std::memory_order_relaxed);
+                }
+                return job;
+            }
+            if (index < count)
+            {
+                m_workers[index]->failed_steals.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        return nullptr;
+    }
+
+    void execute(Job* job, std::size_t index)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::exception_ptr exception;
+        try
+        {
+            job->function();
+        }
+        catch (...)
+        {
+            // Escaping the worker would terminate the program, and leave the
+            // counter pending forever. Exceptions of jobs without a counter
+            // have nobody to report to and are dropped.
+            exception = std::current_exception();
+        }
+        const auto duration = std::chrono::steady_clock::now() - start;
+        if (index < m_workers.size())
+        {
+            Worker& worker = *m_workers[index];
+            worker.jobs_executed.fetch_add(1, std::memory_order_relaxed);
+            worker.busy_time.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+                                       std::memory_order_relaxed);
+        }
+        Counter* counter = job->counter;
+        delete job;
+        if (counter)
+        {
+            finish(*counter, exception);
+        }
+    }
+
+    void finish(Counter& counter, const std::exception_ptr& exception)
+    {
+        std::vector<Job*> dependents;
+        {
+            // Decrement under the lock so `run_after` never observes a
+            // non-zero count after the dependents were released
+            std::lock_guard<std::mutex> lock(counter.m_mutex);
+            if (exception && !counter.m_exception)
+            {
+                counter.m_exception = exception;
+            }
+            if (counter.m_pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            {
+                return;
+            }
+            dependents.swap(counter.m_dependents);
+        }
+        for (Job* dependent : dependents)
+        {
+            schedule(dependent);
+        }
+    }
+
+    template <class TFunction>
+    void run_range(std::size_t begin, std::size_t end, std::size_t grain, TFunction& function, Counter& counter)
+    {
+        run([this, begin, end, grain, &function, &counter]()
+            {
+                std::size_t first = begin;
+                std::size_t last = end;
+                const std::size_t index = current_index();
+                while (first < last)
+                {
+                    if (last - first >= 2 * grain &&
+                        index < m_workers.size() &&
+                        m_workers[index]->deque.size() == 0)
+                    {
+                        const std::size_t middle = first + (last - first) / 2;
+                        run_range(middle, last, grain, function, counter);
+                        last = middle;
+                    }
+                    const std::size_t chunk_end = std::min(last, first + grain);
+                    for (std::size_t i = first; i < chunk_end; ++i)
+                    {
+                        function(i);
+                    }
+                    first = chunk_end;
+                }
+            },
+            &counter);
+    }
+
+    void worker_loop(std::size_t index)
+    {
+        bind_current_thread(index);
+        while (true)
+        {
+            Job* job = find_job(index);
+            if (job)
+            {
+                execute(job, index);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_sleeping.fetch_add(1, std::memory_order_seq_cst);
+            m_sleep_condition.wait(lock, [this]()
+                                   {
+                                       return m_stopping.load() || m_queued.load(std::memory_order_seq_cst) > 0;
+                                   });
+            m_sleeping.fetch_sub(1, std::memory_order_seq_cst);
+            if (m_stopping.load())
+            {
+                return;
+            }
+        }
+    }
+private:
+    std::vector<std::unique_ptr<Worker>> m_workers;
+
+    std::mutex m_injected_mutex;
+    std::deque<Job*> m_injected;
+
+    std::mutex m_pinned_mutex;
+    std::vector<Job*> m_pinned;
+
+    std::atomic<bool> m_stopping;
+    std::atomic<std::int64_t> m_queued;
+    std::atomic<int> m_sleeping;
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_sleep_condition;
+
+    const std::chrono::steady_clock::time_point m_start;
+};
+
+
+/**
+* Run `function(i)` for every `i` in `[begin, end)`, in parallel on the job
+* system if one is given, serially otherwise
+*/
+template <class TFunction>
+void parallel_for(JobSystem* jobs, std::size_t begin, std::size_t end, TFunction&& function, std::size_t min_grain = 1)
+{
+    if (jobs)
+    {
+        jobs->parallel_for(begin, end, std::forward<TFunction>(function), min_grain);
+    }
+    else
+    {
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            function(i);
+        }
+    }
+}
+
+
+}  // namespace jobs
+
+
+}  // namespace crudegl
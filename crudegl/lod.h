@@ -0,0 +1,426 @@
+#pragma once
+
+#include "bounds.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+/**
+* Range of the index buffer of a mesh drawing one level of detail
+*/
+struct LODLevel
+{
+    std::size_t first_index;
+    std::size_t index_count;
+    // Largest distance between this level and the full detail surface
+    float error;
+};
+
+
+// Whether meshes of this type can hold levels of detail
+template <class TMesh, class = void>
+struct has_lods : std::false_type
+{
+};
+
+
+template <class TMesh>
+struct has_lods<TMesh, decltype(std::declval<TMesh&>().set_lods(std::vector<LODLevel>()))> : std::true_type
+{
+};
+
+
+/**
+* Return the key of the grid cell containing a position
+*
+* @param origin is the minimum corner of the grid
+* @param bits is the number of bits per axis, cells beyond the last one are
+*        clamped to it, at most 21
+*/
+inline std::uint64_t cluster_key(const glm::vec3& position, const glm::vec3& origin, float cell_size, unsigned bits)
+{
+    const float last = static_cast<float>((std::uint64_t(1) << bits) - 1);
+    const glm::vec3 grid = (position - origin) / cell_size;
+    const auto x = static_cast<std::uint64_t>(std::min(grid.x, last));
+    const auto y = static_cast<std::uint64_t>(std::min(grid.y, last));
+    const auto z = static_cast<std::uint64_t>(std::min(grid.z, last));
+    return x | y << bits | z << (2 * bits);
+}
+
+
+/**
+* Map every vertex to the first vertex sharing its grid cell
+*/
+template <class TPositionAllocator>
+void cluster_vertices(const std::vector<glm::vec3, TPositionAllocator>& positions,
+                      const glm::vec3& origin,
+                      float cell_size,
+                      std::vector<GLuint>& representative)
+{
+    std::unordered_map<std::uint64_t, GLuint> cells;
+    representative.resize(positions.size());
+    for (std::size_t i = 0; i < positions.size(); ++i)
+    {
+        const std::uint64_t key = cluster_key(positions[i], origin, cell_size, 21);
+        representative[i] = cells.emplace(key, static_cast<GLuint>(i)).first->second;
+    }
+}
+
+
+/**
+* Append the indices of triangles to a list, dropping collapsed triangles and
+* all but the first of triangles sharing the same corners, whatever their
+* order
+*
+* @return number of indices appended
+*/
+template <class TIndexAllocator>
+std::size_t append_unique_triangles(const std::vector<std::tuple<GLuint, GLuint, GLuint>>& triangles,
+                                    std::vector<GLuint, TIndexAllocator>& indices)
+{
+    std::vector<std::tuple<GLuint, GLuint, GLuint>> sorted;
+    std::vector<std::size_t> order;
+    for (std::size_t i = 0; i < triangles.size(); ++i)
+    {
+        GLuint corners[3] = {std::get<0>(triangles[i]), std::get<1>(triangles[i]), std::get<2>(triangles[i])};
+        if (corners[0] == corners[1] || corners[1] == corners[2] || corners[0] == corners[2])
+        {
+            continue;
+        }
+        std::sort(corners, corners + 3);
+        sorted.emplace_back(corners[0], corners[1], corners[2]);
+        order.push_back(i);
+    }
+    std::vector<std::size_t> ranks(order.size());
+    for (std::size_t i = 0; i < ranks.size(); ++i)
+    {
+        ranks[i] = i;
+    }
+    std::stable_sort(ranks.begin(), ranks.end(), [&](std::size_t lhs, std::size_t rhs)
+                     {
+                         return sorted[lhs] < sorted[rhs];
+                     });
+    const std::size_t first = indices.size();
+    for (std::size_t i = 0; i < ranks.size(); ++i)
+    {
+        if (i > 0 && sorted[ranks[i]] == sorted[ranks[i - 1]])
+        {
+            continue;
+        }
+        const auto& triangle = triangles[order[ranks[i]]];
+        indices.insert(indices.end(), {std::get<0>(triangle), std::get<1>(triangle), std::get<2>(triangle)});
+    }
+    return indices.size() - first;
+}
+
+
+/**
+* Append coarser versions of a triangle list to it and return the ranges of
+* all levels, the full detail one first
+*
+* Levels are simplified by clustering vertices on grids halving in resolution
+* from level to level, each cell keeping the first of its vertices, so all
+* levels share the vertices of the mesh. A grid that would not remove at least
+* a quarter of the triangles of the previous level is skipped in favor of the
+* next coarser one. Stops once a grid collapses every triangle, or the
+* resolution runs out.
+*
+* @param indices are three indices into `positions` per triangle
+* @param level_count is the largest number of levels, the full detail one
+*        included
+* @param resolution is the number of cells along the longest side of the
+*        bounds for the first simplified level
+*/
+template <class TPositionAllocator, class TIndexAllocator>
+std::vector<LODLevel> build_lods(const std::vector<glm::vec3, TPositionAllocator>& positions,
+                                 std::vector<GLuint, TIndexAllocator>& indices,
+                                 std::size_t level_count,
+                                 std::size_t resolution = 64)
+{
+    std::vector<LODLevel> levels{LODLevel{0, indices.size(), 0.0f}};
+    geometry::BoundingBox bounds;
+    for (const glm::vec3& position : positions)
+    {
+        bounds.expand(position);
+    }
+    if (bounds.empty() || indices.empty())
+    {
+        return levels;
+    }
+    const glm::vec3 extent = bounds.maximum - bounds.minimum;
+    const float longest = std::max(std::max(extent.x, extent.y), extent.z);
+
+    std::vector<GLuint> representative;
+    std::vector<std::tuple<GLuint, GLuint, GLuint>> triangles;
+    for (; levels.size() < level_count && resolution > 0; resolution /= 2)
+    {
+        const float cell_size = std::max(longest / resolution, 1e-6f);
+        cluster_vertices(positions, bounds.minimum, cell_size, representative);
+
+        // Simplify the previous level
+        const LODLevel& previous = levels.back();
+        triangles.clear();
+        for (std::size_t i = previous.first_index; i + 2 < previous.first_index + previous.index_count; i += 3)
+        {
+            triangles.emplace_back(representative[indices[i]],
+                                   representative[indices[i + 1]],
+                                   representative[indices[i + 2]]);
+        }
+        const std::size_t first = indices.size();
+        const std::size_t count = append_unique_triangles(triangles, indices);
+        if (count == 0 || count * 4 > previous.index_count * 3)
+        {
+            indices.resize(first);
+            if (count == 0)
+            {
+                break;
+            }
+            continue;
+        }
+        levels.push_back(LODLevel{first, count, cell_size * std::sqrt(3.0f)});
+    }
+    return levels;
+}
+
+
+/**
+* Measures the GPU time of frames with timer queries, reading results a few
+* frames late so the CPU never waits for them
+*/
+class GPUTimer
+{
+public:
+    enum
+    {
+        latency = 4
+    };
+
+    GPUTimer() : m_frame(0), m_milliseconds(0.0f), m_pending{}
+    {
+        glGenQueries(latency, m_queries);
+    }
+    ~GPUTimer()
+    {
+        glDeleteQueries(latency, m_queries);
+    }
+
+    // Owns OpenGL objects
+    GPUTimer(const GPUTimer&) = delete;
+    GPUTimer& operator=(const GPUTimer&) = delete;
+
+    void begin_frame()
+    {
+        const std::size_t slot = m_frame % latency;
+        if (m_pending[slot])
+        {
+            // Only reached if the result isn't back after `latency` frames,
+            // which drivers practically never allow to happen
+            collect(slot);
+        }
+        glBeginQuery(GL_TIME_ELAPSED, m_queries[slot]);
+    }
+    /**
+    * End the measurement of the frame and collect every result available
+    * @return whether a new result was collected
+    */
+    bool end_frame()
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        m_pending[m_frame % latency] = true;
+        ++m_frame;
+        bool collected = false;
+        for (std::size_t slot = 0; slot < latency; ++slot)
+        {
+            if (!m_pending[slot])
+            {
+                continue;
+            }
+            GLuint available = 0;
+            glGetQueryObjectuiv(m_queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available)
+            {
+                collect(slot);
+                collected = true;
+            }
+        }
+        return collected;
+    }
+    /**
+    * Return the GPU time of the latest frame measured, in milliseconds
+    */
+    float get_milliseconds() const noexcept
+    {
+        return m_milliseconds;
+    }
+private:
+    void collect(std::size_t slot)
+    {
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(m_queries[slot], GL_QUERY_RESULT, &nanoseconds);
+        m_milliseconds = static_cast<float>(nanoseconds) * 1e-6f;
+        m_pending[slot] = false;
+    }
+private:
+    std::size_t m_frame;
+    float m_milliseconds;
+    GLuint m_queries[latency];
+    bool m_pending[latency];
+};
+
+
+struct LODSettings
+{
+    // Largest projected error in pixels, adjusted by `LODController::adapt`
+    float pixel_error;
+    // Fraction of the threshold the projected error has to move past to
+    // switch levels, avoiding flicker around the threshold
+    float hysteresis;
+    // Instances with a projected diameter below this many pixels always use
+    // their coarsest level
+    float min_pixel_size;
+    // Range `pixel_error` is kept within when adapting
+    float min_pixel_error;
+    float max_pixel_error;
+};
+
+
+/**
+* Picks a level of detail per mesh instance from its projected error, and
+* steers the error threshold towards a GPU frame time target
+*/
+class LODController
+{
+public:
+    explicit LODController(const LODSettings& settings = LODSettings{1.0f, 0.15f, 2.0f, 0.5f, 16.0f})
+        : m_settings(settings),
+          m_average_milliseconds(0.0f)
+    {
+    }
+    /**
+    * Add an instance of a mesh with the given levels
+    * @return a handle used to update the instance and get it's level
+    */
+    std::size_t add(const std::vector<LODLevel>& levels, const geometry::Sphere& bounds)
+    {
+        Instance instance{&levels, bounds, 0};
+        m_instances.push_back(instance);
+        return m_instances.size() - 1;
+    }
+    /**
+    * Move an instance, with `bounds` in world space
+    */
+    void set_bounds(std::size_t instance, const geometry::Sphere& bounds)
+    {
+        m_instances[instance].bounds = bounds;
+    }
+    /**
+    * Choose the level of every instance for a camera at `eye`
+    * @param error_scale converts a world space error at unit distance into
+    *        pixels, the viewport height over twice the tangent of half the
+    *        vertical field of view for a perspective projection
+    */
+    void update(const glm::vec3& eye, float error_scale)
+    {
+        for (Instance& instance : m_instances)
+        {
+            if (!instance.levels->empty())
+            {
+                instance.level = select(*instance.levels, instance.bounds, instance.level, eye, error_scale);
+            }
+        }
+    }
+    /**
+    * Return the level of a mesh with the given levels for a camera at `eye`,
+    * the way `update` does for the instances of the controller, for callers
+    * keeping instances of their own
+    * @param bounds are the bounds of the mesh in world space
+    * @param current is the level of the last frame, only left once the
+    *        projected error moves past the hysteresis
+    */
+    std::size_t select(const std::vector<LODLevel>& levels, const geometry::Sphere& bounds, std::size_t current,
+                       const glm::vec3& eye, float error_scale) const
+    {
+        const float distance = std::max(glm::length(bounds.center - eye) - bounds.radius, 1e-4f);
+        const float pixels = error_scale / distance;
+        if (2.0f * bounds.radius * pixels < m_settings.min_pixel_size)
+        {
+            return levels.size() - 1;
+        }
+        const float coarser = m_settings.pixel_error * (1.0f - m_settings.hysteresis);
+        const float finer = m_settings.pixel_error * (1.0f + m_settings.hysteresis);
+        std::size_t level = std::min(current, levels.size() - 1);
+        while (level > 0 && levels[level].error * pixels > finer)
+        {
+            --level;
+        }
+        while (level + 1 < levels.size() && levels[level + 1].error * pixels <= coarser)
+        {
+            ++level;
+        }
+        return level;
+    }
+    /**
+    * Scale the error threshold towards reaching `target_milliseconds` of
+    * GPU time per frame, from the frame times measured by a `GPUTimer`
+    */
+    void adapt(float measured_milliseconds, float target_milliseconds, float gain = 0.25f)
+    {
+        // Smooth out single slow frames, but follow sustained load quickly
+        m_average_milliseconds = m_average_milliseconds > 0.0f ?
+            m_average_milliseconds + 0.3f * (measured_milliseconds - m_average_milliseconds) :
+            measured_milliseconds;
+        const float ratio = (m_average_milliseconds - target_milliseconds) / target_milliseconds;
+        const float scale = std::min(std::max(1.0f + gain * ratio, 0.5f), 2.0f);
+        m_settings.pixel_error = std::min(std::max(m_settings.pixel_error * scale, m_settings.min_pixel_error),
+                                          m_settings.max_pixel_error);
+    }
+    std::size_t get_level(std::size_t instance) const
+    {
+        return m_instances[instance].level;
+    }
+    float get_pixel_error() const noexcept
+    {
+        return m_settings.pixel_error;
+    }
+    std::size_t size() const noexcept
+    {
+        return m_instances.size();
+    }
+private:
+    struct Instance
+    {
+        // Levels of the mesh, which outlives the instance
+        const std::vector<LODLevel>* levels;
+        geometry::Sphere bounds;
+        std::size_t level;
+    };
+
+    LODSettings m_settings;
+    float m_average_milliseconds;
+    std::vector<Instance> m_instances;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
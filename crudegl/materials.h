@@ -0,0 +1,312 @@
+#pragma once
+
+#include "programs.h"
+#include "textures.h"
+
+#include <assimp/material.h>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+// Index of a material within a `MaterialLibrary`, and of it's parameters
+// within the material buffer
+using MaterialHandle = GLuint;
+// Index of a texture within a `MaterialLibrary`, or `no_texture`
+using TextureHandle = GLint;
+
+
+constexpr MaterialHandle no_material = static_cast<MaterialHandle>(-1);
+constexpr TextureHandle no_texture = -1;
+
+
+// Shader storage buffer binding point of the material buffer, clear of the
+// ones used for skinning, vertex pulling and per-draw data
+enum MaterialBinding
+{
+    material_binding = 7
+};
+
+
+/**
+* Parameters of a material, laid out as `Material` of `materials_glsl` under
+* std430
+*/
+struct MaterialParameters
+{
+    // Diffuse color, with the opacity in `w`
+    glm::vec4 diffuse;
+    // Specular color, with the shininess in `w`
+    glm::vec4 specular;
+    glm::vec4 emissive;
+    TextureHandle diffuse_texture;
+    TextureHandle specular_texture;
+    GLint padding[2];
+};
+
+
+static_assert(sizeof(MaterialParameters) == 64, "MaterialParameters must match the std430 layout of materials_glsl");
+
+
+/**
+* GLSL declarations of the material buffer, indexed by `DrawData::material`
+* or by a uniform. Paste them after the version directive of a `#version 430`
+* shader.
+*/
+const char* const materials_glsl = R"glsl(
+struct Material
+{
+    vec4 diffuse;
+    vec4 specular;
+    vec4 emissive;
+    int diffuse_texture;
+    int specular_texture;
+};
+
+layout (std430, binding = 7) readonly buffer Materials
+{
+    Material materials[];
+};
+)glsl";
+
+
+/**
+* A material shared by every mesh using the same parameters and textures
+*/
+struct Material
+{
+    MaterialParameters parameters;
+    // Every texture of the material, in the order `Mesh` binds them
+    std::vector<TextureHandle> textures;
+};
+
+
+// Whether meshes of this type can refer to a material
+template <class TMesh, class = void>
+struct has_material : std::false_type
+{
+};
+
+
+template <class TMesh>
+struct has_material<TMesh, decltype(std::declval<TMesh&>().set_material(MaterialHandle()))> : std::true_type
+{
+};
+
+
+/**
+* Return the colors, shininess and opacity of an imported material, with
+* defaults for the properties the file doesn't define and no textures
+*/
+inline MaterialParameters import_material_parameters(const aiMaterial* material)
+{
+    MaterialParameters parameters;
+    aiColor3D diffuse{1.0f, 1.0f, 1.0f};
+    aiColor3D specular{0.0f, 0.0f, 0.0f};
+    aiColor3D emissive{0.0f, 0.0f, 0.0f};
+    float shininess = 0.0f;
+    float opacity = 1.0f;
+    material->Get(AI_MATKEY_COLOR_DIFFUSE, diffuse);
+    material->Get(AI_MATKEY_COLOR_SPECULAR, specular);
+    material->Get(AI_MATKEY_COLOR_EMISSIVE, emissive);
+    material->Get(AI_MATKEY_SHININESS, shininess);
+    material->Get(AI_MATKEY_OPACITY, opacity);
+    parameters.diffuse = glm::vec4(diffuse.r, diffuse.g, diffuse.b, opacity);
+    parameters.specular = glm::vec4(specular.r, specular.g, specular.b, shininess);
+    parameters.emissive = glm::vec4(emissive.r, emissive.g, emissive.b, 0.0f);
+    parameters.diffuse_texture = no_texture;
+    parameters.specular_texture = no_texture;
+    // Materials are compared byte by byte, padding included
+    parameters.padding[0] = 0;
+    parameters.padding[1] = 0;
+    return parameters;
+}
+
+
+/**
+* Materials of any number of models, each stored once however many meshes
+* and models use it, with their parameters packed in one storage buffer
+*
+* Textures are deduplicated by path and referenced by handle, the library
+* keeping the first instance created for a path. Adding materials may happen
+* from any thread, such as from `AssetModel::process` running on workers,
+* while `upload`, `bind` and `bind_textures` must run on the thread owning
+* the OpenGL context.
+*/
+template <class TTexture = textures::Texture2D>
+class MaterialLibrary
+{
+public:
+    using texture_type = TTexture;
+    using texture_ptr = std::shared_ptr<texture_type>;
+
+    MaterialLibrary() : m_buffer(0),
+                        m_uploaded_count(0)
+    {
+    }
+    ~MaterialLibrary()
+    {
+        glDeleteBuffers(1, &m_buffer);
+    }
+
+    // Owns OpenGL objects
+    MaterialLibrary(const MaterialLibrary&) = delete;
+    MaterialLibrary& operator=(const MaterialLibrary&) = delete;
+
+    /**
+    * Return the handle of the texture at `path`, adding `texture` under it if
+    * the path wasn't seen before
+    */
+    TextureHandle add_texture(const std::string& path, texture_ptr texture)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto found = m_texture_handles.find(path);
+        if (found != m_texture_handles.end())
+        {
+            return found->second;
+        }
+        const auto handle = static_cast<TextureHandle>(m_textures.size());
+        m_textures.push_back(std::move(texture));
+        m_texture_handles.emplace(path, handle);
+        return handle;
+    }
+    /**
+    * Return the handle of a material with the same parameters and textures,
+    * adding it if there is none yet
+    */
+    MaterialHandle add(const Material& material)
+    {
+        std::string key(reinterpret_cast<const char*>(&material.parameters), sizeof(MaterialParameters));
+        key.append(reinterpret_cast<const char*>(material.textures.data()), material.textures.size() * sizeof(TextureHandle));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto found = m_material_handles.find(key);
+        if (found != m_material_handles.end())
+        {
+            return found->second;
+        }
+        const auto handle = static_cast<MaterialHandle>(m_materials.size());
+        m_materials.push_back(material);
+        m_parameters.push_back(material.parameters);
+        m_material_handles.emplace(std::move(key), handle);
+        return handle;
+    }
+    /**
+    * Return a copy of a material, as materials may be added concurrently
+    */
+    Material get(MaterialHandle handle) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_materials[handle];
+    }
+    texture_ptr get_texture(TextureHandle handle) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_textures[handle];
+    }
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_materials.size();
+    }
+    std::size_t get_texture_count() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_textures.size();
+    }
+    /**
+    * Upload the parameters of the materials added since the last upload
+    */
+    void upload()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_uploaded_count == m_parameters.size())
+        {
+            return;
+        }
+        if (m_buffer == 0)
+        {
+            glGenBuffers(1, &m_buffer);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, m_parameters.size() * sizeof(MaterialParameters), m_parameters.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        m_uploaded_count = m_parameters.size();
+    }
+    /**
+    * Bind the material buffer for `materials_glsl`
+    */
+    void bind() const
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, material_binding, m_buffer);
+    }
+    /**
+    * Bind the textures of a material to consecutive texture units, the way
+    * `Mesh` binds it's own textures
+    */
+    template <class TProgram>
+    void bind_textures(MaterialHandle handle, TProgram& program) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const Material& material = m_materials[handle];
+        for (std::size_t i = 0; i < material.textures.size(); ++i)
+        {
+            const auto& texture = m_textures[material.textures[i]];
+            texture->bind(GL_TEXTURE0 + static_cast<GLenum>(i));
+            program.set_uniform(texture->get_name(), static_cast<GLint>(i));
+        }
+    }
+    /**
+    * Bind the textures of a material to consecutive texture units, for
+    * shaders declaring the units of their samplers
+    */
+    void bind_textures(MaterialHandle handle) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const Material& material = m_materials[handle];
+        for (std::size_t i = 0; i < material.textures.size(); ++i)
+        {
+            m_textures[material.textures[i]]->bind(GL_TEXTURE0 + static_cast<GLenum>(i));
+        }
+    }
+    void unbind_textures(MaterialHandle handle) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const Material& material = m_materials[handle];
+        for (std::size_t i = 0; i < material.textures.size(); ++i)
+        {
+            m_textures[material.textures[i]]->unbind(GL_TEXTURE0 + static_cast<GLenum>(i));
+        }
+    }
+private:
+    mutable std::mutex m_mutex;
+    GLuint m_buffer;
+    std::size_t m_uploaded_count;
+    std::vector<Material> m_materials;
+    std::vector<MaterialParameters> m_parameters;
+    std::vector<texture_ptr> m_textures;
+    // Handles by the content of the material, see `add`
+    std::unordered_map<std::string, MaterialHandle> m_material_handles;
+    std::unordered_map<std::string, TextureHandle> m_texture_handles;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
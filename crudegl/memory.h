@@ -0,0 +1,279 @@
+#pragma once
+
+#include "jobs.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace memory
+{
+
+
+/**
+* Hands out memory by bumping a pointer through large blocks, releasing
+* everything at once on `reset`
+*
+* Blocks are kept across resets and merged into a single block once more than
+* one was needed, so after a few frames of warming up an arena serves a frame
+* without allocating from the heap at all. Not thread safe, use one arena per
+* thread.
+*/
+class LinearArena
+{
+public:
+    /**
+    * Constructor
+    * @param block_size is the size of the first block, allocated on first use
+    */
+    explicit LinearArena(std::size_t block_size = 1 << 16) : m_block_size(block_size),
+                                                             m_block(0),
+                                                             m_offset(0),
+                                                             m_used(0),
+                                                             m_peak(0)
+    {
+    }
+
+    // Hands out pointers into it's blocks
+    LinearArena(const LinearArena&) = delete;
+    LinearArena& operator=(const LinearArena&) = delete;
+
+    void* allocate(std::size_t size, std::size_t alignment)
+    {
+        for (; m_block < m_blocks.size(); ++m_block, m_offset = 0)
+        {
+            Block& block = m_blocks[m_block];
+            const auto base = reinterpret_cast<std::uintptr_t>(block.data.get());
+            const std::size_t offset = ((base + m_offset + alignment - 1) & ~(alignment - 1)) - base;
+            if (offset + size <= block.size)
+            {
+                m_used += offset + size - m_offset;
+                m_peak = std::max(m_peak, m_used);
+                m_offset = offset + size;
+                return block.data.get() + offset;
+            }
+        }
+        // Out of blocks, the next one at least doubling the capacity
+        Block block;
+        block.size = std::max(std::max(m_block_size, get_capacity()), size + alignment);
+        block.data.reset(new unsigned char[block.size]);
+        m_blocks.push_back(std::move(block));
+        m_block = m_blocks.size() - 1;
+        m_offset = 0;
+        return allocate(size, alignment);
+    }
+    /**
+    * Release every allocation, which must not be used anymore
+    */
+    void reset()
+    {
+        if (m_blocks.size() > 1)
+        {
+            m_block_size = get_capacity();
+            m_blocks.clear();
+            Block block;
+            block.size = m_block_size;
+            block.data.reset(new unsigned char[block.size]);
+            m_blocks.push_back(std::move(block));
+        }
+        m_block = 0;
+        m_offset = 0;
+        m_used = 0;
+    }
+    /**
+    * Return the number of bytes allocated since the last reset, alignment
+    * included
+    */
+    std::size_t get_used() const noexcept
+    {
+        return m_used;
+    }
+    /**
+    * Return the largest number of bytes ever used between two resets
+    */
+    std::size_t get_peak() const noexcept
+    {
+        return m_peak;
+    }
+    std::size_t get_capacity() const noexcept
+    {
+        std::size_t capacity = 0;
+        for (const Block& block : m_blocks)
+        {
+            capacity += block.size;
+        }
+        return capacity;
+    }
+private:
+    struct Block
+    {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size;
+    };
+
+    std::size_t m_block_size;
+    std::size_t m_block;
+    std::size_t m_offset;
+    std::size_t m_used;
+    std::size_t m_peak;
+    std::vector<Block> m_blocks;
+};
+
+
+/**
+* Standard allocator drawing from a `LinearArena`, or from the heap when it
+* has none, so containers can switch between both without changing type
+*
+* Takes the place of `std::pmr`, which is C++17 while the core headers stay
+* C++14.
+*
+* Deallocation is a no-op with an arena, the memory returning to it on reset.
+* The arena follows the contents of containers moved or swapped, so a
+* container can be moved to the arena of the next frame by assigning it an
+* empty container of that arena.
+*/
+template <class T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator(LinearArena* arena = nullptr) noexcept : m_arena(arena)
+    {
+    }
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : m_arena(other.get_arena())
+    {
+    }
+    T* allocate(std::size_t count)
+    {
+        if (!m_arena)
+        {
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+        return static_cast<T*>(m_arena->allocate(count * sizeof(T), alignof(T)));
+    }
+    void deallocate(T* pointer, std::size_t) noexcept
+    {
+        if (!m_arena)
+        {
+            ::operator delete(pointer);
+        }
+    }
+    LinearArena* get_arena() const noexcept
+    {
+        return m_arena;
+    }
+private:
+    LinearArena* m_arena;
+};
+
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) noexcept
+{
+    return lhs.get_arena() == rhs.get_arena();
+}
+
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) noexcept
+{
+    return lhs.get_arena() != rhs.get_arena();
+}
+
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+
+/**
+* Linear arenas for the transient data of frames, one per thread of a job
+* system and per frame in flight
+*
+* `begin_frame` moves on to the arenas of the oldest frame and resets them,
+* so data built during a frame, such as command lists, stays valid until the
+* frames after it were begun as well. Each thread of the job system gets it's
+* own arena, threads outside of it share one more arena, which only one of
+* them may use at a time, such as the thread owning the OpenGL context.
+*/
+class FrameArenas
+{
+public:
+    /**
+    * Constructor
+    * @param jobs picks the arena of the calling thread, null for a single
+    *        arena per frame
+    * @param frames_in_flight is the number of frames whose data is kept
+    * @param block_size is the initial size of every arena
+    */
+    explicit FrameArenas(const jobs::JobSystem* jobs = nullptr,
+                         std::size_t frames_in_flight = 3,
+                         std::size_t block_size = 1 << 16) : m_jobs(jobs),
+                                                             m_frame(0),
+                                                             m_thread_count(jobs ? jobs->get_thread_count() + 1 : 1)
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(frames_in_flight, 1) * m_thread_count; ++i)
+        {
+            m_arenas.emplace_back(new LinearArena(block_size));
+        }
+    }
+    /**
+    * Start a frame, releasing the data of the frame `frames_in_flight`
+    * frames ago
+    */
+    void begin_frame()
+    {
+        m_frame = (m_frame + 1) % get_frames_in_flight();
+        for (std::size_t i = 0; i < m_thread_count; ++i)
+        {
+            m_arenas[m_frame * m_thread_count + i]->reset();
+        }
+    }
+    /**
+    * Return the arena of the calling thread for the current frame
+    */
+    LinearArena& get()
+    {
+        const std::size_t thread = m_jobs ? m_jobs->get_thread_index() : 0;
+        return *m_arenas[m_frame * m_thread_count + std::min(thread, m_thread_count - 1)];
+    }
+    std::size_t get_frames_in_flight() const noexcept
+    {
+        return m_arenas.size() / m_thread_count;
+    }
+    /**
+    * Return the bytes used by the current frame on all threads so far
+    */
+    std::size_t get_used() const
+    {
+        std::size_t used = 0;
+        for (std::size_t i = 0; i < m_thread_count; ++i)
+        {
+            used += m_arenas[m_frame * m_thread_count + i]->get_used();
+        }
+        return used;
+    }
+private:
+    const jobs::JobSystem* m_jobs;
+    std::size_t m_frame;
+    std::size_t m_thread_count;
+    std::vector<std::unique_ptr<LinearArena>> m_arenas;
+};
+
+
+}  // namespace memory
+
+
+}  // namespace crudegl
@@ -1,5 +1,10 @@
 #pragma once
 
+#include "lod.h"
+#include "materials.h"
+#include "morph.h"
+#include "occlusion.h"
+#include "picking.h"
 #include "programs.h"
 #include "shaders.h"
 #include "textures.h"
@@ -39,14 +44,28 @@ public:
     * @param indices is a list of indices used for indexed draw
     * @param textures is a list of loaded texture instances
     */
-    Mesh(const std::vector<vertex_data_type>& vertices,
-         const std::vector<GLuint>& indices,
+    template <class TVertexAllocator, class TIndexAllocator>
+    Mesh(const std::vector<vertex_data_type, TVertexAllocator>& vertices,
+         const std::vector<GLuint, TIndexAllocator>& indices,
+         texture_vec&& textures) : Mesh(vertices.data(), vertices.size(), indices.data(), indices.size(), std::move(textures))
+    {
+    }
+    /**
+    * Constructor
+    * Create a mesh instance from vertices and indices in memory the mesh
+    * doesn't own, such as a shared asset cache, only read while constructing
+    */
+    Mesh(const vertex_data_type* vertices,
+         std::size_t vertex_count,
+         const GLuint* indices,
+         std::size_t index_count,
          texture_vec&& textures) : m_vao(0),
                                    m_vbo(0),
                                    m_ebo(0),
-                                   m_vertex_count(vertices.size()),
-                                   m_index_count(indices.size()),
-                                   m_textures(std::move(textures))
+                                   m_vertex_count(vertex_count),
+                                   m_index_count(index_count),
+                                   m_textures(std::move(textures)),
+                                   m_material(no_material)
     {
         // Create and bind vertex array object
         glGenVertexArrays(1, &m_vao);
@@ -55,14 +74,14 @@ public:
         // Create and bind vertex buffer object
         glGenBuffers(1, &m_vbo);
         glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-        glBufferData(GL_ARRAY_BUFFER, m_vertex_count * sizeof(vertex_data_type), vertices.data(), GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, m_vertex_count * sizeof(vertex_data_type), vertices, GL_STATIC_DRAW);
 
         // Create and bind element buffer object
         if (m_index_count > 0)
         {
             glGenBuffers(1, &m_ebo);
             glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
-            glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_index_count * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_index_count * sizeof(GLuint), indices, GL_STATIC_DRAW);
         }
 
         // Set vertex attributes
@@ -83,12 +102,143 @@ public:
     Mesh& operator=(Mesh&&) = default;
 
     void render(program_type& program) const
+    {
+        render(program, m_vao);
+    }
+    /**
+    * Render the mesh with the textures of the mesh, but the vertex attributes
+    * of another vertex array object, sharing the index buffer of the mesh
+    */
+    void render(program_type& program, GLuint vao) const
     {
         bind_textures(program);
-        draw_mesh();
+        draw_mesh(vao, 0);
         // Unbind all textures to avoid accidents
         unbind_textures();
     }
+    /**
+    * Render a level of detail of the mesh, the full detail one if the mesh
+    * has no levels
+    */
+    void render_lod(program_type& program, std::size_t level) const
+    {
+        bind_textures(program);
+        draw_mesh(m_vao, level);
+        unbind_textures();
+    }
+    /**
+    * Set the index ranges of the levels of detail, all stored in the index
+    * buffer of the mesh, the full detail one first
+    */
+    void set_lods(std::vector<LODLevel> lods)
+    {
+        m_lods = std::move(lods);
+    }
+    const std::vector<LODLevel>& get_lods() const noexcept
+    {
+        return m_lods;
+    }
+    /**
+    * Render only some ranges of the indices with a single multi-draw, such
+    * as the visible meshes of a static batch
+    * @param counts are the index counts of the ranges
+    * @param offsets are the byte offsets of the ranges into the index buffer
+    */
+    void render_ranges(program_type& program,
+                       const std::vector<GLsizei>& counts,
+                       const std::vector<const void*>& offsets) const
+    {
+        bind_textures(program);
+        glBindVertexArray(m_vao);
+        glMultiDrawElements(GL_TRIANGLES, counts.data(), GL_UNSIGNED_INT, offsets.data(), static_cast<GLsizei>(counts.size()));
+        glBindVertexArray(0);
+        unbind_textures();
+    }
+    /**
+    * Set the material of the mesh within a `MaterialLibrary`
+    */
+    void set_material(MaterialHandle material)
+    {
+        m_material = material;
+    }
+    /**
+    * Return the material of the mesh, `no_material` if it wasn't imported
+    * into a `MaterialLibrary`
+    */
+    MaterialHandle get_material() const noexcept
+    {
+        return m_material;
+    }
+    /**
+    * Set the bones referenced by the bone indices of the vertices
+    */
+    void set_bone_palette(animation::BonePalette palette)
+    {
+        m_bone_palette = std::move(palette);
+    }
+    const animation::BonePalette& get_bone_palette() const noexcept
+    {
+        return m_bone_palette;
+    }
+    /**
+    * Set the morph targets deforming the vertices
+    */
+    void set_morph_targets(animation::MorphTargetSet targets)
+    {
+        m_morph_targets = std::move(targets);
+    }
+    const animation::MorphTargetSet& get_morph_targets() const noexcept
+    {
+        return m_morph_targets;
+    }
+    /**
+    * Keep a CPU copy of the triangles for picking
+    */
+    void set_triangles(std::shared_ptr<const geometry::TriangleBVH> triangles)
+    {
+        m_triangles = std::move(triangles);
+    }
+    /**
+    * Return the CPU copy of the triangles, null unless the mesh is pickable
+    */
+    const std::shared_ptr<const geometry::TriangleBVH>& get_triangles() const noexcept
+    {
+        return m_triangles;
+    }
+    /**
+    * Designate the mesh, or a simplified stand-in for it, as an occluder
+    */
+    void set_occluder(std::shared_ptr<const geometry::Occluder> occluder)
+    {
+        m_occluder = std::move(occluder);
+    }
+    /**
+    * Return the occluder of the mesh, null unless it is designated as one
+    */
+    const std::shared_ptr<const geometry::Occluder>& get_occluder() const noexcept
+    {
+        return m_occluder;
+    }
+    GLuint get_vertex_array() const noexcept
+    {
+        return m_vao;
+    }
+    GLuint get_vertex_buffer() const noexcept
+    {
+        return m_vbo;
+    }
+    GLuint get_index_buffer() const noexcept
+    {
+        return m_ebo;
+    }
+    std::size_t get_vertex_count() const noexcept
+    {
+        return m_vertex_count;
+    }
+    std::size_t get_index_count() const noexcept
+    {
+        return m_index_count;
+    }
 private:
     void bind_textures(program_type& program) const
     {
@@ -99,10 +249,16 @@ private:
             program.set_uniform(texture->get_name(), static_cast<GLint>(i));
         }
     }
-    void draw_mesh() const
+    void draw_mesh(GLuint vao, std::size_t level) const
     {
-        glBindVertexArray(m_vao);
-        if (m_index_count > 0)
+        glBindVertexArray(vao);
+        if (!m_lods.empty())
+        {
+            const LODLevel& lod = m_lods[std::min(level, m_lods.size() - 1)];
+            glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(lod.index_count), GL_UNSIGNED_INT,
+                           reinterpret_cast<const void*>(lod.first_index * sizeof(GLuint)));
+        }
+        else if (m_index_count > 0)
         {
             glDrawElements(GL_TRIANGLES, m_index_count, GL_UNSIGNED_INT, 0);
         }
@@ -128,6 +284,12 @@ private:
     std::size_t m_vertex_count;
     std::size_t m_index_count;
     texture_vec m_textures;
+    MaterialHandle m_material;
+    animation::BonePalette m_bone_palette;
+    animation::MorphTargetSet m_morph_targets;
+    std::shared_ptr<const geometry::TriangleBVH> m_triangles;
+    std::shared_ptr<const geometry::Occluder> m_occluder;
+    std::vector<LODLevel> m_lods;
 };
 
 
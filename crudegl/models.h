@@ -1,18 +1,38 @@
 #pragma once
 
+#include "animation.h"
+#include "batching.h"
+#include "bounds.h"
+#include "clip_compression.h"
+#include "commands.h"
+#include "hlod.h"
+#include "jobs.h"
+#include "lod.h"
+#include "materials.h"
+#include "memory.h"
 #include "meshes.h"
+#include "morph.h"
+#include "occlusion.h"
+#include "picking.h"
+#include "pulling.h"
 #include "programs.h"
+#include "shared_cache.h"
+#include "streaming.h"
 #include "textures.h"
 #include "vertices.h"
+#include "world.h"
 
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 #include <glad/glad.h>
 
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <typeinfo>
 #include <vector>
 #include <unordered_map>
 
@@ -83,11 +103,13 @@ public:
     using mesh_type = Mesh<vertex_data_type, vertex_layout, texture_type, program_type>;
     /**
     * Constructor
-    * Create a model instance from raw data
+    * Create a model instance from raw data, which may live in an arena as it
+    * is only read during construction
     * @param path is an absolute path to a model file
     */
-    RawModel(const std::vector<vertex_data_type>& vertices,
-             const std::vector<GLuint>& indices,
+    template <class TVertexAllocator, class TIndexAllocator>
+    RawModel(const std::vector<vertex_data_type, TVertexAllocator>& vertices,
+             const std::vector<GLuint, TIndexAllocator>& indices,
              const std::vector<std::string>& texture_paths)
     {
         texture_vec textures;
@@ -116,15 +138,102 @@ public:
             mesh.render(program);
         }
     }
+    /**
+    * Register an instance of every indexed mesh with a render world, never
+    * culled as the bounds of raw vertices are unknown
+    *
+    * Meshes without indices are left out, as the world only issues indexed
+    * draws.
+    *
+    * @param transform is a transform of the world placing the model
+    * @return the instance of each indexed mesh, in mesh order
+    */
+    std::vector<InstanceHandle> register_with(RenderWorld& world, std::size_t transform) const
+    {
+        std::vector<InstanceHandle> instances;
+        for (const auto& mesh : m_meshes)
+        {
+            if (mesh.get_index_count() == 0)
+            {
+                continue;
+            }
+            instances.push_back(world.add_instance(world.add_mesh(mesh, geometry::BoundingBox()), transform));
+        }
+        return instances;
+    }
 private:
     std::vector<mesh_type> m_meshes;
     std::unordered_map<std::string, std::shared_ptr<texture_type>> m_loaded_textures;
 };
 
 
+/**
+* Create a model rendering the given box, used as a stand-in for models whose
+* data is still streaming in
+*
+* @param bounds is the box to render
+*/
+inline std::shared_ptr<Model> make_bounds_proxy(const geometry::BoundingBox& bounds)
+{
+    const glm::vec3& lo = bounds.minimum;
+    const glm::vec3& hi = bounds.maximum;
+    // Four corners per face, each with the face normal and texture
+    // coordinates, laid out as `DefaultVertex`
+    const glm::vec3 corners[6][4] = {
+        {{lo.x, lo.y, hi.z}, {hi.x, lo.y, hi.z}, {hi.x, hi.y, hi.z}, {lo.x, hi.y, hi.z}},
+        {{hi.x, lo.y, lo.z}, {lo.x, lo.y, lo.z}, {lo.x, hi.y, lo.z}, {hi.x, hi.y, lo.z}},
+        {{hi.x, lo.y, hi.z}, {hi.x, lo.y, lo.z}, {hi.x, hi.y, lo.z}, {hi.x, hi.y, hi.z}},
+        {{lo.x, lo.y, lo.z}, {lo.x, lo.y, hi.z}, {lo.x, hi.y, hi.z}, {lo.x, hi.y, lo.z}},
+        {{lo.x, hi.y, hi.z}, {hi.x, hi.y, hi.z}, {hi.x, hi.y, lo.z}, {lo.x, hi.y, lo.z}},
+        {{lo.x, lo.y, lo.z}, {hi.x, lo.y, lo.z}, {hi.x, lo.y, hi.z}, {lo.x, lo.y, hi.z}}
+    };
+    const glm::vec3 normals[6] = {
+        {0.0f, 0.0f, 1.0f}, {0.0f, 0.0f, -1.0f}, {1.0f, 0.0f, 0.0f},
+        {-1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, -1.0f, 0.0f}
+    };
+    const glm::vec2 uvs[4] = {{0.0f, 0.0f}, {1.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 1.0f}};
+    std::vector<GLfloat> vertices;
+    std::vector<GLuint> indices;
+    for (GLuint face = 0; face < 6; ++face)
+    {
+        for (int corner = 0; corner < 4; ++corner)
+        {
+            const glm::vec3& position = corners[face][corner];
+            vertices.insert(vertices.end(), {position.x, position.y, position.z,
+                                             normals[face].x, normals[face].y, normals[face].z,
+                                             uvs[corner].x, uvs[corner].y});
+        }
+        const GLuint base = face * 4;
+        indices.insert(indices.end(), {base, base + 1, base + 2, base, base + 2, base + 3});
+    }
+    return std::make_shared<RawModel<>>(vertices, indices, std::vector<std::string>());
+}
+
+
+/**
+* Controls when a streamed model stops rendering it's proxy
+*/
+struct SwapPolicy
+{
+    // Number of frames the proxy keeps rendering after the model became
+    // resident, so that many models finishing together don't pop at once.
+    // Frames are counted by `AssetModel::advance_frame`.
+    std::size_t delay_frames;
+    // Keep rendering the proxy while any texture of the model still binds a
+    // placeholder, see `AssetModel::set_deferred_textures`
+    bool wait_for_textures;
+};
+
+
+// Size of the first block of each arena storing the data extracted by
+// `AssetModel::process`, later blocks growing with the meshes
+constexpr std::size_t import_block_size = 1 << 20;
+
+
 template <class TVertexData = DefaultVertex,
           class TVertexLayout = DefaultVertex,
-          class TTexture = textures::Texture2D>
+          class TTexture = textures::Texture2D,
+          class TMesh = Mesh<TVertexData, TVertexLayout, TTexture, Model::program_type>>
 class AssetModel : public Model
 {
 public:
@@ -132,15 +241,29 @@ public:
     using vertex_layout = TVertexLayout;
     using texture_type = TTexture;
     using texture_vec = std::vector<std::shared_ptr<texture_type>>;
-    using mesh_type = Mesh<vertex_data_type, vertex_layout, texture_type, program_type>;
+    using mesh_type = TMesh;
     /**
     * Constructor
     * Create a model instance and load all of it's resources
     * @param path is an absolute path to a model file
+    * @param jobs is an optional job system used to process meshes and decode
+    *        textures in parallel
     */
-    explicit AssetModel(const std::string& path) : m_path{path},
-                                                   m_parentdir{utils::fs::dirname(path)},
-                                                   m_loaded{false}
+    explicit AssetModel(const std::string& path,
+                        jobs::JobSystem* jobs = nullptr) : m_path{path},
+                                                           m_parentdir{utils::fs::dirname(path)},
+                                                           m_jobs{jobs},
+                                                           m_loaded{false},
+                                                           m_has_bounds{false},
+                                                           m_pickable{false},
+                                                           m_occluder{false},
+                                                           m_lod_levels{1},
+                                                           m_material_library{nullptr},
+                                                           m_shared_cache{nullptr},
+                                                           m_compress_clips{true},
+                                                           m_swap_policy{0, false},
+                                                           m_frames_resident{0},
+                                                           m_deferred_textures{false}
     {
     }
     /**
@@ -150,78 +273,711 @@ public:
     {
         if (!m_loaded)
         {
-            load_model();
-            m_loaded = true;
+            read();
+            process();
+            upload();
+        }
+    }
+    /**
+    * Read and parse the model file
+    *
+    * Performs file I/O only and may run on any thread.
+    */
+    void read()
+    {
+        m_importer.reset(new Assimp::Importer());
+        const aiScene* scene = m_importer->ReadFile(m_path, aiProcess_Triangulate | aiProcess_FlipUVs);
+        if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+        {
+            m_importer.reset();
+            throw model_error(m_path, "Cannot load model.");
+        }
+    }
+    /**
+    * Extract the vertices and indices of all meshes and decode their textures
+    *
+    * Performs CPU work only and may run on any thread. Meshes and textures
+    * are processed in parallel if the model was given a job system.
+    *
+    * The extracted data lives in arenas of the model, one per thread, until
+    * it is handed over to meshes by `upload` or `add_to`, so threads loading
+    * several models at once don't contend for the heap.
+    */
+    void process()
+    {
+        if (!m_importer)
+        {
+            throw model_error(m_path, "Model not read before processing.");
+        }
+        m_import_arenas.reset(new memory::FrameArenas(m_jobs, 1, import_block_size));
+        const aiScene* scene = m_importer->GetScene();
+        std::vector<aiMesh*> raw_meshes;
+        process_node(scene->mRootNode, scene, raw_meshes);
+        collect_animation(scene, is_skinned_vertex<vertex_data_type>());
+
+        // Texture and material deduplication shares state between meshes,
+        // so both are collected up front and only decoding runs in parallel
+        m_mesh_data.resize(raw_meshes.size());
+        std::vector<MaterialHandle> materials(scene->mNumMaterials, no_material);
+        for (std::size_t i = 0; i < raw_meshes.size(); ++i)
+        {
+            check_bone_count(raw_meshes[i], is_skinned_vertex<vertex_data_type>());
+            m_mesh_data[i].textures = collect_textures(raw_meshes[i], scene);
+            m_mesh_data[i].material = collect_material(raw_meshes[i], scene, materials);
+        }
+        jobs::parallel_for(m_jobs, 0, raw_meshes.size(), [&](std::size_t i)
+                           {
+                               process_mesh(raw_meshes[i], i, m_mesh_data[i]);
+                           });
+        if (!m_has_bounds)
+        {
+            for (const auto& data : m_mesh_data)
+            {
+                m_bounds.expand(data.bounds);
+            }
+            m_has_bounds = true;
+        }
+
+        std::vector<texture_type*> textures;
+        for (const auto& entry : m_loaded_textures)
+        {
+            textures.push_back(entry.second.get());
+        }
+        jobs::parallel_for(m_jobs, 0, textures.size(), [&](std::size_t i)
+                           {
+                               textures[i]->read();
+                               textures[i]->process();
+                           });
+        m_importer.reset();
+    }
+    /**
+    * Create the OpenGL resources of all processed meshes and textures
+    *
+    * Textures deferred with `set_deferred_textures` only get their
+    * placeholders, if their type has any.
+    *
+    * Must run on the thread owning the OpenGL context.
+    */
+    void upload()
+    {
+        for (const auto& entry : m_loaded_textures)
+        {
+            if (m_deferred_textures)
+            {
+                upload_texture_placeholder(*entry.second, streaming::has_placeholder<texture_type>());
+            }
+            else
+            {
+                entry.second->upload();
+            }
+        }
+        upload_materials(has_material<mesh_type>());
+        for (auto& data : m_mesh_data)
+        {
+            emplace_mesh(data, std::is_constructible<mesh_type, const vertex_data_type*, std::size_t,
+                                                     const GLuint*, std::size_t, texture_vec&&>());
+            m_mesh_bounds.push_back(data.bounds);
+            set_bone_palette(m_meshes.back(), data, is_skinned_vertex<vertex_data_type>());
+            set_morph_targets(m_meshes.back(), data, animation::has_morph_targets<mesh_type>());
+            set_triangles(m_meshes.back(), data, geometry::has_pick_triangles<mesh_type>());
+            set_occluder(m_meshes.back(), data, geometry::has_occluder<mesh_type>());
+            set_lods(m_meshes.back(), data, has_lods<mesh_type>());
+            set_material(m_meshes.back(), data, has_material<mesh_type>());
+        }
+        release_mesh_data();
+        m_loaded = true;
+    }
+    /**
+    * Upload textures left out by `upload`, a few per frame so they don't
+    * stall the frame the model became resident in
+    *
+    * Must run on the thread owning the OpenGL context, after `upload`.
+    *
+    * @param max_count is the largest number of textures to upload
+    * @return number of textures still waiting for their upload
+    */
+    std::size_t upload_textures(std::size_t max_count)
+    {
+        std::size_t pending = 0;
+        for (const auto& entry : m_loaded_textures)
+        {
+            if (entry.second->is_resident())
+            {
+                continue;
+            }
+            if (max_count > 0)
+            {
+                entry.second->upload();
+                --max_count;
+            }
+            else
+            {
+                ++pending;
+            }
+        }
+        return pending;
+    }
+    /**
+    * Hand the processed meshes over to a static batcher instead of creating
+    * meshes of this model, which renders nothing afterwards
+    *
+    * Must run after `process`, `upload` still uploads the textures.
+    *
+    * @param transform places the model in world space
+    * @return where each mesh ended up in the batches
+    */
+    std::vector<BatchLocation> add_to(StaticBatcher<mesh_type>& batcher, const glm::mat4& transform)
+    {
+        unshare_mesh_data();
+        std::vector<BatchLocation> locations;
+        for (const auto& data : m_mesh_data)
+        {
+            locations.push_back(batcher.add(data.vertices, get_full_detail(data), data.textures, transform, data.material));
+        }
+        release_mesh_data();
+        return locations;
+    }
+    /**
+    * Copy the processed meshes into a vertex pool to be drawn by vertex
+    * pulling instead of creating meshes of this model, which renders nothing
+    * afterwards
+    *
+    * Must run on the thread owning the OpenGL context, after `process`.
+    * `upload` still uploads the textures.
+    *
+    * @param format identifies the vertex format of this model to shaders
+    * @return where each mesh ended up in the pool
+    */
+    std::vector<PulledMesh> add_to(VertexPool& pool, GLuint format = 0)
+    {
+        unshare_mesh_data();
+        std::vector<PulledMesh> meshes;
+        for (const auto& data : m_mesh_data)
+        {
+            meshes.push_back(pool.add(data.vertices, get_full_detail(data), format));
+        }
+        release_mesh_data();
+        return meshes;
+    }
+    /**
+    * Add the processed meshes to an HLOD builder, keeping them for this
+    * model to render up close
+    *
+    * Must run after `process` and before `upload`, which releases the
+    * texture pixels baked into the proxies.
+    *
+    * @param transform places the model in world space
+    * @return the item id of each mesh
+    */
+    std::vector<std::size_t> add_to(HLODBuilder& builder, const glm::mat4& transform)
+    {
+        unshare_mesh_data();
+        std::vector<std::size_t> items;
+        for (const auto& data : m_mesh_data)
+        {
+            items.push_back(builder.add(data.vertices, get_full_detail(data), data.textures, transform));
+        }
+        return items;
+    }
+    /**
+    * Create the proxy rendered while the model is not resident yet, a box
+    * around the model unless a proxy was set explicitly
+    *
+    * Must run on the thread owning the OpenGL context, after `process` or
+    * after bounds were provided with `set_bounds`.
+    */
+    void upload_placeholder()
+    {
+        if (!m_proxy && m_has_bounds && !m_bounds.empty())
+        {
+            m_proxy = make_bounds_proxy(m_bounds);
         }
     }
     /**
     * Render the current model
+    *
+    * While the model is not resident, it's proxy is rendered instead if it
+    * has one, see `set_proxy` and `upload_placeholder`.
+    *
     * @param program is a compiled and linked OpenGL program with shaders
     */
     void render(program_type& program) const override
     {
-        if (!m_loaded)
+        if (!m_loaded || !swap_ready())
         {
-            throw model_error(m_path, "Model not loaded before rendering.");
+            if (m_proxy)
+            {
+                m_proxy->render(program);
+                return;
+            }
+            if (!m_loaded)
+            {
+                throw model_error(m_path, "Model not loaded before rendering.");
+            }
         }
         for (const auto& mesh : m_meshes)
         {
             mesh.render(program);
         }
     }
+    /**
+    * Register an instance of every mesh with a render world, which renders
+    * them from then on instead of this model
+    *
+    * Must run after `upload`, the model keeping the meshes alive.
+    *
+    * @param transform is a transform of the world placing the model
+    * @return the instance of each mesh
+    */
+    std::vector<InstanceHandle> register_with(RenderWorld& world, std::size_t transform) const
+    {
+        std::vector<InstanceHandle> instances;
+        for (std::size_t i = 0; i < m_meshes.size(); ++i)
+        {
+            instances.push_back(world.add_instance(world.add_mesh(m_meshes[i], m_mesh_bounds[i]), transform));
+        }
+        return instances;
+    }
+    /**
+    * Record the commands rendering the model into a command list, to be
+    * executed on the thread owning the OpenGL context
+    *
+    * Only reads the model, so different models can be recorded in parallel.
+    * Meshes are drawn with the textures of their material, see
+    * `set_material_library`. Records nothing, it's proxy included, until
+    * the model is resident and the swap policy lets it replace the proxy,
+    * see `advance_frame`.
+    */
+    void record(CommandList& list, const program_type& program) const
+    {
+        if (!m_loaded || !swap_ready())
+        {
+            return;
+        }
+        list.bind_program(program);
+        for (const auto& mesh : m_meshes)
+        {
+            list.draw(mesh);
+        }
+    }
+    /**
+    * Return whether the full model data is uploaded
+    */
+    bool is_resident() const noexcept
+    {
+        return m_loaded;
+    }
+    /**
+    * Set the model rendered in place of this one until it's resident, such
+    * as pre-baked low detail geometry
+    */
+    void set_proxy(std::shared_ptr<Model> proxy)
+    {
+        m_proxy = std::move(proxy);
+    }
+    /**
+    * Count a frame towards the delay of the swap policy, once the model is
+    * resident and it's textures too if the policy waits for them
+    *
+    * Call once per frame on the thread owning the OpenGL context, before
+    * rendering or recording the model, which leave the model untouched.
+    */
+    void advance_frame()
+    {
+        if (m_loaded && textures_ready() && m_frames_resident < m_swap_policy.delay_frames)
+        {
+            ++m_frames_resident;
+        }
+    }
+    /**
+    * Set when rendering switches from the proxy to the full model
+    */
+    void set_swap_policy(const SwapPolicy& policy)
+    {
+        m_swap_policy = policy;
+    }
+    /**
+    * Leave the textures to `upload_textures` instead of uploading them along
+    * with the meshes, which then bind placeholders, must be set before
+    * `upload`
+    */
+    void set_deferred_textures(bool deferred)
+    {
+        m_deferred_textures = deferred;
+    }
+    /**
+    * Keep a CPU copy of the triangles of every mesh with a BVH over them for
+    * picking, must be set before `process`
+    */
+    void set_pickable(bool pickable)
+    {
+        m_pickable = pickable;
+    }
+    /**
+    * Designate every mesh of the model as an occluder for software occlusion
+    * culling, must be set before `process`
+    *
+    * Detailed models are better left out in favour of simplified occluders
+    * attached to their meshes with `Mesh::set_occluder`.
+    */
+    void set_occluder(bool occluder)
+    {
+        m_occluder = occluder;
+    }
+    /**
+    * Generate up to `levels` levels of detail per mesh, the full detail one
+    * included, must be set before `process`
+    */
+    void set_lod_levels(std::size_t levels)
+    {
+        m_lod_levels = levels;
+    }
+    /**
+    * Import the materials of the meshes into a library shared with other
+    * models, which must outlive the model, must be set before `process`
+    *
+    * Only mesh types referring to materials use the library, see
+    * `has_material`, the others leave it untouched.
+    */
+    void set_material_library(MaterialLibrary<texture_type>* library)
+    {
+        m_material_library = library;
+    }
+    /**
+    * Share the extracted meshes and decoded textures with other processes
+    * through a cache, which must outlive the model, must be set before
+    * `process`
+    *
+    * Meshes found in the cache skip extraction and are uploaded straight
+    * from it. Meshes of pickable models and occluders are never shared, as
+    * they need the positions of the raw mesh.
+    */
+    void set_shared_cache(streaming::SharedAssetCache* cache)
+    {
+        m_shared_cache = cache;
+    }
+    /**
+    * Set whether the animation clips are compressed at import and the
+    * tolerances used, must be set before `process`
+    *
+    * Clips are compressed with the default tolerances unless set otherwise.
+    */
+    void set_clip_compression(bool compress,
+                              const animation::CompressionSettings& settings = animation::CompressionSettings())
+    {
+        m_compress_clips = compress;
+        m_clip_compression = settings;
+    }
+    /**
+    * Provide the bounds of the model ahead of loading, e.g. from an asset
+    * manifest, so a bounds proxy can be shown before the file is read
+    */
+    void set_bounds(const geometry::BoundingBox& bounds)
+    {
+        m_bounds = bounds;
+        m_has_bounds = true;
+    }
+    /**
+    * Return the bounds of the model, empty until known
+    */
+    geometry::BoundingBox get_bounds() const
+    {
+        return m_has_bounds ? m_bounds : geometry::BoundingBox();
+    }
+    /**
+    * Return the meshes extracted from the model file
+    */
+    const std::vector<mesh_type>& get_meshes() const noexcept
+    {
+        return m_meshes;
+    }
+    /**
+    * Return the node hierarchy animated by the clips, only extracted for
+    * skinned vertex types
+    */
+    const animation::Skeleton& get_skeleton() const noexcept
+    {
+        return m_skeleton;
+    }
+    /**
+    * Return the animation clips of the model, compressed unless disabled
+    * with `set_clip_compression`
+    */
+    const std::vector<std::unique_ptr<animation::Clip>>& get_clips() const noexcept
+    {
+        return m_clips;
+    }
 private:
+    struct MeshData
+    {
+        memory::ArenaVector<vertex_data_type> vertices;
+        memory::ArenaVector<GLuint> indices;
+        texture_vec textures;
+        geometry::BoundingBox bounds;
+        animation::BonePalette bones;
+        animation::MorphTargetSet morph_targets;
+        std::shared_ptr<const geometry::TriangleBVH> triangles;
+        std::shared_ptr<const geometry::Occluder> occluder;
+        std::vector<LODLevel> lods;
+        MaterialHandle material;
+        // Vertices and indices mapped from the shared cache, used instead of
+        // `vertices` and `indices` while set
+        streaming::SharedAsset shared;
+    };
     /**
-    * Load model file and initiate recursive model processing
+    * Start of the data a mesh shares through the cache, followed by it's
+    * levels of detail, vertices and indices
     */
-    void load_model()
+    struct SharedMeshHeader
     {
-        Assimp::Importer importer;
-        const aiScene* scene = importer.ReadFile(m_path, aiProcess_Triangulate | aiProcess_FlipUVs);
-        if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+        std::uint64_t vertex_count;
+        std::uint64_t index_count;
+        std::uint64_t lod_count;
+        geometry::BoundingBox bounds;
+    };
+    // Offsets within the shared data of a mesh
+    struct SharedMeshLayout
+    {
+        std::size_t lods;
+        std::size_t vertices;
+        std::size_t indices;
+        std::size_t size;
+    };
+    /**
+    * Return whether the swap policy allows rendering the full model instead
+    * of it's proxy, see `advance_frame`
+    */
+    bool swap_ready() const
+    {
+        return textures_ready() && m_frames_resident >= m_swap_policy.delay_frames;
+    }
+    /**
+    * Return whether the textures are resident, or the policy doesn't wait
+    * for them
+    */
+    bool textures_ready() const
+    {
+        if (m_swap_policy.wait_for_textures)
         {
-            throw model_error(m_path, "Cannot load model.");
+            for (const auto& entry : m_loaded_textures)
+            {
+                if (!entry.second->is_resident())
+                {
+                    return false;
+                }
+            }
         }
-        process_node(scene->mRootNode, scene);
+        return true;
+    }
+    static void upload_texture_placeholder(texture_type& texture, std::true_type)
+    {
+        texture.upload_placeholder();
+    }
+    static void upload_texture_placeholder(texture_type&, std::false_type)
+    {
+    }
+    /**
+    * Drop the extracted mesh data along with the arenas storing it
+    */
+    void release_mesh_data()
+    {
+        m_mesh_data.clear();
+        m_import_arenas.reset();
     }
     /**
-    * Recursively process each mesh within the model
+    * Recursively collect each mesh within the model
     * @param node is the current node within the scene data structure
     * @param scene is the model / scene containing all the meshes
+    * @param raw_meshes is the vector into which meshes are inserted
     */
-    void process_node(aiNode* node, const aiScene* scene)
+    void process_node(aiNode* node, const aiScene* scene, std::vector<aiMesh*>& raw_meshes)
     {
         // Process all meshes of the current node
         for (GLuint i = 0; i < node->mNumMeshes; ++i)
         {
             GLuint mesh_index = node->mMeshes[i];
-            aiMesh* raw_mesh = scene->mMeshes[mesh_index];
-            m_meshes.push_back(process_mesh(raw_mesh, scene));
+            raw_meshes.push_back(scene->mMeshes[mesh_index]);
         }
         // Process all children of the current mesh
         for (GLuint i = 0; i < node->mNumChildren; ++i)
         {
-            process_node(node->mChildren[i], scene);
+            process_node(node->mChildren[i], scene, raw_meshes);
         }
     }
     /**
-    * Create a new `Mesh` instance from a raw mesh and load all it's resources
+    * Extract the vertex and index data of a raw mesh, safe to run in parallel
+    * for different meshes
     * @param raw_mesh is the raw assimp data structure describing the mesh
-    * @param scene is the model / scene containing all the meshes
+    * @param index identifies the mesh within the model in the shared cache
+    * @param data is the destination of the extracted data
+    */
+    void process_mesh(aiMesh* raw_mesh, std::size_t index, MeshData& data) const
+    {
+        data.bones = animation::collect_bone_palette(raw_mesh);
+        if (raw_mesh->mNumAnimMeshes > 0)
+        {
+            data.morph_targets = animation::MorphTargetSet(raw_mesh);
+        }
+        const bool shared = m_shared_cache && !m_pickable && !m_occluder;
+        const std::string key = shared ? get_shared_key(index) : std::string();
+        if (shared && map_shared_mesh(key, data))
+        {
+            return;
+        }
+        memory::LinearArena& arena = m_import_arenas->get();
+        data.vertices = collect_vertices(raw_mesh, arena, is_skinned_vertex<vertex_data_type>());
+        data.indices = collect_indices(raw_mesh, arena);
+        memory::ArenaVector<glm::vec3> positions(raw_mesh->mNumVertices, glm::vec3(), &arena);
+        for (GLuint i = 0; i < raw_mesh->mNumVertices; ++i)
+        {
+            const aiVector3D& position = raw_mesh->mVertices[i];
+            positions[i] = glm::vec3(position.x, position.y, position.z);
+            data.bounds.expand(positions[i]);
+        }
+        if (m_pickable)
+        {
+            data.triangles = std::make_shared<geometry::TriangleBVH>(positions, data.indices, m_jobs);
+        }
+        if (m_occluder)
+        {
+            data.occluder = std::make_shared<geometry::Occluder>(std::vector<glm::vec3>(positions.begin(), positions.end()),
+                                                                 std::vector<GLuint>(data.indices.begin(), data.indices.end()));
+        }
+        // Appends to the indices, so has to come after the others
+        if (m_lod_levels > 1 && has_lods<mesh_type>::value)
+        {
+            data.lods = build_lods(positions, data.indices, m_lod_levels);
+        }
+        if (shared)
+        {
+            share_mesh(key, data);
+        }
+    }
+    /**
+    * Return the key of a mesh in the shared cache, which tells apart the
+    * vertex types and levels of detail a model is extracted with
+    */
+    std::string get_shared_key(std::size_t index) const
+    {
+        const std::size_t lod_levels = has_lods<mesh_type>::value ? m_lod_levels : 1;
+        return "mesh:" + m_path + "#" + std::to_string(index) + "#" + typeid(vertex_data_type).name() + "#" +
+               std::to_string(lod_levels);
+    }
+    static std::size_t align_offset(std::size_t offset, std::size_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+    static SharedMeshLayout get_shared_layout(const SharedMeshHeader& header)
+    {
+        SharedMeshLayout layout;
+        layout.lods = align_offset(sizeof(SharedMeshHeader), alignof(LODLevel));
+        layout.vertices = align_offset(layout.lods + header.lod_count * sizeof(LODLevel), alignof(vertex_data_type));
+        layout.indices = align_offset(layout.vertices + header.vertex_count * sizeof(vertex_data_type), alignof(GLuint));
+        layout.size = layout.indices + header.index_count * sizeof(GLuint);
+        return layout;
+    }
+    /**
+    * Map a mesh extracted by another process, if it's in the shared cache
+    */
+    bool map_shared_mesh(const std::string& key, MeshData& data) const
+    {
+        streaming::SharedAsset asset = m_shared_cache->find(key);
+        if (!asset)
+        {
+            return false;
+        }
+        SharedMeshHeader header;
+        std::memcpy(&header, asset.data(), sizeof(header));
+        const SharedMeshLayout layout = get_shared_layout(header);
+        data.bounds = header.bounds;
+        data.lods.resize(header.lod_count);
+        std::memcpy(data.lods.data(), asset.data() + layout.lods, data.lods.size() * sizeof(LODLevel));
+        data.shared = std::move(asset);
+        return true;
+    }
+    /**
+    * Publish an extracted mesh to the shared cache, unless another process
+    * is publishing it already
+    */
+    void share_mesh(const std::string& key, const MeshData& data) const
+    {
+        SharedMeshHeader header;
+        header.vertex_count = data.vertices.size();
+        header.index_count = data.indices.size();
+        header.lod_count = data.lods.size();
+        header.bounds = data.bounds;
+        const SharedMeshLayout layout = get_shared_layout(header);
+        m_shared_cache->insert(key, layout.size, [&](unsigned char* shared)
+                               {
+                                   std::memcpy(shared, &header, sizeof(header));
+                                   std::memcpy(shared + layout.lods, data.lods.data(), data.lods.size() * sizeof(LODLevel));
+                                   std::memcpy(shared + layout.vertices, data.vertices.data(),
+                                               data.vertices.size() * sizeof(vertex_data_type));
+                                   std::memcpy(shared + layout.indices, data.indices.data(), data.indices.size() * sizeof(GLuint));
+                               });
+    }
+    /**
+    * Copy the vertices and indices of a mesh mapped from the shared cache,
+    * for the consumers needing vectors
+    */
+    void unshare(MeshData& data)
+    {
+        if (!data.shared)
+        {
+            return;
+        }
+        SharedMeshHeader header;
+        std::memcpy(&header, data.shared.data(), sizeof(header));
+        const SharedMeshLayout layout = get_shared_layout(header);
+        const auto* vertices = reinterpret_cast<const vertex_data_type*>(data.shared.data() + layout.vertices);
+        const auto* indices = reinterpret_cast<const GLuint*>(data.shared.data() + layout.indices);
+        memory::LinearArena& arena = m_import_arenas->get();
+        data.vertices = memory::ArenaVector<vertex_data_type>(vertices, vertices + header.vertex_count, &arena);
+        data.indices = memory::ArenaVector<GLuint>(indices, indices + header.index_count, &arena);
+        data.shared.reset();
+    }
+    void unshare_mesh_data()
+    {
+        for (auto& data : m_mesh_data)
+        {
+            unshare(data);
+        }
+    }
+    /**
+    * Create the mesh of the extracted data, straight from the shared cache
+    * if it was mapped from it
     */
-    mesh_type process_mesh(aiMesh* raw_mesh, const aiScene* scene)
+    void emplace_mesh(MeshData& data, std::true_type)
+    {
+        if (!data.shared)
+        {
+            m_meshes.emplace_back(data.vertices, data.indices, std::move(data.textures));
+            return;
+        }
+        SharedMeshHeader header;
+        std::memcpy(&header, data.shared.data(), sizeof(header));
+        const SharedMeshLayout layout = get_shared_layout(header);
+        m_meshes.emplace_back(reinterpret_cast<const vertex_data_type*>(data.shared.data() + layout.vertices),
+                              static_cast<std::size_t>(header.vertex_count),
+                              reinterpret_cast<const GLuint*>(data.shared.data() + layout.indices),
+                              static_cast<std::size_t>(header.index_count),
+                              std::move(data.textures));
+        data.shared.reset();
+    }
+    void emplace_mesh(MeshData& data, std::false_type)
     {
-        auto vertices = collect_vertices(raw_mesh);
-        auto indices = collect_indices(raw_mesh);
-        auto textures = collect_textures(raw_mesh, scene);
-        return mesh_type(vertices, indices, std::move(textures));
+        unshare(data);
+        m_meshes.emplace_back(data.vertices, data.indices, std::move(data.textures));
     }
     /**
     * Collect and return all vertices from the passed in mesh
     * @param raw_mesh is the raw assimp data structure describing the mesh
+    * @param arena stores the vertices
     */
-    std::vector<vertex_data_type> collect_vertices(aiMesh* raw_mesh)
+    memory::ArenaVector<vertex_data_type> collect_vertices(aiMesh* raw_mesh, memory::LinearArena& arena, std::false_type) const
     {
-        std::vector<vertex_data_type> vertices;
+        memory::ArenaVector<vertex_data_type> vertices(&arena);
+        vertices.reserve(raw_mesh->mNumVertices);
         for (GLuint i = 0; i < raw_mesh->mNumVertices; ++i)
         {
             vertices.emplace_back(raw_mesh, i);
@@ -229,15 +985,144 @@ private:
         return vertices;
     }
     /**
+    * Collect and return all vertices from the passed in mesh, along with
+    * their bone influences
+    * @param raw_mesh is the raw assimp data structure describing the mesh
+    * @param arena stores the vertices
+    */
+    memory::ArenaVector<vertex_data_type> collect_vertices(aiMesh* raw_mesh, memory::LinearArena& arena, std::true_type) const
+    {
+        const auto influences = animation::compute_bone_influences(raw_mesh, m_jobs);
+        memory::ArenaVector<vertex_data_type> vertices(&arena);
+        vertices.reserve(raw_mesh->mNumVertices);
+        for (GLuint i = 0; i < raw_mesh->mNumVertices; ++i)
+        {
+            vertices.emplace_back(raw_mesh, i, influences);
+        }
+        return vertices;
+    }
+    void check_bone_count(const aiMesh*, std::false_type) const
+    {
+    }
+    /**
+    * Throw if the bone indices of the vertex type can't address every bone
+    * of the mesh, such as `BoneIndices` for more than 256 bones
+    */
+    void check_bone_count(const aiMesh* raw_mesh, std::true_type) const
+    {
+        if (raw_mesh->mNumBones > max_bone_count<vertex_data_type>::value)
+        {
+            throw model_error(m_path, "Mesh " + std::string(raw_mesh->mName.C_Str()) + " has " +
+                                      std::to_string(raw_mesh->mNumBones) + " bones, more than the bone indices of " +
+                                      "the vertex type can address, use WideBoneIndices.");
+        }
+    }
+    void collect_animation(const aiScene*, std::false_type)
+    {
+    }
+    void collect_animation(const aiScene* scene, std::true_type)
+    {
+        m_skeleton = animation::Skeleton(scene->mRootNode);
+        m_clips.resize(scene->mNumAnimations);
+        jobs::parallel_for(m_jobs, 0, m_clips.size(), [&](std::size_t i)
+                           {
+                               const aiAnimation* source = scene->mAnimations[i];
+                               if (m_compress_clips)
+                               {
+                                   m_clips[i].reset(new animation::CompressedClip(source, m_skeleton,
+                                                                                  m_clip_compression));
+                               }
+                               else
+                               {
+                                   m_clips[i].reset(new animation::AnimationClip(source, m_skeleton));
+                               }
+                           });
+    }
+    static void set_bone_palette(mesh_type&, MeshData&, std::false_type)
+    {
+    }
+    static void set_bone_palette(mesh_type& mesh, MeshData& data, std::true_type)
+    {
+        mesh.set_bone_palette(std::move(data.bones));
+    }
+    static void set_morph_targets(mesh_type&, MeshData&, std::false_type)
+    {
+    }
+    static void set_morph_targets(mesh_type& mesh, MeshData& data, std::true_type)
+    {
+        mesh.set_morph_targets(std::move(data.morph_targets));
+    }
+    static void set_triangles(mesh_type&, MeshData&, std::false_type)
+    {
+    }
+    static void set_triangles(mesh_type& mesh, MeshData& data, std::true_type)
+    {
+        mesh.set_triangles(std::move(data.triangles));
+    }
+    static void set_occluder(mesh_type&, MeshData&, std::false_type)
+    {
+    }
+    static void set_occluder(mesh_type& mesh, MeshData& data, std::true_type)
+    {
+        mesh.set_occluder(std::move(data.occluder));
+    }
+    /**
+    * Return the indices of the full detail level only
+    */
+    static memory::ArenaVector<GLuint> get_full_detail(const MeshData& data)
+    {
+        if (data.lods.empty())
+        {
+            return data.indices;
+        }
+        return memory::ArenaVector<GLuint>(data.indices.begin(), data.indices.begin() + data.lods.front().index_count,
+                                           data.indices.get_allocator());
+    }
+    // Kept out of mesh types without materials, so that those never
+    // reference the buffers of the library
+    void upload_materials(std::false_type)
+    {
+    }
+    void upload_materials(std::true_type)
+    {
+        if (m_material_library)
+        {
+            m_material_library->upload();
+        }
+    }
+    static void set_material(mesh_type&, MeshData&, std::false_type)
+    {
+    }
+    static void set_material(mesh_type& mesh, MeshData& data, std::true_type)
+    {
+        mesh.set_material(data.material);
+    }
+    void share_texture(texture_type&, std::false_type) const
+    {
+    }
+    void share_texture(texture_type& texture, std::true_type) const
+    {
+        texture.set_shared_cache(m_shared_cache);
+    }
+    static void set_lods(mesh_type&, MeshData&, std::false_type)
+    {
+    }
+    static void set_lods(mesh_type& mesh, MeshData& data, std::true_type)
+    {
+        mesh.set_lods(std::move(data.lods));
+    }
+    /**
     * Collect and return all indices of all faces from the passed in mesh
     * @param raw_mesh is the raw assimp data structure describing the mesh
+    * @param arena stores the indices
     */
-    std::vector<GLuint> collect_indices(aiMesh* raw_mesh)
+    memory::ArenaVector<GLuint> collect_indices(aiMesh* raw_mesh, memory::LinearArena& arena) const
     {
-        std::vector<GLuint> indices;
+        memory::ArenaVector<GLuint> indices(&arena);
+        indices.reserve(raw_mesh->mNumFaces * 3);
         for (GLuint i = 0; i < raw_mesh->mNumFaces; ++i)
         {
-            aiFace face = raw_mesh->mFaces[i];
+            const aiFace& face = raw_mesh->mFaces[i];
             for (GLuint j = 0; j < face.mNumIndices; ++j)
             {
                 indices.push_back(face.mIndices[j]);
@@ -253,7 +1138,7 @@ private:
     texture_vec collect_textures(aiMesh* raw_mesh, const aiScene* scene)
     {
         texture_vec textures;
-        if (raw_mesh->mMaterialIndex > 0)
+        if (raw_mesh->mMaterialIndex < scene->mNumMaterials)
         {
             aiMaterial* material = scene->mMaterials[raw_mesh->mMaterialIndex];
             load_textures(material, aiTextureType_DIFFUSE, textures);
@@ -262,8 +1147,52 @@ private:
         return textures;
     }
     /**
-    * Load all the requested texture types from the passed in material into
-    * the given vector
+    * Return the material of the passed in mesh within the material library,
+    * importing it once per material of the scene
+    * @param handles holds the handle of each material of the scene imported
+    *        so far, `no_material` for the others
+    */
+    MaterialHandle collect_material(aiMesh* raw_mesh, const aiScene* scene, std::vector<MaterialHandle>& handles)
+    {
+        if (!m_material_library || !has_material<mesh_type>::value || raw_mesh->mMaterialIndex >= scene->mNumMaterials)
+        {
+            return no_material;
+        }
+        MaterialHandle& handle = handles[raw_mesh->mMaterialIndex];
+        if (handle == no_material)
+        {
+            aiMaterial* raw_material = scene->mMaterials[raw_mesh->mMaterialIndex];
+            Material material;
+            material.parameters = import_material_parameters(raw_material);
+            add_material_textures(raw_material, aiTextureType_DIFFUSE, material, material.parameters.diffuse_texture);
+            add_material_textures(raw_material, aiTextureType_SPECULAR, material, material.parameters.specular_texture);
+            handle = m_material_library->add(material);
+        }
+        return handle;
+    }
+    /**
+    * Add the textures of the requested type, created by `load_textures`, to
+    * the material library and to the passed in material
+    * @param first is set to the handle of the first texture of the type
+    */
+    void add_material_textures(aiMaterial* raw_material, aiTextureType type, Material& material, TextureHandle& first)
+    {
+        for (GLuint i = 0; i < raw_material->GetTextureCount(type); ++i)
+        {
+            aiString path;
+            raw_material->GetTexture(type, i, &path);
+            const TextureHandle texture = m_material_library->add_texture(utils::fs::join(m_parentdir, path.C_Str()),
+                                                                          m_loaded_textures.at(path.C_Str()));
+            material.textures.push_back(texture);
+            if (first == no_texture)
+            {
+                first = texture;
+            }
+        }
+    }
+    /**
+    * Create all the requested texture types from the passed in material into
+    * the given vector, their data is loaded later on by `process` and `upload`
     * @param material is the source material from which to load textures
     * @param type is the type of textures to load from the material
     * @param textures is the vector into which textures are inserted
@@ -277,15 +1206,15 @@ private:
             auto found = m_loaded_textures.find(path.C_Str());
             if (found == m_loaded_textures.end())
             {
-                // Not yet loaded, load texture
+                // Not yet seen, create texture
                 auto instance = std::make_shared<texture_type>(utils::fs::join(m_parentdir, path.C_Str()));
-                instance->load();
+                share_texture(*instance, textures::has_shared_cache<texture_type>());
                 textures.push_back(instance);
                 m_loaded_textures.insert({path.C_Str(), instance});
             }
             else
             {
-                // If already loaded, use the existing instance
+                // If already seen, use the existing instance
                 textures.push_back(found->second);
             }
         }
@@ -294,7 +1223,30 @@ private:
     bool m_loaded;
     std::string m_path;
     std::string m_parentdir;
+    jobs::JobSystem* m_jobs;
+    bool m_has_bounds;
+    bool m_pickable;
+    bool m_occluder;
+    std::size_t m_lod_levels;
+    MaterialLibrary<texture_type>* m_material_library;
+    streaming::SharedAssetCache* m_shared_cache;
+    bool m_compress_clips;
+    animation::CompressionSettings m_clip_compression;
+    geometry::BoundingBox m_bounds;
+    std::shared_ptr<Model> m_proxy;
+    SwapPolicy m_swap_policy;
+    // Frames counted by `advance_frame` since the model became resident
+    std::size_t m_frames_resident;
+    bool m_deferred_textures;
+    std::unique_ptr<Assimp::Importer> m_importer;
+    // Storage of the extracted mesh data, see `process`
+    std::unique_ptr<memory::FrameArenas> m_import_arenas;
+    std::vector<MeshData> m_mesh_data;
     std::vector<mesh_type> m_meshes;
+    // Bounds of each mesh in model space
+    std::vector<geometry::BoundingBox> m_mesh_bounds;
+    animation::Skeleton m_skeleton;
+    std::vector<std::unique_ptr<animation::Clip>> m_clips;
     std::unordered_map<std::string, std::shared_ptr<texture_type>> m_loaded_textures;
 };
 
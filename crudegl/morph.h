@@ -0,0 +1,728 @@
+#pragma once
+
+#include "animation.h"
+#include "programs.h"
+#include "shaders.h"
+#include "skinning.h"
+
+#include <assimp/mesh.h>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace animation
+{
+
+
+/**
+* Morph targets (blend shapes) of a mesh, stored as sparse deltas
+*
+* Only the vertices a target moves are stored, each as the vertex index and
+* the position and normal deltas padded to two vec4, so memory is
+* proportional to the deltas and one delta is blended with a single 8 lane
+* or two 4 lane operations. The undeformed positions and normals are kept
+* once per mesh in the same layout.
+*/
+class MorphTargetSet
+{
+public:
+    enum
+    {
+        // Position and normal, as two vec4
+        floats_per_vertex = 8
+    };
+
+    MorphTargetSet() : m_vertex_count{0}
+    {
+    }
+    /**
+    * Constructor
+    * Extract the targets from the anim meshes of `mesh`, which hold the
+    * complete target positions and normals
+    *
+    * @param epsilon is the largest delta component still considered zero
+    */
+    explicit MorphTargetSet(const aiMesh* mesh, float epsilon = 1e-6f) : m_vertex_count{mesh->mNumVertices}
+    {
+        m_base.assign(m_vertex_count * floats_per_vertex, 0.0f);
+        for (std::size_t v = 0; v < m_vertex_count; ++v)
+        {
+            float* base = m_base.data() + v * floats_per_vertex;
+            base[0] = mesh->mVertices[v].x;
+            base[1] = mesh->mVertices[v].y;
+            base[2] = mesh->mVertices[v].z;
+            base[3] = 1.0f;
+            if (mesh->mNormals)
+            {
+                base[4] = mesh->mNormals[v].x;
+                base[5] = mesh->mNormals[v].y;
+                base[6] = mesh->mNormals[v].z;
+            }
+        }
+        for (unsigned int i = 0; i < mesh->mNumAnimMeshes; ++i)
+        {
+            const aiAnimMesh* target = mesh->mAnimMeshes[i];
+            if (target->mNumVertices != m_vertex_count)
+            {
+                continue;
+            }
+            m_targets.push_back(Target{target->mName.C_Str(), target->mWeight,
+                                       static_cast<std::uint32_t>(m_vertices.size()), 0});
+            for (std::size_t v = 0; v < m_vertex_count; ++v)
+            {
+                const float* base = m_base.data() + v * floats_per_vertex;
+                float delta[floats_per_vertex] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+                if (target->mVertices)
+                {
+                    delta[0] = target->mVertices[v].x - base[0];
+                    delta[1] = target->mVertices[v].y - base[1];
+                    delta[2] = target->mVertices[v].z - base[2];
+                }
+                if (target->mNormals && mesh->mNormals)
+                {
+                    delta[4] = target->mNormals[v].x - base[4];
+                    delta[5] = target->mNormals[v].y - base[5];
+                    delta[6] = target->mNormals[v].z - base[6];
+                }
+                float largest = 0.0f;
+                for (float component : delta)
+                {
+                    largest = std::max(largest, std::abs(component));
+                }
+                if (largest > epsilon)
+                {
+                    m_vertices.push_back(static_cast<std::uint32_t>(v));
+                    m_deltas.insert(m_deltas.end(), delta, delta + floats_per_vertex);
+                    ++m_targets.back().count;
+                }
+            }
+        }
+    }
+    /**
+    * Return the number of targets
+    */
+    std::size_t size() const noexcept
+    {
+        return m_targets.size();
+    }
+    bool empty() const noexcept
+    {
+        return m_targets.empty();
+    }
+    std::size_t get_vertex_count() const noexcept
+    {
+        return m_vertex_count;
+    }
+    const std::string& get_name(std::size_t target) const
+    {
+        return m_targets[target].name;
+    }
+    /**
+    * Return the weight the target has in the model file
+    */
+    float get_default_weight(std::size_t target) const
+    {
+        return m_targets[target].default_weight;
+    }
+    /**
+    * Return the number of vertices the target moves
+    */
+    std::size_t get_delta_count(std::size_t target) const
+    {
+        return m_targets[target].count;
+    }
+    /**
+    * Return the index of the first delta of the target within all deltas
+    */
+    std::size_t get_first_delta(std::size_t target) const
+    {
+        return m_targets[target].first;
+    }
+    /**
+    * Return the vertex index of every delta, of all targets
+    */
+    const std::vector<std::uint32_t>& get_vertices() const noexcept
+    {
+        return m_vertices;
+    }
+    /**
+    * Return the position and normal deltas, of all targets
+    */
+    const std::vector<float>& get_deltas() const noexcept
+    {
+        return m_deltas;
+    }
+    /**
+    * Return the undeformed position and normal of every vertex
+    */
+    const std::vector<float>& get_base() const noexcept
+    {
+        return m_base;
+    }
+    /**
+    * Return the number of bytes used by the targets, excluding the base
+    */
+    std::size_t memory_size() const
+    {
+        return m_vertices.size() * sizeof(std::uint32_t) + m_deltas.size() * sizeof(float) +
+               m_targets.size() * sizeof(Target);
+    }
+private:
+    struct Target
+    {
+        std::string name;
+        float default_weight;
+        std::uint32_t first;
+        std::uint32_t count;
+    };
+
+    std::size_t m_vertex_count;
+    std::vector<Target> m_targets;
+    std::vector<std::uint32_t> m_vertices;
+    std::vector<float> m_deltas;
+    std::vector<float> m_base;
+};
+
+
+// Whether meshes of this type can hold the morph targets of their vertices
+template <class TMesh, class = void>
+struct has_morph_targets : std::false_type
+{
+};
+
+
+template <class TMesh>
+struct has_morph_targets<TMesh, decltype(std::declval<TMesh&>().set_morph_targets(std::declval<MorphTargetSet>()))>
+    : std::true_type
+{
+};
+
+
+/**
+* Return whether `weights` are the weights last applied, one per target,
+* missing weights counting as zero and extra ones being ignored
+*/
+inline bool same_morph_weights(const std::vector<float>& applied, const std::vector<float>& weights)
+{
+    for (std::size_t target = 0; target < applied.size(); ++target)
+    {
+        if (applied[target] != (target < weights.size() ? weights[target] : 0.0f))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+* Blends morph targets on the CPU into a dynamic position and normal stream
+*
+* Work is proportional to the deltas of the targets with non-zero weights:
+* instead of starting from a full copy of the undeformed mesh every time,
+* only the vertices the previous blend touched are restored.
+*/
+class MorphAccumulator
+{
+public:
+    /**
+    * Constructor
+    * @param targets are the morph targets, which must outlive the accumulator
+    */
+    explicit MorphAccumulator(const MorphTargetSet& targets) : m_targets{&targets},
+                                                              m_stream(targets.get_base()),
+                                                              m_marks(targets.get_vertex_count(), 0),
+                                                              m_weights(targets.size(), 0.0f),
+                                                              m_dirty_begin{std::numeric_limits<std::size_t>::max()},
+                                                              m_dirty_end{0}
+    {
+    }
+    /**
+    * Blend the targets by `weights`, one weight per target, missing weights
+    * are zero and extra ones are ignored
+    * @return whether the stream changed
+    */
+    bool apply(const std::vector<float>& weights)
+    {
+        if (same_morph_weights(m_weights, weights))
+        {
+            return false;
+        }
+        for (std::size_t target = 0; target < m_weights.size(); ++target)
+        {
+            m_weights[target] = target < weights.size() ? weights[target] : 0.0f;
+        }
+
+        const float* base = m_targets->get_base().data();
+        for (std::uint32_t vertex : m_touched)
+        {
+            std::copy_n(base + vertex * MorphTargetSet::floats_per_vertex,
+                        static_cast<int>(MorphTargetSet::floats_per_vertex),
+                        m_stream.data() + vertex * MorphTargetSet::floats_per_vertex);
+            mark_dirty(vertex);
+        }
+        m_touched.clear();
+
+        const std::uint32_t* vertices = m_targets->get_vertices().data();
+        const float* deltas = m_targets->get_deltas().data();
+        for (std::size_t target = 0; target < m_targets->size(); ++target)
+        {
+            if (m_weights[target] == 0.0f)
+            {
+                continue;
+            }
+            const simd::Lanes::type weight = simd::Lanes::set(m_weights[target]);
+            const std::size_t first = m_targets->get_first_delta(target);
+            const std::size_t last = first + m_targets->get_delta_count(target);
+            for (std::size_t i = first; i < last; ++i)
+            {
+                const std::uint32_t vertex = vertices[i];
+                if (!m_marks[vertex])
+                {
+                    m_marks[vertex] = 1;
+                    m_touched.push_back(vertex);
+                }
+                float* destination = m_stream.data() + vertex * MorphTargetSet::floats_per_vertex;
+                const float* delta = deltas + i * MorphTargetSet::floats_per_vertex;
+                for (int c = 0; c < MorphTargetSet::floats_per_vertex; c += simd::Lanes::width)
+                {
+                    const simd::Lanes::type scaled = simd::Lanes::mul(simd::Lanes::load(delta + c), weight);
+                    simd::Lanes::store(destination + c, simd::Lanes::add(simd::Lanes::load(destination + c), scaled));
+                }
+            }
+        }
+        for (std::uint32_t vertex : m_touched)
+        {
+            m_marks[vertex] = 0;
+            normalize_normal(m_stream.data() + vertex * MorphTargetSet::floats_per_vertex);
+            mark_dirty(vertex);
+        }
+        return true;
+    }
+    /**
+    * Return the blended position and normal of every vertex, as two vec4
+    */
+    const std::vector<float>& get_stream() const noexcept
+    {
+        return m_stream;
+    }
+    /**
+    * Return the first vertex changed since the last `clear_dirty`
+    */
+    std::size_t get_dirty_begin() const noexcept
+    {
+        return m_dirty_end > 0 ? m_dirty_begin : 0;
+    }
+    /**
+    * Return one past the last vertex changed since the last `clear_dirty`
+    */
+    std::size_t get_dirty_end() const noexcept
+    {
+        return m_dirty_end;
+    }
+    void clear_dirty() noexcept
+    {
+        m_dirty_begin = std::numeric_limits<std::size_t>::max();
+        m_dirty_end = 0;
+    }
+private:
+    static void normalize_normal(float* vertex)
+    {
+        // Adding weighted deltas leaves the normals off unit length
+        float* normal = vertex + 4;
+        const float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        if (length > 0.0f)
+        {
+            normal[0] /= length;
+            normal[1] /= length;
+            normal[2] /= length;
+        }
+    }
+    void mark_dirty(std::size_t vertex)
+    {
+        m_dirty_begin = std::min(m_dirty_begin, vertex);
+        m_dirty_end = std::max(m_dirty_end, vertex + 1);
+    }
+private:
+    const MorphTargetSet* m_targets;
+    std::vector<float> m_stream;
+    std::vector<std::uint8_t> m_marks;
+    std::vector<std::uint32_t> m_touched;
+    std::vector<float> m_weights;
+    std::size_t m_dirty_begin;
+    std::size_t m_dirty_end;
+};
+
+
+/**
+* One morphed character using a shared mesh
+*
+* Holds a buffer with the character's morphed positions and normals, which
+* is either uploaded from a `MorphAccumulator` or written by a `MorphPass`.
+*/
+template <class TMesh>
+class MorphInstance
+{
+public:
+    friend class MorphPass;
+    using mesh_type = TMesh;
+    using program_type = typename mesh_type::program_type;
+
+    /**
+    * Constructor
+    * @param mesh is the morphed mesh, which must outlive the instance
+    * @param targets are the morph targets of the mesh
+    */
+    MorphInstance(const mesh_type& mesh, const MorphTargetSet& targets) : m_mesh(&mesh),
+                                                                          m_vao(0),
+                                                                          m_morphed(0),
+                                                                          m_weights(targets.size(), 0.0f)
+    {
+        const auto& base = targets.get_base();
+        glGenBuffers(1, &m_morphed);
+        glBindBuffer(GL_ARRAY_BUFFER, m_morphed);
+        glBufferData(GL_ARRAY_BUFFER, base.size() * sizeof(float), base.data(), GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        m_vao = make_deformed_vertex_array(mesh, m_morphed);
+    }
+    ~MorphInstance()
+    {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_morphed);
+    }
+
+    // Move-only semantics
+    MorphInstance(const MorphInstance&) = delete;
+    MorphInstance& operator=(const MorphInstance&) = delete;
+
+    MorphInstance(MorphInstance&& other) noexcept : m_mesh(other.m_mesh),
+                                                    m_vao(other.m_vao),
+                                                    m_morphed(other.m_morphed),
+                                                    m_weights(std::move(other.m_weights))
+    {
+        other.m_vao = 0;
+        other.m_morphed = 0;
+    }
+    MorphInstance& operator=(MorphInstance&& other) noexcept
+    {
+        std::swap(m_mesh, other.m_mesh);
+        std::swap(m_vao, other.m_vao);
+        std::swap(m_morphed, other.m_morphed);
+        std::swap(m_weights, other.m_weights);
+        return *this;
+    }
+
+    /**
+    * Upload the vertices a CPU accumulator changed since the last upload
+    */
+    void upload(MorphAccumulator& accumulator)
+    {
+        const std::size_t begin = accumulator.get_dirty_begin();
+        const std::size_t end = accumulator.get_dirty_end();
+        accumulator.clear_dirty();
+        if (end <= begin)
+        {
+            return;
+        }
+        const std::size_t vertex_size = MorphTargetSet::floats_per_vertex * sizeof(float);
+        glBindBuffer(GL_ARRAY_BUFFER, m_morphed);
+        glBufferSubData(GL_ARRAY_BUFFER,
+                        begin * vertex_size,
+                        (end - begin) * vertex_size,
+                        accumulator.get_stream().data() + begin * MorphTargetSet::floats_per_vertex);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    /**
+    * Render the morphed vertices with the textures of the mesh
+    */
+    void render(program_type& program) const
+    {
+        m_mesh->render(program, m_vao);
+    }
+    GLuint get_morphed_buffer() const noexcept
+    {
+        return m_morphed;
+    }
+private:
+    const mesh_type* m_mesh;
+    GLuint m_vao;
+    GLuint m_morphed;
+    // Weights last applied by a `MorphPass`
+    std::vector<float> m_weights;
+};
+
+
+/**
+* Morph targets of a mesh uploaded for blending on the GPU
+*/
+class MorphTargetBuffer
+{
+public:
+    explicit MorphTargetBuffer(const MorphTargetSet& targets) : m_targets(&targets)
+    {
+        glGenBuffers(buffer_count, m_buffers);
+        const auto& base = targets.get_base();
+        const auto& vertices = targets.get_vertices();
+        const auto& deltas = targets.get_deltas();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[base_buffer]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, base.size() * sizeof(float), base.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[vertices_buffer]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, vertices.size() * sizeof(std::uint32_t), vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[deltas_buffer]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, deltas.size() * sizeof(float), deltas.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    ~MorphTargetBuffer()
+    {
+        glDeleteBuffers(buffer_count, m_buffers);
+    }
+
+    // Move-only semantics
+    MorphTargetBuffer(const MorphTargetBuffer&) = delete;
+    MorphTargetBuffer& operator=(const MorphTargetBuffer&) = delete;
+
+    MorphTargetBuffer(MorphTargetBuffer&& other) noexcept : m_targets(other.m_targets)
+    {
+        for (int i = 0; i < buffer_count; ++i)
+        {
+            m_buffers[i] = other.m_buffers[i];
+            other.m_buffers[i] = 0;
+        }
+    }
+    MorphTargetBuffer& operator=(MorphTargetBuffer&& other) noexcept
+    {
+        std::swap(m_targets, other.m_targets);
+        std::swap(m_buffers, other.m_buffers);
+        return *this;
+    }
+
+    const MorphTargetSet& get_targets() const noexcept
+    {
+        return *m_targets;
+    }
+private:
+    friend class MorphPass;
+
+    enum
+    {
+        base_buffer,
+        vertices_buffer,
+        deltas_buffer,
+        buffer_count
+    };
+
+    const MorphTargetSet* m_targets;
+    GLuint m_buffers[buffer_count];
+};
+
+
+/**
+* Compute shader of the morph pass, running one stage over the vertices
+* moved by one target: restoring them, adding the weighted deltas or
+* renormalizing the normals
+*/
+const char* const morph_compute_glsl = R"glsl(
+#version 430
+
+layout (local_size_x = 64) in;
+
+layout (std430, binding = 0) readonly buffer DeltaVertices
+{
+    uint delta_vertices[];
+};
+
+layout (std430, binding = 1) readonly buffer Deltas
+{
+    vec4 deltas[];
+};
+
+layout (std430, binding = 2) buffer MorphedVertices
+{
+    vec4 morphed[];
+};
+
+layout (std430, binding = 3) readonly buffer BaseVertices
+{
+    vec4 base[];
+};
+
+const uint stage_restore = 0u;
+const uint stage_add = 1u;
+const uint stage_normalize = 2u;
+
+uniform uint stage;
+uniform uint first_delta;
+uniform uint delta_count;
+uniform float weight;
+
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= delta_count)
+    {
+        return;
+    }
+    uint delta = first_delta + index;
+    uint vertex = delta_vertices[delta];
+    if (stage == stage_restore)
+    {
+        morphed[vertex * 2u] = base[vertex * 2u];
+        morphed[vertex * 2u + 1u] = base[vertex * 2u + 1u];
+    }
+    else if (stage == stage_add)
+    {
+        morphed[vertex * 2u] += deltas[delta * 2u] * weight;
+        morphed[vertex * 2u + 1u] += deltas[delta * 2u + 1u] * weight;
+    }
+    else
+    {
+        vec3 normal = morphed[vertex * 2u + 1u].xyz;
+        if (dot(normal, normal) > 0.0)
+        {
+            morphed[vertex * 2u + 1u].xyz = normalize(normal);
+        }
+    }
+}
+)glsl";
+
+
+/**
+* Blends morph targets on the GPU, dispatching only the targets with
+* non-zero weights of instances whose weights changed
+*
+* Like `MorphAccumulator`, only the vertices moved by the previous targets
+* are restored, so work is proportional to the deltas of the targets with
+* non-zero weights rather than to the vertex count.
+*
+* Requires OpenGL 4.3, which llvmpipe provides as well.
+*/
+class MorphPass
+{
+public:
+    MorphPass() : m_dispatched(0)
+    {
+        shaders::ComputeShader shader(morph_compute_glsl, shaders::from_source);
+        m_program.attach(shader);
+        m_program.link();
+        m_stage_location = glGetUniformLocation(m_program.get_handle(), "stage");
+        m_first_location = glGetUniformLocation(m_program.get_handle(), "first_delta");
+        m_count_location = glGetUniformLocation(m_program.get_handle(), "delta_count");
+        m_weight_location = glGetUniformLocation(m_program.get_handle(), "weight");
+    }
+    /**
+    * Blend the targets into the morphed vertices of the instance, unless
+    * the weights are the same as last time
+    * @param weights holds one weight per target, missing weights are zero
+    *        and extra ones are ignored
+    * @return whether the instance was morphed
+    */
+    template <class TMesh>
+    bool apply(MorphInstance<TMesh>& instance, const MorphTargetBuffer& targets, const std::vector<float>& weights)
+    {
+        if (same_morph_weights(instance.m_weights, weights))
+        {
+            return false;
+        }
+        const auto& set = targets.get_targets();
+        m_program.use();
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, targets.m_buffers[MorphTargetBuffer::vertices_buffer]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, targets.m_buffers[MorphTargetBuffer::deltas_buffer]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, instance.m_morphed);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, targets.m_buffers[MorphTargetBuffer::base_buffer]);
+
+        // Restore the vertices moved by the previous targets, restoring a
+        // vertex twice writes the same values
+        for (std::size_t target = 0; target < set.size(); ++target)
+        {
+            if (instance.m_weights[target] != 0.0f)
+            {
+                dispatch(set, target, stage_restore, 0.0f);
+            }
+        }
+        for (std::size_t target = 0; target < set.size(); ++target)
+        {
+            instance.m_weights[target] = target < weights.size() ? weights[target] : 0.0f;
+        }
+        // Targets may move the same vertices, so each one has to see the
+        // writes of the previous one
+        for (std::size_t target = 0; target < set.size(); ++target)
+        {
+            if (instance.m_weights[target] != 0.0f)
+            {
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+                dispatch(set, target, stage_add, instance.m_weights[target]);
+            }
+        }
+        for (std::size_t target = 0; target < set.size(); ++target)
+        {
+            if (instance.m_weights[target] != 0.0f)
+            {
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+                dispatch(set, target, stage_normalize, 0.0f);
+            }
+        }
+        ++m_dispatched;
+        return true;
+    }
+    /**
+    * Make the morphed vertices written since the last call visible to
+    * vertex fetching, must be called before rendering them
+    */
+    void finish()
+    {
+        if (m_dispatched > 0)
+        {
+            glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+            m_dispatched = 0;
+        }
+    }
+private:
+    // Stages of `morph_compute_glsl`
+    enum : GLuint
+    {
+        stage_restore,
+        stage_add,
+        stage_normalize
+    };
+
+    void dispatch(const MorphTargetSet& set, std::size_t target, GLuint stage, float weight)
+    {
+        const auto count = static_cast<GLuint>(set.get_delta_count(target));
+        if (count == 0)
+        {
+            return;
+        }
+        glUniform1ui(m_stage_location, stage);
+        glUniform1ui(m_first_location, static_cast<GLuint>(set.get_first_delta(target)));
+        glUniform1ui(m_count_location, count);
+        glUniform1f(m_weight_location, weight);
+        glDispatchCompute((count + 63) / 64, 1, 1);
+    }
+private:
+    shaders::GLSLProgram m_program;
+    GLint m_stage_location;
+    GLint m_first_location;
+    GLint m_count_location;
+    GLint m_weight_location;
+    std::size_t m_dispatched;
+};
+
+
+}  // namespace animation
+
+
+}  // namespace crudegl
@@ -0,0 +1,513 @@
+#pragma once
+
+#include "bounds.h"
+#include "bvh.h"
+#include "jobs.h"
+#include "memory.h"
+#include "simd.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace geometry
+{
+
+
+/**
+* Triangles of a mesh, or of a simplified version of it, rendered into an
+* `OcclusionBuffer`
+*
+* Simplified occluders must stay inside the silhouette of the mesh they stand
+* for, anything sticking out wrongly hides the meshes behind it.
+*/
+class Occluder
+{
+public:
+    /**
+    * Constructor
+    * @param indices are three indices into `positions` per triangle
+    */
+    Occluder(std::vector<glm::vec3> positions, std::vector<std::uint32_t> indices) : m_positions(std::move(positions)),
+                                                                                     m_indices(std::move(indices))
+    {
+        for (const glm::vec3& position : m_positions)
+        {
+            m_bounds.expand(position);
+        }
+    }
+    const std::vector<glm::vec3>& get_positions() const noexcept
+    {
+        return m_positions;
+    }
+    const std::vector<std::uint32_t>& get_indices() const noexcept
+    {
+        return m_indices;
+    }
+    const BoundingBox& get_bounds() const noexcept
+    {
+        return m_bounds;
+    }
+private:
+    std::vector<glm::vec3> m_positions;
+    std::vector<std::uint32_t> m_indices;
+    BoundingBox m_bounds;
+};
+
+
+// Whether meshes of this type can be designated as occluders
+template <class TMesh, class = void>
+struct has_occluder : std::false_type
+{
+};
+
+
+template <class TMesh>
+struct has_occluder<TMesh, decltype(std::declval<TMesh&>().set_occluder(std::shared_ptr<const Occluder>()))>
+    : std::true_type
+{
+};
+
+
+struct OccluderInstance
+{
+    const Occluder* occluder;
+    glm::mat4 model;
+};
+
+
+/**
+* Low resolution depth buffer rasterized on the CPU from occluders, with a
+* hierarchical depth pyramid to test the bounds of meshes against
+*
+* Occluder triangles are transformed and set up in parallel per occluder,
+* then the screen is split into tiles rasterized in parallel, each testing a
+* row of pixels per SIMD operation. Every level of the pyramid stores the
+* farthest depth of the 2x2 texels below it, so a box is hidden when its
+* nearest depth lies behind the few texels covering its screen rectangle.
+*
+* Depth follows the OpenGL conventions mapped to [0, 1], one meaning far.
+*/
+class OcclusionBuffer
+{
+public:
+    enum
+    {
+        tile_width = 32,
+        tile_height = 16
+    };
+
+    /**
+    * Constructor
+    * @param width and `height` are rounded up to whole tiles
+    * @param jobs runs occluder setup, tile rasterization and tests in parallel
+    */
+    OcclusionBuffer(std::size_t width = 256, std::size_t height = 128, jobs::JobSystem* jobs = nullptr)
+        : m_width((width + tile_width - 1) / tile_width * tile_width),
+          m_height((height + tile_height - 1) / tile_height * tile_height),
+          m_jobs(jobs),
+          m_arenas(nullptr),
+          m_view_projection(1.0f)
+    {
+        std::size_t level_width = m_width;
+        std::size_t level_height = m_height;
+        m_levels.push_back(Level{level_width, level_height, std::vector<float>(level_width * level_height, 1.0f)});
+        while (level_width > 1 || level_height > 1)
+        {
+            level_width = (level_width + 1) / 2;
+            level_height = (level_height + 1) / 2;
+            m_levels.push_back(Level{level_width, level_height, std::vector<float>(level_width * level_height, 1.0f)});
+        }
+    }
+    /**
+    * Draw the scratch memory of every frame from frame arenas, which must
+    * use the job system of the buffer, instead of the heap
+    */
+    void set_frame_arenas(memory::FrameArenas* arenas)
+    {
+        m_arenas = arenas;
+    }
+    /**
+    * Rasterize the occluders seen through `view_projection` and rebuild the
+    * depth pyramid, replacing the previous frame
+    */
+    void render(const glm::mat4& view_projection, const std::vector<OccluderInstance>& occluders)
+    {
+        m_view_projection = view_projection;
+        const Frustum frustum(view_projection);
+        m_triangles.resize(occluders.size());
+        jobs::parallel_for(m_jobs, 0, occluders.size(), [&](std::size_t i)
+                           {
+                               m_triangles[i].clear();
+                               const OccluderInstance& instance = occluders[i];
+                               if (frustum.intersects(instance.occluder->get_bounds().transformed(instance.model)))
+                               {
+                                   setup(*instance.occluder, view_projection * instance.model, m_triangles[i]);
+                               }
+                           });
+        const std::size_t tiles_x = m_width / tile_width;
+        const std::size_t tiles_y = m_height / tile_height;
+        jobs::parallel_for(m_jobs, 0, tiles_x * tiles_y, [&](std::size_t tile)
+                           {
+                               rasterize_tile((tile % tiles_x) * tile_width, (tile / tiles_x) * tile_height);
+                           });
+        build_pyramid();
+    }
+    /**
+    * Return whether anything of the box in world space may be visible
+    *
+    * Boxes crossing the near plane are visible, boxes entirely outside the
+    * screen are not.
+    */
+    bool is_visible(const BoundingBox& bounds) const
+    {
+        if (bounds.empty())
+        {
+            return false;
+        }
+        glm::vec3 minimum(std::numeric_limits<float>::max());
+        glm::vec3 maximum(-std::numeric_limits<float>::max());
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            const glm::vec4 position(corner & 1 ? bounds.maximum.x : bounds.minimum.x,
+                                     corner & 2 ? bounds.maximum.y : bounds.minimum.y,
+                                     corner & 4 ? bounds.maximum.z : bounds.minimum.z,
+                                     1.0f);
+            const glm::vec4 clip = m_view_projection * position;
+            if (clip.z < -clip.w || clip.w <= 0.0f)
+            {
+                return true;
+            }
+            const glm::vec3 screen = to_screen(clip);
+            minimum = glm::min(minimum, screen);
+            maximum = glm::max(maximum, screen);
+        }
+        if (maximum.x < 0.0f || maximum.y < 0.0f || minimum.x >= m_width || minimum.y >= m_height || minimum.z > 1.0f)
+        {
+            return false;
+        }
+        const auto x0 = static_cast<std::size_t>(std::max(minimum.x, 0.0f));
+        const auto y0 = static_cast<std::size_t>(std::max(minimum.y, 0.0f));
+        const auto x1 = std::min(static_cast<std::size_t>(maximum.x), m_width - 1);
+        const auto y1 = std::min(static_cast<std::size_t>(maximum.y), m_height - 1);
+
+        // The finest level covering the rectangle with at most 2x2 texels
+        std::size_t level = 0;
+        while (level + 1 < m_levels.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+        {
+            ++level;
+        }
+        const Level& depths = m_levels[level];
+        for (std::size_t y = y0 >> level; y <= y1 >> level; ++y)
+        {
+            for (std::size_t x = x0 >> level; x <= x1 >> level; ++x)
+            {
+                if (depths.depth[y * depths.width + x] >= minimum.z)
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    /**
+    * Test many boxes at once
+    * @param visible receives one flag per box
+    */
+    void test(const std::vector<BoundingBox>& bounds, std::vector<std::uint8_t>& visible) const
+    {
+        visible.resize(bounds.size());
+        jobs::parallel_for(m_jobs, 0, bounds.size(), [&](std::size_t i)
+                           {
+                               visible[i] = is_visible(bounds[i]) ? 1 : 0;
+                           },
+                           64);
+    }
+    /**
+    * Remove the meshes hidden behind the occluders from `handles`, e.g. the
+    * result of a frustum query of the same scene
+    */
+    void filter(const SceneBVH& scene, std::vector<MeshHandle>& handles) const
+    {
+        memory::ArenaVector<std::uint8_t> visible(handles.size(), 0, get_arena());
+        jobs::parallel_for(m_jobs, 0, handles.size(), [&](std::size_t i)
+                           {
+                               visible[i] = is_visible(scene.get_bounds(handles[i])) ? 1 : 0;
+                           },
+                           64);
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < handles.size(); ++i)
+        {
+            if (visible[i])
+            {
+                handles[kept++] = handles[i];
+            }
+        }
+        handles.resize(kept);
+    }
+    std::size_t get_width() const noexcept
+    {
+        return m_width;
+    }
+    std::size_t get_height() const noexcept
+    {
+        return m_height;
+    }
+    std::size_t get_level_count() const noexcept
+    {
+        return m_levels.size();
+    }
+    /**
+    * Return the depths of a pyramid level row by row, bottom row first, level
+    * zero being the rasterized depth
+    */
+    const std::vector<float>& get_depth(std::size_t level = 0) const
+    {
+        return m_levels[level].depth;
+    }
+private:
+    // Screen space triangle as edge functions and a depth plane, each
+    // evaluated as a * x + b * y + c
+    struct Triangle
+    {
+        float edge_a[3];
+        float edge_b[3];
+        float edge_c[3];
+        float depth_a;
+        float depth_b;
+        float depth_c;
+        int min_x;
+        int min_y;
+        int max_x;
+        int max_y;
+    };
+
+    struct Level
+    {
+        std::size_t width;
+        std::size_t height;
+        std::vector<float> depth;
+    };
+
+    /**
+    * Return the frame arena of the calling thread, null to use the heap
+    */
+    memory::LinearArena* get_arena() const
+    {
+        return m_arenas ? &m_arenas->get() : nullptr;
+    }
+    glm::vec3 to_screen(const glm::vec4& clip) const
+    {
+        const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        return glm::vec3((ndc.x * 0.5f + 0.5f) * m_width, (ndc.y * 0.5f + 0.5f) * m_height, ndc.z * 0.5f + 0.5f);
+    }
+    /**
+    * Transform the triangles of an occluder to the screen, clipping them at
+    * the near plane
+    */
+    void setup(const Occluder& occluder, const glm::mat4& model_view_projection, std::vector<Triangle>& triangles) const
+    {
+        const auto& positions = occluder.get_positions();
+        const auto& indices = occluder.get_indices();
+        memory::ArenaVector<glm::vec4> clip(positions.size(), glm::vec4(), get_arena());
+        for (std::size_t i = 0; i < positions.size(); ++i)
+        {
+            clip[i] = model_view_projection * glm::vec4(positions[i], 1.0f);
+        }
+        for (std::size_t i = 0; i + 2 < indices.size(); i += 3)
+        {
+            const glm::vec4 corners[3] = {clip[indices[i]], clip[indices[i + 1]], clip[indices[i + 2]]};
+            // Signed distances from the near plane
+            float distances[3];
+            int inside = 0;
+            for (int c = 0; c < 3; ++c)
+            {
+                distances[c] = corners[c].z + corners[c].w;
+                inside += distances[c] >= 0.0f ? 1 : 0;
+            }
+            if (inside == 3)
+            {
+                add_triangle(to_screen(corners[0]), to_screen(corners[1]), to_screen(corners[2]), triangles);
+                continue;
+            }
+            if (inside == 0)
+            {
+                continue;
+            }
+            // Clip the polygon, leaving three or four corners
+            glm::vec3 polygon[4];
+            int count = 0;
+            for (int c = 0; c < 3; ++c)
+            {
+                const int next = (c + 1) % 3;
+                if (distances[c] >= 0.0f)
+                {
+                    polygon[count++] = to_screen(corners[c]);
+                }
+                if ((distances[c] >= 0.0f) != (distances[next] >= 0.0f))
+                {
+                    const float t = distances[c] / (distances[c] - distances[next]);
+                    polygon[count++] = to_screen(corners[c] + (corners[next] - corners[c]) * t);
+                }
+            }
+            for (int c = 2; c < count; ++c)
+            {
+                add_triangle(polygon[0], polygon[c - 1], polygon[c], triangles);
+            }
+        }
+    }
+    void add_triangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, std::vector<Triangle>& triangles) const
+    {
+        const float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+        if (area == 0.0f || !std::isfinite(area))
+        {
+            return;
+        }
+        const float min_x = std::min(std::min(v0.x, v1.x), v2.x);
+        const float min_y = std::min(std::min(v0.y, v1.y), v2.y);
+        const float max_x = std::max(std::max(v0.x, v1.x), v2.x);
+        const float max_y = std::max(std::max(v0.y, v1.y), v2.y);
+        if (max_x < 0.0f || max_y < 0.0f || min_x >= m_width || min_y >= m_height)
+        {
+            return;
+        }
+        Triangle triangle;
+        // Both windings are rasterized, edges are flipped so that inside is
+        // positive
+        const float sign = area > 0.0f ? 1.0f : -1.0f;
+        const glm::vec3 corners[3] = {v0, v1, v2};
+        for (int e = 0; e < 3; ++e)
+        {
+            const glm::vec3& a = corners[e];
+            const glm::vec3& b = corners[(e + 1) % 3];
+            triangle.edge_a[e] = sign * (a.y - b.y);
+            triangle.edge_b[e] = sign * (b.x - a.x);
+            triangle.edge_c[e] = sign * (a.x * b.y - a.y * b.x);
+        }
+        // Depth plane through the corners
+        const float inverse_area = 1.0f / area;
+        triangle.depth_a = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) * inverse_area;
+        triangle.depth_b = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) * inverse_area;
+        triangle.depth_c = v0.z - triangle.depth_a * v0.x - triangle.depth_b * v0.y;
+        triangle.min_x = static_cast<int>(std::max(min_x, 0.0f));
+        triangle.min_y = static_cast<int>(std::max(min_y, 0.0f));
+        triangle.max_x = static_cast<int>(std::min(max_x, static_cast<float>(m_width - 1)));
+        triangle.max_y = static_cast<int>(std::min(max_y, static_cast<float>(m_height - 1)));
+        triangles.push_back(triangle);
+    }
+    void rasterize_tile(std::size_t tile_x, std::size_t tile_y)
+    {
+        using simd::Lanes;
+        static const float lane_offsets[8] = {0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f};
+        std::vector<float>& depth = m_levels[0].depth;
+        for (std::size_t y = tile_y; y < tile_y + tile_height; ++y)
+        {
+            std::fill_n(depth.begin() + y * m_width + tile_x, static_cast<int>(tile_width), 1.0f);
+        }
+        const int tile_min_x = static_cast<int>(tile_x);
+        const int tile_min_y = static_cast<int>(tile_y);
+        const int tile_max_x = tile_min_x + tile_width - 1;
+        const int tile_max_y = tile_min_y + tile_height - 1;
+        const Lanes::type offsets = Lanes::load(lane_offsets);
+        const Lanes::type zero = Lanes::set(0.0f);
+        for (const auto& triangles : m_triangles)
+        {
+            for (const Triangle& triangle : triangles)
+            {
+                if (triangle.max_x < tile_min_x || triangle.min_x > tile_max_x ||
+                    triangle.max_y < tile_min_y || triangle.min_y > tile_max_y)
+                {
+                    continue;
+                }
+                // Start at a whole block of lanes within the tile
+                const int x0 = tile_min_x + (std::max(triangle.min_x, tile_min_x) - tile_min_x) / Lanes::width * Lanes::width;
+                const int x1 = std::min(triangle.max_x, tile_max_x);
+                const int y0 = std::max(triangle.min_y, tile_min_y);
+                const int y1 = std::min(triangle.max_y, tile_max_y);
+                Lanes::type edge_a[3];
+                for (int e = 0; e < 3; ++e)
+                {
+                    edge_a[e] = Lanes::set(triangle.edge_a[e]);
+                }
+                const Lanes::type depth_a = Lanes::set(triangle.depth_a);
+                for (int y = y0; y <= y1; ++y)
+                {
+                    const float center_y = y + 0.5f;
+                    Lanes::type edge_row[3];
+                    for (int e = 0; e < 3; ++e)
+                    {
+                        edge_row[e] = Lanes::set(triangle.edge_b[e] * center_y + triangle.edge_c[e]);
+                    }
+                    const Lanes::type depth_row = Lanes::set(triangle.depth_b * center_y + triangle.depth_c);
+                    float* row = depth.data() + y * m_width;
+                    for (int x = x0; x <= x1; x += Lanes::width)
+                    {
+                        const Lanes::type center_x = Lanes::add(Lanes::set(static_cast<float>(x)), offsets);
+                        Lanes::mask inside = Lanes::less_equal(zero, Lanes::add(Lanes::mul(edge_a[0], center_x), edge_row[0]));
+                        for (int e = 1; e < 3; ++e)
+                        {
+                            const Lanes::type edge = Lanes::add(Lanes::mul(edge_a[e], center_x), edge_row[e]);
+                            inside = Lanes::both(inside, Lanes::less_equal(zero, edge));
+                        }
+                        if (!Lanes::bits(inside))
+                        {
+                            continue;
+                        }
+                        const Lanes::type z = Lanes::add(Lanes::mul(depth_a, center_x), depth_row);
+                        const Lanes::type previous = Lanes::load(row + x);
+                        Lanes::store(row + x, Lanes::select(inside, Lanes::min(previous, z), previous));
+                    }
+                }
+            }
+        }
+    }
+    void build_pyramid()
+    {
+        for (std::size_t level = 1; level < m_levels.size(); ++level)
+        {
+            const Level& source = m_levels[level - 1];
+            Level& destination = m_levels[level];
+            for (std::size_t y = 0; y < destination.height; ++y)
+            {
+                const std::size_t y0 = y * 2;
+                const std::size_t y1 = std::min(y0 + 1, source.height - 1);
+                for (std::size_t x = 0; x < destination.width; ++x)
+                {
+                    const std::size_t x0 = x * 2;
+                    const std::size_t x1 = std::min(x0 + 1, source.width - 1);
+                    destination.depth[y * destination.width + x] =
+                        std::max(std::max(source.depth[y0 * source.width + x0], source.depth[y0 * source.width + x1]),
+                                 std::max(source.depth[y1 * source.width + x0], source.depth[y1 * source.width + x1]));
+                }
+            }
+        }
+    }
+private:
+    std::size_t m_width;
+    std::size_t m_height;
+    jobs::JobSystem* m_jobs;
+    memory::FrameArenas* m_arenas;
+    glm::mat4 m_view_projection;
+    // Screen space triangles of every occluder of the current frame
+    std::vector<std::vector<Triangle>> m_triangles;
+    std::vector<Level> m_levels;
+};
+
+
+}  // namespace geometry
+
+
+}  // namespace crudegl
@@ -0,0 +1,398 @@
+#pragma once
+
+#include "bounds.h"
+#include "bvh.h"
+#include "jobs.h"
+#include "simd.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace geometry
+{
+
+
+struct TriangleHit
+{
+    std::uint32_t triangle;
+    // Weights of the second and third vertex at the hit point
+    float u;
+    float v;
+    float distance;
+};
+
+
+/**
+* CPU copy of the triangles of a mesh with a BVH over them, for picking
+*
+* The triangles of every leaf are stored as one vertex and two edges in
+* structure of arrays blocks of the SIMD lane width, so that a leaf is
+* intersected with a few Moller-Trumbore tests of a full register each.
+* Blocks are padded with degenerate triangles, which never hit.
+*/
+class TriangleBVH
+{
+public:
+    /**
+    * Constructor
+    * Build the BVH over the triangles, in parallel if given a job system
+    * @param indices are three indices into `positions` per triangle
+    */
+    template <class TPositionAllocator, class TIndexAllocator>
+    TriangleBVH(const std::vector<glm::vec3, TPositionAllocator>& positions,
+                const std::vector<GLuint, TIndexAllocator>& indices,
+                jobs::JobSystem* jobs = nullptr) : m_triangle_count(indices.size() / 3)
+    {
+        const std::size_t triangle_count = m_triangle_count;
+        std::vector<BVHPrimitive> primitives(triangle_count);
+        jobs::parallel_for(jobs, 0, triangle_count, [&](std::size_t i)
+                           {
+                               BoundingBox bounds;
+                               for (std::size_t corner = 0; corner < 3; ++corner)
+                               {
+                                   bounds.expand(positions[indices[i * 3 + corner]]);
+                               }
+                               primitives[i] = BVHPrimitive{bounds, bounds.center(), static_cast<std::uint32_t>(i)};
+                           },
+                           1024);
+        m_nodes = BVHBuilder(bvh_width, 16, jobs).build(primitives);
+
+        // Give every leaf a range of whole blocks
+        struct Leaf
+        {
+            std::uint32_t source;
+            std::uint32_t count;
+            std::uint32_t destination;
+        };
+        std::vector<Leaf> leaves;
+        std::size_t slot_count = 0;
+        for (BVHNode& node : m_nodes)
+        {
+            for (std::size_t slot = 0; slot < node.child_count; ++slot)
+            {
+                if (node.count[slot] == 0)
+                {
+                    continue;
+                }
+                leaves.push_back(Leaf{node.child[slot], node.count[slot], static_cast<std::uint32_t>(slot_count)});
+                node.child[slot] = static_cast<std::uint32_t>(slot_count);
+                slot_count += (node.count[slot] + simd::Lanes::width - 1) / simd::Lanes::width * simd::Lanes::width;
+            }
+        }
+        for (auto& stream : m_streams)
+        {
+            stream.assign(slot_count, 0.0f);
+        }
+        m_triangles.assign(slot_count, std::numeric_limits<std::uint32_t>::max());
+        jobs::parallel_for(jobs, 0, leaves.size(), [&](std::size_t i)
+                           {
+                               const Leaf& leaf = leaves[i];
+                               for (std::uint32_t j = 0; j < leaf.count; ++j)
+                               {
+                                   const std::uint32_t triangle = primitives[leaf.source + j].index;
+                                   const std::uint32_t destination = leaf.destination + j;
+                                   const glm::vec3& a = positions[indices[triangle * 3]];
+                                   const glm::vec3 edges[2] = {positions[indices[triangle * 3 + 1]] - a,
+                                                               positions[indices[triangle * 3 + 2]] - a};
+                                   for (int axis = 0; axis < 3; ++axis)
+                                   {
+                                       m_streams[vertex_x + axis][destination] = a[axis];
+                                       m_streams[edge1_x + axis][destination] = edges[0][axis];
+                                       m_streams[edge2_x + axis][destination] = edges[1][axis];
+                                   }
+                                   m_triangles[destination] = triangle;
+                               }
+                           },
+                           64);
+        for (std::size_t i = 0; i < triangle_count; ++i)
+        {
+            m_bounds.expand(primitives[i].bounds);
+        }
+    }
+    /**
+    * Find the nearest triangle hit by the ray within `max_distance`
+    *
+    * Distances are measured in multiples of the length of the ray direction.
+    * Triangles are hit from both sides.
+    */
+    bool intersect(const Ray& ray, float max_distance, TriangleHit& hit) const
+    {
+        bool found = false;
+        traverse_bvh(m_nodes, ray, max_distance, [&](std::uint32_t first, std::uint32_t count, float distance)
+                     {
+                         for (std::uint32_t i = first; i < first + count; i += simd::Lanes::width)
+                         {
+                             if (intersect_block(ray, i, distance, hit))
+                             {
+                                 distance = hit.distance;
+                                 found = true;
+                             }
+                         }
+                         return distance;
+                     });
+        return found;
+    }
+    /**
+    * Return the bounds of all triangles, in the space of the positions
+    */
+    const BoundingBox& get_bounds() const noexcept
+    {
+        return m_bounds;
+    }
+    std::size_t get_triangle_count() const noexcept
+    {
+        return m_triangle_count;
+    }
+    /**
+    * Return the number of bytes used by the nodes and triangles
+    */
+    std::size_t memory_size() const noexcept
+    {
+        return m_nodes.size() * sizeof(BVHNode) +
+               m_triangles.size() * (sizeof(std::uint32_t) + stream_count * sizeof(float));
+    }
+private:
+    enum Stream
+    {
+        vertex_x,
+        vertex_y,
+        vertex_z,
+        edge1_x,
+        edge1_y,
+        edge1_z,
+        edge2_x,
+        edge2_y,
+        edge2_z,
+        stream_count
+    };
+
+    /**
+    * Intersect the ray with one block of triangles, updating `hit` when a
+    * triangle is nearer than `max_distance`
+    */
+    bool intersect_block(const Ray& ray, std::uint32_t first, float max_distance, TriangleHit& hit) const
+    {
+        using simd::Lanes;
+        Lanes::type vertex[3];
+        Lanes::type edge1[3];
+        Lanes::type edge2[3];
+        Lanes::type direction[3];
+        Lanes::type offset[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            vertex[axis] = Lanes::load(m_streams[vertex_x + axis].data() + first);
+            edge1[axis] = Lanes::load(m_streams[edge1_x + axis].data() + first);
+            edge2[axis] = Lanes::load(m_streams[edge2_x + axis].data() + first);
+            direction[axis] = Lanes::set(ray.direction[axis]);
+            offset[axis] = Lanes::sub(Lanes::set(ray.origin[axis]), vertex[axis]);
+        }
+        Lanes::type p[3];
+        Lanes::type q[3];
+        cross(direction, edge2, p);
+        cross(offset, edge1, q);
+        const Lanes::type determinant = dot(edge1, p);
+        const Lanes::type inverse = Lanes::div(Lanes::set(1.0f), determinant);
+        const Lanes::type u = Lanes::mul(dot(offset, p), inverse);
+        const Lanes::type v = Lanes::mul(dot(direction, q), inverse);
+        const Lanes::type t = Lanes::mul(dot(edge2, q), inverse);
+
+        // Degenerate triangles and rays parallel to a triangle divide by
+        // zero, their NaN coordinates fail the comparisons
+        const Lanes::type zero = Lanes::set(0.0f);
+        Lanes::mask inside = Lanes::both(Lanes::less_equal(zero, u), Lanes::less_equal(zero, v));
+        inside = Lanes::both(inside, Lanes::less_equal(Lanes::add(u, v), Lanes::set(1.0f)));
+        inside = Lanes::both(inside, Lanes::less_equal(zero, t));
+        inside = Lanes::both(inside, Lanes::less_equal(t, Lanes::set(max_distance)));
+        int hits = Lanes::bits(inside);
+        if (!hits)
+        {
+            return false;
+        }
+        float distances[simd::Lanes::width];
+        float us[simd::Lanes::width];
+        float vs[simd::Lanes::width];
+        Lanes::store(distances, t);
+        Lanes::store(us, u);
+        Lanes::store(vs, v);
+        bool found = false;
+        for (; hits; hits &= hits - 1)
+        {
+            const int lane = lowest_bit(hits);
+            if (distances[lane] <= max_distance)
+            {
+                max_distance = distances[lane];
+                hit = TriangleHit{m_triangles[first + lane], us[lane], vs[lane], distances[lane]};
+                found = true;
+            }
+        }
+        return found;
+    }
+    static void cross(const simd::Lanes::type a[3], const simd::Lanes::type b[3], simd::Lanes::type result[3])
+    {
+        using simd::Lanes;
+        result[0] = Lanes::sub(Lanes::mul(a[1], b[2]), Lanes::mul(a[2], b[1]));
+        result[1] = Lanes::sub(Lanes::mul(a[2], b[0]), Lanes::mul(a[0], b[2]));
+        result[2] = Lanes::sub(Lanes::mul(a[0], b[1]), Lanes::mul(a[1], b[0]));
+    }
+    static simd::Lanes::type dot(const simd::Lanes::type a[3], const simd::Lanes::type b[3])
+    {
+        using simd::Lanes;
+        return Lanes::add(Lanes::add(Lanes::mul(a[0], b[0]), Lanes::mul(a[1], b[1])), Lanes::mul(a[2], b[2]));
+    }
+private:
+    std::vector<BVHNode> m_nodes;
+    std::vector<float> m_streams[stream_count];
+    // Index of the triangle in every slot of the streams
+    std::vector<std::uint32_t> m_triangles;
+    std::size_t m_triangle_count;
+    BoundingBox m_bounds;
+};
+
+
+// Whether meshes of this type can hold a CPU copy of their triangles
+template <class TMesh, class = void>
+struct has_pick_triangles : std::false_type
+{
+};
+
+
+template <class TMesh>
+struct has_pick_triangles<TMesh, decltype(std::declval<TMesh&>().set_triangles(std::shared_ptr<const TriangleBVH>()))>
+    : std::true_type
+{
+};
+
+
+struct PickHit
+{
+    MeshHandle mesh;
+    std::uint32_t triangle;
+    // Weights of the three vertices of the triangle at the hit point
+    glm::vec3 barycentrics;
+    float distance;
+};
+
+
+/**
+* Picks the nearest triangle of the meshes in a `SceneBVH` hit by a ray
+*
+* The scene BVH finds the meshes whose world bounds the ray hits nearest
+* first, and the ray is intersected with their triangle BVHs in model space,
+* skipping every mesh behind the nearest hit so far.
+*/
+class Picker
+{
+public:
+    /**
+    * Constructor
+    * @param scene holds the world bounds of the meshes, and must outlive
+    *        the picker
+    * @param jobs runs batch queries in parallel
+    */
+    explicit Picker(const SceneBVH& scene, jobs::JobSystem* jobs = nullptr) : m_scene(&scene),
+                                                                              m_jobs(jobs)
+    {
+    }
+    /**
+    * Make a mesh of the scene pickable
+    * @param triangles are the triangles of the mesh in model space
+    * @param model is the model to world transform of the mesh
+    */
+    void set_target(MeshHandle mesh, std::shared_ptr<const TriangleBVH> triangles, const glm::mat4& model)
+    {
+        if (mesh >= m_targets.size())
+        {
+            m_targets.resize(mesh + 1);
+        }
+        m_targets[mesh] = Target{std::move(triangles), glm::inverse(model)};
+    }
+    /**
+    * Update the model to world transform of a pickable mesh
+    */
+    void set_transform(MeshHandle mesh, const glm::mat4& model)
+    {
+        m_targets[mesh].world_to_model = glm::inverse(model);
+    }
+    void clear_target(MeshHandle mesh)
+    {
+        if (mesh < m_targets.size())
+        {
+            m_targets[mesh] = Target();
+        }
+    }
+    /**
+    * Find the nearest triangle hit by the ray, given in world space
+    * @return whether a triangle was hit, `hit.mesh` is `invalid_mesh_handle`
+    *         otherwise
+    */
+    bool pick(const Ray& ray, PickHit& hit, float max_distance = std::numeric_limits<float>::infinity()) const
+    {
+        hit = PickHit{invalid_mesh_handle, 0, glm::vec3(0.0f), max_distance};
+        m_scene->traverse(ray, max_distance, [&](MeshHandle mesh, float distance)
+                          {
+                              if (mesh >= m_targets.size() || !m_targets[mesh].triangles)
+                              {
+                                  return distance;
+                              }
+                              const Target& target = m_targets[mesh];
+                              const Ray model_ray(glm::vec3(target.world_to_model * glm::vec4(ray.origin, 1.0f)),
+                                                  glm::vec3(target.world_to_model * glm::vec4(ray.direction, 0.0f)));
+                              TriangleHit triangle;
+                              if (!target.triangles->intersect(model_ray, distance, triangle))
+                              {
+                                  return distance;
+                              }
+                              hit = PickHit{mesh,
+                                            triangle.triangle,
+                                            glm::vec3(1.0f - triangle.u - triangle.v, triangle.u, triangle.v),
+                                            triangle.distance};
+                              return triangle.distance;
+                          });
+        return hit.mesh != invalid_mesh_handle;
+    }
+    /**
+    * Pick with many rays at once, e.g. for hover highlighting
+    * @param hits receives one hit per ray
+    */
+    void pick(const std::vector<Ray>& rays,
+              std::vector<PickHit>& hits,
+              float max_distance = std::numeric_limits<float>::infinity()) const
+    {
+        hits.resize(rays.size());
+        jobs::parallel_for(m_jobs, 0, rays.size(), [&](std::size_t i)
+                           {
+                               pick(rays[i], hits[i], max_distance);
+                           },
+                           16);
+    }
+private:
+    struct Target
+    {
+        std::shared_ptr<const TriangleBVH> triangles;
+        glm::mat4 world_to_model;
+    };
+
+    const SceneBVH* m_scene;
+    jobs::JobSystem* m_jobs;
+    std::vector<Target> m_targets;
+};
+
+
+}  // namespace geometry
+
+
+}  // namespace crudegl
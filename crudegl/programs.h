@@ -85,6 +85,13 @@ public:
         return attach(shader.get_handle());
     }
     /**
+    * Overloaded version of the above attach method for compute shaders
+    */
+    bool attach(shaders::ComputeShader& shader)
+    {
+        return attach(shader.get_handle());
+    }
+    /**
     * Attempt linking the attached shaders of the program
     */
     void link()
@@ -166,6 +173,10 @@ public:
     {
         glUniform4i(get_uniform_location(name), v0, v1, v2, v3);
     }
+    void set_uniform(const std::string& name, GLuint v0)
+    {
+        glUniform1ui(get_uniform_location(name), v0);
+    }
     void set_uniform(const std::string& name, const std::vector<GLfloat>& values)
     {
         glUniform1fv(get_uniform_location(name), values.size(), glm::value_ptr(values));
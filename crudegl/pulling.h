@@ -0,0 +1,415 @@
+#pragma once
+
+#include "vertices.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+// Shader storage buffer binding points used for vertex pulling, clear of
+// the ones used for skinning
+enum PullingBinding
+{
+    pulled_vertex_binding = 3,
+    pulled_index_binding = 4,
+    pulled_format_binding = 5
+};
+
+
+/**
+* GLSL declarations shared by all pulled vertex formats, reading the vertex
+* pool as 32 bit words at any byte address. Paste them after the version
+* directive of a `#version 430` shader, followed by the helpers of the vertex
+* formats from `make_pulling_glsl`.
+*/
+const char* const vertex_pulling_glsl = R"glsl(
+layout (std430, binding = 3) readonly buffer PulledVertices
+{
+    uint pulled_vertex_words[];
+};
+
+layout (std430, binding = 4) readonly buffer PulledIndices
+{
+    uint pulled_indices[];
+};
+
+uint pulled_word(uint address)
+{
+    uint shift = (address & 3u) * 8u;
+    uint low = pulled_vertex_words[address >> 2];
+    return shift == 0u ? low : (low >> shift) | (pulled_vertex_words[(address >> 2) + 1u] << (32u - shift));
+}
+
+uint pulled_bits(uint address, int bits)
+{
+    return bitfieldExtract(pulled_word(address), 0, bits);
+}
+
+int pulled_signed_bits(uint address, int bits)
+{
+    return bitfieldExtract(int(pulled_word(address)), 0, bits);
+}
+)glsl";
+
+
+/**
+* GLSL declarations returning the format of the current draw of a
+* `VertexPool::draw` mixing formats, for shaders branching on it. Requires
+* `#version 460` or `#extension GL_ARB_shader_draw_parameters : require`.
+*/
+const char* const pulled_format_glsl = R"glsl(
+layout (std430, binding = 5) readonly buffer PulledFormats
+{
+    uint pulled_formats[];
+};
+
+uint pulled_format()
+{
+#if __VERSION__ >= 460
+    return pulled_formats[gl_DrawID];
+#else
+    return pulled_formats[gl_DrawIDARB];
+#endif
+}
+)glsl";
+
+
+/**
+* Return the GLSL expression reading one component of an attribute
+* @param address is a GLSL expression of the byte address of the component
+*/
+template <class TAttribute>
+std::string make_component_glsl(const std::string& address)
+{
+    const bool integer = is_integer_attribute<TAttribute>::value;
+    const bool normalized = TAttribute::normalized == GL_TRUE;
+    switch (static_cast<GLenum>(TAttribute::type))
+    {
+    case GL_FLOAT:
+        return "uintBitsToFloat(pulled_word(" + address + "))";
+    case GL_HALF_FLOAT:
+        return "unpackHalf2x16(pulled_bits(" + address + ", 16)).x";
+    case GL_UNSIGNED_INT:
+        return integer ? "pulled_word(" + address + ")" : "float(pulled_word(" + address + "))";
+    case GL_INT:
+        return integer ? "int(pulled_word(" + address + "))" : "float(int(pulled_word(" + address + ")))";
+    case GL_UNSIGNED_BYTE:
+    case GL_UNSIGNED_SHORT:
+    {
+        const bool byte = TAttribute::type == GL_UNSIGNED_BYTE;
+        const std::string value = "pulled_bits(" + address + (byte ? ", 8)" : ", 16)");
+        if (integer)
+        {
+            return value;
+        }
+        return normalized ? "float(" + value + (byte ? ") / 255.0" : ") / 65535.0") : "float(" + value + ")";
+    }
+    case GL_BYTE:
+    case GL_SHORT:
+    {
+        const bool byte = TAttribute::type == GL_BYTE;
+        const std::string value = "pulled_signed_bits(" + address + (byte ? ", 8)" : ", 16)");
+        if (integer)
+        {
+            return value;
+        }
+        return normalized ? "max(float(" + value + (byte ? ") / 127.0, -1.0)" : ") / 32767.0, -1.0)") : "float(" + value + ")";
+    }
+    default:
+        throw std::invalid_argument("Vertex attribute type cannot be pulled: " + std::to_string(TAttribute::type));
+    }
+}
+
+
+/**
+* Append the function reading the attribute at `layout_position` of a vertex
+* @param offset is the byte offset of the attribute within the vertex
+*/
+template <class TAttribute>
+void append_pulling_function(std::string& glsl, const std::string& name, std::size_t layout_position, std::size_t offset)
+{
+    const bool integer = is_integer_attribute<TAttribute>::value;
+    const bool is_signed = TAttribute::type == GL_BYTE || TAttribute::type == GL_SHORT || TAttribute::type == GL_INT;
+    const std::string prefix = integer ? (is_signed ? "i" : "u") : "";
+    const std::string type = TAttribute::size == 1 ? (integer ? (is_signed ? "int" : "uint") : "float") :
+                                                     prefix + "vec" + std::to_string(TAttribute::size);
+    const std::size_t component_size = gl_type_size(TAttribute::type);
+
+    glsl += type + " " + name + "_attribute" + std::to_string(layout_position) + "(uint vertex)\n{\n";
+    glsl += "    uint address = vertex * " + name + "_stride;\n";
+    glsl += "    return " + type + "(";
+    for (std::size_t component = 0; component < TAttribute::size; ++component)
+    {
+        if (component > 0)
+        {
+            glsl += ", ";
+        }
+        glsl += make_component_glsl<TAttribute>("address + " + std::to_string(offset + component * component_size) + "u");
+    }
+    glsl += ");\n}\n\n";
+}
+
+
+template <class TVertex, std::size_t... layout_position>
+void append_pulling_functions(std::string& glsl, const std::string& name, std::index_sequence<layout_position...>)
+{
+    using expander = int[];
+    static_cast<void>(expander{0, (append_pulling_function<typename TVertex::template attribute<layout_position>>(glsl, name, layout_position, TVertex::offset_of(layout_position)), 0)...});
+}
+
+
+/**
+* Generate GLSL functions reading the attributes of a vertex of type
+* `TVertex` from the vertex pool, named after the layout positions the
+* attributes have in the vertex array object path
+*
+* For `DefaultVertex` and `name` "vertex", `vertex_attribute0(index)` returns
+* the position, `vertex_attribute1(index)` the normal and so on. Pass
+* `uint(gl_VertexID)` as the index, which already includes the base vertex of
+* the draw.
+*/
+template <class TVertex>
+std::string make_pulling_glsl(const std::string& name)
+{
+    std::string glsl = "const uint " + name + "_stride = " + std::to_string(sizeof(TVertex)) + "u;\n\n";
+    append_pulling_functions<TVertex>(glsl, name, std::make_index_sequence<TVertex::attribute_count>{});
+    return glsl;
+}
+
+
+class vertex_pool_error : public std::runtime_error
+{
+public:
+    explicit vertex_pool_error(const std::string& message) : std::runtime_error(message)
+    {
+    }
+};
+
+
+/**
+* Location of a mesh within a `VertexPool`
+*/
+struct PulledMesh
+{
+    // Vertex index of the first vertex, counted in vertices of it's format
+    GLint base_vertex;
+    std::size_t first_index;
+    std::size_t index_count;
+    // Application defined format id, see `pulled_format_glsl`
+    GLuint format;
+};
+
+
+/**
+* Vertices and indices of many meshes, of any vertex formats, in shared
+* buffers read by the vertex shader instead of through vertex attributes
+*
+* Vertices are stored at a multiple of their size, so a vertex is found at
+* `gl_VertexID` times the size of its format, and all meshes draw with the
+* same, otherwise empty, vertex array object. The index buffer is both the
+* element buffer of that vertex array object and a shader storage buffer.
+*/
+class VertexPool
+{
+public:
+    /**
+    * Constructor
+    * @param vertex_capacity is the size of the vertex storage in bytes
+    * @param index_capacity is the number of indices that can be stored
+    */
+    VertexPool(std::size_t vertex_capacity, std::size_t index_capacity) : m_vertex_capacity(vertex_capacity),
+                                                                          m_index_capacity(index_capacity),
+                                                                          m_vertex_size(0),
+                                                                          m_index_count(0),
+                                                                          m_vao(0),
+                                                                          m_buffers{0, 0, 0},
+                                                                          m_format_capacity(1)
+    {
+        glGenVertexArrays(1, &m_vao);
+        glGenBuffers(buffer_count, m_buffers);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[vertex_buffer]);
+        // One more word, read when pulling the last bytes at an unaligned
+        // address
+        glBufferData(GL_SHADER_STORAGE_BUFFER, m_vertex_capacity + sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[format_buffer]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, m_format_capacity * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        glBindVertexArray(m_vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffers[index_buffer]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_index_capacity * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
+    ~VertexPool()
+    {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(buffer_count, m_buffers);
+    }
+
+    // Owns OpenGL objects
+    VertexPool(const VertexPool&) = delete;
+    VertexPool& operator=(const VertexPool&) = delete;
+
+    /**
+    * Copy a mesh into the pool
+    * @param format identifies the vertex format to shaders drawing several
+    */
+    template <class TVertex, class TVertexAllocator, class TIndexAllocator>
+    PulledMesh add(const std::vector<TVertex, TVertexAllocator>& vertices,
+                   const std::vector<GLuint, TIndexAllocator>& indices,
+                   GLuint format = 0)
+    {
+        const std::size_t stride = sizeof(TVertex);
+        const std::size_t base_vertex = (m_vertex_size + stride - 1) / stride;
+        const std::size_t offset = base_vertex * stride;
+        const std::size_t size = vertices.size() * stride;
+        if (offset + size > m_vertex_capacity || m_index_count + indices.size() > m_index_capacity)
+        {
+            throw vertex_pool_error("Vertex pool is full.");
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[vertex_buffer]);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, size, vertices.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[index_buffer]);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, m_index_count * sizeof(GLuint), indices.size() * sizeof(GLuint), indices.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        const PulledMesh mesh{static_cast<GLint>(base_vertex), m_index_count, indices.size(), format};
+        m_vertex_size = offset + size;
+        m_index_count += indices.size();
+        return mesh;
+    }
+    /**
+    * Bind the vertex array object and the storage buffers, once for any
+    * number of draws
+    */
+    void bind() const
+    {
+        glBindVertexArray(m_vao);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, pulled_vertex_binding, m_buffers[vertex_buffer]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, pulled_index_binding, m_buffers[index_buffer]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, pulled_format_binding, m_buffers[format_buffer]);
+    }
+    void unbind() const
+    {
+        glBindVertexArray(0);
+    }
+    /**
+    * Draw a mesh, the pool being bound, publishing it's format to
+    * `pulled_format_glsl`
+    */
+    void draw(const PulledMesh& mesh) const
+    {
+        // A single draw only reads the first format
+        upload_formats(&mesh.format, 1);
+        glDrawElementsBaseVertex(GL_TRIANGLES, static_cast<GLsizei>(mesh.index_count), GL_UNSIGNED_INT,
+                                 reinterpret_cast<const void*>(mesh.first_index * sizeof(GLuint)), mesh.base_vertex);
+    }
+    /**
+    * Draw meshes of any formats with a single multi-draw, the pool being
+    * bound, publishing the format of each draw to `pulled_format_glsl`
+    */
+    void draw(const std::vector<PulledMesh>& meshes) const
+    {
+        if (meshes.empty())
+        {
+            return;
+        }
+        m_counts.clear();
+        m_offsets.clear();
+        m_base_vertices.clear();
+        m_formats.clear();
+        for (const PulledMesh& mesh : meshes)
+        {
+            m_counts.push_back(static_cast<GLsizei>(mesh.index_count));
+            m_offsets.push_back(reinterpret_cast<const void*>(mesh.first_index * sizeof(GLuint)));
+            m_base_vertices.push_back(mesh.base_vertex);
+            m_formats.push_back(mesh.format);
+        }
+        upload_formats(m_formats.data(), m_formats.size());
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, m_counts.data(), GL_UNSIGNED_INT, m_offsets.data(),
+                                      static_cast<GLsizei>(m_counts.size()), m_base_vertices.data());
+    }
+    /**
+    * Return the vertex array object all meshes of the pool are drawn with
+    */
+    GLuint get_vertex_array() const noexcept
+    {
+        return m_vao;
+    }
+    /**
+    * Return the number of bytes of vertex storage used, padding included
+    */
+    std::size_t get_vertex_size() const noexcept
+    {
+        return m_vertex_size;
+    }
+    std::size_t get_index_count() const noexcept
+    {
+        return m_index_count;
+    }
+private:
+    /**
+    * Write the formats of the next draws to the start of the format buffer,
+    * unless it already holds them, growing it as needed
+    */
+    void upload_formats(const GLuint* formats, std::size_t count) const
+    {
+        if (count <= m_uploaded_formats.size() && std::equal(formats, formats + count, m_uploaded_formats.begin()))
+        {
+            return;
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[format_buffer]);
+        if (count > m_format_capacity)
+        {
+            // The buffer stays bound to its binding point, which always
+            // covers all of it
+            m_format_capacity = std::max(count, m_format_capacity * 2);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, m_format_capacity * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+        }
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(GLuint), formats);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        m_uploaded_formats.assign(formats, formats + count);
+    }
+private:
+    enum
+    {
+        vertex_buffer,
+        index_buffer,
+        format_buffer,
+        buffer_count
+    };
+
+    std::size_t m_vertex_capacity;
+    std::size_t m_index_capacity;
+    std::size_t m_vertex_size;
+    std::size_t m_index_count;
+    GLuint m_vao;
+    GLuint m_buffers[buffer_count];
+    // Multi-draw arguments, kept to reuse their storage
+    mutable std::vector<GLsizei> m_counts;
+    mutable std::vector<const void*> m_offsets;
+    mutable std::vector<GLint> m_base_vertices;
+    mutable std::vector<GLuint> m_formats;
+    // Size of the format buffer, and the formats at its start
+    mutable std::size_t m_format_capacity;
+    mutable std::vector<GLuint> m_uploaded_formats;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
@@ -0,0 +1,324 @@
+#pragma once
+
+#include "bounds.h"
+#include "models.h"
+#include "programs.h"
+#include "shaders.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+using QueryHandle = std::size_t;
+
+
+const char* const query_box_vertex_glsl = R"glsl(
+#version 420 core
+layout(location = 0) in vec3 corner;
+layout(location = 1) in vec3 box_minimum;
+layout(location = 2) in vec3 box_maximum;
+uniform mat4 view_projection;
+void main()
+{
+    gl_Position = view_projection * vec4(mix(box_minimum, box_maximum, corner), 1.0);
+}
+)glsl";
+
+
+const char* const query_box_fragment_glsl = R"glsl(
+#version 420 core
+void main()
+{
+}
+)glsl";
+
+
+/**
+* Hardware occlusion queries on bounding boxes, skipping the rendering of
+* hidden models with conditional rendering instead of reading results back
+*
+* Each frame `test` draws the boxes of the objects due for a query against
+* the depth buffer, all with one program and vertex array. Hidden objects are
+* queried every frame so they reappear quickly, visible objects only every
+* `retest_interval` frames, staggered so the queries spread over frames.
+* Results are polled without ever stalling the CPU. While a result is
+* outstanding the object is rendered conditionally on its query: in no-wait
+* mode for objects visible so far, which the GPU renders rather than wait
+* when the result is late, and in wait mode for hidden ones, whose queries
+* come back hidden most of the time and which would otherwise always be
+* rendered on drivers completing queries late, llvmpipe among them.
+*
+* Requires OpenGL 4.2, which llvmpipe provides as well.
+*/
+class OcclusionQueries
+{
+public:
+    explicit OcclusionQueries(std::size_t retest_interval = 4) : m_retest_interval(retest_interval > 0 ? retest_interval : 1),
+                                                                 m_frame(0),
+                                                                 m_vao(0),
+                                                                 m_corner_buffer(0),
+                                                                 m_index_buffer(0),
+                                                                 m_box_buffer(0)
+    {
+        shaders::VertexShader vertex(query_box_vertex_glsl, shaders::from_source);
+        shaders::FragmentShader fragment(query_box_fragment_glsl, shaders::from_source);
+        m_program.attach(vertex);
+        m_program.attach(fragment);
+        m_program.link();
+        m_view_projection_location = glGetUniformLocation(m_program.get_handle(), "view_projection");
+
+        const GLfloat corners[] = {0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f,
+                                   0.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
+        const GLubyte indices[] = {0, 2, 1, 1, 2, 3, 4, 5, 6, 5, 7, 6, 0, 1, 4, 1, 5, 4,
+                                   2, 6, 3, 3, 6, 7, 0, 4, 2, 2, 4, 6, 1, 3, 5, 3, 7, 5};
+        glGenVertexArrays(1, &m_vao);
+        glGenBuffers(1, &m_corner_buffer);
+        glGenBuffers(1, &m_index_buffer);
+        glGenBuffers(1, &m_box_buffer);
+        glBindVertexArray(m_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, m_corner_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), nullptr);
+        glBindBuffer(GL_ARRAY_BUFFER, m_box_buffer);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), nullptr);
+        glVertexAttribDivisor(1, 1);
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat),
+                              reinterpret_cast<const void*>(3 * sizeof(GLfloat)));
+        glVertexAttribDivisor(2, 1);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    ~OcclusionQueries()
+    {
+        for (const Entry& entry : m_entries)
+        {
+            glDeleteQueries(1, &entry.query);
+        }
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_corner_buffer);
+        glDeleteBuffers(1, &m_index_buffer);
+        glDeleteBuffers(1, &m_box_buffer);
+    }
+
+    // Owns OpenGL objects
+    OcclusionQueries(const OcclusionQueries&) = delete;
+    OcclusionQueries& operator=(const OcclusionQueries&) = delete;
+
+    /**
+    * Add an object with bounds in world space, visible until tested
+    * otherwise
+    */
+    QueryHandle add(const geometry::BoundingBox& bounds)
+    {
+        Entry entry;
+        entry.bounds = bounds;
+        glGenQueries(1, &entry.query);
+        entry.next_test = m_frame + m_entries.size() % m_retest_interval;
+        entry.visible = true;
+        entry.pending = false;
+        m_entries.push_back(entry);
+        return m_entries.size() - 1;
+    }
+    /**
+    * Update the bounds of a moving object
+    */
+    void set_bounds(QueryHandle handle, const geometry::BoundingBox& bounds)
+    {
+        m_entries[handle].bounds = bounds;
+    }
+    /**
+    * Collect the results that are back and issue the queries due this
+    * frame
+    *
+    * Call once per frame after the main occluders are in the depth buffer,
+    * e.g. after a depth pre-pass or after rendering the objects that were
+    * visible last frame. The face culling, depth test, depth write and
+    * color write state of the caller is restored.
+    */
+    void test(const glm::mat4& view_projection)
+    {
+        ++m_frame;
+        m_issued.clear();
+        m_boxes.clear();
+        for (std::size_t i = 0; i < m_entries.size(); ++i)
+        {
+            Entry& entry = m_entries[i];
+            if (entry.pending)
+            {
+                GLuint available = 0;
+                glGetQueryObjectuiv(entry.query, GL_QUERY_RESULT_AVAILABLE, &available);
+                if (!available)
+                {
+                    continue;
+                }
+                GLuint passed = 0;
+                glGetQueryObjectuiv(entry.query, GL_QUERY_RESULT, &passed);
+                entry.visible = passed != 0;
+                entry.pending = false;
+            }
+            if (entry.visible && m_frame < entry.next_test)
+            {
+                continue;
+            }
+            entry.next_test = m_frame + m_retest_interval;
+            // The box would be clipped away by the near plane with the
+            // camera inside or right next to it
+            if (crosses_near_plane(entry.bounds, view_projection))
+            {
+                entry.visible = true;
+                continue;
+            }
+            entry.pending = true;
+            m_issued.push_back(i);
+            const glm::vec3& minimum = entry.bounds.minimum;
+            const glm::vec3& maximum = entry.bounds.maximum;
+            m_boxes.insert(m_boxes.end(), {minimum.x, minimum.y, minimum.z, maximum.x, maximum.y, maximum.z});
+        }
+        if (m_issued.empty())
+        {
+            return;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, m_box_buffer);
+        glBufferData(GL_ARRAY_BUFFER, m_boxes.size() * sizeof(GLfloat), m_boxes.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        const GLboolean cull_face = glIsEnabled(GL_CULL_FACE);
+        const GLboolean depth_test = glIsEnabled(GL_DEPTH_TEST);
+        GLboolean depth_mask = GL_TRUE;
+        glGetBooleanv(GL_DEPTH_WRITEMASK, &depth_mask);
+        GLboolean color_mask[4] = {GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE};
+        glGetBooleanv(GL_COLOR_WRITEMASK, color_mask);
+        glDisable(GL_CULL_FACE);
+        glEnable(GL_DEPTH_TEST);
+        glDepthMask(GL_FALSE);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        m_program.use();
+        glUniformMatrix4fv(m_view_projection_location, 1, GL_FALSE, &view_projection[0][0]);
+        glBindVertexArray(m_vao);
+        for (std::size_t i = 0; i < m_issued.size(); ++i)
+        {
+            glBeginQuery(GL_ANY_SAMPLES_PASSED, m_entries[m_issued[i]].query);
+            glDrawElementsInstancedBaseInstance(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, nullptr, 1, static_cast<GLuint>(i));
+            glEndQuery(GL_ANY_SAMPLES_PASSED);
+        }
+        glBindVertexArray(0);
+        glColorMask(color_mask[0], color_mask[1], color_mask[2], color_mask[3]);
+        glDepthMask(depth_mask);
+        if (!depth_test)
+        {
+            glDisable(GL_DEPTH_TEST);
+        }
+        if (cull_face)
+        {
+            glEnable(GL_CULL_FACE);
+        }
+    }
+    /**
+    * Call `draw` unless the object is known to be hidden, conditionally on
+    * its query while the result is outstanding
+    */
+    template <class TDraw>
+    void render(QueryHandle handle, TDraw&& draw) const
+    {
+        const Entry& entry = m_entries[handle];
+        if (entry.pending)
+        {
+            glBeginConditionalRender(entry.query, entry.visible ? GL_QUERY_NO_WAIT : GL_QUERY_WAIT);
+            draw();
+            glEndConditionalRender();
+        }
+        else if (entry.visible)
+        {
+            draw();
+        }
+    }
+    void render(QueryHandle handle, const Model& model, Model::program_type& program) const
+    {
+        render(handle, [&]()
+               {
+                   model.render(program);
+               });
+    }
+    /**
+    * Return whether the object was visible at its last completed query
+    */
+    bool is_visible(QueryHandle handle) const
+    {
+        return m_entries[handle].visible;
+    }
+    /**
+    * Return the number of queries issued by the last `test`
+    */
+    std::size_t get_issued_count() const noexcept
+    {
+        return m_issued.size();
+    }
+    std::size_t size() const noexcept
+    {
+        return m_entries.size();
+    }
+private:
+    struct Entry
+    {
+        geometry::BoundingBox bounds;
+        GLuint query;
+        // Frame from which a visible object is queried again
+        std::size_t next_test;
+        bool visible;
+        // Whether a query was issued and its result not read yet
+        bool pending;
+    };
+
+    static bool crosses_near_plane(const geometry::BoundingBox& bounds, const glm::mat4& view_projection)
+    {
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            const glm::vec4 position(corner & 1 ? bounds.maximum.x : bounds.minimum.x,
+                                     corner & 2 ? bounds.maximum.y : bounds.minimum.y,
+                                     corner & 4 ? bounds.maximum.z : bounds.minimum.z,
+                                     1.0f);
+            const glm::vec4 clip = view_projection * position;
+            if (clip.z < -clip.w || clip.w <= 0.0f)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+private:
+    std::size_t m_retest_interval;
+    std::size_t m_frame;
+    shaders::GLSLProgram m_program;
+    GLint m_view_projection_location;
+    GLuint m_vao;
+    GLuint m_corner_buffer;
+    GLuint m_index_buffer;
+    // Minimum and maximum of every box queried this frame
+    GLuint m_box_buffer;
+    std::vector<Entry> m_entries;
+    std::vector<std::size_t> m_issued;
+    std::vector<GLfloat> m_boxes;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
@@ -41,14 +41,23 @@ public:
 };
 
 
-template <GLenum type>
+// Tag selecting the constructors taking shader source code instead of a path
+struct from_source_t
+{
+};
+
+
+constexpr from_source_t from_source{};
+
+
+template <GLenum shader_type>
 class Shader
 {
 public:
     friend class GLSLProgram;
     enum
     {
-        type = type
+        type = shader_type
     };
     /**
     * Constructor
@@ -63,6 +72,19 @@ public:
         load_source();
         compile();
     }
+    /**
+    * Constructor
+    * Compile the given shader source code, for shaders generated or
+    * embedded in the program
+    *
+    * @param source is the GLSL source code of the shader
+    */
+    Shader(const std::string& source, from_source_t): m_path(),
+                                                      m_data(source),
+                                                      m_handle(0)
+    {
+        compile();
+    }
 
     virtual ~Shader()
     {
@@ -144,6 +166,7 @@ private:
 using VertexShader = Shader<GL_VERTEX_SHADER>;
 using GeometryShader = Shader<GL_GEOMETRY_SHADER>;
 using FragmentShader = Shader<GL_FRAGMENT_SHADER>;
+using ComputeShader = Shader<GL_COMPUTE_SHADER>;
 
 
 }  // namespace shaders
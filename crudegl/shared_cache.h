@@ -0,0 +1,819 @@
+#pragma once
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+
+namespace crudegl
+{
+
+
+namespace streaming
+{
+
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "SharedAssetCache shares atomics between processes, which requires them to be lock free");
+
+
+class shared_cache_error : public std::runtime_error
+{
+public:
+    shared_cache_error(const std::string& message, int error) : std::runtime_error(message + " " + std::strerror(error))
+    {
+    }
+};
+
+
+namespace detail
+{
+
+
+constexpr std::uint64_t shared_cache_magic = 0x6372756465676c32;
+
+
+// Values of `SharedSlot::control` above the largest reference count
+constexpr std::uint32_t slot_absent = 0xfffffffd;
+constexpr std::uint32_t slot_writing = 0xfffffffe;
+constexpr std::uint32_t slot_evicting = 0xffffffff;
+
+
+// Values of `SharedSlot::hash` of slots not holding a key
+constexpr std::uint64_t slot_free = 0;
+constexpr std::uint64_t slot_claimed = 1;
+constexpr std::uint64_t slot_tombstone = 2;
+
+
+// Number of processes that can have a cache open at the same time
+constexpr std::size_t shared_cache_max_processes = 256;
+
+
+// Values of `SharedProcess::pid` of entries not owned by a process
+constexpr std::int32_t process_free = 0;
+constexpr std::int32_t process_reclaiming = -1;
+
+
+// Flag of the per-process reference counts, set while the process populates
+// the entry of the slot
+constexpr std::uint32_t references_writing = 0x80000000;
+
+
+/**
+* Start of the index segment shared by every process opening a cache
+*/
+struct SharedHeader
+{
+    // Set last by the creating process, once the rest is initialized
+    std::atomic<std::uint64_t> magic;
+    std::uint64_t slot_count;
+    std::uint64_t capacity;
+    // Bytes of all populated entries
+    std::atomic<std::uint64_t> used;
+    // Ticks on every lookup, orders entries for eviction
+    std::atomic<std::uint64_t> clock;
+};
+
+
+/**
+* Entry of the hash index, following the header
+*
+* A slot keeps it's key while the entry is populated or being populated and
+* becomes a tombstone once evicted, so probe sequences never break and the
+* index needs no locks. A new key reclaims a tombstone straight into the
+* writing state. `control` holds the number of handles referencing the data,
+* or one of the `slot_*` states.
+*/
+struct SharedSlot
+{
+    std::atomic<std::uint64_t> hash;
+    std::atomic<std::uint64_t> check;
+    std::atomic<std::uint32_t> control;
+    // Incremented every time the entry is populated, names it's data
+    std::atomic<std::uint32_t> generation;
+    std::atomic<std::uint64_t> size;
+    std::atomic<std::uint64_t> last_use;
+};
+
+
+/**
+* Entry of the process table, following the slots, owned by a process
+* having the cache open
+*
+* The table is followed by the number of references every process holds to
+* each slot, which lets the references of a process that died be dropped.
+*/
+struct SharedProcess
+{
+    std::atomic<std::int32_t> pid;
+};
+
+
+static_assert(sizeof(pid_t) <= sizeof(std::int32_t), "Process ids are stored in 32 bits");
+
+
+/**
+* Start of the shared memory object holding the data of an entry, followed
+* by the key and the data aligned to `shared_data_alignment`
+*/
+struct SharedDataHeader
+{
+    std::uint64_t magic;
+    std::uint64_t key_size;
+    std::uint64_t size;
+};
+
+
+constexpr std::size_t shared_data_alignment = 64;
+
+
+inline std::uint64_t fnv1a(const std::string& key, std::uint64_t hash)
+{
+    for (unsigned char c : key)
+    {
+        hash = (hash ^ c) * 0x100000001b3;
+    }
+    return hash;
+}
+
+
+}  // namespace detail
+
+
+class SharedAssetCache;
+
+
+/**
+* Read-only mapping of a cache entry, keeping it from being evicted while
+* alive
+*
+* The data stays valid while the handle is, even past the cache being
+* removed, but the handle must not outlive the `SharedAssetCache` it came
+* from.
+*/
+class SharedAsset
+{
+public:
+    SharedAsset() noexcept : m_slot(nullptr),
+                             m_references(nullptr),
+                             m_mapping(nullptr),
+                             m_mapping_size(0),
+                             m_data(nullptr),
+                             m_size(0)
+    {
+    }
+    ~SharedAsset()
+    {
+        reset();
+    }
+
+    // Move-only semantics
+    SharedAsset(const SharedAsset&) = delete;
+    SharedAsset& operator=(const SharedAsset&) = delete;
+
+    SharedAsset(SharedAsset&& rhs) noexcept : SharedAsset()
+    {
+        swap(rhs);
+    }
+    SharedAsset& operator=(SharedAsset&& rhs) noexcept
+    {
+        SharedAsset(std::move(rhs)).swap(*this);
+        return *this;
+    }
+
+    void swap(SharedAsset& rhs) noexcept
+    {
+        std::swap(m_slot, rhs.m_slot);
+        std::swap(m_references, rhs.m_references);
+        std::swap(m_mapping, rhs.m_mapping);
+        std::swap(m_mapping_size, rhs.m_mapping_size);
+        std::swap(m_data, rhs.m_data);
+        std::swap(m_size, rhs.m_size);
+    }
+    /**
+    * Unmap the entry and drop the reference to it
+    */
+    void reset() noexcept
+    {
+        if (m_mapping)
+        {
+            munmap(m_mapping, m_mapping_size);
+        }
+        if (m_slot)
+        {
+            m_references->fetch_sub(1, std::memory_order_relaxed);
+            m_slot->control.fetch_sub(1, std::memory_order_release);
+        }
+        m_slot = nullptr;
+        m_references = nullptr;
+        m_mapping = nullptr;
+        m_mapping_size = 0;
+        m_data = nullptr;
+        m_size = 0;
+    }
+    const unsigned char* data() const noexcept
+    {
+        return m_data;
+    }
+    std::size_t size() const noexcept
+    {
+        return m_size;
+    }
+    explicit operator bool() const noexcept
+    {
+        return m_data != nullptr;
+    }
+private:
+    friend class SharedAssetCache;
+
+    detail::SharedSlot* m_slot;
+    // References of this process to the slot
+    std::atomic<std::uint32_t>* m_references;
+    void* m_mapping;
+    std::size_t m_mapping_size;
+    const unsigned char* m_data;
+    std::size_t m_size;
+};
+
+
+/**
+* Decoded assets shared between the processes of a host through POSIX shared
+* memory, so that every asset is decoded by the first process needing it and
+* mapped read-only by the others
+*
+* A small shared segment holds an open addressing hash index of the entries,
+* updated with atomic operations only. Each entry lives in a shared memory
+* object of it's own, so evicting it is a matter of unlinking the object, the
+* memory being returned once the last process unmapped it. Entries are only
+* evicted while no handle references them, the least recently used first,
+* once populating another one would exceed the capacity.
+*
+* Entries being populated by another process are reported as missing rather
+* than waited for, as are entries whose key doesn't fit the index anymore, so
+* callers decode those privately.
+*
+* Every process counts the references it holds in a table of it's own, so
+* that the references and the half populated entries of a process that died
+* are reclaimed, once another process opens the cache or finds nothing left
+* to evict. Processes are told apart by their pid, so a cache must only be
+* shared within one pid namespace, and a dead process's pid reused by another
+* one delays the reclaim until that one exits.
+*/
+class SharedAssetCache
+{
+public:
+    /**
+    * Constructor
+    * Open the cache of the given name, creating it if no process did yet
+    * @param name identifies the cache, starting with a slash
+    * @param slot_count is the number of entries the cache can hold at once,
+    *        ignored when opening an existing cache
+    * @param capacity is the number of bytes above which entries are evicted,
+    *        ignored when opening an existing cache
+    */
+    explicit SharedAssetCache(const std::string& name,
+                              std::size_t slot_count = 4096,
+                              std::size_t capacity = std::size_t(1) << 30) : m_name(name),
+                                                                               m_header(nullptr),
+                                                                               m_slots(nullptr),
+                                                                               m_processes(nullptr),
+                                                                               m_references(nullptr),
+                                                                               m_process(0),
+                                                                               m_segment_size(0)
+    {
+        int fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        const bool created = fd >= 0;
+        if (!created && errno == EEXIST)
+        {
+            fd = shm_open(m_name.c_str(), O_RDWR, 0600);
+        }
+        if (fd < 0)
+        {
+            throw shared_cache_error("Cannot open shared asset cache " + m_name + ".", errno);
+        }
+        try
+        {
+            if (created)
+            {
+                create(fd, slot_count, capacity);
+            }
+            else
+            {
+                attach(fd);
+            }
+            register_process();
+        }
+        catch (...)
+        {
+            close(fd);
+            if (m_header)
+            {
+                munmap(m_header, m_segment_size);
+            }
+            if (created)
+            {
+                shm_unlink(m_name.c_str());
+            }
+            throw;
+        }
+        close(fd);
+    }
+    ~SharedAssetCache()
+    {
+        m_processes[m_process].pid.store(detail::process_free, std::memory_order_release);
+        munmap(m_header, m_segment_size);
+    }
+
+    // Maps shared memory
+    SharedAssetCache(const SharedAssetCache&) = delete;
+    SharedAssetCache& operator=(const SharedAssetCache&) = delete;
+
+    /**
+    * Map the entry of a key, empty if it's not populated
+    */
+    SharedAsset find(const std::string& key)
+    {
+        detail::SharedSlot* slot = find_slot(key, nullptr);
+        if (!slot || !acquire(*slot))
+        {
+            return SharedAsset();
+        }
+        return map(*slot, key);
+    }
+    /**
+    * Map the entry of a key, populating it first if it's missing
+    *
+    * The entry is populated by calling `fill` with a writable buffer of
+    * `size` bytes, which is only visible to other processes once `fill`
+    * returned. Exceptions thrown by `fill` leave the entry missing.
+    *
+    * @return the entry, empty if another process is populating it, the index
+    *         is full or the entry doesn't fit the capacity
+    */
+    template <class TFill>
+    SharedAsset insert(const std::string& key, std::size_t size, TFill&& fill)
+    {
+        bool claimed = false;
+        detail::SharedSlot* slot = find_slot(key, &claimed);
+        if (!slot)
+        {
+            return SharedAsset();
+        }
+        if (!claimed)
+        {
+            // Populated, or being populated or evicted by another process
+            return acquire(*slot) ? map(*slot, key) : SharedAsset();
+        }
+        std::atomic<std::uint32_t>& references = get_references(*slot);
+        references.store(detail::references_writing, std::memory_order_relaxed);
+        try
+        {
+            return populate(*slot, key, size, std::forward<TFill>(fill));
+        }
+        catch (...)
+        {
+            references.store(0, std::memory_order_relaxed);
+            retire(*slot);
+            throw;
+        }
+    }
+    /**
+    * Unlink the cache and all of it's entries, which stay mapped by the
+    * handles and caches still open until they are closed
+    */
+    void unlink()
+    {
+        for (std::size_t i = 0; i < m_header->slot_count; ++i)
+        {
+            detail::SharedSlot& slot = m_slots[i];
+            if (slot.hash.load(std::memory_order_acquire) > detail::slot_tombstone)
+            {
+                shm_unlink(get_data_name(i, slot.generation.load(std::memory_order_acquire)).c_str());
+            }
+        }
+        shm_unlink(m_name.c_str());
+    }
+    /**
+    * Return the bytes of all populated entries, headers included
+    */
+    std::size_t get_used() const noexcept
+    {
+        return static_cast<std::size_t>(m_header->used.load(std::memory_order_relaxed));
+    }
+    std::size_t get_capacity() const noexcept
+    {
+        return static_cast<std::size_t>(m_header->capacity);
+    }
+    std::size_t get_slot_count() const noexcept
+    {
+        return static_cast<std::size_t>(m_header->slot_count);
+    }
+private:
+    static std::size_t get_segment_size(std::size_t slot_count)
+    {
+        return sizeof(detail::SharedHeader) + slot_count * sizeof(detail::SharedSlot) +
+               detail::shared_cache_max_processes * (sizeof(detail::SharedProcess) +
+                                                     slot_count * sizeof(std::atomic<std::uint32_t>));
+    }
+    void create(int fd, std::size_t slot_count, std::size_t capacity)
+    {
+        m_segment_size = get_segment_size(slot_count);
+        if (ftruncate(fd, static_cast<off_t>(m_segment_size)) != 0)
+        {
+            throw shared_cache_error("Cannot size shared asset cache " + m_name + ".", errno);
+        }
+        map_segment(fd);
+        // The new segment is zero filled, which leaves every slot and process
+        // entry free
+        m_header->slot_count = slot_count;
+        m_header->capacity = capacity;
+        m_header->used.store(0, std::memory_order_relaxed);
+        m_header->clock.store(0, std::memory_order_relaxed);
+        m_header->magic.store(detail::shared_cache_magic, std::memory_order_release);
+    }
+    void attach(int fd)
+    {
+        // The creating process may still be initializing the segment
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        struct stat status;
+        while (fstat(fd, &status) == 0 && static_cast<std::size_t>(status.st_size) < sizeof(detail::SharedHeader))
+        {
+            wait_until(deadline);
+        }
+        m_segment_size = sizeof(detail::SharedHeader);
+        map_segment(fd);
+        while (m_header->magic.load(std::memory_order_acquire) != detail::shared_cache_magic)
+        {
+            wait_until(deadline);
+        }
+        const std::size_t segment_size = get_segment_size(m_header->slot_count);
+        munmap(m_header, m_segment_size);
+        m_header = nullptr;
+        m_segment_size = segment_size;
+        map_segment(fd);
+    }
+    void wait_until(std::chrono::steady_clock::time_point deadline)
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+        {
+            throw shared_cache_error("Shared asset cache " + m_name + " was never initialized.", ETIMEDOUT);
+        }
+        std::this_thread::yield();
+    }
+    void map_segment(int fd)
+    {
+        void* segment = mmap(nullptr, m_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (segment == MAP_FAILED)
+        {
+            throw shared_cache_error("Cannot map shared asset cache " + m_name + ".", errno);
+        }
+        m_header = static_cast<detail::SharedHeader*>(segment);
+        m_slots = reinterpret_cast<detail::SharedSlot*>(m_header + 1);
+    }
+    /**
+    * Register this process in the process table, reclaiming the entries of
+    * processes that died if the table is full
+    */
+    void register_process()
+    {
+        m_processes = reinterpret_cast<detail::SharedProcess*>(m_slots + get_slot_count());
+        m_references = reinterpret_cast<std::atomic<std::uint32_t>*>(m_processes + detail::shared_cache_max_processes);
+        reclaim_dead_processes();
+        const auto pid = static_cast<std::int32_t>(getpid());
+        for (std::size_t i = 0; i < detail::shared_cache_max_processes; ++i)
+        {
+            std::int32_t unowned = detail::process_free;
+            if (m_processes[i].pid.compare_exchange_strong(unowned, pid, std::memory_order_acquire))
+            {
+                m_process = i;
+                return;
+            }
+        }
+        throw shared_cache_error("Too many processes have shared asset cache " + m_name + " open.", EUSERS);
+    }
+    /**
+    * Drop the references of processes that died and retire the slots they
+    * were populating
+    * @return whether there were any such processes
+    */
+    bool reclaim_dead_processes()
+    {
+        bool reclaimed = false;
+        for (std::size_t i = 0; i < detail::shared_cache_max_processes; ++i)
+        {
+            std::int32_t pid = m_processes[i].pid.load(std::memory_order_acquire);
+            if (pid <= detail::process_free || kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH)
+            {
+                continue;
+            }
+            if (!m_processes[i].pid.compare_exchange_strong(pid, detail::process_reclaiming, std::memory_order_acquire))
+            {
+                continue;
+            }
+            std::atomic<std::uint32_t>* references = m_references + i * get_slot_count();
+            for (std::size_t s = 0; s < get_slot_count(); ++s)
+            {
+                const std::uint32_t count = references[s].exchange(0, std::memory_order_relaxed);
+                detail::SharedSlot& slot = m_slots[s];
+                std::uint32_t control = slot.control.load(std::memory_order_relaxed);
+                if (count == detail::references_writing)
+                {
+                    if (control == detail::slot_writing)
+                    {
+                        retire(slot);
+                    }
+                    continue;
+                }
+                while (count > 0 && control >= count && control < detail::slot_absent &&
+                       !slot.control.compare_exchange_weak(control, control - count, std::memory_order_release))
+                {
+                }
+            }
+            m_processes[i].pid.store(detail::process_free, std::memory_order_release);
+            reclaimed = true;
+        }
+        return reclaimed;
+    }
+    /**
+    * Return the slot of a key, null if there is none
+    *
+    * With `claimed` set, a missing key claims a free slot or reclaims a
+    * tombstone, the first of it's probe sequence, which is returned in the
+    * writing state with `*claimed` set.
+    */
+    detail::SharedSlot* find_slot(const std::string& key, bool* claimed)
+    {
+        std::uint64_t hash = detail::fnv1a(key, 0xcbf29ce484222325);
+        hash = hash > detail::slot_tombstone ? hash : hash + detail::slot_tombstone + 1;
+        const std::uint64_t check = detail::fnv1a(key, hash ^ 0x9e3779b97f4a7c15);
+        const std::size_t slot_count = get_slot_count();
+        // Starts over whenever another process claims the chosen slot first,
+        // possibly for this key
+        for (;;)
+        {
+            detail::SharedSlot* tombstone = nullptr;
+            detail::SharedSlot* unused = nullptr;
+            for (std::size_t probe = 0; probe < slot_count && !unused; ++probe)
+            {
+                detail::SharedSlot& slot = m_slots[(hash + probe) % slot_count];
+                std::uint64_t current = slot.hash.load(std::memory_order_acquire);
+                // Another process is claiming the slot, for this key or another
+                while (current == detail::slot_claimed)
+                {
+                    std::this_thread::yield();
+                    current = slot.hash.load(std::memory_order_acquire);
+                }
+                if (current == detail::slot_free)
+                {
+                    unused = &slot;
+                }
+                else if (current == detail::slot_tombstone)
+                {
+                    tombstone = tombstone ? tombstone : &slot;
+                }
+                else if (current == hash && slot.check.load(std::memory_order_relaxed) == check)
+                {
+                    return &slot;
+                }
+            }
+            detail::SharedSlot* slot = tombstone ? tombstone : unused;
+            if (!claimed || !slot)
+            {
+                return nullptr;
+            }
+            std::uint64_t expected = tombstone ? detail::slot_tombstone : detail::slot_free;
+            if (slot->hash.compare_exchange_strong(expected, detail::slot_claimed, std::memory_order_acquire))
+            {
+                slot->check.store(check, std::memory_order_relaxed);
+                slot->control.store(detail::slot_writing, std::memory_order_relaxed);
+                slot->hash.store(hash, std::memory_order_release);
+                *claimed = true;
+                return slot;
+            }
+        }
+    }
+    /**
+    * Turn a slot without an entry into a tombstone, which probe sequences
+    * skip and a new key can reclaim
+    */
+    static void retire(detail::SharedSlot& slot)
+    {
+        // The control goes first, as a tombstone is reclaimed right away
+        slot.control.store(detail::slot_absent, std::memory_order_release);
+        slot.hash.store(detail::slot_tombstone, std::memory_order_release);
+    }
+    std::atomic<std::uint32_t>& get_references(const detail::SharedSlot& slot)
+    {
+        return m_references[m_process * get_slot_count() + static_cast<std::size_t>(&slot - m_slots)];
+    }
+    /**
+    * Take a reference to the entry of a slot, fails unless it's populated
+    */
+    bool acquire(detail::SharedSlot& slot)
+    {
+        std::uint32_t control = slot.control.load(std::memory_order_acquire);
+        while (control < detail::slot_absent - 1)
+        {
+            if (slot.control.compare_exchange_weak(control, control + 1, std::memory_order_acquire))
+            {
+                get_references(slot).fetch_add(1, std::memory_order_relaxed);
+                slot.last_use.store(m_header->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+    /**
+    * Map the entry of a slot the caller holds a reference to, handing the
+    * reference over to the returned handle
+    */
+    SharedAsset map(detail::SharedSlot& slot, const std::string& key)
+    {
+        SharedAsset asset;
+        asset.m_slot = &slot;
+        asset.m_references = &get_references(slot);
+        const int fd = shm_open(get_data_name(static_cast<std::size_t>(&slot - m_slots),
+                                              slot.generation.load(std::memory_order_acquire)).c_str(),
+                                O_RDONLY, 0600);
+        if (fd < 0)
+        {
+            return SharedAsset();
+        }
+        const auto size = static_cast<std::size_t>(slot.size.load(std::memory_order_relaxed));
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return SharedAsset();
+        }
+        asset.m_mapping = mapping;
+        asset.m_mapping_size = size;
+        const auto* header = static_cast<const detail::SharedDataHeader*>(mapping);
+        const char* stored_key = reinterpret_cast<const char*>(header + 1);
+        // Guards against colliding hashes as well
+        if (header->magic != detail::shared_cache_magic || header->key_size != key.size() ||
+            key.compare(0, key.size(), stored_key, header->key_size) != 0)
+        {
+            return SharedAsset();
+        }
+        asset.m_data = static_cast<const unsigned char*>(mapping) + get_data_offset(key.size());
+        asset.m_size = static_cast<std::size_t>(header->size);
+        return asset;
+    }
+    template <class TFill>
+    SharedAsset populate(detail::SharedSlot& slot, const std::string& key, std::size_t size, TFill&& fill)
+    {
+        const std::size_t offset = get_data_offset(key.size());
+        const std::size_t total = offset + size;
+        if (!make_room(total))
+        {
+            get_references(slot).store(0, std::memory_order_relaxed);
+            retire(slot);
+            return SharedAsset();
+        }
+        const std::size_t index = static_cast<std::size_t>(&slot - m_slots);
+        const std::uint32_t generation = slot.generation.load(std::memory_order_relaxed) + 1;
+        const std::string name = get_data_name(index, generation);
+        // Left behind by a process that died while populating the entry
+        shm_unlink(name.c_str());
+        const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+        {
+            throw shared_cache_error("Cannot create shared asset " + key + ".", errno);
+        }
+        if (ftruncate(fd, static_cast<off_t>(total)) != 0)
+        {
+            const int error = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            throw shared_cache_error("Cannot size shared asset " + key + ".", error);
+        }
+        void* mapping = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        const int error = errno;
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            shm_unlink(name.c_str());
+            throw shared_cache_error("Cannot map shared asset " + key + ".", error);
+        }
+        SharedAsset asset;
+        asset.m_mapping = mapping;
+        asset.m_mapping_size = total;
+        auto* header = static_cast<detail::SharedDataHeader*>(mapping);
+        header->magic = detail::shared_cache_magic;
+        header->key_size = key.size();
+        header->size = size;
+        std::memcpy(header + 1, key.data(), key.size());
+        try
+        {
+            fill(static_cast<unsigned char*>(mapping) + offset);
+        }
+        catch (...)
+        {
+            shm_unlink(name.c_str());
+            throw;
+        }
+        mprotect(mapping, total, PROT_READ);
+
+        slot.generation.store(generation, std::memory_order_relaxed);
+        slot.size.store(total, std::memory_order_relaxed);
+        slot.last_use.store(m_header->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+        m_header->used.fetch_add(total, std::memory_order_relaxed);
+        // Publish the entry with the reference of the returned handle
+        get_references(slot).store(1, std::memory_order_relaxed);
+        slot.control.store(1, std::memory_order_release);
+        asset.m_slot = &slot;
+        asset.m_references = &get_references(slot);
+        asset.m_data = static_cast<const unsigned char*>(mapping) + offset;
+        asset.m_size = size;
+        return asset;
+    }
+    /**
+    * Evict unreferenced entries, the least recently used first, until `size`
+    * more bytes fit the capacity, reclaiming the references of processes
+    * that died once none is left
+    *
+    * The capacity is a soft limit, as processes populating entries at the
+    * same time may each see room for their own.
+    */
+    bool make_room(std::size_t size)
+    {
+        if (size > get_capacity())
+        {
+            return false;
+        }
+        while (m_header->used.load(std::memory_order_relaxed) + size > get_capacity())
+        {
+            detail::SharedSlot* oldest = nullptr;
+            std::uint64_t oldest_use = std::numeric_limits<std::uint64_t>::max();
+            for (std::size_t i = 0; i < get_slot_count(); ++i)
+            {
+                detail::SharedSlot& slot = m_slots[i];
+                if (slot.hash.load(std::memory_order_relaxed) > detail::slot_tombstone &&
+                    slot.control.load(std::memory_order_relaxed) == 0 &&
+                    slot.last_use.load(std::memory_order_relaxed) < oldest_use)
+                {
+                    oldest = &slot;
+                    oldest_use = slot.last_use.load(std::memory_order_relaxed);
+                }
+            }
+            if (!oldest)
+            {
+                if (reclaim_dead_processes())
+                {
+                    continue;
+                }
+                return false;
+            }
+            std::uint32_t unreferenced = 0;
+            if (oldest->control.compare_exchange_strong(unreferenced, detail::slot_evicting, std::memory_order_acquire))
+            {
+                shm_unlink(get_data_name(static_cast<std::size_t>(oldest - m_slots),
+                                         oldest->generation.load(std::memory_order_relaxed)).c_str());
+                m_header->used.fetch_sub(oldest->size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                retire(*oldest);
+            }
+        }
+        return true;
+    }
+    std::string get_data_name(std::size_t slot, std::uint32_t generation) const
+    {
+        return m_name + "." + std::to_string(slot) + "." + std::to_string(generation);
+    }
+    static std::size_t get_data_offset(std::size_t key_size)
+    {
+        const std::size_t end = sizeof(detail::SharedDataHeader) + key_size;
+        return (end + detail::shared_data_alignment - 1) / detail::shared_data_alignment * detail::shared_data_alignment;
+    }
+private:
+    std::string m_name;
+    detail::SharedHeader* m_header;
+    detail::SharedSlot* m_slots;
+    detail::SharedProcess* m_processes;
+    // References per process and slot
+    std::atomic<std::uint32_t>* m_references;
+    // Entry of this process in the process table
+    std::size_t m_process;
+    std::size_t m_segment_size;
+};
+
+
+}  // namespace streaming
+
+
+}  // namespace crudegl
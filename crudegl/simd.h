@@ -0,0 +1,268 @@
+#pragma once
+
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace crudegl
+{
+
+
+namespace simd
+{
+
+
+#if defined(__AVX__)
+/**
+* Eight float lanes
+*/
+struct Lanes
+{
+    enum
+    {
+        width = 8
+    };
+    using type = __m256;
+    using mask = __m256;
+
+    static type load(const float* source)
+    {
+        return _mm256_loadu_ps(source);
+    }
+    static void store(float* destination, type value)
+    {
+        _mm256_storeu_ps(destination, value);
+    }
+    static type set(float value)
+    {
+        return _mm256_set1_ps(value);
+    }
+    static type add(type lhs, type rhs)
+    {
+        return _mm256_add_ps(lhs, rhs);
+    }
+    static type sub(type lhs, type rhs)
+    {
+        return _mm256_sub_ps(lhs, rhs);
+    }
+    static type mul(type lhs, type rhs)
+    {
+        return _mm256_mul_ps(lhs, rhs);
+    }
+    static type div(type lhs, type rhs)
+    {
+        return _mm256_div_ps(lhs, rhs);
+    }
+    static type sqrt(type value)
+    {
+        return _mm256_sqrt_ps(value);
+    }
+    static type min(type lhs, type rhs)
+    {
+        return _mm256_min_ps(lhs, rhs);
+    }
+    static type max(type lhs, type rhs)
+    {
+        return _mm256_max_ps(lhs, rhs);
+    }
+    // Negate `value` in the lanes where `sign` is negative
+    static type copy_sign(type value, type sign)
+    {
+        return _mm256_xor_ps(value, _mm256_and_ps(sign, _mm256_set1_ps(-0.0f)));
+    }
+    static mask equal(type lhs, type rhs)
+    {
+        return _mm256_cmp_ps(lhs, rhs, _CMP_EQ_OQ);
+    }
+    static mask less_equal(type lhs, type rhs)
+    {
+        return _mm256_cmp_ps(lhs, rhs, _CMP_LE_OQ);
+    }
+    static mask both(mask lhs, mask rhs)
+    {
+        return _mm256_and_ps(lhs, rhs);
+    }
+    // Return one bit per lane, set where `condition` is set
+    static int bits(mask condition)
+    {
+        return _mm256_movemask_ps(condition);
+    }
+    // Pick `if_set` in the lanes where `condition` is set, `if_clear` elsewhere
+    static type select(mask condition, type if_set, type if_clear)
+    {
+        return _mm256_blendv_ps(if_clear, if_set, condition);
+    }
+};
+#elif defined(__SSE2__) || defined(_M_X64)
+/**
+* Four float lanes
+*/
+struct Lanes
+{
+    enum
+    {
+        width = 4
+    };
+    using type = __m128;
+    using mask = __m128;
+
+    static type load(const float* source)
+    {
+        return _mm_loadu_ps(source);
+    }
+    static void store(float* destination, type value)
+    {
+        _mm_storeu_ps(destination, value);
+    }
+    static type set(float value)
+    {
+        return _mm_set1_ps(value);
+    }
+    static type add(type lhs, type rhs)
+    {
+        return _mm_add_ps(lhs, rhs);
+    }
+    static type sub(type lhs, type rhs)
+    {
+        return _mm_sub_ps(lhs, rhs);
+    }
+    static type mul(type lhs, type rhs)
+    {
+        return _mm_mul_ps(lhs, rhs);
+    }
+    static type div(type lhs, type rhs)
+    {
+        return _mm_div_ps(lhs, rhs);
+    }
+    static type sqrt(type value)
+    {
+        return _mm_sqrt_ps(value);
+    }
+    static type min(type lhs, type rhs)
+    {
+        return _mm_min_ps(lhs, rhs);
+    }
+    static type max(type lhs, type rhs)
+    {
+        return _mm_max_ps(lhs, rhs);
+    }
+    // Negate `value` in the lanes where `sign` is negative
+    static type copy_sign(type value, type sign)
+    {
+        return _mm_xor_ps(value, _mm_and_ps(sign, _mm_set1_ps(-0.0f)));
+    }
+    static mask equal(type lhs, type rhs)
+    {
+        return _mm_cmpeq_ps(lhs, rhs);
+    }
+    static mask less_equal(type lhs, type rhs)
+    {
+        return _mm_cmple_ps(lhs, rhs);
+    }
+    static mask both(mask lhs, mask rhs)
+    {
+        return _mm_and_ps(lhs, rhs);
+    }
+    // Return one bit per lane, set where `condition` is set
+    static int bits(mask condition)
+    {
+        return _mm_movemask_ps(condition);
+    }
+    // Pick `if_set` in the lanes where `condition` is set, `if_clear` elsewhere
+    static type select(mask condition, type if_set, type if_clear)
+    {
+        return _mm_or_ps(_mm_and_ps(condition, if_set), _mm_andnot_ps(condition, if_clear));
+    }
+};
+#else
+/**
+* Scalar fallback for targets without SSE
+*/
+struct Lanes
+{
+    enum
+    {
+        width = 1
+    };
+    using type = float;
+    using mask = bool;
+
+    static type load(const float* source)
+    {
+        return *source;
+    }
+    static void store(float* destination, type value)
+    {
+        *destination = value;
+    }
+    static type set(float value)
+    {
+        return value;
+    }
+    static type add(type lhs, type rhs)
+    {
+        return lhs + rhs;
+    }
+    static type sub(type lhs, type rhs)
+    {
+        return lhs - rhs;
+    }
+    static type mul(type lhs, type rhs)
+    {
+        return lhs * rhs;
+    }
+    static type div(type lhs, type rhs)
+    {
+        return lhs / rhs;
+    }
+    static type sqrt(type value)
+    {
+        return std::sqrt(value);
+    }
+    static type min(type lhs, type rhs)
+    {
+        return std::min(lhs, rhs);
+    }
+    static type max(type lhs, type rhs)
+    {
+        return std::max(lhs, rhs);
+    }
+    // Negate `value` in the lanes where `sign` is negative
+    static type copy_sign(type value, type sign)
+    {
+        return std::signbit(sign) ? -value : value;
+    }
+    static mask equal(type lhs, type rhs)
+    {
+        return lhs == rhs;
+    }
+    static mask less_equal(type lhs, type rhs)
+    {
+        return lhs <= rhs;
+    }
+    static mask both(mask lhs, mask rhs)
+    {
+        return lhs && rhs;
+    }
+    // Return one bit per lane, set where `condition` is set
+    static int bits(mask condition)
+    {
+        return condition ? 1 : 0;
+    }
+    // Pick `if_set` in the lanes where `condition` is set, `if_clear` elsewhere
+    static type select(mask condition, type if_set, type if_clear)
+    {
+        return condition ? if_set : if_clear;
+    }
+};
+#endif
+
+
+}  // namespace simd
+
+
+}  // namespace crudegl
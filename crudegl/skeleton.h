@@ -0,0 +1,192 @@
+#pragma once
+
+#include "jobs.h"
+
+#include <assimp/mesh.h>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace animation
+{
+
+
+/**
+* Convert an assimp row-major matrix to a column-major glm matrix
+*/
+inline glm::mat4 to_mat4(const aiMatrix4x4& m)
+{
+    glm::mat4 result;
+    result[0] = glm::vec4(m.a1, m.b1, m.c1, m.d1);
+    result[1] = glm::vec4(m.a2, m.b2, m.c2, m.d2);
+    result[2] = glm::vec4(m.a3, m.b3, m.c3, m.d3);
+    result[3] = glm::vec4(m.a4, m.b4, m.c4, m.d4);
+    return result;
+}
+
+
+struct Bone
+{
+    std::string name;
+    // Transforms from mesh space to the bone's local space in bind pose
+    glm::mat4 offset;
+};
+
+
+// Bones referenced by the bone indices of a mesh's vertices
+using BonePalette = std::vector<Bone>;
+
+
+/**
+* The four most influential bones of every vertex of a mesh
+*/
+struct BoneInfluences
+{
+    enum
+    {
+        max_influences = 4
+    };
+
+    // Palette indices of the bones, unused slots are 0 with a weight of 0
+    std::vector<glm::uvec4> bones;
+    // Weights of the bones, normalized to sum up to 1
+    std::vector<glm::vec4> weights;
+};
+
+
+/**
+* Return the bone palette of a raw mesh, in the order of `aiMesh::mBones`
+*/
+inline BonePalette collect_bone_palette(const aiMesh* mesh)
+{
+    BonePalette palette;
+    palette.reserve(mesh->mNumBones);
+    for (unsigned int i = 0; i < mesh->mNumBones; ++i)
+    {
+        const aiBone* bone = mesh->mBones[i];
+        palette.push_back(Bone{bone->mName.C_Str(), to_mat4(bone->mOffsetMatrix)});
+    }
+    return palette;
+}
+
+
+/**
+* Invert assimp's per-bone weight lists into the four strongest influences
+* per vertex
+*
+* Instead of scanning every bone's weight list for every vertex, the weights
+* are bucketed per vertex with a counting sort: the influences of each vertex
+* are counted, a prefix sum turns the counts into bucket offsets and the
+* weights are scattered into their buckets. Counting and scattering run in
+* parallel over bones, selecting the strongest four in parallel over
+* vertices, which makes the whole pass linear in the number of weights.
+*
+* @param mesh is the raw assimp mesh with bones
+* @param jobs is an optional job system to run the passes on
+*/
+inline BoneInfluences compute_bone_influences(const aiMesh* mesh, jobs::JobSystem* jobs = nullptr)
+{
+    const std::size_t vertex_count = mesh->mNumVertices;
+    const std::size_t bone_count = mesh->mNumBones;
+    BoneInfluences influences;
+    influences.bones.assign(vertex_count, glm::uvec4(0u));
+    influences.weights.assign(vertex_count, glm::vec4(0.0f));
+    if (bone_count == 0 || vertex_count == 0)
+    {
+        return influences;
+    }
+
+    struct Influence
+    {
+        unsigned int bone;
+        float weight;
+    };
+
+    // Count the influences per vertex
+    std::vector<std::atomic<unsigned int>> counts(vertex_count);
+    for (auto& count : counts)
+    {
+        count.store(0, std::memory_order_relaxed);
+    }
+    jobs::parallel_for(jobs, 0, bone_count, [&](std::size_t b)
+                       {
+                           const aiBone* bone = mesh->mBones[b];
+                           for (unsigned int w = 0; w < bone->mNumWeights; ++w)
+                           {
+                               const unsigned int vertex = bone->mWeights[w].mVertexId;
+                               if (vertex < vertex_count)
+                               {
+                                   counts[vertex].fetch_add(1, std::memory_order_relaxed);
+                               }
+                           }
+                       });
+
+    // Exclusive prefix sum turns the counts into bucket offsets, the counts
+    // are reused as scatter cursors
+    std::vector<std::size_t> offsets(vertex_count + 1, 0);
+    for (std::size_t v = 0; v < vertex_count; ++v)
+    {
+        offsets[v + 1] = offsets[v] + counts[v].load(std::memory_order_relaxed);
+        counts[v].store(0, std::memory_order_relaxed);
+    }
+
+    // Scatter every weight into it's vertex's bucket
+    std::vector<Influence> buckets(offsets[vertex_count]);
+    jobs::parallel_for(jobs, 0, bone_count, [&](std::size_t b)
+                       {
+                           const aiBone* bone = mesh->mBones[b];
+                           for (unsigned int w = 0; w < bone->mNumWeights; ++w)
+                           {
+                               const aiVertexWeight& weight = bone->mWeights[w];
+                               if (weight.mVertexId < vertex_count)
+                               {
+                                   const unsigned int slot = counts[weight.mVertexId].fetch_add(1, std::memory_order_relaxed);
+                                   buckets[offsets[weight.mVertexId] + slot] = Influence{static_cast<unsigned int>(b), weight.mWeight};
+                               }
+                           }
+                       });
+
+    // Keep the strongest four per vertex and renormalize them
+    jobs::parallel_for(jobs, 0, vertex_count, [&](std::size_t v)
+                       {
+                           Influence* first = buckets.data() + offsets[v];
+                           Influence* last = buckets.data() + offsets[v + 1];
+                           const std::size_t kept = std::min<std::size_t>(last - first, BoneInfluences::max_influences);
+                           std::partial_sort(first, first + kept, last, [](const Influence& lhs, const Influence& rhs)
+                                             {
+                                                 // Ties are broken by bone index so the result
+                                                 // doesn't depend on the scatter order
+                                                 return lhs.weight > rhs.weight ||
+                                                        (lhs.weight == rhs.weight && lhs.bone < rhs.bone);
+                                             });
+                           float total = 0.0f;
+                           for (std::size_t i = 0; i < kept; ++i)
+                           {
+                               total += first[i].weight;
+                           }
+                           for (std::size_t i = 0; i < kept && total > 0.0f; ++i)
+                           {
+                               influences.bones[v][static_cast<int>(i)] = first[i].bone;
+                               influences.weights[v][static_cast<int>(i)] = first[i].weight / total;
+                           }
+                       },
+                       1024);
+    return influences;
+}
+
+
+}  // namespace animation
+
+
+}  // namespace crudegl
@@ -0,0 +1,465 @@
+#pragma once
+
+#include "programs.h"
+#include "shaders.h"
+#include "vertices.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace animation
+{
+
+
+// Shader storage buffer binding points used for skinning
+enum SkinningBinding
+{
+    vertex_binding = 0,
+    palette_binding = 1,
+    skinned_binding = 2
+};
+
+
+/**
+* GLSL declarations for skinning in the vertex shader instead of a skinning
+* pass. Paste them after the version directive of a `#version 430` shader
+* and bind the palette with `PaletteBuffer::bind(palette_binding)`:
+*
+*     layout (location = 3) in uvec4 bone_indices;
+*     layout (location = 4) in vec4 bone_weights;
+*     ...
+*     mat4 skin = skinning_matrix(bone_indices, bone_weights);
+*     gl_Position = projection * view * model * skin * vec4(position, 1.0);
+*/
+const char* const vertex_skinning_glsl = R"glsl(
+layout (std430, binding = 1) readonly buffer BonePalette
+{
+    mat4 palette[];
+};
+
+mat4 skinning_matrix(uvec4 bones, vec4 weights)
+{
+    return palette[bones.x] * weights.x + palette[bones.y] * weights.y +
+           palette[bones.z] * weights.z + palette[bones.w] * weights.w;
+}
+)glsl";
+
+
+/**
+* Compute shader of the skinning pass. Reads the vertices straight from the
+* vertex buffer of a mesh as 32 bit words, using the layout passed in the
+* uniforms, and writes a skinned position and normal per vertex.
+*/
+const char* const skinning_compute_glsl = R"glsl(
+#version 430
+
+layout (local_size_x = 64) in;
+
+layout (std430, binding = 0) readonly buffer Vertices
+{
+    uint vertex_words[];
+};
+
+layout (std430, binding = 1) readonly buffer BonePalette
+{
+    mat4 palette[];
+};
+
+layout (std430, binding = 2) writeonly buffer SkinnedVertices
+{
+    vec4 skinned[];
+};
+
+uniform uint vertex_count;
+// Vertex stride and attribute offsets, in words
+uniform uint stride;
+uniform uint position_offset;
+uniform uint normal_offset;
+uniform uint bones_offset;
+uniform uint weights_offset;
+// Bone indices are 16 instead of 8 bit wide
+uniform bool wide_bones;
+
+vec3 read_vec3(uint word)
+{
+    return vec3(uintBitsToFloat(vertex_words[word]),
+                uintBitsToFloat(vertex_words[word + 1u]),
+                uintBitsToFloat(vertex_words[word + 2u]));
+}
+
+void main()
+{
+    uint vertex = gl_GlobalInvocationID.x;
+    if (vertex >= vertex_count)
+    {
+        return;
+    }
+    uint base = vertex * stride;
+    uvec4 bones;
+    if (wide_bones)
+    {
+        uint low = vertex_words[base + bones_offset];
+        uint high = vertex_words[base + bones_offset + 1u];
+        bones = uvec4(low & 0xffffu, low >> 16u, high & 0xffffu, high >> 16u);
+    }
+    else
+    {
+        uint word = vertex_words[base + bones_offset];
+        bones = uvec4(word & 0xffu, (word >> 8u) & 0xffu, (word >> 16u) & 0xffu, word >> 24u);
+    }
+    vec4 weights = unpackUnorm4x8(vertex_words[base + weights_offset]);
+    // Without a palette the vertices stay in the bind pose
+    mat4 skin = mat4(1.0);
+    if (palette.length() > 0)
+    {
+        skin = palette[bones.x] * weights.x + palette[bones.y] * weights.y +
+               palette[bones.z] * weights.z + palette[bones.w] * weights.w;
+    }
+    skinned[vertex * 2u] = vec4((skin * vec4(read_vec3(base + position_offset), 1.0)).xyz, 1.0);
+    skinned[vertex * 2u + 1u] = vec4(normalize(mat3(skin) * read_vec3(base + normal_offset)), 0.0);
+}
+)glsl";
+
+
+/**
+* Shader storage buffer holding a skinning matrix palette
+*/
+class PaletteBuffer
+{
+public:
+    PaletteBuffer() : m_buffer(0)
+    {
+        glGenBuffers(1, &m_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, 0, nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    ~PaletteBuffer()
+    {
+        glDeleteBuffers(1, &m_buffer);
+    }
+
+    // Move-only semantics
+    PaletteBuffer(const PaletteBuffer&) = delete;
+    PaletteBuffer& operator=(const PaletteBuffer&) = delete;
+
+    PaletteBuffer(PaletteBuffer&& other) noexcept : m_buffer(other.m_buffer),
+                                                    m_palette(std::move(other.m_palette))
+    {
+        other.m_buffer = 0;
+    }
+    PaletteBuffer& operator=(PaletteBuffer&& other) noexcept
+    {
+        std::swap(m_buffer, other.m_buffer);
+        std::swap(m_palette, other.m_palette);
+        return *this;
+    }
+
+    /**
+    * Upload the palette, unless it's the same as the last one uploaded
+    * @return whether the palette changed
+    */
+    bool update(const std::vector<glm::mat4>& palette)
+    {
+        if (palette.size() == m_palette.size() &&
+            (palette.empty() || std::memcmp(palette.data(), m_palette.data(), palette.size() * sizeof(glm::mat4)) == 0))
+        {
+            return false;
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffer);
+        if (palette.size() == m_palette.size())
+        {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, palette.size() * sizeof(glm::mat4), palette.data());
+        }
+        else
+        {
+            glBufferData(GL_SHADER_STORAGE_BUFFER, palette.size() * sizeof(glm::mat4), palette.data(), GL_DYNAMIC_DRAW);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        m_palette = palette;
+        return true;
+    }
+    void bind(GLuint binding = palette_binding) const
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, m_buffer);
+    }
+private:
+    GLuint m_buffer;
+    // Last uploaded palette, to skip uploading unchanged ones
+    std::vector<glm::mat4> m_palette;
+};
+
+
+/**
+* Create a vertex array object drawing the vertices of `mesh`, but reading
+* positions and normals from `deformed_buffer`, which stores them as two
+* vec4 per vertex
+*/
+template <class TMesh>
+GLuint make_deformed_vertex_array(const TMesh& mesh, GLuint deformed_buffer)
+{
+    using vertex_layout = typename TMesh::vertex_layout;
+    const std::size_t position_location = vertex_layout::template position_of<models::attributes::Position>();
+    const std::size_t normal_location = vertex_layout::template position_of<models::attributes::Normal>();
+    GLuint vao = 0;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.get_vertex_buffer());
+    if (mesh.get_index_count() > 0)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.get_index_buffer());
+    }
+    models::add_each<vertex_layout, models::VertexAttributeInstaller>();
+    // Positions and normals are read from the deformed buffer instead
+    const GLsizei stride = 2 * sizeof(glm::vec4);
+    glBindBuffer(GL_ARRAY_BUFFER, deformed_buffer);
+    glVertexAttribPointer(position_location, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(0));
+    glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<GLvoid*>(sizeof(glm::vec4)));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return vao;
+}
+
+
+class SkinningPass;
+
+
+/**
+* One skinned character using a shared mesh
+*
+* Holds the character's palette and a buffer with it's skinned positions and
+* normals, written by a `SkinningPass`. Rendering uses the skinned buffer
+* for positions and normals and the vertex buffer of the mesh for all other
+* attributes, so every pass of a frame (depth, shadows, color) draws the
+* same skinned vertices without skinning them again.
+*/
+template <class TMesh>
+class SkinnedInstance
+{
+public:
+    friend class SkinningPass;
+    using mesh_type = TMesh;
+    using vertex_layout = typename mesh_type::vertex_layout;
+    using program_type = typename mesh_type::program_type;
+    enum
+    {
+        attribute_count = vertex_layout::attribute_count,
+        position_location = vertex_layout::template position_of<models::attributes::Position>(),
+        normal_location = vertex_layout::template position_of<models::attributes::Normal>(),
+        bones_location = vertex_layout::template position_of<models::attributes::BoneIndices>(),
+        wide_bones_location = vertex_layout::template position_of<models::attributes::WideBoneIndices>(),
+        weights_location = vertex_layout::template position_of<models::attributes::BoneWeights>()
+    };
+    static_assert(position_location < attribute_count && normal_location < attribute_count,
+                  "Skinned vertices need positions and normals");
+    static_assert((bones_location < attribute_count || wide_bones_location < attribute_count) &&
+                  weights_location < attribute_count,
+                  "Skinned vertices need bone indices and weights");
+    static_assert(sizeof(vertex_layout) % 4 == 0, "The skinning pass reads vertices as 32 bit words");
+
+    /**
+    * Constructor
+    * @param mesh is the skinned mesh, which must outlive the instance
+    */
+    explicit SkinnedInstance(const mesh_type& mesh) : m_mesh(&mesh),
+                                                      m_vao(0),
+                                                      m_skinned(0),
+                                                      m_dirty(true)
+    {
+        glGenBuffers(1, &m_skinned);
+        glBindBuffer(GL_ARRAY_BUFFER, m_skinned);
+        glBufferData(GL_ARRAY_BUFFER, mesh.get_vertex_count() * 2 * sizeof(glm::vec4), nullptr, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        m_vao = make_deformed_vertex_array(mesh, m_skinned);
+    }
+    ~SkinnedInstance()
+    {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_skinned);
+    }
+
+    // Move-only semantics
+    SkinnedInstance(const SkinnedInstance&) = delete;
+    SkinnedInstance& operator=(const SkinnedInstance&) = delete;
+
+    SkinnedInstance(SkinnedInstance&& other) noexcept : m_mesh(other.m_mesh),
+                                                        m_vao(other.m_vao),
+                                                        m_skinned(other.m_skinned),
+                                                        m_palette(std::move(other.m_palette)),
+                                                        m_dirty(other.m_dirty)
+    {
+        other.m_vao = 0;
+        other.m_skinned = 0;
+    }
+    SkinnedInstance& operator=(SkinnedInstance&& other) noexcept
+    {
+        std::swap(m_mesh, other.m_mesh);
+        std::swap(m_vao, other.m_vao);
+        std::swap(m_skinned, other.m_skinned);
+        std::swap(m_palette, other.m_palette);
+        std::swap(m_dirty, other.m_dirty);
+        return *this;
+    }
+
+    /**
+    * Set the skinning palette of the character, it's vertices are skinned
+    * again by the next skinning pass only if it changed
+    * @return whether the palette changed
+    */
+    bool set_palette(const std::vector<glm::mat4>& palette)
+    {
+        const bool changed = m_palette.update(palette);
+        m_dirty = m_dirty || changed;
+        return changed;
+    }
+    /**
+    * Return whether the skinned vertices are out of date with the palette
+    */
+    bool is_dirty() const noexcept
+    {
+        return m_dirty;
+    }
+    /**
+    * Render the skinned vertices with the textures of the mesh
+    */
+    void render(program_type& program) const
+    {
+        m_mesh->render(program, m_vao);
+    }
+    const mesh_type& get_mesh() const noexcept
+    {
+        return *m_mesh;
+    }
+    /**
+    * Return the buffer with the skinned position and normal of every vertex,
+    * stored as two vec4 each
+    */
+    GLuint get_skinned_buffer() const noexcept
+    {
+        return m_skinned;
+    }
+private:
+    const mesh_type* m_mesh;
+    GLuint m_vao;
+    GLuint m_skinned;
+    PaletteBuffer m_palette;
+    bool m_dirty;
+};
+
+
+/**
+* Compute pre-pass skinning the vertices of characters whose palettes
+* changed since they were last skinned
+*
+* Requires OpenGL 4.3, which llvmpipe provides as well.
+*/
+class SkinningPass
+{
+public:
+    SkinningPass() : m_dispatched(0)
+    {
+        shaders::ComputeShader shader(skinning_compute_glsl, shaders::from_source);
+        m_program.attach(shader);
+        m_program.link();
+        const char* names[uniform_count] = {"vertex_count", "stride", "position_offset", "normal_offset",
+                                            "bones_offset", "weights_offset", "wide_bones"};
+        for (int i = 0; i < uniform_count; ++i)
+        {
+            m_locations[i] = glGetUniformLocation(m_program.get_handle(), names[i]);
+        }
+    }
+    /**
+    * Skin the vertices of the instance, if it's palette changed
+    * @return whether the instance was skinned
+    */
+    template <class TMesh>
+    bool skin(SkinnedInstance<TMesh>& instance)
+    {
+        using instance_type = SkinnedInstance<TMesh>;
+        using vertex_layout = typename instance_type::vertex_layout;
+        if (!instance.m_dirty)
+        {
+            return false;
+        }
+        const bool wide_bones = instance_type::bones_location >= instance_type::attribute_count;
+        const std::size_t bones_location = wide_bones ? instance_type::wide_bones_location : instance_type::bones_location;
+        const auto vertex_count = static_cast<GLuint>(instance.m_mesh->get_vertex_count());
+
+        m_program.use();
+        glUniform1ui(m_locations[vertex_count_uniform], vertex_count);
+        glUniform1ui(m_locations[stride_uniform], sizeof(vertex_layout) / 4);
+        glUniform1ui(m_locations[position_offset_uniform], vertex_layout::offset_of(instance_type::position_location) / 4);
+        glUniform1ui(m_locations[normal_offset_uniform], vertex_layout::offset_of(instance_type::normal_location) / 4);
+        glUniform1ui(m_locations[bones_offset_uniform], vertex_layout::offset_of(bones_location) / 4);
+        glUniform1ui(m_locations[weights_offset_uniform], vertex_layout::offset_of(instance_type::weights_location) / 4);
+        glUniform1i(m_locations[wide_bones_uniform], wide_bones ? 1 : 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, vertex_binding, instance.m_mesh->get_vertex_buffer());
+        instance.m_palette.bind(palette_binding);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, skinned_binding, instance.m_skinned);
+        glDispatchCompute((vertex_count + 63) / 64, 1, 1);
+
+        instance.m_dirty = false;
+        ++m_dispatched;
+        return true;
+    }
+    /**
+    * Make the skinned vertices written since the last call visible to
+    * vertex fetching, must be called before rendering them
+    */
+    void finish()
+    {
+        if (m_dispatched > 0)
+        {
+            glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+            m_dispatched = 0;
+        }
+    }
+    /**
+    * Skin all instances with changed palettes and finish the pass
+    * @return the number of instances skinned
+    */
+    template <class TMesh>
+    std::size_t execute(const std::vector<SkinnedInstance<TMesh>*>& instances)
+    {
+        std::size_t skinned = 0;
+        for (auto instance : instances)
+        {
+            skinned += skin(*instance) ? 1 : 0;
+        }
+        finish();
+        return skinned;
+    }
+private:
+    enum Uniform
+    {
+        vertex_count_uniform,
+        stride_uniform,
+        position_offset_uniform,
+        normal_offset_uniform,
+        bones_offset_uniform,
+        weights_offset_uniform,
+        wide_bones_uniform,
+        uniform_count
+    };
+
+    shaders::GLSLProgram m_program;
+    GLint m_locations[uniform_count];
+    std::size_t m_dispatched;
+};
+
+
+}  // namespace animation
+
+
+}  // namespace crudegl
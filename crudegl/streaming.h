@@ -0,0 +1,449 @@
+#pragma once
+
+#include "jobs.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace streaming
+{
+
+
+using RequestHandle = std::uint64_t;
+
+
+enum class Status
+{
+    // Waiting for a free I/O slot
+    pending_read,
+    reading,
+    // Read finished, waiting for a free CPU slot
+    pending_process,
+    processing,
+    // Processed, waiting for it's turn on the OpenGL thread
+    pending_upload,
+    resident,
+    cancelled,
+    failed,
+    // The handle is not known to the scheduler
+    unknown
+};
+
+
+struct Limits
+{
+    // Maximum number of read stages running at once
+    std::size_t max_reads;
+    // Maximum number of process stages running at once
+    std::size_t max_processes;
+    // Maximum number of upload stages performed by a single `update`
+    std::size_t max_uploads_per_update;
+    // Requests whose priority was not updated for this many frames are
+    // considered stale and cancelled, 0 disables the check
+    std::size_t stale_frames;
+};
+
+
+/**
+* Return a priority from the projected size of a bounding sphere in pixels,
+* larger on screen means more urgent
+*
+* @param radius is the bounding sphere radius in world units
+* @param distance is the distance of the sphere center from the camera
+* @param fov_y is the vertical field of view in radians
+* @param viewport_height is the height of the viewport in pixels
+*/
+inline float priority_from_screen_size(float radius, float distance, float fov_y, float viewport_height)
+{
+    if (distance <= radius)
+    {
+        // Camera is inside the bounds
+        return viewport_height;
+    }
+    const float projected = radius / (distance * std::tan(fov_y * 0.5f));
+    return projected * viewport_height * 0.5f;
+}
+
+
+/**
+* Return a priority from the distance to the camera, closer is more urgent
+*/
+inline float priority_from_distance(const glm::vec3& position, const glm::vec3& camera)
+{
+    return 1.0f / (1.0f + glm::length(position - camera));
+}
+
+
+template <class TAsset, class = void>
+struct has_placeholder : std::false_type
+{
+};
+
+
+template <class TAsset>
+struct has_placeholder<TAsset, decltype(std::declval<TAsset&>().upload_placeholder())> : std::true_type
+{
+};
+
+
+/**
+* Schedules the read, process and upload stages of asset requests
+*
+* Any type with `read`, `process` and `upload` member functions can be
+* requested, such as `AssetModel` and `Texture2D`. Read and process stages
+* run on the job system with separate limits on how many may run at once,
+* upload stages run from `update` on the OpenGL thread.
+*
+* Requests re-enter the queue between stages, and every free slot goes to
+* the most urgent request waiting for that stage, so a nearby asset requested
+* late overtakes distant ones requested earlier at the next stage boundary.
+* Cancelled and stale requests are dropped before their upload, so no GPU
+* memory is spent on them.
+*
+* Assets that also have an `upload_placeholder` member function get it
+* invoked as soon as they are processed, outside of the upload limit, so
+* proxies and placeholder textures render while they wait for their upload.
+*/
+class RequestScheduler
+{
+public:
+    using callback_type = std::function<void(RequestHandle, Status, std::exception_ptr)>;
+    /**
+    * Constructor
+    *
+    * @param jobs is the job system executing the read and process stages
+    * @param limits caps the number of stages in flight
+    */
+    RequestScheduler(jobs::JobSystem& jobs,
+                     const Limits& limits = default_limits()) : m_jobs(jobs),
+                                                                m_limits(limits),
+                                                                m_frame(0),
+                                                                m_next_handle(1),
+                                                                m_reads_in_flight(0),
+                                                                m_processes_in_flight(0),
+                                                                m_in_flight(0)
+    {
+    }
+
+    ~RequestScheduler()
+    {
+        // Stages in flight reference the scheduler, wait for them
+        m_jobs.wait_until([this]()
+                          {
+                              std::lock_guard<std::mutex> lock(m_mutex);
+                              return m_in_flight == 0;
+                          });
+    }
+
+    // Non-copyable, non-movable, running stages hold a pointer to it
+    RequestScheduler(const RequestScheduler&) = delete;
+    RequestScheduler& operator=(const RequestScheduler&) = delete;
+
+    static Limits default_limits()
+    {
+        return Limits{2, std::max<std::size_t>(1, jobs::JobSystem::default_worker_count()), 4, 0};
+    }
+    /**
+    * Queue an asset for loading
+    *
+    * @param asset is the asset to load, kept alive until the request ends
+    * @param priority is the initial priority, higher is more urgent
+    * @param callback is invoked on the OpenGL thread from `update` once the
+    *        request became resident, failed or was cancelled, along with the
+    *        exception that made it fail
+    * @return handle identifying the request
+    */
+    template <class TAsset>
+    RequestHandle request(std::shared_ptr<TAsset> asset, float priority, callback_type callback = nullptr)
+    {
+        auto request = std::make_shared<Request>();
+        request->read = [asset]()
+        {
+            asset->read();
+        };
+        request->process = [asset]()
+        {
+            asset->process();
+        };
+        request->upload = [asset]()
+        {
+            asset->upload();
+        };
+        set_placeholder(*request, asset, has_placeholder<TAsset>());
+        request->callback = std::move(callback);
+        request->priority = priority;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        request->touched_frame = m_frame;
+        const RequestHandle handle = m_next_handle++;
+        m_requests.emplace(handle, std::move(request));
+        return handle;
+    }
+    /**
+    * Update the priority of a request, also marks it as still wanted
+    */
+    void set_priority(RequestHandle handle, float priority)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_requests.find(handle);
+        if (found != m_requests.end())
+        {
+            found->second->priority = priority;
+            found->second->touched_frame = m_frame;
+        }
+    }
+    /**
+    * Cancel a request, a stage already running finishes but it's result is
+    * dropped and no further stage starts
+    */
+    void cancel(RequestHandle handle)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_requests.find(handle);
+        if (found != m_requests.end())
+        {
+            found->second->cancelled = true;
+        }
+    }
+    /**
+    * Return the current status of a request, requests are forgotten once
+    * their final status was reported by `update`
+    */
+    Status get_status(RequestHandle handle) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto found = m_requests.find(handle);
+        return found != m_requests.end() ? found->second->status : Status::unknown;
+    }
+    /**
+    * Advance the scheduler by one frame, must be called on the OpenGL thread
+    *
+    * Drops cancelled and stale requests, starts the most urgent waiting read
+    * and process stages up to the limits and performs the most urgent
+    * uploads.
+    */
+    void update()
+    {
+        std::vector<std::pair<RequestHandle, std::shared_ptr<Request>>> finished;
+        std::vector<std::pair<RequestHandle, std::shared_ptr<Request>>> uploads;
+        std::vector<std::function<void()>> placeholders;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_frame;
+            std::vector<std::pair<RequestHandle, Request*>> reads;
+            std::vector<std::pair<RequestHandle, Request*>> processes;
+            std::vector<std::pair<RequestHandle, std::shared_ptr<Request>>> ready;
+            for (auto it = m_requests.begin(); it != m_requests.end();)
+            {
+                Request& request = *it->second;
+                if (request.running)
+                {
+                    ++it;
+                    continue;
+                }
+                if (!request.cancelled &&
+                    m_limits.stale_frames > 0 &&
+                    m_frame - request.touched_frame > m_limits.stale_frames)
+                {
+                    request.cancelled = true;
+                }
+                if (request.cancelled && request.status != Status::failed)
+                {
+                    request.status = Status::cancelled;
+                }
+                if (request.status == Status::cancelled || request.status == Status::failed)
+                {
+                    finished.emplace_back(it->first, std::move(it->second));
+                    it = m_requests.erase(it);
+                    continue;
+                }
+                switch (request.status)
+                {
+                case Status::pending_read:
+                    reads.emplace_back(it->first, &request);
+                    break;
+                case Status::pending_process:
+                    processes.emplace_back(it->first, &request);
+                    break;
+                case Status::pending_upload:
+                    if (request.upload_placeholder)
+                    {
+                        placeholders.push_back(std::move(request.upload_placeholder));
+                        request.upload_placeholder = nullptr;
+                    }
+                    ready.emplace_back(it->first, it->second);
+                    break;
+                default:
+                    break;
+                }
+                ++it;
+            }
+            start_stages(reads, m_limits.max_reads - std::min(m_limits.max_reads, m_reads_in_flight));
+            start_stages(processes, m_limits.max_processes - std::min(m_limits.max_processes, m_processes_in_flight));
+
+            const std::size_t upload_count = std::min(ready.size(), m_limits.max_uploads_per_update);
+            std::partial_sort(ready.begin(), ready.begin() + upload_count, ready.end(), [](const auto& lhs, const auto& rhs)
+                              {
+                                  return lhs.second->priority > rhs.second->priority;
+                              });
+            for (std::size_t i = 0; i < upload_count; ++i)
+            {
+                m_requests.erase(ready[i].first);
+                uploads.push_back(std::move(ready[i]));
+            }
+        }
+
+        // Uploads and callbacks run without the lock held, callbacks may
+        // issue new requests
+        for (auto& upload_placeholder : placeholders)
+        {
+            upload_placeholder();
+        }
+        for (auto& upload : uploads)
+        {
+            Request& request = *upload.second;
+            try
+            {
+                request.upload();
+                request.status = Status::resident;
+            }
+            catch (...)
+            {
+                request.error = std::current_exception();
+                request.status = Status::failed;
+            }
+            finished.push_back(std::move(upload));
+        }
+        for (auto& entry : finished)
+        {
+            if (entry.second->callback)
+            {
+                entry.second->callback(entry.first, entry.second->status, entry.second->error);
+            }
+        }
+    }
+    /**
+    * Return the number of requests not yet resident, failed or cancelled
+    */
+    std::size_t get_pending_count() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_requests.size();
+    }
+private:
+    struct Request
+    {
+        std::function<void()> read;
+        std::function<void()> process;
+        std::function<void()> upload;
+        std::function<void()> upload_placeholder;
+        callback_type callback;
+        float priority = 0.0f;
+        std::uint64_t touched_frame = 0;
+        Status status = Status::pending_read;
+        bool running = false;
+        bool cancelled = false;
+        std::exception_ptr error;
+    };
+
+    template <class TAsset>
+    static void set_placeholder(Request& request, const std::shared_ptr<TAsset>& asset, std::true_type)
+    {
+        request.upload_placeholder = [asset]()
+        {
+            asset->upload_placeholder();
+        };
+    }
+
+    template <class TAsset>
+    static void set_placeholder(Request&, const std::shared_ptr<TAsset>&, std::false_type)
+    {
+    }
+
+    void start_stages(std::vector<std::pair<RequestHandle, Request*>>& waiting, std::size_t free_slots)
+    {
+        const std::size_t count = std::min(waiting.size(), free_slots);
+        std::partial_sort(waiting.begin(), waiting.begin() + count, waiting.end(), [](const auto& lhs, const auto& rhs)
+                          {
+                              return lhs.second->priority > rhs.second->priority;
+                          });
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            start_stage(m_requests.at(waiting[i].first));
+        }
+    }
+
+    void start_stage(std::shared_ptr<Request> request)
+    {
+        const bool reading = request->status == Status::pending_read;
+        request->status = reading ? Status::reading : Status::processing;
+        request->running = true;
+        ++(reading ? m_reads_in_flight : m_processes_in_flight);
+        ++m_in_flight;
+        m_jobs.run([this, request, reading]()
+                   {
+                       std::exception_ptr error;
+                       try
+                       {
+                           if (reading)
+                           {
+                               request->read();
+                           }
+                           else
+                           {
+                               request->process();
+                           }
+                       }
+                       catch (...)
+                       {
+                           error = std::current_exception();
+                       }
+                       std::lock_guard<std::mutex> lock(m_mutex);
+                       --(reading ? m_reads_in_flight : m_processes_in_flight);
+                       --m_in_flight;
+                       request->running = false;
+                       if (error)
+                       {
+                           request->error = error;
+                           request->status = Status::failed;
+                       }
+                       else
+                       {
+                           request->status = reading ? Status::pending_process : Status::pending_upload;
+                       }
+                   });
+    }
+private:
+    jobs::JobSystem& m_jobs;
+    const Limits m_limits;
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<RequestHandle, std::shared_ptr<Request>> m_requests;
+    std::uint64_t m_frame;
+    RequestHandle m_next_handle;
+    std::size_t m_reads_in_flight;
+    std::size_t m_processes_in_flight;
+    std::size_t m_in_flight;
+};
+
+
+}  // namespace streaming
+
+
+}  // namespace crudegl
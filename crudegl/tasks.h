@@ -0,0 +1,719 @@
+#pragma once
+
+// Coroutine based asset loading, requires C++20
+
+#include "jobs.h"
+#include "models.h"
+#include "programs.h"
+#include "shaders.h"
+#include "textures.h"
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace tasks
+{
+
+
+class operation_cancelled : public std::runtime_error
+{
+public:
+    operation_cancelled() : std::runtime_error("Operation cancelled.")
+    {
+    }
+};
+
+
+/**
+* Read-only view of a cancellation flag, passed down to the operations that
+* should stop when the owning `CancellationSource` is cancelled. A default
+* constructed token is never cancelled.
+*/
+class CancellationToken
+{
+public:
+    CancellationToken() = default;
+
+    bool is_cancelled() const noexcept
+    {
+        return m_flag && m_flag->load(std::memory_order_acquire);
+    }
+    void throw_if_cancelled() const
+    {
+        if (is_cancelled())
+        {
+            throw operation_cancelled();
+        }
+    }
+private:
+    friend class CancellationSource;
+
+    explicit CancellationToken(std::shared_ptr<std::atomic<bool>> flag) : m_flag(std::move(flag))
+    {
+    }
+private:
+    std::shared_ptr<std::atomic<bool>> m_flag;
+};
+
+
+class CancellationSource
+{
+public:
+    CancellationSource() : m_flag(std::make_shared<std::atomic<bool>>(false))
+    {
+    }
+
+    void cancel() noexcept
+    {
+        m_flag->store(true, std::memory_order_release);
+    }
+    CancellationToken token() const
+    {
+        return CancellationToken(m_flag);
+    }
+private:
+    std::shared_ptr<std::atomic<bool>> m_flag;
+};
+
+
+template <class T>
+class Task;
+
+
+namespace detail
+{
+
+
+class PromiseBase
+{
+public:
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+        template <class TPromise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<TPromise> handle) noexcept
+        {
+            // Symmetric transfer to the awaiting coroutine avoids growing the
+            // stack on long chains of synchronously completing tasks
+            auto continuation = handle.promise().m_continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+    FinalAwaiter final_suspend() noexcept
+    {
+        return {};
+    }
+    void unhandled_exception() noexcept
+    {
+        m_exception = std::current_exception();
+    }
+    void set_continuation(std::coroutine_handle<> continuation) noexcept
+    {
+        m_continuation = continuation;
+    }
+protected:
+    void rethrow_if_failed() const
+    {
+        if (m_exception)
+        {
+            std::rethrow_exception(m_exception);
+        }
+    }
+private:
+    std::coroutine_handle<> m_continuation;
+    std::exception_ptr m_exception;
+};
+
+
+template <class T>
+class Promise : public PromiseBase
+{
+public:
+    Task<T> get_return_object() noexcept;
+
+    template <class TValue>
+    void return_value(TValue&& value)
+    {
+        m_value.emplace(std::forward<TValue>(value));
+    }
+    T result()
+    {
+        rethrow_if_failed();
+        return std::move(*m_value);
+    }
+private:
+    std::optional<T> m_value;
+};
+
+
+template <>
+class Promise<void> : public PromiseBase
+{
+public:
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept
+    {
+    }
+    void result()
+    {
+        rethrow_if_failed();
+    }
+};
+
+
+}  // namespace detail
+
+
+/**
+* Lazily started coroutine producing a value of type `T`
+*
+* The coroutine body starts running when the task is awaited, and the
+* awaiting coroutine resumes on whichever thread the task finished on.
+* Exceptions thrown by the body are rethrown to the awaiting coroutine.
+*/
+template <class T = void>
+class [[nodiscard]] Task
+{
+public:
+    using promise_type = detail::Promise<T>;
+    using value_type = T;
+
+    Task() noexcept = default;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle)
+    {
+    }
+
+    ~Task()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    // Move-only semantics
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    Task(Task&& rhs) noexcept : m_handle(std::exchange(rhs.m_handle, nullptr))
+    {
+    }
+    Task& operator=(Task&& rhs) noexcept
+    {
+        if (this != &rhs)
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(rhs.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    auto operator co_await() && noexcept
+    {
+        struct Awaiter
+        {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept
+            {
+                return !handle;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().set_continuation(awaiting);
+                return handle;
+            }
+            T await_resume()
+            {
+                return handle.promise().result();
+            }
+        };
+        return Awaiter{m_handle};
+    }
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+
+namespace detail
+{
+
+
+template <class T>
+Task<T> Promise<T>::get_return_object() noexcept
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+
+inline Task<void> Promise<void>::get_return_object() noexcept
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+
+/**
+* Eagerly started coroutine that destroys itself on completion
+*/
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() noexcept
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void() noexcept
+        {
+        }
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+
+/**
+* Resumes the awaiting coroutine once a number of children arrived
+*/
+class Latch
+{
+public:
+    explicit Latch(std::size_t count) : m_remaining(count + 1)
+    {
+    }
+    /**
+    * Mark one child as finished, the last one resumes the awaiting coroutine
+    */
+    void arrive()
+    {
+        if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            m_awaiting.resume();
+        }
+    }
+    /**
+    * Register the awaiting coroutine and start the children
+    *
+    * @return whether the coroutine has to suspend, false if all children
+    *         already finished
+    */
+    template <class TStart>
+    bool start(std::coroutine_handle<> awaiting, TStart& start_children)
+    {
+        m_awaiting = awaiting;
+        start_children();
+        return m_remaining.fetch_sub(1, std::memory_order_acq_rel) > 1;
+    }
+private:
+    std::atomic<std::size_t> m_remaining;
+    std::coroutine_handle<> m_awaiting;
+};
+
+
+template <class TStart>
+struct LatchAwaiter
+{
+    Latch& latch;
+    TStart start_children;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    bool await_suspend(std::coroutine_handle<> awaiting)
+    {
+        return latch.start(awaiting, start_children);
+    }
+    void await_resume() noexcept
+    {
+    }
+};
+
+
+template <class TStart>
+LatchAwaiter<TStart> wait_for(Latch& latch, TStart start_children)
+{
+    return LatchAwaiter<TStart>{latch, std::move(start_children)};
+}
+
+
+struct ScheduleAwaiter
+{
+    jobs::JobSystem& jobs;
+    bool pinned;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        if (pinned)
+        {
+            jobs.run_pinned([handle]()
+                            {
+                                handle.resume();
+                            });
+        }
+        else
+        {
+            jobs.run([handle]()
+                     {
+                         handle.resume();
+                     });
+        }
+    }
+    void await_resume() noexcept
+    {
+    }
+};
+
+
+template <class T>
+Detached run_child(jobs::JobSystem& jobs,
+                   Task<T> task,
+                   std::optional<T>& result,
+                   std::exception_ptr& error,
+                   Latch& latch)
+{
+    co_await ScheduleAwaiter{jobs, false};
+    try
+    {
+        result.emplace(co_await std::move(task));
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    latch.arrive();
+}
+
+
+inline Detached run_child(jobs::JobSystem& jobs,
+                          Task<void> task,
+                          std::exception_ptr& error,
+                          Latch& latch)
+{
+    co_await ScheduleAwaiter{jobs, false};
+    try
+    {
+        co_await std::move(task);
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    latch.arrive();
+}
+
+
+template <class... Ts, std::size_t... I>
+Task<std::tuple<Ts...>> when_all(jobs::JobSystem& jobs, std::index_sequence<I...>, Task<Ts>... tasks)
+{
+    std::tuple<std::optional<Ts>...> results;
+    std::exception_ptr errors[sizeof...(Ts)];
+    Latch latch(sizeof...(Ts));
+    co_await wait_for(latch, [&]()
+                      {
+                          (run_child(jobs, std::move(tasks), std::get<I>(results), errors[I], latch), ...);
+                      });
+    for (const auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+    co_return std::tuple<Ts...>(std::move(*std::get<I>(results))...);
+}
+
+
+}  // namespace detail
+
+
+/**
+* Continue the awaiting coroutine on a worker thread of the job system, used
+* before CPU and I/O heavy stages
+*/
+inline detail::ScheduleAwaiter resume_on_worker(jobs::JobSystem& jobs)
+{
+    return detail::ScheduleAwaiter{jobs, false};
+}
+
+
+/**
+* Continue the awaiting coroutine on the thread owning the OpenGL context,
+* used before upload stages. The continuation runs from
+* `JobSystem::run_pinned_jobs` or while that thread waits on the job system.
+*/
+inline detail::ScheduleAwaiter resume_on_gl_thread(jobs::JobSystem& jobs)
+{
+    return detail::ScheduleAwaiter{jobs, true};
+}
+
+
+/**
+* Run all tasks concurrently on the job system and resume once all of them
+* finished, producing a tuple of their results. If any of them failed, the
+* first failure in argument order is rethrown after all of them finished.
+*/
+template <class... Ts>
+Task<std::tuple<Ts...>> when_all(jobs::JobSystem& jobs, Task<Ts>... tasks)
+{
+    static_assert(sizeof...(Ts) > 0, "when_all requires at least one task");
+    static_assert(!(std::is_void<Ts>::value || ...), "Use the vector overload for void tasks");
+    return detail::when_all(jobs, std::index_sequence_for<Ts...>{}, std::move(tasks)...);
+}
+
+
+/**
+* Run a dynamic number of tasks concurrently on the job system and resume
+* once all of them finished, producing their results in order
+*/
+template <class T>
+Task<std::vector<T>> when_all(jobs::JobSystem& jobs, std::vector<Task<T>> tasks)
+{
+    std::vector<std::optional<T>> results(tasks.size());
+    std::vector<std::exception_ptr> errors(tasks.size());
+    detail::Latch latch(tasks.size());
+    co_await detail::wait_for(latch, [&]()
+                              {
+                                  for (std::size_t i = 0; i < tasks.size(); ++i)
+                                  {
+                                      detail::run_child(jobs, std::move(tasks[i]), results[i], errors[i], latch);
+                                  }
+                              });
+    for (const auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+    std::vector<T> values;
+    values.reserve(results.size());
+    for (auto& result : results)
+    {
+        values.push_back(std::move(*result));
+    }
+    co_return values;
+}
+
+
+inline Task<void> when_all(jobs::JobSystem& jobs, std::vector<Task<void>> tasks)
+{
+    std::vector<std::exception_ptr> errors(tasks.size());
+    detail::Latch latch(tasks.size());
+    co_await detail::wait_for(latch, [&]()
+                              {
+                                  for (std::size_t i = 0; i < tasks.size(); ++i)
+                                  {
+                                      detail::run_child(jobs, std::move(tasks[i]), errors[i], latch);
+                                  }
+                              });
+    for (const auto& error : errors)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+
+/**
+* Start a task without waiting for it
+*
+* @param task is the task to run to completion
+* @param on_error is invoked with any exception escaping the task, except
+*        for cancellations which are expected and ignored
+*/
+inline void spawn(Task<void> task, std::function<void(std::exception_ptr)> on_error = nullptr)
+{
+    [](Task<void> task, std::function<void(std::exception_ptr)> on_error) -> detail::Detached
+    {
+        try
+        {
+            co_await std::move(task);
+        }
+        catch (const operation_cancelled&)
+        {
+        }
+        catch (...)
+        {
+            if (on_error)
+            {
+                on_error(std::current_exception());
+            }
+        }
+    }(std::move(task), std::move(on_error));
+}
+
+
+/**
+* Run a task to completion and return it's result, executing other jobs while
+* waiting. When called on the thread owning the OpenGL context, that includes
+* the upload stages of the task.
+*/
+template <class T>
+T sync_wait(jobs::JobSystem& jobs, Task<T> task)
+{
+    std::optional<std::conditional_t<std::is_void<T>::value, bool, T>> result;
+    std::exception_ptr error;
+    std::atomic<bool> done(false);
+    [](Task<T> task, decltype(result)& result, std::exception_ptr& error, std::atomic<bool>& done) -> detail::Detached
+    {
+        try
+        {
+            if constexpr (std::is_void<T>::value)
+            {
+                co_await std::move(task);
+                result.emplace(true);
+            }
+            else
+            {
+                result.emplace(co_await std::move(task));
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        done.store(true, std::memory_order_release);
+    }(std::move(task), result, error, done);
+    jobs.wait_until([&done]()
+                    {
+                        return done.load(std::memory_order_acquire);
+                    });
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    if constexpr (!std::is_void<T>::value)
+    {
+        return std::move(*result);
+    }
+}
+
+
+/**
+* Load a model, reading and processing it on worker threads and uploading it
+* on the OpenGL thread. Cancellation is checked between stages, so an
+* abandoned load stops before the next stage starts.
+*
+* @param path is an absolute path to a model file
+*/
+template <class TModel = models::AssetModel<>>
+Task<std::shared_ptr<TModel>> load_model(jobs::JobSystem& jobs,
+                                         std::string path,
+                                         CancellationToken token = {})
+{
+    auto model = std::make_shared<TModel>(path, &jobs);
+    co_await resume_on_worker(jobs);
+    token.throw_if_cancelled();
+    model->read();
+    token.throw_if_cancelled();
+    model->process();
+    co_await resume_on_gl_thread(jobs);
+    token.throw_if_cancelled();
+    model->upload();
+    co_return model;
+}
+
+
+/**
+* Load a texture, reading and decoding it on worker threads and uploading it
+* on the OpenGL thread
+*
+* @param path is an absolute path to the texture image file
+* @param name under which the texture is referenced in shaders
+*/
+template <class TTexture = textures::Texture2D>
+Task<std::shared_ptr<TTexture>> load_texture(jobs::JobSystem& jobs,
+                                             std::string path,
+                                             std::string name = "",
+                                             CancellationToken token = {})
+{
+    auto texture = std::make_shared<TTexture>(path, name);
+    co_await resume_on_worker(jobs);
+    token.throw_if_cancelled();
+    texture->read();
+    token.throw_if_cancelled();
+    texture->process();
+    co_await resume_on_gl_thread(jobs);
+    token.throw_if_cancelled();
+    texture->upload();
+    co_return texture;
+}
+
+
+/**
+* Load, compile and link a program from a vertex and a fragment shader, all
+* of which happens on the OpenGL thread
+*
+* @param vertex_path is an absolute path to the vertex shader source
+* @param fragment_path is an absolute path to the fragment shader source
+*/
+inline Task<std::shared_ptr<shaders::GLSLProgram>> load_program(jobs::JobSystem& jobs,
+                                                                std::string vertex_path,
+                                                                std::string fragment_path,
+                                                                CancellationToken token = {})
+{
+    co_await resume_on_gl_thread(jobs);
+    token.throw_if_cancelled();
+    shaders::VertexShader vertex_shader(vertex_path);
+    shaders::FragmentShader fragment_shader(fragment_path);
+    auto program = std::make_shared<shaders::GLSLProgram>();
+    program->attach(vertex_shader);
+    program->attach(fragment_shader);
+    program->link();
+    co_return program;
+}
+
+
+}  // namespace tasks
+
+
+}  // namespace crudegl
@@ -1,10 +1,21 @@
 #pragma once
 
+#include "shared_cache.h"
 #include "utils.h"
 
 #include <glad/glad.h>
 #include <SOIL.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
 
 namespace crudegl
 {
@@ -14,6 +25,11 @@ namespace textures
 {
 
 
+// Offset of the pixels of a texture in the shared cache, after it's width
+// and height
+constexpr std::size_t shared_pixels_offset = 2 * sizeof(std::int32_t);
+
+
 class Texture2D
 {
 public:
@@ -41,7 +57,13 @@ public:
                                             m_mag_filter{mag_filter},
                                             m_wrap_s{wrap_s},
                                             m_wrap_t{wrap_t},
-                                            m_generate_mipmap{m_generate_mipmap},
+                                            m_generate_mipmap{generate_mipmap},
+                                            m_width{0},
+                                            m_height{0},
+                                            m_pixels{nullptr, SOIL_free_image_data},
+                                            m_average_color{128, 128, 128},
+                                            m_shared_cache{nullptr},
+                                            m_placeholder{0},
                                             m_handle{0}
     {
         if (m_name.empty())
@@ -49,10 +71,45 @@ public:
             m_name = utils::fs::noextension(utils::fs::basename(path));
         }
     }
+    /**
+    * Constructor
+    * Create a texture from decoded RGB pixels, such as a baked atlas, which
+    * only needs to be uploaded
+    *
+    * @param name under which the texture is referenced in shaders
+    * @param pixels holds three bytes per texel, row by row
+    */
+    Texture2D(const std::string& name,
+              GLsizei width,
+              GLsizei height,
+              const std::vector<unsigned char>& pixels,
+              GLenum min_filter = GL_LINEAR_MIPMAP_LINEAR,
+              GLenum mag_filter = GL_LINEAR,
+              GLenum wrap_s = GL_CLAMP_TO_EDGE,
+              GLenum wrap_t = GL_CLAMP_TO_EDGE,
+              bool generate_mipmap = true): m_name{name},
+                                            m_path{},
+                                            m_min_filter{min_filter},
+                                            m_mag_filter{mag_filter},
+                                            m_wrap_s{wrap_s},
+                                            m_wrap_t{wrap_t},
+                                            m_generate_mipmap{generate_mipmap},
+                                            m_width{width},
+                                            m_height{height},
+                                            m_pixels{new unsigned char[pixels.size()], delete_pixels},
+                                            m_average_color{128, 128, 128},
+                                            m_shared_cache{nullptr},
+                                            m_placeholder{0},
+                                            m_handle{0}
+    {
+        std::copy(pixels.begin(), pixels.end(), m_pixels.get());
+        compute_average_color();
+    }
 
     virtual ~Texture2D() noexcept
     {
         glDeleteTextures(1, &m_handle);
+        glDeleteTextures(1, &m_placeholder);
     }
 
     // Move-only semantics
@@ -66,6 +123,93 @@ public:
     * Load the texture data into the currently active texture unit
     */
     void load()
+    {
+        read();
+        process();
+        upload();
+    }
+    /**
+    * Share the decoded pixels with other processes through a cache, which
+    * must outlive the texture, must be set before `read`
+    *
+    * The pixels are then decoded by the first process reading the texture,
+    * the others mapping and uploading them from the cache.
+    */
+    void set_shared_cache(streaming::SharedAssetCache* cache)
+    {
+        m_shared_cache = cache;
+    }
+    /**
+    * Read the raw contents of the texture image file
+    *
+    * Performs file I/O only and may run on any thread.
+    */
+    void read()
+    {
+        if (m_shared_cache)
+        {
+            m_shared = m_shared_cache->find(get_shared_key());
+            if (m_shared)
+            {
+                return;
+            }
+        }
+        std::ifstream file(m_path, std::ios::binary);
+        m_file_data.assign(std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>());
+    }
+    /**
+    * Decode the previously read image file into raw pixels
+    *
+    * Performs CPU work only and may run on any thread.
+    */
+    void process()
+    {
+        if (m_shared)
+        {
+            std::int32_t size[2];
+            std::memcpy(size, m_shared.data(), sizeof(size));
+            m_width = size[0];
+            m_height = size[1];
+            compute_average_color();
+            return;
+        }
+        int width = 0, height = 0;
+        m_pixels.reset(SOIL_load_image_from_memory(m_file_data.data(),
+                                                   static_cast<int>(m_file_data.size()),
+                                                   &width,
+                                                   &height,
+                                                   0,
+                                                   SOIL_LOAD_RGB));
+        m_width = width;
+        m_height = height;
+        std::vector<unsigned char>().swap(m_file_data);
+        compute_average_color();
+        if (m_shared_cache && m_pixels)
+        {
+            share_pixels();
+        }
+    }
+    /**
+    * Upload a single texel texture holding the average color of the decoded
+    * image, the last level of it's mip chain, which is bound in place of the
+    * texture until `upload` finished
+    *
+    * Must run on the thread owning the OpenGL context, after `process`.
+    */
+    void upload_placeholder()
+    {
+        if (m_placeholder == 0 && m_handle == 0)
+        {
+            m_placeholder = create_solid_texture(m_average_color);
+        }
+    }
+    /**
+    * Upload the decoded pixels into the currently active texture unit
+    *
+    * Must run on the thread owning the OpenGL context.
+    */
+    void upload()
     {
         glGenTextures(1, &m_handle);
         glBindTexture(GL_TEXTURE_2D, m_handle);
@@ -75,26 +219,39 @@ public:
         // Set texture filtering
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, m_min_filter);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, m_mag_filter);
-        // Load texture data
-        int width, height;
-        unsigned char* bytes = SOIL_load_image(m_path.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, bytes);
+        // Load texture data, rows of three byte texels are tightly packed
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_width, m_height, 0, GL_RGB, GL_UNSIGNED_BYTE, get_pixels());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
         if (m_generate_mipmap)
         {
             glGenerateMipmap(GL_TEXTURE_2D);
         }
-        SOIL_free_image_data(bytes);
+        m_pixels.reset();
+        m_shared.reset();
         glBindTexture(GL_TEXTURE_2D, 0);
+        glDeleteTextures(1, &m_placeholder);
+        m_placeholder = 0;
     }
     /**
     * Bind the texture to the specified texture unit
     *
+    * Until the texture is uploaded, it's placeholder is bound instead, or a
+    * shared grey texel if it has none yet.
+    *
     * @param unit specifies to which texture unit to bind
     */
     void bind(GLenum unit) const noexcept
     {
         glActiveTexture(unit);
-        glBindTexture(GL_TEXTURE_2D, m_handle);
+        if (m_handle)
+        {
+            glBindTexture(GL_TEXTURE_2D, m_handle);
+        }
+        else
+        {
+            glBindTexture(GL_TEXTURE_2D, m_placeholder ? m_placeholder : default_placeholder());
+        }
     }
     /**
     * Unbind the texture
@@ -116,6 +273,13 @@ public:
         return m_handle;
     }
     /**
+    * Return whether the full resolution texture is uploaded
+    */
+    bool is_resident() const noexcept
+    {
+        return m_handle != 0;
+    }
+    /**
     * Return the identifier by which the texture is referenced in the shaders
     *
     * @return unique string identifier
@@ -124,6 +288,93 @@ public:
     {
         return m_name;
     }
+    /**
+    * Return the decoded RGB pixels, only available between `process` and
+    * `upload`
+    */
+    const unsigned char* get_pixels() const noexcept
+    {
+        return m_shared ? m_shared.data() + shared_pixels_offset : m_pixels.get();
+    }
+    GLsizei get_width() const noexcept
+    {
+        return m_width;
+    }
+    GLsizei get_height() const noexcept
+    {
+        return m_height;
+    }
+private:
+    std::string get_shared_key() const
+    {
+        return "texture:" + m_path;
+    }
+    /**
+    * Publish the decoded pixels to the shared cache and use the shared copy
+    * from then on, unless another process is publishing them already
+    */
+    void share_pixels()
+    {
+        const std::size_t size = static_cast<std::size_t>(m_width) * m_height * 3;
+        m_shared = m_shared_cache->insert(get_shared_key(), shared_pixels_offset + size, [&](unsigned char* data)
+                                          {
+                                              const std::int32_t extent[2] = {m_width, m_height};
+                                              std::memcpy(data, extent, sizeof(extent));
+                                              std::memcpy(data + shared_pixels_offset, m_pixels.get(), size);
+                                          });
+        if (m_shared)
+        {
+            m_pixels.reset();
+        }
+    }
+    void compute_average_color()
+    {
+        if (!get_pixels() || m_width <= 0 || m_height <= 0)
+        {
+            return;
+        }
+        const std::size_t texel_count = static_cast<std::size_t>(m_width) * m_height;
+        std::size_t sums[3] = {0, 0, 0};
+        const unsigned char* texel = get_pixels();
+        for (std::size_t i = 0; i < texel_count; ++i, texel += 3)
+        {
+            sums[0] += texel[0];
+            sums[1] += texel[1];
+            sums[2] += texel[2];
+        }
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            m_average_color[channel] = static_cast<unsigned char>(sums[channel] / texel_count);
+        }
+    }
+
+    static void delete_pixels(unsigned char* pixels)
+    {
+        delete[] pixels;
+    }
+    static GLuint create_solid_texture(const unsigned char (&color)[3])
+    {
+        GLuint handle = 0;
+        glGenTextures(1, &handle);
+        glBindTexture(GL_TEXTURE_2D, handle);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, color);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return handle;
+    }
+    /**
+    * Return the grey texel shared by all textures without a placeholder of
+    * their own, created on first use and kept for the lifetime of the context
+    */
+    static GLuint default_placeholder()
+    {
+        static const unsigned char grey[3] = {128, 128, 128};
+        static const GLuint handle = create_solid_texture(grey);
+        return handle;
+    }
 private:
     std::string m_name;
     std::string m_path;
@@ -133,10 +384,33 @@ private:
     GLenum m_wrap_t;
     bool m_generate_mipmap;
 
+    std::vector<unsigned char> m_file_data;
+    GLsizei m_width;
+    GLsizei m_height;
+    std::unique_ptr<unsigned char, void (*)(unsigned char*)> m_pixels;
+    unsigned char m_average_color[3];
+    streaming::SharedAssetCache* m_shared_cache;
+    // Decoded pixels mapped from the shared cache, used instead of `m_pixels`
+    streaming::SharedAsset m_shared;
+
+    GLuint m_placeholder;
     GLuint m_handle;
 };
 
 
+// Whether textures of this type can share their pixels between processes
+template <class TTexture, class = void>
+struct has_shared_cache : std::false_type
+{
+};
+
+
+template <class TTexture>
+struct has_shared_cache<TTexture, decltype(std::declval<TTexture&>().set_shared_cache(nullptr))> : std::true_type
+{
+};
+
+
 }  // namespace textures
 
 
@@ -1,10 +1,17 @@
 #pragma once
 
+#include "skeleton.h"
+
 #include <assimp/mesh.h>
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
 #include <tuple>
+#include <type_traits>
 #include <utility>
 
 
@@ -84,19 +91,185 @@ struct TextureCoordinate
 };
 
 
+/**
+* Indices of the four most influential bones of the vertex into the bone
+* palette of it's mesh, fed to the shader as an integer attribute. Use
+* `BoneIndices` for meshes with up to 256 bones and `WideBoneIndices` above,
+* `AssetModel` refuses meshes with more bones than the indices can address.
+*/
+template <class TIndex, GLenum index_type>
+struct BasicBoneIndices
+{
+    enum
+    {
+        size = 4,
+        type = index_type,
+        normalized = GL_FALSE,
+        integer = GL_TRUE
+    };
+    TIndex bone_indices[4];
+
+    BasicBoneIndices(aiMesh*, GLuint index, const animation::BoneInfluences& influences)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            bone_indices[i] = static_cast<TIndex>(influences.bones[index][i]);
+        }
+    }
+};
+
+
+using BoneIndices = BasicBoneIndices<GLubyte, GL_UNSIGNED_BYTE>;
+using WideBoneIndices = BasicBoneIndices<GLushort, GL_UNSIGNED_SHORT>;
+
+
+/**
+* Weights of the four most influential bones of the vertex, stored as
+* unsigned normalized bytes that always sum up to exactly 255
+*/
+struct BoneWeights
+{
+    enum
+    {
+        size = 4,
+        type = GL_UNSIGNED_BYTE,
+        normalized = GL_TRUE
+    };
+    GLubyte bone_weights[4];
+
+    BoneWeights(aiMesh*, GLuint index, const animation::BoneInfluences& influences)
+    {
+        const glm::vec4& weights = influences.weights[index];
+        int total = 0;
+        int strongest = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            bone_weights[i] = static_cast<GLubyte>(std::lround(weights[i] * 255.0f));
+            total += bone_weights[i];
+            strongest = bone_weights[i] > bone_weights[strongest] ? i : strongest;
+        }
+        // Assign the rounding error to the strongest influence
+        if (total > 0)
+        {
+            bone_weights[strongest] = static_cast<GLubyte>(bone_weights[strongest] + 255 - total);
+        }
+    }
+};
+
+
 }  // namespace attributes
 
 
+/**
+* Return the size in bytes of a single component of the given OpenGL type
+*/
+constexpr std::size_t gl_type_size(GLenum type)
+{
+    return type == GL_BYTE || type == GL_UNSIGNED_BYTE ? 1 :
+           type == GL_SHORT || type == GL_UNSIGNED_SHORT || type == GL_HALF_FLOAT ? 2 :
+           type == GL_DOUBLE ? 8 : 4;
+}
+
+
+// Whether the attribute is fed to the shader as an integer, without
+// conversion to floating point
+template <class TAttribute, class = void>
+struct is_integer_attribute : std::false_type
+{
+};
+
+
+template <class TAttribute>
+struct is_integer_attribute<TAttribute, std::enable_if_t<TAttribute::integer == GL_TRUE>> : std::true_type
+{
+};
+
+
+// Whether the attribute is extracted from the bone influences of the mesh
+template <class TAttribute>
+struct is_skinning_attribute : std::is_constructible<TAttribute, aiMesh*, GLuint, const animation::BoneInfluences&>
+{
+};
+
+
+template <class... Attrs>
+struct any_skinning_attribute : std::false_type
+{
+};
+
+
+template <class TAttribute, class... Attrs>
+struct any_skinning_attribute<TAttribute, Attrs...> : std::integral_constant<bool, is_skinning_attribute<TAttribute>::value ||
+                                                                                   any_skinning_attribute<Attrs...>::value>
+{
+};
+
+
+template <class TAttribute, bool = is_skinning_attribute<TAttribute>::value>
+struct AttributeFactory
+{
+    static TAttribute create(aiMesh* mesh, GLuint index, const animation::BoneInfluences& influences)
+    {
+        return TAttribute(mesh, index, influences);
+    }
+};
+
+
+template <class TAttribute>
+struct AttributeFactory<TAttribute, false>
+{
+    static TAttribute create(aiMesh* mesh, GLuint index, const animation::BoneInfluences&)
+    {
+        return TAttribute(mesh, index);
+    }
+};
+
+
+// Index of `TAttribute` within `Attrs`, or the number of `Attrs` if it's not
+// one of them
+template <class TAttribute, class... Attrs>
+struct attribute_index : std::integral_constant<std::size_t, 0>
+{
+};
+
+
+template <class TAttribute, class TFirst, class... Attrs>
+struct attribute_index<TAttribute, TFirst, Attrs...> : std::integral_constant<std::size_t, std::is_same<TAttribute, TFirst>::value ?
+                                                                                           0 : 1 + attribute_index<TAttribute, Attrs...>::value>
+{
+};
+
+
 template <typename... Attrs>
 struct Vertex : public Attrs...
 {
     enum
     {
-        attribute_count = sizeof...(Attrs)
+        attribute_count = sizeof...(Attrs),
+        skinned = any_skinning_attribute<Attrs...>::value
     };
     // Get the vertex attribute type for the given `layout_position`
     template <std::size_t layout_position>
     using attribute = std::tuple_element_t<layout_position, std::tuple<Attrs...>>;
+    // Get the layout position of the given vertex attribute type, which is
+    // `attribute_count` if the vertex has no such attribute
+    template <class TAttribute>
+    static constexpr std::size_t position_of()
+    {
+        return attribute_index<TAttribute, Attrs...>::value;
+    }
+    // Get the byte offset of the attribute at `layout_position` within the
+    // vertex, as installed by `VertexAttributeInstaller`
+    static constexpr std::size_t offset_of(std::size_t layout_position)
+    {
+        const std::size_t sizes[] = {0, (Attrs::size * gl_type_size(Attrs::type))...};
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < layout_position; ++i)
+        {
+            offset += sizes[i + 1];
+        }
+        return offset;
+    }
     /**
     * Constructor
     * Invoke each base class constructor, essentially delegating data
@@ -112,6 +285,62 @@ struct Vertex : public Attrs...
     Vertex(aiMesh* mesh, GLuint index) : Attrs(mesh, index)...
     {
     }
+    /**
+    * Constructor
+    * Same as above, for vertex types with skinning attributes, which are
+    * extracted from the per-vertex bone influences instead of the mesh
+    *
+    * @param mesh is the assimp provided raw mesh
+    * @param index is the vertex index within the mesh that should be processed
+    * @param influences are the bone influences of all vertices of the mesh
+    */
+    Vertex(aiMesh* mesh,
+           GLuint index,
+           const animation::BoneInfluences& influences) : Attrs(AttributeFactory<Attrs>::create(mesh, index, influences))...
+    {
+    }
+};
+
+
+// Whether vertices of this type have to be constructed with the bone
+// influences of their mesh
+template <class TVertex, class = void>
+struct is_skinned_vertex : std::false_type
+{
+};
+
+
+template <class TVertex>
+struct is_skinned_vertex<TVertex, std::enable_if_t<TVertex::skinned>> : std::true_type
+{
+};
+
+
+// Number of bones the bone indices of an attribute can address, unlimited
+// for attributes without any
+template <class TAttribute>
+struct attribute_bone_count : std::integral_constant<std::size_t, std::numeric_limits<std::size_t>::max()>
+{
+};
+
+
+template <class TIndex, GLenum index_type>
+struct attribute_bone_count<attributes::BasicBoneIndices<TIndex, index_type>>
+    : std::integral_constant<std::size_t, static_cast<std::size_t>(std::numeric_limits<TIndex>::max()) + 1>
+{
+};
+
+
+// Number of bones the bone palette of a mesh may hold for it's vertices to
+// address all of them
+template <class TVertex>
+struct max_bone_count;
+
+
+template <class... Attrs>
+struct max_bone_count<Vertex<Attrs...>>
+    : std::integral_constant<std::size_t, std::min({std::numeric_limits<std::size_t>::max(), attribute_bone_count<Attrs>::value...})>
+{
 };
 
 
@@ -124,7 +353,7 @@ void add_each(std::size_t& offset, std::index_sequence<layout_position...>)
     const std::size_t stride = sizeof(TVertex);
     // Instantiate and invoke vertex attributes, passing the stride, current
     // buffer offset and their respective layout_position to them.
-    static_cast<void>(expander{0, (static_cast<void>(TInstaller<TVertex::attribute<layout_position>>()(stride, offset, layout_position)), 0)...});
+    static_cast<void>(expander{0, (static_cast<void>(TInstaller<typename TVertex::template attribute<layout_position>>()(stride, offset, layout_position)), 0)...});
 }
 
 
@@ -158,6 +387,14 @@ struct VertexAttributeInstaller
      *        the vertex shader itself
      */
     void operator()(std::size_t stride, std::size_t& offset, std::size_t layout_position)
+    {
+        set_pointer(stride, offset, layout_position, is_integer_attribute<TAttribute>());
+        glEnableVertexAttribArray(layout_position);
+        const std::size_t data_size = TAttribute::size * gl_type_size(TAttribute::type);
+        offset += data_size;
+    }
+private:
+    void set_pointer(std::size_t stride, std::size_t offset, std::size_t layout_position, std::false_type)
     {
         glVertexAttribPointer(layout_position,
                               TAttribute::size,
@@ -165,9 +402,14 @@ struct VertexAttributeInstaller
                               TAttribute::normalized,
                               stride,
                               (GLvoid*)offset);
-        glEnableVertexAttribArray(layout_position);
-        const std::size_t data_size = TAttribute::size * sizeof(TAttribute::type);
-        offset += data_size;
+    }
+    void set_pointer(std::size_t stride, std::size_t offset, std::size_t layout_position, std::true_type)
+    {
+        glVertexAttribIPointer(layout_position,
+                               TAttribute::size,
+                               TAttribute::type,
+                               stride,
+                               (GLvoid*)offset);
     }
 };
 
@@ -177,6 +419,13 @@ using DefaultVertex = Vertex<attributes::Position,
                              attributes::TextureCoordinate>;
 
 
+using SkinnedVertex = Vertex<attributes::Position,
+                             attributes::Normal,
+                             attributes::TextureCoordinate,
+                             attributes::BoneIndices,
+                             attributes::BoneWeights>;
+
+
 }  // namespace models
 
 
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "bounds.h"
+#include "draws.h"
+#include "jobs.h"
+#include "lod.h"
+#include "materials.h"
+#include "programs.h"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace crudegl
+{
+
+
+namespace models
+{
+
+
+using InstanceHandle = std::size_t;
+
+
+enum InstanceFlag : std::uint8_t
+{
+    // Rendered unless culled
+    instance_enabled = 1,
+    // Passed the last culling
+    instance_visible = 2
+};
+
+
+/**
+* Mesh instances of any number of models in flat tables, updated and turned
+* into draws by linear passes over the tables instead of a virtual call per
+* model
+*
+* Meshes, transforms and instances live in separate tables with one array per
+* field. Instances refer to a mesh and to a transform by index, several
+* instances sharing a transform when they move together, such as the meshes
+* of a model. `update` culls the instances against the view frustum and picks
+* their level of detail, `submit` queues the visible ones with their
+* transform and material as per-draw data. Instances with empty bounds are
+* never culled.
+*
+* Models register their meshes with `AssetModel::register_with` and keep
+* owning them, the world only refers to their vertex arrays and levels.
+*/
+class RenderWorld
+{
+public:
+    /**
+    * Constructor
+    * @param jobs updates the instances in parallel
+    */
+    explicit RenderWorld(jobs::JobSystem* jobs = nullptr) : m_jobs(jobs),
+                                                            m_visible_count(0)
+    {
+    }
+    /**
+    * Add a mesh drawn from the index buffer of a vertex array object
+    * @param lods are the levels of detail of the mesh, none if empty or
+    *        null, which must outlive the world
+    * @param bounds are the bounds of the mesh in model space
+    * @return the index of the mesh
+    */
+    std::size_t add_mesh(GLuint vao,
+                         std::size_t index_count,
+                         const std::vector<LODLevel>* lods,
+                         MaterialHandle material,
+                         const geometry::BoundingBox& bounds)
+    {
+        m_mesh_vaos.push_back(vao);
+        m_mesh_index_counts.push_back(index_count);
+        m_mesh_lods.push_back(lods);
+        m_mesh_materials.push_back(material);
+        m_mesh_bounds.push_back(bounds);
+        return m_mesh_vaos.size() - 1;
+    }
+    template <class TMesh>
+    std::size_t add_mesh(const TMesh& mesh, const geometry::BoundingBox& bounds)
+    {
+        return add_mesh(mesh.get_vertex_array(), mesh.get_index_count(), &mesh.get_lods(), mesh.get_material(), bounds);
+    }
+    /**
+    * Add a transform shared by the instances moving together
+    * @return the index of the transform
+    */
+    std::size_t add_transform(const glm::mat4& transform)
+    {
+        m_transforms.push_back(transform);
+        m_transforms_dirty.push_back(1);
+        return m_transforms.size() - 1;
+    }
+    void set_transform(std::size_t transform, const glm::mat4& matrix)
+    {
+        m_transforms[transform] = matrix;
+        m_transforms_dirty[transform] = 1;
+    }
+    const glm::mat4& get_transform(std::size_t transform) const
+    {
+        return m_transforms[transform];
+    }
+    /**
+    * Add an instance of a mesh, enabled and with the material of the mesh
+    */
+    InstanceHandle add_instance(std::size_t mesh, std::size_t transform)
+    {
+        m_instance_meshes.push_back(static_cast<std::uint32_t>(mesh));
+        m_instance_transforms.push_back(static_cast<std::uint32_t>(transform));
+        m_instance_materials.push_back(m_mesh_materials[mesh]);
+        m_instance_bounds.push_back(m_mesh_bounds[mesh].transformed(m_transforms[transform]));
+        m_instance_flags.push_back(instance_enabled);
+        m_instance_levels.push_back(0);
+        return m_instance_meshes.size() - 1;
+    }
+    void set_enabled(InstanceHandle instance, bool enabled)
+    {
+        m_instance_flags[instance] = static_cast<std::uint8_t>(enabled ? m_instance_flags[instance] | instance_enabled :
+                                                                         m_instance_flags[instance] & ~instance_enabled);
+    }
+    void set_material(InstanceHandle instance, MaterialHandle material)
+    {
+        m_instance_materials[instance] = material;
+    }
+    /**
+    * Update the bounds of instances whose transform changed, cull them and
+    * pick their level of detail
+    * @param eye is the camera position in world space
+    * @param error_scale converts a world space error at unit distance into
+    *        pixels, see `LODController::update`
+    * @param lod picks the levels with it's error threshold and hysteresis,
+    *        see `LODController::select`, it's own instances are left alone
+    */
+    void update(const glm::mat4& view_projection, const glm::vec3& eye, float error_scale, const LODController& lod)
+    {
+        const geometry::Frustum frustum(view_projection);
+        jobs::parallel_for(m_jobs, 0, m_instance_meshes.size(), [&](std::size_t i)
+                           {
+                               update_instance(i, frustum, eye, error_scale, lod);
+                           }, 1024);
+        std::fill(m_transforms_dirty.begin(), m_transforms_dirty.end(), 0);
+        m_visible_count = static_cast<std::size_t>(std::count_if(m_instance_flags.begin(), m_instance_flags.end(),
+                                                                 [](std::uint8_t flags)
+                                                                 {
+                                                                     return (flags & instance_visible) != 0;
+                                                                 }));
+    }
+    /**
+    * Queue the instances visible at the last `update`, in instance order,
+    * with the instance index as object index of their per-draw data
+    */
+    void submit(RenderQueue& queue, shaders::GLSLProgram& program) const
+    {
+        for (std::size_t i = 0; i < m_instance_meshes.size(); ++i)
+        {
+            if (!(m_instance_flags[i] & instance_visible))
+            {
+                continue;
+            }
+            const std::size_t mesh = m_instance_meshes[i];
+            DrawData data;
+            data.model = m_transforms[m_instance_transforms[i]];
+            data.material = m_instance_materials[i];
+            data.object = static_cast<GLuint>(i);
+            data.padding[0] = 0;
+            data.padding[1] = 0;
+            const std::vector<LODLevel>* lods = m_mesh_lods[mesh];
+            if (lods && !lods->empty())
+            {
+                const LODLevel& lod = (*lods)[m_instance_levels[i]];
+                queue.submit(program, m_mesh_vaos[mesh], lod.first_index, lod.index_count, 0, data);
+            }
+            else
+            {
+                queue.submit(program, m_mesh_vaos[mesh], 0, m_mesh_index_counts[mesh], 0, data);
+            }
+        }
+    }
+    bool is_visible(InstanceHandle instance) const
+    {
+        return (m_instance_flags[instance] & instance_visible) != 0;
+    }
+    std::size_t get_level(InstanceHandle instance) const
+    {
+        return m_instance_levels[instance];
+    }
+    const geometry::BoundingBox& get_bounds(InstanceHandle instance) const
+    {
+        return m_instance_bounds[instance];
+    }
+    /**
+    * Return the number of instances visible at the last `update`
+    */
+    std::size_t get_visible_count() const noexcept
+    {
+        return m_visible_count;
+    }
+    std::size_t size() const noexcept
+    {
+        return m_instance_meshes.size();
+    }
+private:
+    void update_instance(std::size_t i, const geometry::Frustum& frustum, const glm::vec3& eye,
+                         float error_scale, const LODController& lod)
+    {
+        const std::size_t mesh = m_instance_meshes[i];
+        const std::size_t transform = m_instance_transforms[i];
+        if (m_transforms_dirty[transform])
+        {
+            m_instance_bounds[i] = m_mesh_bounds[mesh].transformed(m_transforms[transform]);
+        }
+        auto flags = static_cast<std::uint8_t>(m_instance_flags[i] & ~instance_visible);
+        const geometry::BoundingBox& bounds = m_instance_bounds[i];
+        if ((flags & instance_enabled) && (bounds.empty() || frustum.intersects(bounds)))
+        {
+            flags |= instance_visible;
+        }
+        m_instance_flags[i] = flags;
+
+        const std::vector<LODLevel>* lods = m_mesh_lods[mesh];
+        if (!lods || lods->size() < 2 || bounds.empty())
+        {
+            m_instance_levels[i] = 0;
+            return;
+        }
+        // Culled instances keep their level, so hysteresis still applies
+        // when they come back into view
+        if (!(flags & instance_visible))
+        {
+            return;
+        }
+        const std::size_t level = lod.select(*lods, geometry::Sphere(bounds.center(), bounds.radius()),
+                                             m_instance_levels[i], eye, error_scale);
+        m_instance_levels[i] = static_cast<std::uint8_t>(std::min<std::size_t>(level, 255));
+    }
+private:
+    jobs::JobSystem* m_jobs;
+    std::size_t m_visible_count;
+    // Mesh table
+    std::vector<GLuint> m_mesh_vaos;
+    std::vector<std::size_t> m_mesh_index_counts;
+    std::vector<const std::vector<LODLevel>*> m_mesh_lods;
+    std::vector<MaterialHandle> m_mesh_materials;
+    std::vector<geometry::BoundingBox> m_mesh_bounds;
+    // Transform table
+    std::vector<glm::mat4> m_transforms;
+    std::vector<std::uint8_t> m_transforms_dirty;
+    // Instance table
+    std::vector<std::uint32_t> m_instance_meshes;
+    std::vector<std::uint32_t> m_instance_transforms;
+    std::vector<MaterialHandle> m_instance_materials;
+    std::vector<geometry::BoundingBox> m_instance_bounds;
+    std::vector<std::uint8_t> m_instance_flags;
+    std::vector<std::uint8_t> m_instance_levels;
+};
+
+
+}  // namespace models
+
+
+}  // namespace crudegl
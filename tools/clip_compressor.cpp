@@ -0,0 +1,109 @@
+/**
+* Animation clip compressor
+*
+* Compress every animation of a model file with `CompressedClip` and print
+* the achieved compression ratio and the measured errors as JSON to the
+* standard output, so that tolerances can be tuned per asset library.
+*
+* Usage: clip_compressor <model-path> [translation-tolerance rotation-tolerance scale-tolerance]
+*
+* No OpenGL context is needed, only the node hierarchy and the animations of
+* the model are loaded.
+*/
+#include <crudegl/clip_compression.h>
+
+#include "json.h"
+
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+
+namespace
+{
+
+
+using crudegl::animation::CompressedClip;
+using crudegl::animation::CompressionSettings;
+
+
+void write_clip(std::ostream& out, const CompressedClip& clip)
+{
+    const auto& report = clip.get_report();
+    out << "    {\n"
+        << "      \"name\": " << quote(clip.get_name()) << ",\n"
+        << "      \"duration\": " << clip.get_duration() << ",\n"
+        << "      \"source_keys\": " << report.source_keys << ",\n"
+        << "      \"compressed_keys\": " << report.compressed_keys << ",\n"
+        << "      \"source_bytes\": " << report.source_bytes << ",\n"
+        << "      \"compressed_bytes\": " << report.compressed_bytes << ",\n"
+        << "      \"ratio\": " << report.ratio() << ",\n"
+        << "      \"max_translation_error\": " << report.max_translation_error << ",\n"
+        << "      \"max_rotation_error\": " << report.max_rotation_error << ",\n"
+        << "      \"max_scale_error\": " << report.max_scale_error << "\n"
+        << "    }";
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv)
+{
+    if (argc != 2 && argc != 5)
+    {
+        std::cerr << "usage: " << argv[0]
+                  << " <model-path> [translation-tolerance rotation-tolerance scale-tolerance]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    CompressionSettings settings;
+    if (argc == 5)
+    {
+        float* tolerances[] = {&settings.translation_tolerance, &settings.rotation_tolerance, &settings.scale_tolerance};
+        for (int i = 0; i < 3; ++i)
+        {
+            const float tolerance = std::strtof(argv[i + 2], nullptr);
+            if (tolerance < 0.0f)
+            {
+                std::cerr << "invalid tolerance: " << argv[i + 2] << std::endl;
+                return EXIT_FAILURE;
+            }
+            *tolerances[i] = tolerance;
+        }
+    }
+
+    Assimp::Importer importer;
+    const aiScene* scene = importer.ReadFile(argv[1], 0);
+    if (!scene || !scene->mRootNode)
+    {
+        std::cout << "{\"path\": " << quote(argv[1])
+                  << ", \"error\": " << quote(importer.GetErrorString()) << "}" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const crudegl::animation::Skeleton skeleton(scene->mRootNode);
+    const auto clips = crudegl::animation::compress_clips(scene, skeleton, settings);
+    std::size_t source_bytes = 0;
+    std::size_t compressed_bytes = 0;
+    std::cout << "{\n"
+              << "  \"path\": " << quote(argv[1]) << ",\n"
+              << "  \"clips\": [\n";
+    for (std::size_t i = 0; i < clips.size(); ++i)
+    {
+        source_bytes += clips[i].get_report().source_bytes;
+        compressed_bytes += clips[i].get_report().compressed_bytes;
+        write_clip(std::cout, clips[i]);
+        std::cout << (i + 1 < clips.size() ? ",\n" : "\n");
+    }
+    std::cout << "  ],\n"
+              << "  \"totals\": {\"clip_count\": " << clips.size()
+              << ", \"source_bytes\": " << source_bytes
+              << ", \"compressed_bytes\": " << compressed_bytes
+              << ", \"ratio\": " << (compressed_bytes > 0 ? static_cast<double>(source_bytes) / compressed_bytes : 0.0) << "}\n"
+              << "}" << std::endl;
+    return EXIT_SUCCESS;
+}
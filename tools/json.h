@@ -0,0 +1,35 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+
+/**
+* Quote a string as a JSON string literal
+*/
+inline std::string quote(const std::string& value)
+{
+    std::ostringstream out;
+    out << '"';
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '"': out << "\\\""; break;
+        case '\\': out << "\\\\"; break;
+        case '\n': out << "\\n"; break;
+        case '\t': out << "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                out << "\\u00" << "0123456789abcdef"[(c >> 4) & 0xf] << "0123456789abcdef"[c & 0xf];
+            }
+            else
+            {
+                out << c;
+            }
+        }
+    }
+    out << '"';
+    return out.str();
+}
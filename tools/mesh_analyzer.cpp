@@ -0,0 +1,204 @@
+/**
+* Mesh quality analyzer
+*
+* Load a model through `AssetModel` and print per-mesh rendering efficiency
+* metrics as JSON to the standard output, so that content pipelines can reject
+* assets that would render inefficiently.
+*
+* Usage: mesh_analyzer <model-path> [cache-size ...]
+*
+* No OpenGL context is needed, meshes and textures are replaced with
+* analyzing stand-ins that never touch the GPU.
+*/
+#include <crudegl/analysis.h>
+#include <crudegl/models.h>
+
+#include "json.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+
+
+using crudegl::analysis::MeshStatistics;
+using crudegl::models::DefaultVertex;
+
+
+std::vector<std::size_t> g_cache_sizes = {16, 32, 64};
+
+
+class TextureReference
+{
+public:
+    TextureReference(const std::string& path) : m_path{path}
+    {
+    }
+    void read()
+    {
+    }
+    void process()
+    {
+    }
+    void upload()
+    {
+    }
+    bool is_resident() const noexcept
+    {
+        return true;
+    }
+    const std::string& get_path() const noexcept
+    {
+        return m_path;
+    }
+private:
+    std::string m_path;
+};
+
+
+class AnalyzedMesh
+{
+public:
+    using texture_vec = std::vector<std::shared_ptr<TextureReference>>;
+
+    // Models hand over their data in import arenas, copied as the analysis
+    // takes plain vectors
+    template <class TVertexAllocator, class TIndexAllocator>
+    AnalyzedMesh(const std::vector<DefaultVertex, TVertexAllocator>& vertices,
+                 const std::vector<GLuint, TIndexAllocator>& indices,
+                 texture_vec&& textures) : m_statistics(crudegl::analysis::analyze_mesh(
+                                               std::vector<DefaultVertex>(vertices.begin(), vertices.end()),
+                                               std::vector<GLuint>(indices.begin(), indices.end()),
+                                               g_cache_sizes)),
+                                           m_textures(std::move(textures))
+    {
+    }
+    void render(crudegl::models::Model::program_type&) const
+    {
+    }
+    const MeshStatistics& get_statistics() const noexcept
+    {
+        return m_statistics;
+    }
+    const texture_vec& get_textures() const noexcept
+    {
+        return m_textures;
+    }
+private:
+    MeshStatistics m_statistics;
+    texture_vec m_textures;
+};
+
+
+using AnalyzedModel = crudegl::models::AssetModel<DefaultVertex,
+                                                  DefaultVertex,
+                                                  TextureReference,
+                                                  AnalyzedMesh>;
+
+
+void write_mesh(std::ostream& out, const AnalyzedMesh& mesh)
+{
+    const auto& stats = mesh.get_statistics();
+    out << "    {\n"
+        << "      \"vertex_count\": " << stats.vertex_count << ",\n"
+        << "      \"index_count\": " << stats.index_count << ",\n"
+        << "      \"triangle_count\": " << stats.triangle_count << ",\n"
+        << "      \"vertex_cache\": [";
+    for (std::size_t i = 0; i < stats.vertex_cache.size(); ++i)
+    {
+        const auto& cache = stats.vertex_cache[i];
+        out << (i > 0 ? ", " : "")
+            << "{\"cache_size\": " << cache.cache_size
+            << ", \"acmr\": " << cache.acmr
+            << ", \"atvr\": " << cache.atvr << "}";
+    }
+    out << "],\n"
+        << "      \"vertex_fetch\": {\"bytes_fetched\": " << stats.vertex_fetch.bytes_fetched
+        << ", \"overfetch\": " << stats.vertex_fetch.overfetch << "},\n"
+        << "      \"overdraw\": {\"pixels_covered\": " << stats.overdraw.pixels_covered
+        << ", \"pixels_shaded\": " << stats.overdraw.pixels_shaded
+        << ", \"overdraw\": " << stats.overdraw.overdraw << "},\n"
+        << "      \"unreferenced_vertices\": " << stats.unreferenced_vertices << ",\n"
+        << "      \"duplicate_vertices\": " << stats.duplicate_vertices << ",\n"
+        << "      \"degenerate_triangles\": " << stats.degenerate_triangles << ",\n"
+        << "      \"bytes_per_vertex\": " << stats.vertex_size << ",\n"
+        << "      \"padding_per_vertex\": " << stats.vertex_padding << ",\n"
+        << "      \"wasted_bytes\": " << stats.wasted_bytes << ",\n"
+        << "      \"textures\": [";
+    const auto& textures = mesh.get_textures();
+    for (std::size_t i = 0; i < textures.size(); ++i)
+    {
+        out << (i > 0 ? ", " : "") << quote(textures[i]->get_path());
+    }
+    out << "]\n"
+        << "    }";
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <model-path> [cache-size ...]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (argc > 2)
+    {
+        g_cache_sizes.clear();
+        for (int i = 2; i < argc; ++i)
+        {
+            const long size = std::strtol(argv[i], nullptr, 10);
+            if (size <= 0)
+            {
+                std::cerr << "invalid cache size: " << argv[i] << std::endl;
+                return EXIT_FAILURE;
+            }
+            g_cache_sizes.push_back(static_cast<std::size_t>(size));
+        }
+    }
+
+    AnalyzedModel model(argv[1]);
+    try
+    {
+        model.load();
+    }
+    catch (const crudegl::models::model_error& error)
+    {
+        std::cout << "{\"path\": " << quote(error.getpath())
+                  << ", \"error\": " << quote(error.what()) << "}" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::size_t vertices = 0;
+    std::size_t triangles = 0;
+    std::size_t wasted_bytes = 0;
+    const auto& meshes = model.get_meshes();
+    std::cout << "{\n"
+              << "  \"path\": " << quote(argv[1]) << ",\n"
+              << "  \"meshes\": [\n";
+    for (std::size_t i = 0; i < meshes.size(); ++i)
+    {
+        const auto& stats = meshes[i].get_statistics();
+        vertices += stats.vertex_count;
+        triangles += stats.triangle_count;
+        wasted_bytes += stats.wasted_bytes;
+        write_mesh(std::cout, meshes[i]);
+        std::cout << (i + 1 < meshes.size() ? ",\n" : "\n");
+    }
+    std::cout << "  ],\n"
+              << "  \"totals\": {\"mesh_count\": " << meshes.size()
+              << ", \"vertex_count\": " << vertices
+              << ", \"triangle_count\": " << triangles
+              << ", \"wasted_bytes\": " << wasted_bytes << "}\n"
+              << "}" << std::endl;
+    return EXIT_SUCCESS;
+}